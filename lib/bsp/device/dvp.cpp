@@ -13,6 +13,8 @@
  * limitations under the License.
  */
 #include <FreeRTOS.h>
+#include <atomic.h>
+#include <clint.h>
 #include <dvp.h>
 #include <fpioa.h>
 #include <hal.h>
@@ -21,11 +23,16 @@
 #include <semphr.h>
 #include <stdio.h>
 #include <sysctl.h>
+#include <task.h>
 #include <utility.h>
 #include <iomem.h>
+#include <memory>
 
 using namespace sys;
 
+/* Longest wait for the frame in flight when the queue is stopped */
+#define DVP_STOP_TIMEOUT_MS 1000
+
 class k_dvp_driver : public dvp_driver, public static_object, public exclusive_object_access
 {
 public:
@@ -37,6 +44,8 @@ public:
     virtual void install() override
     {
         sysctl_clock_disable(clock_);
+        frame_ready_event_ = xSemaphoreCreateBinary();
+        frame_stopped_event_ = xSemaphoreCreateBinary();
 
         pic_set_irq_handler(IRQN_DVP_INTERRUPT, dvp_frame_event_isr, this);
         pic_set_irq_priority(IRQN_DVP_INTERRUPT, 1);
@@ -140,20 +149,18 @@ public:
 #if FIX_CACHE
         configASSERT(!is_memory_cache((uintptr_t)output_buffer));
 #endif
-        if (index == 0)
-        {
-            configASSERT(format == VIDEO_FMT_RGB24_PLANAR);
-            uintptr_t buffer_addr = (uintptr_t)output_buffer;
-            size_t planar_size = width_ * height_;
-            dvp_.r_addr = buffer_addr;
-            dvp_.g_addr = buffer_addr + planar_size;
-            dvp_.b_addr = buffer_addr + planar_size * 2;
-        }
-        else
-        {
-            configASSERT(format == VIDEO_FMT_RGB565);
-            dvp_.rgb_addr = (uintptr_t)output_buffer;
-        }
+        configASSERT(format == (index == 0 ? VIDEO_FMT_RGB24_PLANAR : VIDEO_FMT_RGB565));
+        set_output_buffer(index, output_buffer);
+    }
+
+    virtual void set_output_planes(void *r_plane, void *g_plane, void *b_plane) override
+    {
+#if FIX_CACHE
+        configASSERT(!is_memory_cache((uintptr_t)r_plane) && !is_memory_cache((uintptr_t)g_plane) && !is_memory_cache((uintptr_t)b_plane));
+#endif
+        dvp_.r_addr = (uintptr_t)r_plane;
+        dvp_.g_addr = (uintptr_t)g_plane;
+        dvp_.b_addr = (uintptr_t)b_plane;
     }
 
     virtual void set_frame_event_enable(dvp_frame_event_t event, bool enable) override
@@ -205,12 +212,328 @@ public:
         return apb1_pclk / (xclk_divide + 1);
     }
 
+    virtual bool set_frame_queue(uint32_t buffers_count, dvp_frame_drop_policy_t policy) override
+    {
+        configASSERT(buffers_count == 0 || buffers_count >= 2);
+
+        if (!stop_frame_queue())
+            return false;
+        if (!buffers_count)
+            return true;
+
+        bool outputs_enable[2] = { (dvp_.dvp_cfg & DVP_CFG_AI_OUTPUT_ENABLE) != 0, (dvp_.dvp_cfg & DVP_CFG_DISPLAY_OUTPUT_ENABLE) != 0 };
+        size_t outputs_size[2] = { width_ * height_ * 3, width_ * height_ * 2 };
+        frame_slots_ = std::make_unique<frame_slot[]>(buffers_count);
+        frame_slots_count_ = buffers_count;
+        uint32_t i, output;
+        for (i = 0; i < buffers_count; i++)
+        {
+            for (output = 0; output < 2; output++)
+            {
+                void *buffer = nullptr;
+                if (outputs_enable[output])
+                {
+                    buffer = iomem_malloc(outputs_size[output]);
+                    configASSERT(buffer);
+                }
+
+                frame_slots_[i].buffers[output] = buffer;
+            }
+
+            frame_slots_[i].state = FRAME_FREE;
+        }
+
+        frame_slots_[0].state = FRAME_FILLING;
+        filling_index_ = 0;
+        sequence_ = 0;
+        drop_policy_ = policy;
+        frame_capturing_ = false;
+
+        /* Given back when the queue stops */
+        saved_addrs_[0] = dvp_.r_addr;
+        saved_addrs_[1] = dvp_.g_addr;
+        saved_addrs_[2] = dvp_.b_addr;
+        saved_addrs_[3] = dvp_.rgb_addr;
+        saved_cfg_ = dvp_.dvp_cfg & (DVP_CFG_AUTO_ENABLE | DVP_CFG_START_INT_ENABLE | DVP_CFG_FINISH_INT_ENABLE);
+        set_frame_buffers(frame_slots_[0]);
+        set_frame_event_enable(VIDEO_FE_BEGIN, true);
+        set_frame_event_enable(VIDEO_FE_END, true);
+
+        queue_lock();
+        queue_length_ = buffers_count;
+        queue_unlock();
+        return true;
+    }
+
+    virtual bool acquire_frame(dvp_frame_t &frame, TickType_t timeout) override
+    {
+        configASSERT(queue_length_);
+
+        TickType_t start = xTaskGetTickCount();
+        while (true)
+        {
+            queue_lock();
+            uint32_t index = find_oldest_ready();
+            if (index != queue_length_)
+            {
+                auto &slot = frame_slots_[index];
+                slot.state = FRAME_ACQUIRED;
+                frame.index = index;
+                frame.sequence = slot.sequence;
+                frame.timestamp = slot.timestamp;
+                frame.output_buffers[0] = slot.buffers[0];
+                frame.output_buffers[1] = slot.buffers[1];
+                queue_unlock();
+                return true;
+            }
+            queue_unlock();
+
+            TickType_t wait = portMAX_DELAY;
+            if (timeout != portMAX_DELAY)
+            {
+                TickType_t elapsed = xTaskGetTickCount() - start;
+                if (elapsed >= timeout)
+                    return false;
+                wait = timeout - elapsed;
+            }
+
+            if (xSemaphoreTake(frame_ready_event_, wait) != pdTRUE)
+                return false;
+        }
+    }
+
+    virtual void release_frame(uint32_t index) override
+    {
+        queue_lock();
+        configASSERT(index < queue_length_ && frame_slots_[index].state == FRAME_ACQUIRED);
+        frame_slots_[index].state = FRAME_FREE;
+        queue_unlock();
+    }
+
 private:
+    enum frame_state
+    {
+        FRAME_FREE,
+        FRAME_FILLING,
+        FRAME_READY,
+        FRAME_ACQUIRED
+    };
+
+    struct frame_slot
+    {
+        void *buffers[2];
+        frame_state state;
+        uint32_t sequence;
+        uint64_t timestamp;
+    };
+
+    void set_output_buffer(uint32_t index, void *output_buffer)
+    {
+        if (index == 0)
+        {
+            uintptr_t buffer_addr = (uintptr_t)output_buffer;
+            size_t planar_size = width_ * height_;
+            dvp_.r_addr = buffer_addr;
+            dvp_.g_addr = buffer_addr + planar_size;
+            dvp_.b_addr = buffer_addr + planar_size * 2;
+        }
+        else
+        {
+            dvp_.rgb_addr = (uintptr_t)output_buffer;
+        }
+    }
+
+    void set_frame_buffers(const frame_slot &slot)
+    {
+        uint32_t output;
+        for (output = 0; output < 2; output++)
+        {
+            if (slot.buffers[output])
+                set_output_buffer(output, slot.buffers[output]);
+        }
+    }
+
+    /* Stop capturing into the queue and give the output buffers back, fails while a frame is acquired */
+    bool stop_frame_queue()
+    {
+        queue_lock();
+        if (!queue_length_)
+        {
+            queue_unlock();
+            return true;
+        }
+
+        uint32_t i;
+        for (i = 0; i < queue_length_; i++)
+        {
+            if (frame_slots_[i].state == FRAME_ACQUIRED)
+            {
+                queue_unlock();
+                return false;
+            }
+        }
+
+        /* No frame starts after this, but one started by the auto enable may not have reached the ISR yet */
+        queue_stopping_ = true;
+        dvp_.dvp_cfg &= ~DVP_CFG_AUTO_ENABLE;
+        bool capturing = frame_capturing_ || ((saved_cfg_ & DVP_CFG_AUTO_ENABLE) && (dvp_.sts & DVP_STS_FRAME_START));
+        xSemaphoreTake(frame_stopped_event_, 0);
+        queue_unlock();
+
+        /* The frame in flight still writes to the queue buffers, a stalled sensor gives up after the timeout */
+        if (capturing)
+            xSemaphoreTake(frame_stopped_event_, pdMS_TO_TICKS(DVP_STOP_TIMEOUT_MS));
+
+        queue_lock();
+        queue_length_ = 0;
+        queue_stopping_ = false;
+        frame_capturing_ = false;
+        dvp_.r_addr = saved_addrs_[0];
+        dvp_.g_addr = saved_addrs_[1];
+        dvp_.b_addr = saved_addrs_[2];
+        dvp_.rgb_addr = saved_addrs_[3];
+        dvp_.dvp_cfg = (dvp_.dvp_cfg & ~(DVP_CFG_AUTO_ENABLE | DVP_CFG_START_INT_ENABLE | DVP_CFG_FINISH_INT_ENABLE)) | saved_cfg_;
+        queue_unlock();
+
+        free_frame_queue();
+        return true;
+    }
+
+    void free_frame_queue()
+    {
+        if (!frame_slots_)
+            return;
+
+        uint32_t i, output;
+        for (i = 0; i < frame_slots_count_; i++)
+        {
+            for (output = 0; output < 2; output++)
+            {
+                if (frame_slots_[i].buffers[output])
+                    iomem_free(frame_slots_[i].buffers[output]);
+            }
+        }
+
+        frame_slots_.reset();
+        frame_slots_count_ = 0;
+    }
+
+    /* The queue is shared with the frame ISR which may run on the other core */
+    void queue_lock()
+    {
+        taskENTER_CRITICAL();
+        spinlock_lock(&queue_spinlock_);
+    }
+
+    void queue_unlock()
+    {
+        spinlock_unlock(&queue_spinlock_);
+        taskEXIT_CRITICAL();
+    }
+
+    uint32_t find_oldest_ready() const
+    {
+        uint32_t i, oldest = queue_length_;
+        for (i = 0; i < queue_length_; i++)
+        {
+            if (frame_slots_[i].state == FRAME_READY
+                && (oldest == queue_length_ || (int32_t)(frame_slots_[i].sequence - frame_slots_[oldest].sequence) < 0))
+                oldest = i;
+        }
+
+        return oldest;
+    }
+
+    uint32_t find_free() const
+    {
+        uint32_t i;
+        for (i = 0; i < queue_length_; i++)
+        {
+            if (frame_slots_[i].state == FRAME_FREE)
+                break;
+        }
+
+        return i;
+    }
+
+    static uint64_t get_time_us()
+    {
+        return clint->mtime * CLINT_CLOCK_DIV / (sysctl_clock_get_freq(SYSCTL_CLOCK_CPU) / 1000000UL);
+    }
+
+    /* Called from the ISR on VIDEO_FE_BEGIN, the frame is only captured while the queue runs */
+    void begin_queue_frame()
+    {
+        spinlock_lock(&queue_spinlock_);
+        if (queue_length_ && !queue_stopping_)
+        {
+            frame_start_time_ = get_time_us();
+            frame_capturing_ = true;
+            if (!(dvp_.dvp_cfg & DVP_CFG_AUTO_ENABLE))
+                enable_frame();
+        }
+        spinlock_unlock(&queue_spinlock_);
+    }
+
+    /* Called from the ISR on VIDEO_FE_END, never waits for the consumer */
+    void rotate_frame_queue()
+    {
+        spinlock_lock(&queue_spinlock_);
+        frame_capturing_ = false;
+        if (!queue_length_)
+        {
+            spinlock_unlock(&queue_spinlock_);
+            return;
+        }
+
+        if (queue_stopping_)
+        {
+            spinlock_unlock(&queue_spinlock_);
+            BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+            xSemaphoreGiveFromISR(frame_stopped_event_, &xHigherPriorityTaskWoken);
+            if (xHigherPriorityTaskWoken)
+            {
+                portYIELD_FROM_ISR();
+            }
+            return;
+        }
+
+        auto &filling = frame_slots_[filling_index_];
+        filling.sequence = sequence_++;
+        filling.timestamp = frame_start_time_;
+
+        uint32_t next = find_free();
+        if (next == queue_length_ && drop_policy_ == DVP_DROP_OLDEST)
+            next = find_oldest_ready();
+
+        bool published = next != queue_length_;
+        if (published)
+        {
+            filling.state = FRAME_READY;
+            frame_slots_[next].state = FRAME_FILLING;
+            filling_index_ = next;
+            set_frame_buffers(frame_slots_[next]);
+        }
+        spinlock_unlock(&queue_spinlock_);
+
+        if (published)
+        {
+            BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+            xSemaphoreGiveFromISR(frame_ready_event_, &xHigherPriorityTaskWoken);
+            if (xHigherPriorityTaskWoken)
+            {
+                portYIELD_FROM_ISR();
+            }
+        }
+    }
+
     static void dvp_frame_event_isr(void *userdata)
     {
         auto &driver = *reinterpret_cast<k_dvp_driver *>(userdata);
         if (driver.dvp_.sts & DVP_STS_FRAME_START)
         {
+            driver.begin_queue_frame();
+
             dvp_on_frame_event_t callback;
             if ((callback = driver.frame_event_callback_))
                 callback(VIDEO_FE_BEGIN, driver.frame_event_callback_data_);
@@ -218,6 +541,8 @@ private:
         }
         if (driver.dvp_.sts & DVP_STS_FRAME_FINISH)
         {
+            driver.rotate_frame_queue();
+
             dvp_on_frame_event_t callback;
             if ((callback = driver.frame_event_callback_))
                 callback(VIDEO_FE_END, driver.frame_event_callback_data_);
@@ -234,6 +559,21 @@ private:
     size_t width_;
     size_t height_;
     uint32_t xclk_devide_;
+
+    SemaphoreHandle_t frame_ready_event_;
+    SemaphoreHandle_t frame_stopped_event_;
+    std::unique_ptr<frame_slot[]> frame_slots_;
+    uint32_t frame_slots_count_ = 0;
+    volatile uint32_t queue_length_ = 0;
+    volatile bool queue_stopping_ = false;
+    volatile bool frame_capturing_ = false;
+    uint32_t saved_addrs_[4];
+    uint32_t saved_cfg_;
+    spinlock_t queue_spinlock_ = SPINLOCK_INIT;
+    uint32_t filling_index_;
+    uint32_t sequence_;
+    uint64_t frame_start_time_;
+    dvp_frame_drop_policy_t drop_policy_;
 };
 
 static k_dvp_driver dev0_driver(DVP_BASE_ADDR, SYSCTL_CLOCK_DVP);
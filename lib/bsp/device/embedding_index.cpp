@@ -0,0 +1,352 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <devices.h>
+#include <embedding_index.h>
+#include <math.h>
+#include <parallel.h>
+#include <stdexcept>
+#include <string.h>
+#include <vector>
+
+/* Entries are stored in blocks of 8, dimension major: the 64 bits word d of a block holds
+ * component d of its 8 entries, offset by 128 to be unsigned. A search multiplies the bytes
+ * spread into 16 bits lanes by each nibble of the query component, so a lane never exceeds
+ * 255 * 15 and 16 components can be accumulated before widening to 32 bits lanes.
+ */
+
+#define BLOCK_ENTRIES 8
+#define NIBBLE_ACCUMULATIONS 16
+#define LANES_U8 0x00FF00FF00FF00FFULL
+#define LANES_U16 0x0000FFFF0000FFFFULL
+#define EMBEDDING_PARALLEL_MIN_BLOCKS 16
+#define EMBEDDING_INDEX_MAGIC 0x58444945 /* EIDX */
+#define EMBEDDING_INDEX_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t dimension;
+    uint32_t count;
+} embedding_index_header_t;
+
+struct embedding_entry
+{
+    uint32_t label;
+    float scale;
+    /* Sum of the offset components */
+    uint32_t sum;
+};
+
+struct _embedding_index
+{
+    uint32_t dimension;
+    std::vector<uint64_t> blocks;
+    std::vector<embedding_entry> entries;
+};
+
+/* Symmetric per vector quantization, returns the scale */
+static float quantize(const float *embedding, uint32_t dimension, uint8_t *dest, uint32_t &sum)
+{
+    float max = 0;
+    for (uint32_t i = 0; i < dimension; i++)
+        max = std::max(max, fabsf(embedding[i]));
+
+    float scale = max / 127;
+    float inv_scale = max == 0 ? 0 : 127 / max;
+    sum = 0;
+    for (uint32_t i = 0; i < dimension; i++)
+    {
+        dest[i] = (uint8_t)(lrintf(embedding[i] * inv_scale) + 128);
+        sum += dest[i];
+    }
+
+    return scale;
+}
+
+static void add_quantized(embedding_index_t &index, const uint8_t *components, const embedding_entry &entry)
+{
+    size_t id = index.entries.size();
+    size_t lane = id % BLOCK_ENTRIES;
+    if (lane == 0)
+        index.blocks.resize(index.blocks.size() + index.dimension, 0x8080808080808080ULL);
+
+    auto block = reinterpret_cast<uint8_t *>(index.blocks.data() + id / BLOCK_ENTRIES * index.dimension);
+    for (uint32_t i = 0; i < index.dimension; i++)
+        block[i * BLOCK_ENTRIES + lane] = components[i];
+    index.entries.push_back(entry);
+}
+
+/* Unsigned dot products of the 8 entries of a block with the query split in nibbles */
+static void block_dot(const uint64_t *block, uint32_t dimension, const uint8_t *query_lo, const uint8_t *query_hi, uint32_t *dots)
+{
+    /* 32 bits lanes: [0] entries 0 4, [1] 2 6, [2] 1 5, [3] 3 7, then the same for the high nibbles */
+    uint64_t sums[8] = {};
+    for (uint32_t d = 0; d < dimension; d += NIBBLE_ACCUMULATIONS)
+    {
+        uint64_t even_lo = 0, odd_lo = 0, even_hi = 0, odd_hi = 0;
+        uint32_t end = std::min(d + NIBBLE_ACCUMULATIONS, dimension);
+        for (uint32_t i = d; i < end; i++)
+        {
+            uint64_t value = block[i];
+            uint64_t even = value & LANES_U8, odd = (value >> 8) & LANES_U8;
+            even_lo += even * query_lo[i];
+            odd_lo += odd * query_lo[i];
+            even_hi += even * query_hi[i];
+            odd_hi += odd * query_hi[i];
+        }
+
+        sums[0] += even_lo & LANES_U16;
+        sums[1] += (even_lo >> 16) & LANES_U16;
+        sums[2] += odd_lo & LANES_U16;
+        sums[3] += (odd_lo >> 16) & LANES_U16;
+        sums[4] += even_hi & LANES_U16;
+        sums[5] += (even_hi >> 16) & LANES_U16;
+        sums[6] += odd_hi & LANES_U16;
+        sums[7] += (odd_hi >> 16) & LANES_U16;
+    }
+
+    static const uint8_t lanes[BLOCK_ENTRIES] = { 0, 2, 1, 3, 0, 2, 1, 3 };
+    for (size_t e = 0; e < BLOCK_ENTRIES; e++)
+    {
+        size_t shift = e < 4 ? 0 : 32;
+        uint32_t lo = (uint32_t)(sums[lanes[e]] >> shift);
+        uint32_t hi = (uint32_t)(sums[lanes[e] + 4] >> shift);
+        dots[e] = lo + hi * 16;
+    }
+}
+
+struct search_context
+{
+    const embedding_index_t *index;
+    const uint8_t *query_lo;
+    const uint8_t *query_hi;
+    uint32_t query_sum;
+    float query_scale;
+    size_t k;
+    embedding_match_t *parts[2];
+    size_t counts[2];
+};
+
+static void insert_match(embedding_match_t *matches, size_t &count, size_t k, const embedding_match_t &match)
+{
+    if (count == k && match.score <= matches[k - 1].score)
+        return;
+
+    size_t i = count == k ? k - 1 : count++;
+    while (i > 0 && matches[i - 1].score < match.score)
+    {
+        matches[i] = matches[i - 1];
+        i--;
+    }
+    matches[i] = match;
+}
+
+static void search_blocks(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<search_context *>(userdata);
+    auto &index = *ctx.index;
+    int64_t bias = 128LL * 128 * index.dimension - 128LL * ctx.query_sum;
+    size_t &count = ctx.counts[part];
+
+    for (size_t b = begin; b < end; b++)
+    {
+        uint32_t dots[BLOCK_ENTRIES];
+        block_dot(index.blocks.data() + b * index.dimension, index.dimension, ctx.query_lo, ctx.query_hi, dots);
+
+        size_t entries = std::min<size_t>(BLOCK_ENTRIES, index.entries.size() - b * BLOCK_ENTRIES);
+        for (size_t e = 0; e < entries; e++)
+        {
+            uint32_t id = b * BLOCK_ENTRIES + e;
+            auto &entry = index.entries[id];
+            int64_t dot = (int64_t)dots[e] - 128LL * entry.sum + bias;
+            embedding_match_t match { id, entry.label, dot * entry.scale * ctx.query_scale };
+            insert_match(ctx.parts[part], count, ctx.k, match);
+        }
+    }
+}
+
+static void write_exact(handle_t file, const void *buffer, size_t len)
+{
+    if (io_write(file, reinterpret_cast<const uint8_t *>(buffer), len) != (int)len)
+        throw std::runtime_error("Cannot write embedding index.");
+}
+
+static void read_exact(handle_t file, void *buffer, size_t len)
+{
+    auto data = reinterpret_cast<uint8_t *>(buffer);
+    while (len)
+    {
+        int read = io_read(file, data, len);
+        if (read <= 0)
+            throw std::runtime_error("Unexpected end of embedding index.");
+        data += read;
+        len -= read;
+    }
+}
+
+embedding_index_t *embedding_index_create(uint32_t dimension)
+{
+    if (!dimension)
+        return nullptr;
+
+    try
+    {
+        auto index = new embedding_index_t;
+        index->dimension = dimension;
+        return index;
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void embedding_index_destroy(embedding_index_t *index)
+{
+    delete index;
+}
+
+int embedding_index_add(embedding_index_t *index, const float *embedding, uint32_t label)
+{
+    if (!index || !embedding)
+        return -1;
+
+    try
+    {
+        std::vector<uint8_t> components(index->dimension);
+        embedding_entry entry { label, 0, 0 };
+        entry.scale = quantize(embedding, index->dimension, components.data(), entry.sum);
+        add_quantized(*index, components.data(), entry);
+        return index->entries.size() - 1;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+size_t embedding_index_get_count(const embedding_index_t *index)
+{
+    return index ? index->entries.size() : 0;
+}
+
+int embedding_index_search(const embedding_index_t *index, const float *query, embedding_match_t *matches, size_t k)
+{
+    if (!index || !query || !matches || !k)
+        return -1;
+
+    try
+    {
+        std::vector<uint8_t> components(index->dimension * 2);
+        std::vector<embedding_match_t> part_matches(k);
+        search_context ctx;
+        ctx.index = index;
+        ctx.query_lo = components.data();
+        ctx.query_hi = components.data() + index->dimension;
+        ctx.query_scale = quantize(query, index->dimension, components.data(), ctx.query_sum);
+        for (uint32_t i = 0; i < index->dimension; i++)
+        {
+            uint8_t value = components[i];
+            components[i] = value & 0xF;
+            components[index->dimension + i] = value >> 4;
+        }
+
+        ctx.k = k;
+        ctx.parts[0] = matches;
+        ctx.parts[1] = part_matches.data();
+        ctx.counts[0] = ctx.counts[1] = 0;
+        size_t blocks = (index->entries.size() + BLOCK_ENTRIES - 1) / BLOCK_ENTRIES;
+        parallel_for(search_blocks, &ctx, blocks, EMBEDDING_PARALLEL_MIN_BLOCKS, 1);
+
+        size_t count = ctx.counts[0];
+        for (size_t i = 0; i < ctx.counts[1]; i++)
+            insert_match(matches, count, k, part_matches[i]);
+        return count;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int embedding_index_save(const embedding_index_t *index, handle_t file)
+{
+    if (!index)
+        return -1;
+
+    try
+    {
+        embedding_index_header_t header { EMBEDDING_INDEX_MAGIC, EMBEDDING_INDEX_VERSION, index->dimension, (uint32_t)index->entries.size() };
+        write_exact(file, &header, sizeof(header));
+
+        /* Entries are written one after another so the file does not depend on the block layout */
+        std::vector<uint8_t> components(index->dimension);
+        for (size_t id = 0; id < index->entries.size(); id++)
+        {
+            auto block = reinterpret_cast<const uint8_t *>(index->blocks.data() + id / BLOCK_ENTRIES * index->dimension);
+            for (uint32_t i = 0; i < index->dimension; i++)
+                components[i] = block[i * BLOCK_ENTRIES + id % BLOCK_ENTRIES];
+
+            auto &entry = index->entries[id];
+            write_exact(file, &entry.label, sizeof(entry.label));
+            write_exact(file, &entry.scale, sizeof(entry.scale));
+            write_exact(file, components.data(), components.size());
+        }
+
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+embedding_index_t *embedding_index_load(handle_t file)
+{
+    embedding_index_t *index = nullptr;
+    try
+    {
+        embedding_index_header_t header;
+        read_exact(file, &header, sizeof(header));
+        if (header.magic != EMBEDDING_INDEX_MAGIC || header.version != EMBEDDING_INDEX_VERSION || !header.dimension)
+            return nullptr;
+
+        index = new embedding_index_t;
+        index->dimension = header.dimension;
+        index->entries.reserve(header.count);
+        index->blocks.reserve((header.count + BLOCK_ENTRIES - 1) / BLOCK_ENTRIES * header.dimension);
+
+        std::vector<uint8_t> components(header.dimension);
+        for (uint32_t id = 0; id < header.count; id++)
+        {
+            embedding_entry entry { 0, 0, 0 };
+            read_exact(file, &entry.label, sizeof(entry.label));
+            read_exact(file, &entry.scale, sizeof(entry.scale));
+            read_exact(file, components.data(), components.size());
+            for (auto value : components)
+                entry.sum += value;
+            add_quantized(*index, components.data(), entry);
+        }
+
+        return index;
+    }
+    catch (...)
+    {
+        delete index;
+        return nullptr;
+    }
+}
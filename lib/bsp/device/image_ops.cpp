@@ -0,0 +1,528 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <image_ops.h>
+#include <memory>
+#include <parallel.h>
+#include <string.h>
+
+/* RV64 has no vector unit, so the kernels below work on 8 bytes (or 4 x 16 bits lanes) per uint64_t. */
+
+/* Below these sizes a split costs more than it saves */
+#define IMAGE_PARALLEL_MIN_ROWS 16
+#define IMAGE_PARALLEL_MIN_ELEMENTS 8192
+
+#define LANES_U8 0x00FF00FF00FF00FFULL
+
+static inline uint64_t load_u64(const uint8_t *src)
+{
+    if (((uintptr_t)src & 7) == 0)
+        return *reinterpret_cast<const uint64_t *>(src);
+    uint64_t value;
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+static inline void store_u64(uint8_t *dest, uint64_t value)
+{
+    if (((uintptr_t)dest & 7) == 0)
+        *reinterpret_cast<uint64_t *>(dest) = value;
+    else
+        memcpy(dest, &value, sizeof(value));
+}
+
+/* Pack 4 x 16 bits lanes holding bytes into 4 bytes */
+static inline uint64_t pack_lanes(uint64_t value)
+{
+    value = (value | (value >> 8)) & 0x0000FFFF0000FFFFULL;
+    return (value | (value >> 16)) & 0x00000000FFFFFFFFULL;
+}
+
+/* RGB565 -> RGB888 */
+
+struct rgb565_context
+{
+    const uint16_t *src;
+    uint8_t *dest;
+    uint32_t width;
+    size_t plane_size;
+};
+
+static void rgb565_expand(uint64_t pixels, uint64_t &r, uint64_t &g, uint64_t &b)
+{
+    /* 5 and 6 bits fields are widened by replicating their high bits, so 31 and 63 map to 255 */
+    uint64_t r5 = (pixels >> 11) & 0x001F001F001F001FULL;
+    uint64_t g6 = (pixels >> 5) & 0x003F003F003F003FULL;
+    uint64_t b5 = pixels & 0x001F001F001F001FULL;
+    r = pack_lanes(((r5 * 0x21) >> 2) & LANES_U8);
+    g = pack_lanes(((g6 * 0x41) >> 4) & LANES_U8);
+    b = pack_lanes(((b5 * 0x21) >> 2) & LANES_U8);
+}
+
+static void rgb565_to_planar_rows(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<rgb565_context *>(userdata);
+    for (size_t y = begin; y < end; y++)
+    {
+        auto src = reinterpret_cast<const uint8_t *>(ctx.src + y * ctx.width);
+        uint8_t *r_row = ctx.dest + y * ctx.width;
+        uint8_t *g_row = r_row + ctx.plane_size;
+        uint8_t *b_row = g_row + ctx.plane_size;
+
+        uint32_t x = 0;
+        for (; x + 8 <= ctx.width; x += 8)
+        {
+            uint64_t r0, g0, b0, r1, g1, b1;
+            rgb565_expand(load_u64(src + x * 2), r0, g0, b0);
+            rgb565_expand(load_u64(src + x * 2 + 8), r1, g1, b1);
+            store_u64(r_row + x, r0 | (r1 << 32));
+            store_u64(g_row + x, g0 | (g1 << 32));
+            store_u64(b_row + x, b0 | (b1 << 32));
+        }
+
+        for (; x < ctx.width; x++)
+        {
+            uint16_t pixel = ctx.src[y * ctx.width + x];
+            uint32_t r5 = pixel >> 11, g6 = (pixel >> 5) & 0x3F, b5 = pixel & 0x1F;
+            r_row[x] = (r5 << 3) | (r5 >> 2);
+            g_row[x] = (g6 << 2) | (g6 >> 4);
+            b_row[x] = (b5 << 3) | (b5 >> 2);
+        }
+    }
+}
+
+/* Resize */
+
+struct resize_context
+{
+    const uint8_t *src;
+    uint32_t src_width;
+    uint32_t src_height;
+    uint8_t *dest;
+    uint32_t width;
+    uint32_t height;
+    size_t dest_stride;
+    size_t dest_plane_stride;
+    const uint16_t *x0;
+    const uint16_t *x1;
+    const uint16_t *wx;
+    const uint16_t *y0;
+    const uint16_t *y1;
+    const uint16_t *wy;
+    uint8_t *rows[2];
+};
+
+static void resize_nearest_rows(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<resize_context *>(userdata);
+    const uint16_t *map = ctx.x0;
+    const uint8_t *last_row = nullptr;
+    uint32_t last_src_y = UINT32_MAX;
+
+    for (size_t r = begin; r < end; r++)
+    {
+        uint32_t c = r / ctx.height, y = r % ctx.height;
+        uint8_t *dest = ctx.dest + c * ctx.dest_plane_stride + y * ctx.dest_stride;
+        uint32_t src_y = c * ctx.src_height + ctx.y0[y];
+
+        /* Upscaling repeats source rows, copy the output of the previous one instead */
+        if (src_y == last_src_y)
+        {
+            memcpy(dest, last_row, ctx.width);
+            continue;
+        }
+
+        const uint8_t *src = ctx.src + (size_t)src_y * ctx.src_width;
+        uint32_t x = 0;
+        for (; x + 8 <= ctx.width; x += 8)
+        {
+            const uint16_t *m = map + x;
+            uint64_t value = (uint64_t)src[m[0]] | ((uint64_t)src[m[1]] << 8) | ((uint64_t)src[m[2]] << 16)
+                | ((uint64_t)src[m[3]] << 24) | ((uint64_t)src[m[4]] << 32) | ((uint64_t)src[m[5]] << 40)
+                | ((uint64_t)src[m[6]] << 48) | ((uint64_t)src[m[7]] << 56);
+            store_u64(dest + x, value);
+        }
+
+        for (; x < ctx.width; x++)
+            dest[x] = src[map[x]];
+
+        last_row = dest;
+        last_src_y = src_y;
+    }
+}
+
+static void resize_bilinear_row(const resize_context &ctx, const uint8_t *src, uint8_t *dest)
+{
+    for (uint32_t x = 0; x < ctx.width; x++)
+    {
+        uint32_t w = ctx.wx[x];
+        dest[x] = (src[ctx.x0[x]] * (256 - w) + src[ctx.x1[x]] * w + 128) >> 8;
+    }
+}
+
+static void resize_blend_rows(const uint8_t *top, const uint8_t *bottom, uint8_t *dest, uint32_t width, uint32_t w)
+{
+    /* Every product stays below 0x10000, so 4 x 16 bits lanes never carry into each other */
+    const uint64_t round = 0x0080008000800080ULL;
+    uint64_t top_w = 256 - w;
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        uint64_t a = load_u64(top + x), b = load_u64(bottom + x);
+        uint64_t even = (((a & LANES_U8) * top_w + (b & LANES_U8) * w + round) >> 8) & LANES_U8;
+        uint64_t odd = ((((a >> 8) & LANES_U8) * top_w + ((b >> 8) & LANES_U8) * w + round) >> 8) & LANES_U8;
+        store_u64(dest + x, even | (odd << 8));
+    }
+
+    for (; x < width; x++)
+        dest[x] = (top[x] * top_w + bottom[x] * w + 128) >> 8;
+}
+
+static void resize_bilinear_rows(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<resize_context *>(userdata);
+    /* Horizontally interpolated source rows, reused while the output rows fall between them */
+    uint8_t *row0 = ctx.rows[part], *row1 = row0 + ctx.width;
+    uint32_t key0 = UINT32_MAX, key1 = UINT32_MAX;
+
+    for (size_t r = begin; r < end; r++)
+    {
+        uint32_t c = r / ctx.height, y = r % ctx.height;
+        uint8_t *dest = ctx.dest + c * ctx.dest_plane_stride + y * ctx.dest_stride;
+        const uint8_t *plane = ctx.src + (size_t)c * ctx.src_width * ctx.src_height;
+        uint32_t src_y0 = c * ctx.src_height + ctx.y0[y];
+        uint32_t src_y1 = c * ctx.src_height + ctx.y1[y];
+
+        if (src_y0 == key1)
+        {
+            std::swap(row0, row1);
+            std::swap(key0, key1);
+        }
+
+        if (src_y0 != key0)
+        {
+            resize_bilinear_row(ctx, plane + (size_t)ctx.y0[y] * ctx.src_width, row0);
+            key0 = src_y0;
+        }
+
+        if (ctx.wy[y] == 0)
+        {
+            memcpy(dest, row0, ctx.width);
+            continue;
+        }
+
+        if (src_y1 != key1)
+        {
+            resize_bilinear_row(ctx, plane + (size_t)ctx.y1[y] * ctx.src_width, row1);
+            key1 = src_y1;
+        }
+
+        resize_blend_rows(row0, row1, dest, ctx.width, ctx.wy[y]);
+    }
+}
+
+static void resize_nearest_map(uint16_t *map, uint32_t src_size, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+        map[i] = (uint64_t)i * src_size / size;
+}
+
+/* Half pixel centers with 8 bits weights, the same sampling as OpenCV INTER_LINEAR */
+static void resize_bilinear_map(uint16_t *map0, uint16_t *map1, uint16_t *weights, uint32_t src_size, uint32_t size)
+{
+    float scale = (float)src_size / size;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        float pos = std::max((i + 0.5f) * scale - 0.5f, 0.f);
+        uint32_t index = std::min((uint32_t)pos, src_size - 1);
+        uint32_t weight = index == src_size - 1 ? 0 : (uint32_t)((pos - index) * 256 + 0.5f);
+        if (weight == 256)
+        {
+            index++;
+            weight = 0;
+        }
+
+        map0[i] = index;
+        map1[i] = std::min(index + 1, src_size - 1);
+        weights[i] = weight;
+    }
+}
+
+static void resize_into(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, size_t dest_stride, size_t dest_plane_stride, image_interp_t interp)
+{
+    resize_context ctx;
+    ctx.src = src;
+    ctx.src_width = src_width;
+    ctx.src_height = src_height;
+    ctx.dest = dest;
+    ctx.width = width;
+    ctx.height = height;
+    ctx.dest_stride = dest_stride;
+    ctx.dest_plane_stride = dest_plane_stride;
+
+    size_t rows = (size_t)channels * height;
+    if (interp == IMAGE_INTERP_NEAREST)
+    {
+        std::unique_ptr<uint16_t[]> maps(new uint16_t[width + height]);
+        ctx.x0 = maps.get();
+        ctx.y0 = ctx.x0 + width;
+        resize_nearest_map(maps.get(), src_width, width);
+        resize_nearest_map(maps.get() + width, src_height, height);
+        parallel_for(resize_nearest_rows, &ctx, rows, IMAGE_PARALLEL_MIN_ROWS, 1);
+    }
+    else
+    {
+        std::unique_ptr<uint16_t[]> maps(new uint16_t[(width + height) * 3]);
+        std::unique_ptr<uint8_t[]> scratch(new uint8_t[width * 4]);
+        uint16_t *map = maps.get();
+        ctx.x0 = map;
+        ctx.x1 = map + width;
+        ctx.wx = map + width * 2;
+        ctx.y0 = map + width * 3;
+        ctx.y1 = ctx.y0 + height;
+        ctx.wy = ctx.y1 + height;
+        ctx.rows[0] = scratch.get();
+        ctx.rows[1] = scratch.get() + width * 2;
+        resize_bilinear_map(map, map + width, map + width * 2, src_width, width);
+        resize_bilinear_map(map + width * 3, map + width * 3 + height, map + width * 3 + height * 2, src_height, height);
+        parallel_for(resize_bilinear_rows, &ctx, rows, IMAGE_PARALLEL_MIN_ROWS, 1);
+    }
+}
+
+static bool check_resize_args(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, image_interp_t interp)
+{
+    /* Maps are uint16_t */
+    return src && dest && channels && src_width && src_height && width && height
+        && src_width <= UINT16_MAX && src_height <= UINT16_MAX
+        && (interp == IMAGE_INTERP_NEAREST || interp == IMAGE_INTERP_BILINEAR);
+}
+
+/* Normalize */
+
+struct normalize_context
+{
+    const uint8_t *src;
+    void *dest;
+    size_t plane_size;
+    const void *luts;
+};
+
+template <class T>
+static void normalize_rows(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<normalize_context *>(userdata);
+    while (begin < end)
+    {
+        size_t c = begin / ctx.plane_size;
+        size_t plane_end = std::min(end, (c + 1) * ctx.plane_size);
+        const T *lut = reinterpret_cast<const T *>(ctx.luts) + c * 256;
+        const uint8_t *src = ctx.src + begin;
+        T *dest = reinterpret_cast<T *>(ctx.dest) + begin;
+        size_t count = plane_end - begin;
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            uint64_t value = load_u64(src + i);
+            if constexpr (sizeof(T) == 1)
+            {
+                uint64_t out = 0;
+                for (size_t j = 0; j < 8; j++)
+                    out |= (uint64_t)(uint8_t)lut[(value >> (j * 8)) & 0xFF] << (j * 8);
+                store_u64(reinterpret_cast<uint8_t *>(dest + i), out);
+            }
+            else
+            {
+                for (size_t j = 0; j < 8; j++)
+                    dest[i + j] = lut[(value >> (j * 8)) & 0xFF];
+            }
+        }
+
+        for (; i < count; i++)
+            dest[i] = lut[src[i]];
+        begin = plane_end;
+    }
+}
+
+int image_rgb565_to_planar(const uint16_t *src, uint8_t *dest, uint32_t width, uint32_t height)
+{
+    if (!src || !dest)
+        return -1;
+
+    rgb565_context ctx { src, dest, width, (size_t)width * height };
+    parallel_for(rgb565_to_planar_rows, &ctx, height, IMAGE_PARALLEL_MIN_ROWS, 1);
+    return 0;
+}
+
+int image_crop(video_format_t format, const void *src, uint32_t src_width, uint32_t src_height, void *dest,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    if (!src || !dest || (uint64_t)x + width > src_width || (uint64_t)y + height > src_height)
+        return -1;
+
+    size_t channels, element;
+    if (format == VIDEO_FMT_RGB565)
+    {
+        channels = 1;
+        element = sizeof(uint16_t);
+    }
+    else if (format == VIDEO_FMT_RGB24_PLANAR)
+    {
+        channels = 3;
+        element = 1;
+    }
+    else
+    {
+        return -1;
+    }
+
+    /* Plain row copies are bound by the memory bandwidth, a second core would not help */
+    auto s = reinterpret_cast<const uint8_t *>(src);
+    auto d = reinterpret_cast<uint8_t *>(dest);
+    size_t src_stride = src_width * element, row_size = width * element;
+    for (size_t c = 0; c < channels; c++)
+    {
+        const uint8_t *plane = s + c * src_stride * src_height + y * src_stride + x * element;
+        for (uint32_t i = 0; i < height; i++)
+        {
+            memcpy(d, plane, row_size);
+            plane += src_stride;
+            d += row_size;
+        }
+    }
+
+    return 0;
+}
+
+int image_resize(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, image_interp_t interp)
+{
+    if (!check_resize_args(src, channels, src_width, src_height, dest, width, height, interp))
+        return -1;
+
+    try
+    {
+        resize_into(src, channels, src_width, src_height, dest, width, height, width, (size_t)width * height, interp);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int image_letterbox(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, image_interp_t interp, uint8_t pad_value)
+{
+    if (!check_resize_args(src, channels, src_width, src_height, dest, width, height, interp))
+        return -1;
+
+    uint32_t scaled_width, scaled_height;
+    if ((uint64_t)src_width * height > (uint64_t)src_height * width)
+    {
+        scaled_width = width;
+        scaled_height = std::max<uint64_t>((uint64_t)src_height * width / src_width, 1);
+    }
+    else
+    {
+        scaled_height = height;
+        scaled_width = std::max<uint64_t>((uint64_t)src_width * height / src_height, 1);
+    }
+
+    uint32_t left = (width - scaled_width) / 2, top = (height - scaled_height) / 2;
+    uint32_t right = width - scaled_width - left, bottom = height - scaled_height - top;
+    size_t plane_size = (size_t)width * height;
+
+    try
+    {
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            uint8_t *plane = dest + c * plane_size;
+            memset(plane, pad_value, (size_t)top * width);
+            memset(plane + (size_t)(top + scaled_height) * width, pad_value, (size_t)bottom * width);
+            if (left || right)
+            {
+                for (uint32_t y = top; y < top + scaled_height; y++)
+                {
+                    memset(plane + (size_t)y * width, pad_value, left);
+                    memset(plane + (size_t)y * width + left + scaled_width, pad_value, right);
+                }
+            }
+        }
+
+        resize_into(src, channels, src_width, src_height, dest + (size_t)top * width + left, scaled_width, scaled_height,
+            width, plane_size, interp);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int image_normalize_u8(const uint8_t *src, uint8_t *dest, uint32_t channels, size_t plane_size,
+    const float *mean, const float *scale, float out_scale, float out_bias)
+{
+    if (!src || !dest || !mean || !scale || out_scale == 0.f)
+        return -1;
+
+    try
+    {
+        std::unique_ptr<uint8_t[]> luts(new uint8_t[channels * 256]);
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                float value = ((i - mean[c]) * scale[c] - out_bias) / out_scale;
+                luts[c * 256 + i] = (uint8_t)std::min(std::max(value + 0.5f, 0.f), 255.f);
+            }
+        }
+
+        normalize_context ctx { src, dest, plane_size, luts.get() };
+        parallel_for(normalize_rows<uint8_t>, &ctx, channels * plane_size, IMAGE_PARALLEL_MIN_ELEMENTS, 8);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int image_normalize_float(const uint8_t *src, float *dest, uint32_t channels, size_t plane_size,
+    const float *mean, const float *scale)
+{
+    if (!src || !dest || !mean || !scale)
+        return -1;
+
+    try
+    {
+        std::unique_ptr<float[]> luts(new float[channels * 256]);
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            for (int i = 0; i < 256; i++)
+                luts[c * 256 + i] = (i - mean[c]) * scale[c];
+        }
+
+        normalize_context ctx { src, dest, plane_size, luts.get() };
+        parallel_for(normalize_rows<float>, &ctx, channels * plane_size, IMAGE_PARALLEL_MIN_ELEMENTS, 8);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
@@ -16,24 +16,33 @@
 #include <string.h>
 #include <FreeRTOS.h>
 #include <task.h>
+#include <devices.h>
 #include <dmac.h>
+#include <encoding.h>
+#include <filesystem.h>
 #include <hal.h>
 #include <kernel/driver_impl.hpp>
 #include <kpu.h>
+#include <kpu_layers.hpp>
+#include <lz4_block.h>
+#include <parallel.h>
 #include <sysctl.h>
-#include <math.h>
-#include <float.h>
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <iomem.h>
 #include <printf.h>
+#include <vector>
 
 using namespace sys;
 
 #define KPU_DEBUG 0
 #define NNCASE_DEBUG 0
 #define USE_CACHED_AI_RAM 0
+/* Whether a newly loaded model runs its fused pairs, see kpu_set_fusion_enabled */
+#define KPU_FUSE_LAYERS 1
+/* The main memory of a model cannot be larger than the general SRAM */
+#define KMODEL_MAX_MAIN_MEM (6 * 1024 * 1024)
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -42,6 +51,84 @@ using namespace sys;
 #define COMMON_ENTRY \
     semaphore_lock locker(free_mutex_);
 
+typedef enum
+{
+    KFU_NONE,
+    /* Executed with the previous layer */
+    KFU_FUSED,
+    KFU_DEQUANTIZE_SOFTMAX,
+    KFU_TF_FLATTEN_FULLY_CONNECTED,
+    KFU_REMOVE_PADDING_DEQUANTIZE,
+    KFU_QUANTIZE_UPLOAD
+} kpu_layer_fusion_t;
+
+/* Block compressed kmodel container, see tools/kmodel_compress.py.
+ * The header is followed by the compressed size of each block and the raw LZ4 blocks.
+ */
+#define KMODEL_LZ4_MAGIC 0x345A4C4B /* KLZ4 */
+#define KMODEL_LZ4_VERSION 1
+/* Set in a block size when the block is stored uncompressed */
+#define KMODEL_LZ4_STORED 0x80000000
+/* Blocks read at once, split between both cores */
+#define KMODEL_LZ4_BATCH_BLOCKS 8
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t raw_size;
+} kmodel_lz4_header_t;
+
+struct kmodel_lz4_batch
+{
+    uint8_t *dest;
+    const uint8_t *src;
+    const uint32_t *block_sizes;
+    const uint32_t *src_offsets;
+    uint32_t first_block;
+    uint32_t block_size;
+    uint32_t raw_size;
+    int failed;
+};
+
+/* Each block is decoded into its final place and written back to the uncached alias while it is still in cache */
+static void kmodel_lz4_decompress_blocks(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &batch = *reinterpret_cast<kmodel_lz4_batch *>(userdata);
+    for (size_t i = begin; i < end; i++)
+    {
+        uint32_t block = batch.first_block + i;
+        uint8_t *dest = batch.dest + (size_t)block * batch.block_size;
+        size_t raw_len = min(batch.block_size, batch.raw_size - block * batch.block_size);
+        const uint8_t *src = batch.src + batch.src_offsets[i];
+        size_t src_len = batch.src_offsets[i + 1] - batch.src_offsets[i];
+
+        if (batch.block_sizes[block] & KMODEL_LZ4_STORED)
+        {
+            if (src_len != raw_len)
+            {
+                batch.failed = 1;
+                return;
+            }
+            memcpy(dest, src, raw_len);
+        }
+        else if (lz4_decompress_block(src, src_len, dest, raw_len) != (int)raw_len)
+        {
+            batch.failed = 1;
+            return;
+        }
+
+        memcpy(dest - IOMEM, dest, raw_len);
+    }
+}
+
+static bool ranges_overlap(uint32_t a, uint32_t a_size, uint32_t b, uint32_t b_size)
+{
+    return a < b + b_size && b < a + a_size;
+}
+
 class k_model_context : public heap_object, public free_object_access
 {
 public:
@@ -51,29 +138,38 @@ public:
         configASSERT(is_memory_cache((uintptr_t)buffer));
 #endif
 
-        uintptr_t base_addr = (uintptr_t)buffer;
         const kpu_model_header_t *header = (const kpu_model_header_t *)buffer;
-        if (header->version == 3 && header->arch == 0)
+        if (header->version == KMODEL_LZ4_MAGIC)
         {
-            model_buffer_ = buffer;
-            output_count_ = header->output_count;
-            outputs_ = (const kpu_model_output_t *)(base_addr + sizeof(kpu_model_header_t));
-            layer_headers_ = (const kpu_model_layer_header_t *)((uintptr_t)outputs_ + sizeof(kpu_model_output_t) * output_count_);
-            layers_length_ = header->layers_length;
-            body_start_ = (const uint8_t *)((uintptr_t)layer_headers_ + sizeof(kpu_model_layer_header_t) * header->layers_length);
-
-            uint32_t body_size = 0;
-            for(int i=0; i<layers_length_; i++)
-            {
-                const kpu_model_layer_header_t *cnt_layer_header = layer_headers_ + i;
-                body_size += cnt_layer_header->body_size;
-            }
+            const kmodel_lz4_header_t *lz4_header = (const kmodel_lz4_header_t *)buffer;
+            const uint32_t *block_sizes = (const uint32_t *)(buffer + sizeof(kmodel_lz4_header_t));
+            const uint8_t *blocks = (const uint8_t *)(block_sizes + lz4_header->block_count);
+            load_compressed(*lz4_header, block_sizes, [&](size_t len) {
+                const uint8_t *src = blocks;
+                blocks += len;
+                return src;
+            });
+        }
+        else if (header->version == 3 && header->arch == 0)
+        {
+            /* The size of a model in memory is only known from its tables */
+            check_header(*header, UINT32_MAX);
+            parse_tables(buffer);
+            validate_outputs();
+
+            uint64_t body_size = 0;
+            for (uint32_t i = 0; i < layers_length_; i++)
+                body_size += layer_headers_[i].body_size;
+            validate_layers(get_tables_size(*header) + body_size);
+
             uint8_t *body_start_iomem = (uint8_t *)((uintptr_t)body_start_ - IOMEM);
             const uint8_t *body_start_cache = body_start_;
             memcpy(body_start_iomem, body_start_cache, body_size);
 
             storage_ = std::make_unique<uint8_t[]>(header->main_mem_usage);
             main_buffer_ = { storage_.get(), ptrdiff_t(header->main_mem_usage) };
+
+            prepare_layer_bodies();
         }
         else
         {
@@ -81,6 +177,81 @@ public:
         }
     }
 
+    k_model_context(handle_t file)
+    {
+        uint32_t magic;
+        read_exact(file, (uint8_t *)&magic, sizeof(magic));
+        if (magic == KMODEL_LZ4_MAGIC)
+        {
+            load_compressed_file(file);
+            return;
+        }
+
+        /* Nothing is allocated from the header before it is checked against what is left of the file */
+        uint64_t size_limit = UINT32_MAX;
+        uint64_t file_size = filesystem_file_get_size(file);
+        fpos_t position = filesystem_file_get_position(file);
+        if (file_size != UINT64_MAX && position >= (fpos_t)sizeof(magic) && (uint64_t)position <= file_size)
+            size_limit = file_size - position + sizeof(magic);
+
+        kpu_model_header_t header;
+        header.version = magic;
+        read_exact(file, (uint8_t *)&header + sizeof(magic), sizeof(header) - sizeof(magic));
+        check_header(header, size_limit);
+
+        /* Only the tables are staged before the model size is known */
+        size_t tables_size = get_tables_size(header);
+        auto tables = std::make_unique<uint8_t[]>(tables_size);
+        memcpy(tables.get(), &header, sizeof(header));
+        read_exact(file, tables.get() + sizeof(header), tables_size - sizeof(header));
+
+        const kpu_model_layer_header_t *layer_headers = (const kpu_model_layer_header_t *)(tables.get() + tables_size
+            - sizeof(kpu_model_layer_header_t) * header.layers_length);
+        uint64_t body_size = 0;
+        uint32_t i;
+        for (i = 0; i < header.layers_length; i++)
+        {
+            body_size += layer_headers[i].body_size;
+            if (tables_size + body_size > size_limit)
+                throw std::runtime_error("Invalid kmodel layer.");
+        }
+
+        size_t model_size = tables_size + body_size;
+        model_storage_ = std::make_unique<uint64_t[]>((model_size + 7) / 8);
+        uint8_t *buffer = (uint8_t *)model_storage_.get();
+#if FIX_CACHE
+        configASSERT(is_memory_cache((uintptr_t)buffer));
+#endif
+        memcpy(buffer, tables.get(), tables_size);
+        tables.reset();
+        parse_tables(buffer);
+        validate_outputs();
+
+        /* Stream the bodies into place, each chunk is written back to the uncached alias while it is still in cache */
+        const size_t chunk_size = 4096;
+        uint8_t *body = (uint8_t *)body_start_;
+        for (i = 0; i < layers_length_; i++)
+        {
+            const kpu_model_layer_header_t *cnt_layer_header = layer_headers_ + i;
+            size_t offset;
+            for (offset = 0; offset < cnt_layer_header->body_size; offset += chunk_size)
+            {
+                size_t len = min(chunk_size, cnt_layer_header->body_size - offset);
+                read_exact(file, body + offset, len);
+                memcpy(body + offset - IOMEM, body + offset, len);
+            }
+
+            /* Fail on a broken layer before the rest of the model is read */
+            validate_layer(cnt_layer_header, body, model_size);
+            body += cnt_layer_header->body_size;
+        }
+
+        storage_ = std::make_unique<uint8_t[]>(header.main_mem_usage);
+        main_buffer_ = { storage_.get(), ptrdiff_t(header.main_mem_usage) };
+
+        prepare_layer_bodies();
+    }
+
     void get(kpu_model_context_t *ctx)
     {
         ctx->body_start = body_start_;
@@ -91,6 +262,343 @@ public:
         ctx->output_count = output_count_;
         ctx->outputs = outputs_;
     }
+
+    const uint8_t *get_layer_body(uint32_t index) const noexcept
+    {
+        return layer_bodies_[index];
+    }
+
+    void set_profile_enabled(bool enable)
+    {
+        if (!enable)
+            profile_.reset();
+        else if (!profile_)
+            profile_ = std::make_unique<kpu_layer_profile_t[]>(layers_length_);
+    }
+
+    kpu_layer_profile_t *get_profile() const noexcept
+    {
+        return profile_.get();
+    }
+
+    uint32_t get_layers_length() const noexcept
+    {
+        return layers_length_;
+    }
+
+    /* The pair the layer belongs to, whether it runs fused or not */
+    kpu_layer_fusion_t get_layer_fusion(uint32_t index) const noexcept
+    {
+        return (kpu_layer_fusion_t)layer_fusions_[index];
+    }
+
+    bool is_fusion_enabled() const noexcept
+    {
+        return fusion_info_.enabled;
+    }
+
+    void set_fusion_enabled(bool enable) noexcept
+    {
+        fusion_info_.enabled = enable;
+    }
+
+    void get_fusion_info(kpu_fusion_info_t *info) const noexcept
+    {
+        *info = fusion_info_;
+    }
+
+    void set_last_run_cycles(uint64_t cycles, uint64_t pair_cycles) noexcept
+    {
+        fusion_info_.last_run_cycles = cycles;
+        fusion_info_.pair_cycles = pair_cycles;
+    }
+
+private:
+    void load_compressed_file(handle_t file)
+    {
+        kmodel_lz4_header_t header;
+        header.magic = KMODEL_LZ4_MAGIC;
+        read_exact(file, (uint8_t *)&header + sizeof(header.magic), sizeof(header) - sizeof(header.magic));
+        if (header.block_count > header.raw_size)
+            throw std::runtime_error("Invalid compressed kmodel.");
+
+        auto block_sizes = std::make_unique<uint32_t[]>(header.block_count);
+        read_exact(file, (uint8_t *)block_sizes.get(), sizeof(uint32_t) * header.block_count);
+
+        /* Compressed blocks are staged one batch at a time */
+        std::unique_ptr<uint8_t[]> staging;
+        size_t staging_size = 0;
+        load_compressed(header, block_sizes.get(), [&](size_t len) {
+            if (len > staging_size)
+            {
+                staging = std::make_unique<uint8_t[]>(len);
+                staging_size = len;
+            }
+
+            read_exact(file, staging.get(), len);
+            return (const uint8_t *)staging.get();
+        });
+    }
+
+    template <class TRead>
+    void load_compressed(const kmodel_lz4_header_t &header, const uint32_t *block_sizes, TRead &&read)
+    {
+        if (header.version != KMODEL_LZ4_VERSION || !header.block_size || header.raw_size < sizeof(kpu_model_header_t)
+            || header.block_count != (header.raw_size - 1) / header.block_size + 1)
+            throw std::runtime_error("Invalid compressed kmodel.");
+
+        model_storage_ = std::make_unique<uint64_t[]>((header.raw_size + 7) / 8);
+        uint8_t *buffer = (uint8_t *)model_storage_.get();
+#if FIX_CACHE
+        configASSERT(is_memory_cache((uintptr_t)buffer));
+#endif
+
+        uint32_t src_offsets[KMODEL_LZ4_BATCH_BLOCKS + 1];
+        kmodel_lz4_batch batch;
+        batch.dest = buffer;
+        batch.block_sizes = block_sizes;
+        batch.src_offsets = src_offsets;
+        batch.block_size = header.block_size;
+        batch.raw_size = header.raw_size;
+        batch.failed = 0;
+
+        uint32_t first, i;
+        for (first = 0; first < header.block_count; first += KMODEL_LZ4_BATCH_BLOCKS)
+        {
+            uint32_t count = min(KMODEL_LZ4_BATCH_BLOCKS, header.block_count - first);
+            src_offsets[0] = 0;
+            for (i = 0; i < count; i++)
+            {
+                uint32_t src_len = block_sizes[first + i] & ~KMODEL_LZ4_STORED;
+                if (src_len > LZ4_COMPRESS_BOUND(header.block_size))
+                    throw std::runtime_error("Invalid compressed kmodel.");
+                src_offsets[i + 1] = src_offsets[i] + src_len;
+            }
+
+            batch.src = read(src_offsets[count]);
+            batch.first_block = first;
+            parallel_for(kmodel_lz4_decompress_blocks, &batch, count, 1, 1);
+            if (batch.failed)
+                throw std::runtime_error("Invalid compressed kmodel.");
+        }
+
+        const kpu_model_header_t *model_header = (const kpu_model_header_t *)buffer;
+        check_header(*model_header, header.raw_size);
+        parse_tables(buffer);
+        validate_outputs();
+
+        uint64_t body_size = 0;
+        for (i = 0; i < layers_length_; i++)
+            body_size += layer_headers_[i].body_size;
+        if (get_tables_size(*model_header) + body_size > header.raw_size)
+            throw std::runtime_error("Invalid kmodel layer.");
+        validate_layers(header.raw_size);
+
+        storage_ = std::make_unique<uint8_t[]>(model_header->main_mem_usage);
+        main_buffer_ = { storage_.get(), ptrdiff_t(model_header->main_mem_usage) };
+
+        prepare_layer_bodies();
+    }
+
+    static uint64_t get_tables_size(const kpu_model_header_t &header)
+    {
+        return sizeof(kpu_model_header_t) + sizeof(kpu_model_output_t) * (uint64_t)header.output_count
+            + sizeof(kpu_model_layer_header_t) * (uint64_t)header.layers_length;
+    }
+
+    static void check_header(const kpu_model_header_t &header, uint64_t model_size)
+    {
+        if (header.version != 3 || header.arch != 0)
+            throw std::runtime_error("Cannot load kmodel.");
+        if (get_tables_size(header) > model_size || header.main_mem_usage > KMODEL_MAX_MAIN_MEM)
+            throw std::runtime_error("Invalid kmodel.");
+    }
+
+    void validate_outputs() const
+    {
+        const kpu_model_header_t *header = (const kpu_model_header_t *)model_buffer_;
+        for (uint32_t i = 0; i < output_count_; i++)
+        {
+            if ((uint64_t)outputs_[i].address + outputs_[i].size > header->main_mem_usage)
+                throw std::runtime_error("Invalid kmodel output.");
+        }
+    }
+
+    static void validate_layer(const kpu_model_layer_header_t *layer_header, const uint8_t *body, uint64_t model_size)
+    {
+        if (layer_header->type == KL_K210_CONV)
+        {
+            const kpu_model_conv_layer_argument_t *arg = (const kpu_model_conv_layer_argument_t *)body;
+            if (layer_header->body_size < sizeof(kpu_model_conv_layer_argument_t)
+                || (uint64_t)arg->layer_offset + sizeof(kpu_layer_argument_t) > model_size
+                || arg->weights_offset >= model_size || arg->bn_offset >= model_size
+                || (uint64_t)arg->act_offset + sizeof(kpu_activate_table_t) > model_size)
+                throw std::runtime_error("Invalid kmodel layer.");
+        }
+    }
+
+    void validate_layers(uint64_t model_size) const
+    {
+        const uint8_t *body = body_start_;
+        for (uint32_t i = 0; i < layers_length_; i++)
+        {
+            validate_layer(layer_headers_ + i, body, model_size);
+            body += layer_headers_[i].body_size;
+        }
+    }
+
+    static void read_exact(handle_t file, uint8_t *buffer, size_t len)
+    {
+        while (len)
+        {
+            int read = io_read(file, buffer, len);
+            if (read <= 0)
+                throw std::runtime_error("Unexpected end of kmodel.");
+            buffer += read;
+            len -= read;
+        }
+    }
+
+    void parse_tables(uint8_t *buffer)
+    {
+        uintptr_t base_addr = (uintptr_t)buffer;
+        const kpu_model_header_t *header = (const kpu_model_header_t *)buffer;
+
+        model_buffer_ = buffer;
+        output_count_ = header->output_count;
+        outputs_ = (const kpu_model_output_t *)(base_addr + sizeof(kpu_model_header_t));
+        layer_headers_ = (const kpu_model_layer_header_t *)((uintptr_t)outputs_ + sizeof(kpu_model_output_t) * output_count_);
+        layers_length_ = header->layers_length;
+        body_start_ = (const uint8_t *)((uintptr_t)layer_headers_ + sizeof(kpu_model_layer_header_t) * header->layers_length);
+    }
+
+    void prepare_layer_bodies()
+    {
+        layer_bodies_ = std::make_unique<const uint8_t *[]>(layers_length_);
+
+        const uint8_t *body = body_start_;
+        for (uint32_t i = 0; i < layers_length_; i++)
+        {
+            const kpu_model_layer_header_t *cnt_layer_header = layer_headers_ + i;
+            layer_bodies_[i] = body;
+
+            /* Weights are read in place by the CPU layers, stage a 8 bytes aligned copy once if they are not aligned */
+            if ((cnt_layer_header->type == KL_FULLY_CONNECTED || cnt_layer_header->type == KL_QUANTIZED_FULLY_CONNECTED)
+                && (uintptr_t)body % sizeof(uint64_t) != 0)
+            {
+                auto staged = std::make_unique<uint64_t[]>((cnt_layer_header->body_size + 7) / 8);
+                memcpy(staged.get(), body, cnt_layer_header->body_size);
+                layer_bodies_[i] = (const uint8_t *)staged.get();
+                staged_bodies_.emplace_back(std::move(staged));
+            }
+
+            body += cnt_layer_header->body_size;
+        }
+
+        /* The pairs are always found, the flag only selects how they run */
+        layer_fusions_ = std::make_unique<uint8_t[]>(layers_length_);
+        fuse_layers();
+        fusion_info_.enabled = KPU_FUSE_LAYERS;
+    }
+
+    void fuse_layers()
+    {
+        uint32_t i;
+        for (i = 0; i + 1 < layers_length_; i++)
+        {
+            uint32_t type = layer_headers_[i].type, next_type = layer_headers_[i + 1].type;
+            const uint8_t *body = layer_bodies_[i], *next_body = layer_bodies_[i + 1];
+            kpu_layer_fusion_t fusion = KFU_NONE;
+            uint32_t tensor = 0, tensor_size = 0;
+
+            /* The second layer must consume exactly the first output and must not overwrite the first input */
+            if (type == KL_DEQUANTIZE && next_type == KL_SOFTMAX)
+            {
+                auto dequantize = (const kpu_model_dequantize_layer_argument_t *)body;
+                auto softmax = (const kpu_model_softmax_layer_argument_t *)next_body;
+                if (dequantize->main_mem_out_address == softmax->main_mem_in_address && dequantize->count == softmax->channels
+                    && !ranges_overlap(softmax->main_mem_out_address, softmax->channels * sizeof(float), dequantize->main_mem_in_address, dequantize->count))
+                {
+                    fusion = KFU_DEQUANTIZE_SOFTMAX;
+                    tensor = dequantize->main_mem_out_address;
+                    tensor_size = dequantize->count * sizeof(float);
+                }
+            }
+            else if (type == KL_TENSORFLOW_FLATTEN && next_type == KL_FULLY_CONNECTED)
+            {
+                auto flatten = (const kpu_model_tf_flatten_layer_argument_t *)body;
+                auto fc = (const kpu_model_fully_connected_layer_argument_t *)next_body;
+                uint32_t count = flatten->shape.width * flatten->shape.height * flatten->shape.channels;
+                if (flatten->main_mem_out_address == fc->main_mem_in_address && count == fc->in_channels
+                    && !ranges_overlap(fc->main_mem_out_address, fc->out_channels * sizeof(float), flatten->main_mem_in_address, count * sizeof(float)))
+                {
+                    fusion = KFU_TF_FLATTEN_FULLY_CONNECTED;
+                    tensor = flatten->main_mem_out_address;
+                    tensor_size = count * sizeof(float);
+                }
+            }
+            else if (type == KL_K210_REMOVE_PADDING && next_type == KL_DEQUANTIZE)
+            {
+                auto remove_padding = (const kpu_model_remove_padding_layer_argument_t *)body;
+                auto dequantize = (const kpu_model_dequantize_layer_argument_t *)next_body;
+                if (remove_padding->main_mem_out_address == dequantize->main_mem_in_address && remove_padding->channels == dequantize->count
+                    && !ranges_overlap(dequantize->main_mem_out_address, dequantize->count * sizeof(float), remove_padding->main_mem_in_address, remove_padding->channels * 16))
+                {
+                    fusion = KFU_REMOVE_PADDING_DEQUANTIZE;
+                    tensor = remove_padding->main_mem_out_address;
+                    tensor_size = remove_padding->channels;
+                }
+            }
+            else if (type == KL_QUANTIZE && next_type == KL_K210_UPLOAD)
+            {
+                auto quantize = (const kpu_model_quantize_layer_argument_t *)body;
+                auto upload = (const kpu_model_upload_layer_argument_t *)next_body;
+                if (quantize->mem_out_address == upload->main_mem_in_address && quantize->count == upload->width * upload->height * upload->channels)
+                {
+                    fusion = KFU_QUANTIZE_UPLOAD;
+                    tensor = quantize->mem_out_address;
+                    tensor_size = quantize->count;
+                }
+            }
+
+            if (fusion != KFU_NONE && is_tensor_dead(tensor, tensor_size, i + 2))
+            {
+                layer_fusions_[i] = fusion;
+                layer_fusions_[i + 1] = KFU_FUSED;
+                fusion_info_.fused_pairs++;
+                fusion_info_.saved_bytes += tensor_size * 2;
+                i++;
+            }
+        }
+    }
+
+    /* True if no layer from first_layer on nor a model output reads the tensor before it is overwritten */
+    bool is_tensor_dead(uint32_t tensor, uint32_t tensor_size, uint32_t first_layer) const
+    {
+        uint32_t i;
+        for (i = first_layer; i < layers_length_; i++)
+        {
+            switch (kpu_layer_tensor_access(layer_headers_[i].type, layer_bodies_[i], tensor, tensor + tensor_size))
+            {
+                case KTA_WRITE:
+                    return true;
+                case KTA_READ:
+                case KTA_UNKNOWN:
+                    return false;
+                default:
+                    break;
+            }
+        }
+
+        for (i = 0; i < output_count_; i++)
+        {
+            if (ranges_overlap(outputs_[i].address, outputs_[i].size, tensor, tensor_size))
+                return false;
+        }
+
+        return true;
+    }
+
 private:
     const uint8_t *model_buffer_;
     const kpu_model_layer_header_t *layer_headers_;
@@ -100,6 +608,12 @@ private:
     const kpu_model_output_t * outputs_;
     gsl::span<uint8_t> main_buffer_;
     std::unique_ptr<uint8_t[]> storage_;
+    std::unique_ptr<uint64_t[]> model_storage_;
+    std::unique_ptr<const uint8_t *[]> layer_bodies_;
+    std::vector<std::unique_ptr<uint64_t[]>> staged_bodies_;
+    std::unique_ptr<kpu_layer_profile_t[]> profile_;
+    std::unique_ptr<uint8_t[]> layer_fusions_;
+    kpu_fusion_info_t fusion_info_ = {};
 };
 
 class k_kpu_driver : public kpu_driver, public static_object, public free_object_access
@@ -131,18 +645,51 @@ public:
 
     virtual handle_t model_load_from_buffer(uint8_t *buffer) override
     {
-        return system_alloc_handle(make_accessor(make_object<k_model_context>(buffer)));
+        try
+        {
+            return system_alloc_handle(make_accessor(make_object<k_model_context>(buffer)));
+        }
+        catch (...)
+        {
+            return NULL_HANDLE;
+        }
+    }
+
+    virtual handle_t model_load_from_file(handle_t file) override
+    {
+        try
+        {
+            return system_alloc_handle(make_accessor(make_object<k_model_context>(file)));
+        }
+        catch (...)
+        {
+            return NULL_HANDLE;
+        }
     }
 
     virtual int run(handle_t context, const uint8_t *src) override
     {
         COMMON_ENTRY;
+        uint64_t run_begin = read_csr(mcycle);
 
         auto model_context = system_handle_to_object(context).as<k_model_context>();
         model_context->get(&ctx_);
-        
+        model_context_ = model_context;
+
         ctx_.current_layer = 0;
         ctx_.current_body = ctx_.body_start;
+
+        fusion_enabled_ = model_context->is_fusion_enabled();
+        pair_cycles_ = 0;
+        profile_ = model_context->get_profile();
+        if (profile_)
+        {
+            uint32_t i;
+            for (i = 0; i < ctx_.layers_length; i++)
+                profile_[i] = { ctx_.layer_headers[i].type, 0, 0, 0, 0 };
+            profile_pending_ = 0;
+            profile_begin_ = read_csr(mcycle);
+        }
         
         kpu_model_header_t *header = (kpu_model_header_t *)ctx_.model_buffer;
         kpu_.interrupt_clear.reg = 7;
@@ -166,25 +713,52 @@ public:
 #if KPU_DEBUG
         gettimeofday(&last_time_, NULL);
 #endif
-        if ((layer_arg.image_size.data.i_row_wid + 1) % 64 != 0)
+        if (!src)
+        {
+            /* The input has been written in place, e.g. by the DVP */
+            if (profile_)
+                profile_pending_ = -1;
+            xSemaphoreGive(completion_event_);
+        }
+        else if ((layer_arg.image_size.data.i_row_wid + 1) % 64 != 0)
         {
             kpu_input_with_padding(&layer_arg, src);
 
+            if (profile_)
+            {
+                profile_[0].memcpy_bytes += (layer_arg.image_size.data.i_row_wid + 1) * (layer_arg.image_size.data.i_col_high + 1) * (layer_arg.image_channel_num.data.i_ch_num + 1);
+                profile_[0].cpu_cycles += read_csr(mcycle) - profile_begin_;
+                profile_pending_ = -1;
+            }
             xSemaphoreGive(completion_event_);
         }
         else
         {
             kpu_input_dma(&layer_arg, src);
+            if (profile_)
+                profile_[0].dma_bytes += layer_arg.kernel_calc_type_cfg.data.channel_switch_addr * 64 * (layer_arg.image_channel_num.data.i_ch_num + 1);
         }
         while (!done_flag_)
         {
             if(xSemaphoreTake(completion_event_, 200) == pdTRUE)
             {
+                if (profile_ && profile_pending_ >= 0)
+                {
+                    uint64_t now = read_csr(mcycle);
+                    profile_[profile_pending_].kpu_cycles += now - profile_begin_;
+                    profile_begin_ = now;
+                }
                 if(mem_out_flag_)
                 {
                     memcpy(dest_kpu_, dest_io_, dest_len_);
                     mem_out_flag_ = 0;
+                    if (profile_ && profile_pending_ >= 0)
+                    {
+                        profile_[profile_pending_].memcpy_bytes += dest_len_;
+                        profile_[profile_pending_].cpu_cycles += read_csr(mcycle) - profile_begin_;
+                    }
                 }
+                profile_pending_ = -1;
                 if (ctx_.current_layer != ctx_.layers_length)
                 {
                     while(ai_step() == 1)
@@ -197,7 +771,73 @@ public:
             }
         }
         done_flag_ = 0;
-        
+        model_context->set_last_run_cycles(read_csr(mcycle) - run_begin, pair_cycles_);
+
+        return 0;
+    }
+
+    virtual int get_input_planes(handle_t context, uint8_t **planes, size_t count) override
+    {
+        COMMON_ENTRY;
+        auto model_context = system_handle_to_object(context).as<k_model_context>();
+        kpu_model_context_t ctx;
+        model_context->get(&ctx);
+
+        if (ctx.layer_headers->type != KL_K210_CONV)
+            return -1;
+        const kpu_model_conv_layer_argument_t *first_layer = (const kpu_model_conv_layer_argument_t *)ctx.body_start;
+        const kpu_layer_argument_t *layer_arg = (const kpu_layer_argument_t *)(ctx.model_buffer + first_layer->layer_offset);
+
+        /* Rows are only contiguous in the KPU layout when they fill whole 64 bytes lines */
+        size_t channels = layer_arg->image_channel_num.data.i_ch_num + 1;
+        if ((layer_arg->image_size.data.i_row_wid + 1) % 64 != 0 || count < channels)
+            return -1;
+
+        size_t i;
+        for (i = 0; i < channels; i++)
+            planes[i] = (uint8_t *)AI_IO_BASE_ADDR + (layer_arg->image_addr.data.image_src_addr + i * layer_arg->kernel_calc_type_cfg.data.channel_switch_addr) * 64;
+        return channels;
+    }
+
+    virtual int run_from_dvp_frame(handle_t context) override
+    {
+        return run(context, nullptr);
+    }
+
+    virtual int set_profile_enabled(handle_t context, bool enable) override
+    {
+        COMMON_ENTRY;
+        auto model_context = system_handle_to_object(context).as<k_model_context>();
+        model_context->set_profile_enabled(enable);
+        return 0;
+    }
+
+    virtual int get_profile(handle_t context, kpu_layer_profile_t *profile, size_t count) override
+    {
+        COMMON_ENTRY;
+        auto model_context = system_handle_to_object(context).as<k_model_context>();
+        const kpu_layer_profile_t *src = model_context->get_profile();
+        if (!src)
+            return -1;
+
+        uint32_t layers_length = model_context->get_layers_length();
+        memcpy(profile, src, sizeof(kpu_layer_profile_t) * min(count, (size_t)layers_length));
+        return layers_length;
+    }
+
+    virtual int set_fusion_enabled(handle_t context, bool enable) override
+    {
+        COMMON_ENTRY;
+        auto model_context = system_handle_to_object(context).as<k_model_context>();
+        model_context->set_fusion_enabled(enable);
+        return 0;
+    }
+
+    virtual int get_fusion_info(handle_t context, kpu_fusion_info_t *info) override
+    {
+        COMMON_ENTRY;
+        auto model_context = system_handle_to_object(context).as<k_model_context>();
+        model_context->get_fusion_info(info);
         return 0;
     }
 
@@ -261,92 +901,58 @@ private:
         kpu_.layer_argument_fifo = layer->dma_parameter.reg;
     }
 
-    void kpu_upload_core(size_t width, size_t height, size_t channels, const uint8_t *src, uint32_t kpu_addr)
+    /* Copy one row with 64 bits stores, the KPU row padding always leaves room for a full tail word */
+    static void kpu_upload_row(uint64_t *dest, const uint8_t *src, size_t width)
     {
-        uint8_t *dest = (uint8_t *)AI_IO_BASE_ADDR + kpu_addr * 64;
-        size_t oc, y, x;
-        uint32_t row_padding;
-        uint32_t row_group;
-        uint32_t row_length;
-        if (width <= 16)
-        {
-        	row_padding = 16;
-        	row_group = 4;
-        	row_length = 1;
-        }
-        else if (width <= 32)
+        size_t words = width / 8, tail = width % 8, i;
+        size_t offset = (uintptr_t)src % 8;
+
+        if (offset == 0)
         {
-        	row_padding = 32;
-        	row_group = 2;
-        	row_length = 1;
+            const uint64_t *u64_src = (const uint64_t *)src;
+            for (i = 0; i < words; i++)
+                dest[i] = u64_src[i];
         }
         else
         {
-        	row_padding = 64;
-        	row_group = 1;
-        	row_length = (width + 63) / 64;
+            /* Merge aligned loads, never reading outside an aligned word that holds row bytes */
+            const uint64_t *u64_src = (const uint64_t *)(src - offset);
+            uint32_t right_shift = offset * 8, left_shift = 64 - right_shift;
+            uint64_t current = u64_src[0];
+            for (i = 0; i < words; i++)
+            {
+                uint64_t next = u64_src[i + 1];
+                dest[i] = (current >> right_shift) | (next << left_shift);
+                current = next;
+            }
         }
 
-        if ((uintptr_t)src % 8 == 0 && width % 8 == 0)
+        if (tail)
         {
-#define UPLOAD_BEGIN()                                                                                               \
-            for (oc = 0; oc < channels; oc++)                                                                                \
-            {                                                                                                                \
-                uint8_t* channel_origin = dest + oc / row_group * row_length * height * 64 + oc % row_group * row_padding;   \
-                for (y = 0; y < height; y++)                                                                                 \
-                {                                                                                                            \
-                    uint64_t *y_origin = (uint64_t *)channel_origin + y * row_length * 64;                                               \
-
-#define UPLOAD_END() \
-                }            \
-            }
-            width /= 8;
-            const uint64_t *u64_src = (const uint64_t *)src;
-            if (width == 1)
-            {
-                UPLOAD_BEGIN()
-                    y_origin[0] = *u64_src++;
-                UPLOAD_END()
-            }
-            else if (width == 2)
-            {
-                UPLOAD_BEGIN()
-                {
-                    y_origin[0] = *u64_src++;
-                    y_origin[1] = *u64_src++;
-                }
-                UPLOAD_END()
-            }
-            else if (width == 4)
-            {
-                UPLOAD_BEGIN()
-                {
-                    y_origin[0] = *u64_src++;
-                    y_origin[1] = *u64_src++;
-                    y_origin[2] = *u64_src++;
-                    y_origin[3] = *u64_src++;
-                }
-                UPLOAD_END()
-            }
-            else
-            {
-                UPLOAD_BEGIN()
-                for (x = 0; x < width; x++)
-                    y_origin[x] = *u64_src++;
-                UPLOAD_END()
-            }
+            const uint8_t *tail_src = src + words * 8;
+            uint64_t value = 0;
+            for (i = 0; i < tail; i++)
+                value |= (uint64_t)tail_src[i] << (i * 8);
+            dest[words] = value;
         }
-        else
+    }
+
+    void kpu_upload_core(size_t width, size_t height, size_t channels, const uint8_t *src, uint32_t kpu_addr)
+    {
+        uint8_t *dest = (uint8_t *)AI_IO_BASE_ADDR + kpu_addr * 64;
+        size_t oc, y;
+        uint32_t row_padding;
+        uint32_t row_group;
+        uint32_t row_length;
+        kpu_row_layout(width, row_padding, row_group, row_length);
+
+        for (oc = 0; oc < channels; oc++)
         {
-            for (oc = 0; oc < channels; oc++)
+            uint8_t *channel_origin = dest + oc / row_group * row_length * height * 64 + oc % row_group * row_padding;
+            for (y = 0; y < height; y++)
             {
-            	uint8_t *channel_origin = dest + oc / row_group * row_length * height * 64 + oc % row_group * row_padding;
-            	for (y = 0; y < height; y++)
-            	{
-            		uint8_t *y_origin = channel_origin + y * row_length * 64;
-            		for (x = 0; x < width; x++)
-                        y_origin[x] = *src++;
-                }
+                kpu_upload_row((uint64_t *)(channel_origin + y * row_length * 64), src, width);
+                src += width;
             }
         }
     }
@@ -368,433 +974,6 @@ private:
         kpu_upload_core(width, height, channels, src, layer->image_addr.data.image_src_addr);
     }
 
-    void kpu_add(const kpu_model_add_layer_argument_t *arg)
-    {
-        const float *src_a = (const float *)(ctx_.main_buffer + arg->main_mem_in_a_address);
-        const float *src_b = (const float *)(ctx_.main_buffer + arg->main_mem_in_b_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t i, count = arg->count;
-        
-        for (i = 0; i < count; i++)
-            dest[i] = src_a[i] + src_b[i];
-    }
-
-    void kpu_quantized_add(const kpu_model_quant_add_layer_argument_t *arg)
-    {
-        const uint8_t *src_a = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_a_address);
-        const uint8_t *src_b = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_b_address);
-        size_t count = ALIGN_UP(arg->count, 8) / 8;
-        int64_t off_a = arg->in_a_offset, mul_a = arg->in_a_mul, sh_a = arg->in_a_shift;
-        int64_t off_b = arg->in_b_offset, mul_b = arg->in_b_mul, sh_b = arg->in_b_shift;
-        int64_t off_o = arg->out_offset, mul_o = arg->out_mul, sh_o = arg->out_shift;
-    
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t i;
-
-        if (sh_a == sh_b)
-        {
-#define QADD_UNROLL_1(x)     \
-            int64_t a##x = *src_a++; \
-            int64_t b##x = *src_b++;
-        
-#define QADD_UNROLL_2(x) \
-            a##x += off_a; \
-            b##x += off_b;
-        
-#define QADD_UNROLL_3(x) \
-            a##x *= mul_a; \
-            b##x *= mul_b;
-        
-#define QADD_UNROLL_4(x) \
-            int64_t v##x = a##x + b##x;
-        
-#define QADD_UNROLL_5(x) \
-            v##x >>= sh_a;
-        
-#define QADD_UNROLL_6(x) \
-            v##x *= mul_o;
-        
-#define QADD_UNROLL_7(x) \
-            v##x >>= sh_o;
-        
-#define QADD_UNROLL_8(x) \
-            v##x += off_o;
-        
-#define QADD_UNROLL_9(x) \
-            v##x = min(0xFF, max(0, v##x));
-        
-#define QADD_UNROLL_10(x) \
-            *dest++ = v##x;
-        
-#define QADD_UNROLL_S(x) \
-            QADD_UNROLL_##x(0) \
-            QADD_UNROLL_##x(1) \
-            QADD_UNROLL_##x(2) \
-            QADD_UNROLL_##x(3) \
-            QADD_UNROLL_##x(4) \
-            QADD_UNROLL_##x(5) \
-            QADD_UNROLL_##x(6) \
-            QADD_UNROLL_##x(7)
-
-            for (i = 0; i < count; i++)
-            {
-                QADD_UNROLL_S(1);
-                QADD_UNROLL_S(2);
-                QADD_UNROLL_S(3);
-                QADD_UNROLL_S(4);
-                QADD_UNROLL_S(5);
-                QADD_UNROLL_S(6);
-                QADD_UNROLL_S(7);
-                QADD_UNROLL_S(8);
-                QADD_UNROLL_S(9);
-                QADD_UNROLL_S(10);
-            }
-        }
-        else
-        {
-#undef QADD_UNROLL_1
-#define QADD_UNROLL_1(x)     \
-            int64_t a##x = *src_a++; \
-            int64_t b##x = *src_b++;
-
-#undef QADD_UNROLL_2
-#define QADD_UNROLL_2(x) \
-            a##x += off_a; \
-            b##x += off_b;
-
-#undef QADD_UNROLL_3
-#define QADD_UNROLL_3(x) \
-            a##x *= mul_a; \
-            b##x *= mul_b;
-
-#undef QADD_UNROLL_4
-#define QADD_UNROLL_4(x) \
-            a##x >>= sh_a; \
-            b##x >>= sh_b;
-
-#undef QADD_UNROLL_5
-#define QADD_UNROLL_5(x) \
-            int64_t v##x = a##x + b##x;
-
-#undef QADD_UNROLL_6
-#define QADD_UNROLL_6(x) \
-            v##x *= mul_o;
-
-#undef QADD_UNROLL_7
-#define QADD_UNROLL_7(x) \
-            v##x >>= sh_o;
-
-#undef QADD_UNROLL_8
-#define QADD_UNROLL_8(x) \
-            v##x += off_o;
-
-#undef QADD_UNROLL_9
-#define QADD_UNROLL_9(x) \
-            v##x = min(0xFF, max(0, v##x));
-
-#undef QADD_UNROLL_10
-#define QADD_UNROLL_10(x) \
-            *dest++ = v##x;
-
-#undef QADD_UNROLL_S
-#define QADD_UNROLL_S(x) \
-            QADD_UNROLL_##x(0) \
-            QADD_UNROLL_##x(1) \
-            QADD_UNROLL_##x(2) \
-            QADD_UNROLL_##x(3) \
-            QADD_UNROLL_##x(4) \
-            QADD_UNROLL_##x(5) \
-            QADD_UNROLL_##x(6) \
-            QADD_UNROLL_##x(7)
-
-            for (i = 0; i < count; i++)
-            {
-                QADD_UNROLL_S(1);
-                QADD_UNROLL_S(2);
-                QADD_UNROLL_S(3);
-                QADD_UNROLL_S(4);
-                QADD_UNROLL_S(5);
-                QADD_UNROLL_S(6);
-                QADD_UNROLL_S(7);
-                QADD_UNROLL_S(8);
-                QADD_UNROLL_S(9);
-                QADD_UNROLL_S(10);
-            }
-        }
-    }
-
-    void kpu_global_average_pool2d(const kpu_model_gap2d_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t oc, channels = arg->channels, kernel_size = arg->kernel_size;
-        
-        for (oc = 0; oc < channels; oc++)
-        {
-            float sum = 0.f;
-            size_t i;
-            for (i = 0; i < kernel_size; i++)
-                sum += *src++;
-
-            dest[oc] = sum / kernel_size;
-        }
-    }
-
-    void kpu_quantized_max_pool2d(const kpu_model_quant_max_pool2d_layer_argument_t *arg)
-    {
-        const uint8_t *src = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_address);
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->main_mem_out_address);
-        kpu_model_shape_t in_shape = arg->in_shape, out_shape = arg->out_shape;
-        uint32_t kernel_width = arg->kernel_width, kernel_height = arg->kernel_height;
-        uint32_t stride_width = arg->stride_width, stride_height = arg->stride_height;
-        uint32_t padding_width = arg->padding_width, padding_height = arg->padding_height;
-    
-        uint32_t out_y, out_x, oc;
-    
-        for (oc = 0; oc < out_shape.channels; oc++)
-        {
-            const uint8_t *channel_src = src + in_shape.width * in_shape.height * oc;
-            for (out_y = 0; out_y < out_shape.height; out_y++)
-            {
-                for (out_x = 0; out_x < out_shape.width; out_x++)
-                {
-                    int32_t in_x_origin = (int32_t)(out_x * stride_width) - padding_width;
-                    int32_t in_y_origin = (int32_t)(out_y * stride_height) - padding_height;
-                    int32_t kernel_x_start = max(0, -in_x_origin);
-                    int32_t kernel_x_end = min(kernel_width, in_shape.width - in_x_origin);
-                    int32_t kernel_y_start = max(0, -in_y_origin);
-                    int32_t kernel_y_end = min(kernel_height, in_shape.height - in_y_origin);
-                    uint8_t value = 0;
-    
-                    int32_t kernel_y, kernel_x;
-                    for (kernel_y = kernel_y_start; kernel_y < kernel_y_end; kernel_y++)
-                    {
-                        for (kernel_x = kernel_x_start; kernel_x < kernel_x_end; kernel_x++)
-                        {
-                            int32_t in_x = in_x_origin + kernel_x;
-                            int32_t in_y = in_y_origin + kernel_y;
-                            value = max(value, channel_src[in_y * in_shape.width + in_x]);
-                        }
-                    }
-    
-                    *dest++ = value;
-                }
-            }
-        }
-    }
-
-    void kpu_average_pool2d(const kpu_model_ave_pool2d_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        kpu_model_shape_t in_shape = arg->in_shape, out_shape = arg->out_shape;
-        uint32_t kernel_width = arg->kernel_width, kernel_height = arg->kernel_height;
-        uint32_t stride_width = arg->stride_width, stride_height = arg->stride_height;
-        uint32_t padding_width = arg->padding_width, padding_height = arg->padding_height;
-    
-        uint32_t out_y, out_x, oc;
-    
-        for (oc = 0; oc < out_shape.channels; oc++)
-        {
-            const float *channel_src = src + in_shape.width * in_shape.height * oc;
-            for (out_y = 0; out_y < out_shape.height; out_y++)
-            {
-                for (out_x = 0; out_x < out_shape.width; out_x++)
-                {
-                    int32_t in_x_origin = (int32_t)(out_x * stride_width) - padding_width;
-                    int32_t in_y_origin = (int32_t)(out_y * stride_height) - padding_height;
-                    int32_t kernel_x_start = max(0, -in_x_origin);
-                    int32_t kernel_x_end = min(kernel_width, in_shape.width - in_x_origin);
-                    int32_t kernel_y_start = max(0, -in_y_origin);
-                    int32_t kernel_y_end = min(kernel_height, in_shape.height - in_y_origin);
-                    float value = 0;
-                    float kernel_count = 0;
-    
-                    int32_t kernel_y, kernel_x;
-                    for (kernel_y = kernel_y_start; kernel_y < kernel_y_end; kernel_y++)
-                    {
-                        for (kernel_x = kernel_x_start; kernel_x < kernel_x_end; kernel_x++)
-                        {
-                            int32_t in_x = in_x_origin + kernel_x;
-                            int32_t in_y = in_y_origin + kernel_y;
-                            value += channel_src[in_y * in_shape.width + in_x];
-                            kernel_count++;
-                        }
-                    }
-    
-                    *dest++ = value / kernel_count;
-                }
-            }
-        }
-    }
-
-    void kpu_quantize(const kpu_model_quantize_layer_argument_t *arg)
-    {
-        size_t count = arg->count;
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        kpu_model_quant_param_t q = arg->quant_param;
-
-        float scale = 1.f / q.scale;
-
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->mem_out_address);
-        size_t i;
-        for (i = 0; i < count; i++)
-        {
-            int value = (*src++ - q.bias) * scale;
-            if (value < 0) value = 0;
-            if (value > 0xFF) value = 0xFF;
-            *dest++ = (uint8_t)value;
-        }
-    }
-
-    void kpu_dequantize(const kpu_model_dequantize_layer_argument_t *arg)
-    {
-        const uint8_t *src = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t oc, count = arg->count;
-        kpu_model_quant_param_t q = arg->quant_param;
-
-        for (oc = 0; oc < count; oc++)
-            dest[oc] = *src++ * q.scale + q.bias;
-    }
-
-    void kpu_requantize(const kpu_model_requantize_layer_argument_t *arg)
-    {
-        const uint8_t *src = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_address);
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t oc, count = ALIGN_UP(arg->count, 8) / 8;
-        const uint8_t *table = arg->table;
-        
-		for (oc = 0; oc < count;)
-	    {
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-			dest[oc++] = table[*src++];
-	    }
-	}
-
-    void kpu_l2_normalization(const kpu_model_l2_norm_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t oc, channels = arg->channels;
-
-        float sum = 0.f;
-        const float epsilon = 1e-10f;
-        for (oc = 0; oc < channels; oc++)
-            sum += src[oc] * src[oc];
-        if (sum < epsilon)
-            sum = epsilon;
-        sum = 1.f / sqrtf(sum);
-        for (oc = 0; oc < channels; oc++)
-            dest[oc] = src[oc] * sum;
-    }
-
-    void kpu_softmax(const kpu_model_softmax_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        size_t oc, channels = arg->channels;
-    
-        float max = FLT_MIN;
-        for (oc = 0; oc < channels; oc++)
-            max = fmaxf(max, src[oc]);
-    
-        float sum = 0.f;
-        for (oc = 0; oc < channels; oc++)
-        {
-            float value = expf(src[oc] - max);
-            sum += value;
-            dest[oc] = value;
-        }
-            
-        for (oc = 0; oc < channels; oc++)
-            dest[oc] /= sum;
-    }
-
-    void kpu_concat(const kpu_model_concat_layer_argument_t *arg)
-    {
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->main_mem_out_address);
-        uint32_t count = arg->input_count, i;
-    
-        for (i = 0; i < count; i++)
-        {
-            kpu_model_memory_range_t input = arg->inputs_mem[i];
-            const uint8_t *src = (const uint8_t *)(ctx_.main_buffer + input.start);
-            memcpy(dest, src, input.size);
-            dest += input.size;
-        }
-    }
-
-    void kpu_fully_connected(const kpu_model_fully_connected_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        uint32_t in_channels = arg->in_channels, out_channels = arg->out_channels, ic, oc;
-
-        float *weights = (float *)malloc(out_channels * in_channels);
-        float *bias = (float *)malloc(out_channels);
-        memcpy(weights, arg->weights, out_channels * in_channels * sizeof(float));
-        memcpy(bias, arg->weights + in_channels * out_channels, out_channels * sizeof(float));
-
-        for (oc = 0; oc < out_channels; oc++)
-        {
-            const float *c_weights = weights + oc * in_channels;
-
-            float sum = 0.0f;
-            for (ic = 0; ic < in_channels; ic++)
-                sum += src[ic] * c_weights[ic];
-            dest[oc] = sum + bias[oc];
-        }
-		free(weights);
-		free(bias);
-    }
-
-    void kpu_tf_flatten(const kpu_model_tf_flatten_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        kpu_model_shape_t in_shape = arg->shape;
-        uint32_t oc, oy, ox;
-    
-        for (oy = 0; oy < in_shape.height; oy++)
-            for (ox = 0; ox < in_shape.width; ox++)
-                for (oc = 0; oc < in_shape.channels; oc++)
-                    *dest++ = src[(oc * in_shape.height + oy) * in_shape.width + ox];
-    }
-
-    void kpu_resize_nearest_neighbor(const kpu_model_resize_nearest_neighbor_layer_argument_t *arg)
-    {
-        const float *src = (const float *)(ctx_.main_buffer + arg->main_mem_in_address);
-        float *dest = (float *)(ctx_.main_buffer + arg->main_mem_out_address);
-        kpu_model_shape_t in_shape = arg->in_shape;
-        uint32_t out_width = arg->out_width, out_height = arg->out_height;
-        uint32_t oc, oy, ox;
-    
-        float height_scale = (float)in_shape.height / out_height;
-        float width_scale = (float)in_shape.width / out_width;
-    
-        for (oc = 0; oc < in_shape.channels; oc++)
-        {
-            const float *channel_src = src + in_shape.width * in_shape.height * oc;
-            for (oy = 0; oy <out_height; oy++)
-            {
-                uint32_t in_y = (uint32_t)min(floorf(oy * height_scale), in_shape.height - 1);
-                const float *y_origin = channel_src + in_y * in_shape.width;
-                for (ox = 0; ox < out_width; ox++)
-                {
-                    uint32_t in_x = (uint32_t)min(floorf(ox * width_scale), in_shape.width - 1);
-                    *dest++ = y_origin[in_x];
-                }
-            }
-        }
-    }
-
     void kpu_conv(const kpu_model_conv_layer_argument_t *arg)
     {
         volatile kpu_layer_argument_t layer = *(kpu_layer_argument_t *)(ctx_.model_buffer + arg->layer_offset);
@@ -829,6 +1008,17 @@ private:
             layer.interrupt_enabe.data.int_en = 1;
         }
         kpu_send_layer((const kpu_layer_argument_t *)&layer);
+
+        if (profile_)
+        {
+            uint32_t cnt_layer_id = ctx_.current_layer - 1;
+            uint64_t now = read_csr(mcycle);
+            if (arg->flags & KLF_MAIN_MEM_OUT)
+                profile_[cnt_layer_id].dma_bytes += dest_len_;
+            profile_[cnt_layer_id].cpu_cycles += now - profile_begin_;
+            profile_begin_ = now;
+            profile_pending_ = cnt_layer_id;
+        }
     }
 
     void kpu_add_padding(const kpu_model_add_padding_layer_argument_t *arg)
@@ -857,22 +1047,15 @@ private:
                     y_origin[x] = *src++;
             }
         }
+
+        if (profile_)
+            profile_[ctx_.current_layer - 1].memcpy_bytes += channels;
 #if USE_CACHED_AI_RAM
         uint32_t lines = row_length * height * channels / row_group;
         kpu_flush_cache(arg->kpu_mem_out_address, lines);
 #endif
     }
 
-    void kpu_remove_padding(const kpu_model_remove_padding_layer_argument_t *arg)
-    {
-        const uint8_t *src = (const uint8_t *)(ctx_.main_buffer + arg->main_mem_in_address);
-        uint8_t *dest = (uint8_t *)(ctx_.main_buffer + arg->main_mem_out_address);
-        uint32_t oc, channels = arg->channels;
-
-        for (oc = 0; oc < channels; oc++)
-            *dest++ = src[oc * 16];
-    }
-
     void kpu_upload(const kpu_model_upload_layer_argument_t *arg)
     {
         size_t width = arg->width;
@@ -880,56 +1063,73 @@ private:
         size_t channels = arg->channels;
 
         kpu_upload_core(width, height, channels, ctx_.main_buffer + arg->main_mem_in_address, arg->kpu_mem_out_address);
+
+        if (profile_)
+            profile_[ctx_.current_layer - 1].memcpy_bytes += width * height * channels;
     }
 
-#if KPU_DEBUG
-    const char *str_layer_type(uint32_t type)
+    /* Quantize straight into the KPU rows, 8 values per 64 bits store */
+    void kpu_quantize_upload(const kpu_model_quantize_layer_argument_t *quantize, const kpu_model_upload_layer_argument_t *upload)
     {
-        switch (type)
+        const float *src = (const float *)(ctx_.main_buffer + quantize->main_mem_in_address);
+        uint8_t *dest = (uint8_t *)AI_IO_BASE_ADDR + upload->kpu_mem_out_address * 64;
+        kpu_model_quant_param_t q = quantize->quant_param;
+        float scale = 1.f / q.scale;
+        size_t width = upload->width, height = upload->height, channels = upload->channels;
+        size_t oc, y, x, i;
+        uint32_t row_padding;
+        uint32_t row_group;
+        uint32_t row_length;
+        kpu_row_layout(width, row_padding, row_group, row_length);
+
+        for (oc = 0; oc < channels; oc++)
         {
-            case KL_ADD:
-                return "Add";
-            case KL_QUANTIZED_ADD:
-                return "QuantAdd";
-            case KL_GLOBAL_AVERAGE_POOL2D:
-                return "GAP";
-            case KL_QUANTIZED_MAX_POOL2D:
-                return "QuantMaxPool2d";
-            case KL_AVERAGE_POOL2D:
-                return "AveragePool2d";
-            case KL_QUANTIZE:
-                return "Quantize";
-            case KL_DEQUANTIZE:
-                return "Dequantize";
-            case KL_REQUANTIZE:
-                return "Requantize";
-            case KL_L2_NORMALIZATION:
-                return "L2Norm";
-            case KL_SOFTMAX:
-                return "Softmax";
-            case KL_CONCAT:
-                return "Concat";
-            case KL_QUANTIZED_CONCAT:
-                return "QuantConcat";
-            case KL_FULLY_CONNECTED:
-                return "FullyConnected";
-            case KL_TENSORFLOW_FLATTEN:
-                return "TFFlatten";
-            case KL_RESIZE_NEAREST_NEIGHBOR:
-                return "ResizeNearestNeighbor";
-            case KL_K210_CONV:
-                return "K210Conv";
-            case KL_K210_ADD_PADDING:
-                return "K210AddPad";
-            case KL_K210_REMOVE_PADDING:
-                return "K210RemovePad";
-            case KL_K210_UPLOAD:
-                return "K210Upload";
+            uint8_t *channel_origin = dest + oc / row_group * row_length * height * 64 + oc % row_group * row_padding;
+            for (y = 0; y < height; y++)
+            {
+                uint64_t *row = (uint64_t *)(channel_origin + y * row_length * 64);
+                for (x = 0; x < width; x += 8)
+                {
+                    uint64_t word = 0;
+                    for (i = 0; i < 8 && x + i < width; i++)
+                    {
+                        int value = (*src++ - q.bias) * scale;
+                        if (value < 0) value = 0;
+                        if (value > 0xFF) value = 0xFF;
+                        word |= (uint64_t)value << (i * 8);
+                    }
+                    *row++ = word;
+                }
+            }
+        }
+
+        if (profile_)
+            profile_[ctx_.current_layer - 1].memcpy_bytes += width * height * channels;
+    }
+
+    void kpu_run_fused(kpu_layer_fusion_t fusion, uint32_t layer_id)
+    {
+        const uint8_t *body = model_context_->get_layer_body(layer_id);
+        const uint8_t *next_body = fusion == KFU_FUSED ? nullptr : model_context_->get_layer_body(layer_id + 1);
+
+        switch (fusion)
+        {
+            case KFU_DEQUANTIZE_SOFTMAX:
+                kpu_dequantize_softmax(ctx_.main_buffer, (const kpu_model_dequantize_layer_argument_t *)body, (const kpu_model_softmax_layer_argument_t *)next_body);
+                break;
+            case KFU_TF_FLATTEN_FULLY_CONNECTED:
+                kpu_tf_flatten_fully_connected(ctx_.main_buffer, (const kpu_model_tf_flatten_layer_argument_t *)body, (const kpu_model_fully_connected_layer_argument_t *)next_body);
+                break;
+            case KFU_REMOVE_PADDING_DEQUANTIZE:
+                kpu_remove_padding_dequantize(ctx_.main_buffer, (const kpu_model_remove_padding_layer_argument_t *)body, (const kpu_model_dequantize_layer_argument_t *)next_body);
+                break;
+            case KFU_QUANTIZE_UPLOAD:
+                kpu_quantize_upload((const kpu_model_quantize_layer_argument_t *)body, (const kpu_model_upload_layer_argument_t *)next_body);
+                break;
             default:
-                return "Unknown";
+                break;
         }
     }
-#endif
 
     int kpu_done()
     {
@@ -942,7 +1142,7 @@ private:
         if (total_time_ != 0)
         {
             uint64_t layer_time = (time_.tv_sec -last_time_.tv_sec) * 1000*1000 + (time_.tv_usec - last_time_.tv_usec);
-            printf("layer %d [%s]: %f ms\n", cnt_layer_id, str_layer_type(last_layer_type_), layer_time / 1000.0);
+            printf("layer %d [%s]: %f ms\n", cnt_layer_id, kpu_layer_type_name(last_layer_type_), layer_time / 1000.0);
             total_time_ += layer_time;
         }
         printf("Model: %f ms\n", total_time_ / 1000.0);
@@ -966,72 +1166,45 @@ private:
         if(total_time_ == 0)
             printf("DMA INPUT: %f ms\n", layer_time / 1000.0);
         else
-            printf("layer %d [%s]: %f ms\n", cnt_layer_id - 1, str_layer_type(last_layer_type_), layer_time / 1000.0);
+            printf("layer %d [%s]: %f ms\n", cnt_layer_id - 1, kpu_layer_type_name(last_layer_type_), layer_time / 1000.0);
         total_time_ += layer_time;
 
         last_layer_type_ = cnt_layer_header->type;
         gettimeofday(&last_time_, NULL);
 #endif
-        switch (cnt_layer_header->type)
+        uint64_t step_begin = read_csr(mcycle);
+        if (profile_)
+            profile_begin_ = step_begin;
+
+        kpu_layer_fusion_t fusion = model_context_->get_layer_fusion(cnt_layer_id);
+        if (fusion != KFU_NONE && fusion_enabled_)
         {
-            case KL_ADD:
-                kpu_add((const kpu_model_add_layer_argument_t *)layer_body);
-                break;
-            case KL_QUANTIZED_ADD:
-                kpu_quantized_add((const kpu_model_quant_add_layer_argument_t *)layer_body);
-                break;
-            case KL_GLOBAL_AVERAGE_POOL2D:
-                kpu_global_average_pool2d((const kpu_model_gap2d_layer_argument_t *)layer_body);
-                break;
-            case KL_QUANTIZED_MAX_POOL2D:
-                kpu_quantized_max_pool2d((const kpu_model_quant_max_pool2d_layer_argument_t *)layer_body);
-                break;
-            case KL_AVERAGE_POOL2D:
-                kpu_average_pool2d((const kpu_model_ave_pool2d_layer_argument_t *)layer_body);
-                break;
-            case KL_QUANTIZE:
-                kpu_quantize((const kpu_model_quantize_layer_argument_t *)layer_body);
-                break;
-            case KL_DEQUANTIZE:
-                kpu_dequantize((const kpu_model_dequantize_layer_argument_t *)layer_body);
-                break;
-            case KL_REQUANTIZE:
-                kpu_requantize((const kpu_model_requantize_layer_argument_t *)layer_body);
-                break;
-            case KL_L2_NORMALIZATION:
-                kpu_l2_normalization((const kpu_model_l2_norm_layer_argument_t *)layer_body);
-                break;
-            case KL_SOFTMAX:
-                kpu_softmax((const kpu_model_softmax_layer_argument_t *)layer_body);
-                break;
-            case KL_CONCAT:
-            case KL_QUANTIZED_CONCAT:
-                kpu_concat((const kpu_model_concat_layer_argument_t *)layer_body);
-                break;
-            case KL_FULLY_CONNECTED:
-                kpu_fully_connected((const kpu_model_fully_connected_layer_argument_t *)layer_body);
-                break;
-            case KL_TENSORFLOW_FLATTEN:
-                kpu_tf_flatten((const kpu_model_tf_flatten_layer_argument_t *)layer_body);
-                break;
-            case KL_RESIZE_NEAREST_NEIGHBOR:
-                kpu_resize_nearest_neighbor((const kpu_model_resize_nearest_neighbor_layer_argument_t *)layer_body);
-                break;
-            case KL_K210_CONV:
-                kpu_conv((const kpu_model_conv_layer_argument_t *)layer_body);
-                return 0;
-            case KL_K210_ADD_PADDING:
-                kpu_add_padding((const kpu_model_add_padding_layer_argument_t *)layer_body);
-                break;
-            case KL_K210_REMOVE_PADDING:
-                kpu_remove_padding((const kpu_model_remove_padding_layer_argument_t *)layer_body);
-                break;
-            case KL_K210_UPLOAD:
-                kpu_upload((const kpu_model_upload_layer_argument_t *)layer_body);
-                break;
-            default:
-                assert(!"Layer is not supported.");
+            kpu_run_fused(fusion, cnt_layer_id);
         }
+        else
+        {
+            switch (cnt_layer_header->type)
+            {
+                case KL_K210_CONV:
+                    kpu_conv((const kpu_model_conv_layer_argument_t *)layer_body);
+                    return 0;
+                case KL_K210_ADD_PADDING:
+                    kpu_add_padding((const kpu_model_add_padding_layer_argument_t *)layer_body);
+                    break;
+                case KL_K210_UPLOAD:
+                    kpu_upload((const kpu_model_upload_layer_argument_t *)layer_body);
+                    break;
+                default:
+                    if (!kpu_run_cpu_layer(ctx_.main_buffer, cnt_layer_header->type, model_context_->get_layer_body(cnt_layer_id)))
+                        assert(!"Layer is not supported.");
+            }
+        }
+
+        if (profile_)
+            profile_[cnt_layer_id].cpu_cycles += read_csr(mcycle) - profile_begin_;
+        /* The layers of a pair are CPU layers, so this is the whole cost of the pair either way */
+        if (fusion != KFU_NONE)
+            pair_cycles_ += read_csr(mcycle) - step_begin;
 
         if (cnt_layer_id != (ctx_.layers_length - 1))
         {
@@ -1054,11 +1227,17 @@ private:
 
     uint8_t done_flag_ = 0;
     kpu_model_context_t ctx_;
+    k_model_context *model_context_;
     uint8_t *dest_kpu_;
     uint8_t *dest_io_;
     size_t dest_len_;
     size_t max_len_;
     uint8_t mem_out_flag_;
+    kpu_layer_profile_t *profile_ = nullptr;
+    int32_t profile_pending_ = -1;
+    uint64_t profile_begin_;
+    bool fusion_enabled_;
+    uint64_t pair_cycles_;
 #if KPU_DEBUG
     struct timeval time_;
     struct timeval last_time_;
@@ -0,0 +1,72 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <devices.h>
+#include <mfcc.h>
+#include <mfcc_kernels.hpp>
+
+using namespace sys;
+
+struct _mfcc
+{
+    mfcc_frontend frontend;
+};
+
+static void mfcc_hardware_fft(uint16_t shift, const uint64_t *input, size_t points, uint64_t *output)
+{
+    fft_complex_uint16(shift, FFT_DIR_FORWARD, input, points, output);
+}
+
+mfcc_t *mfcc_create(const mfcc_config_t *config)
+{
+    if (!config)
+        return nullptr;
+
+    try
+    {
+        return new mfcc_t { mfcc_frontend(*config, mfcc_hardware_fft) };
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void mfcc_destroy(mfcc_t *mfcc)
+{
+    delete mfcc;
+}
+
+void mfcc_reset(mfcc_t *mfcc)
+{
+    if (mfcc)
+        mfcc->frontend.reset();
+}
+
+int mfcc_process(mfcc_t *mfcc, const int16_t *samples, size_t count, int16_t *features, size_t max_frames, size_t *consumed)
+{
+    if (!mfcc || (!samples && count) || (!features && max_frames))
+        return -1;
+
+    size_t used;
+    int frames = mfcc->frontend.process(samples, count, features, max_frames, used);
+    if (consumed)
+        *consumed = used;
+    return frames;
+}
+
+void mfcc_quantize_u8(const int16_t *features, size_t count, int16_t min, int16_t max, uint8_t *dest)
+{
+    mfcc_quantize(features, count, min, max, dest);
+}
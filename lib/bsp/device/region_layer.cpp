@@ -0,0 +1,366 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <math.h>
+#include <parallel.h>
+#include <region_layer.h>
+#include <vector>
+
+#define SIGMOID_LUT_RANGE 8.f
+#define EXP_LUT_RANGE 16.f
+/* Boxes are binned on a NMS_BINS x NMS_BINS grid so only nearby boxes are compared */
+#define NMS_BINS 8
+#define REGION_PARALLEL_MIN_ROWS 4
+
+/* A decoded box and its position in scan order, which breaks score ties */
+struct region_candidate
+{
+    region_box_t box;
+    uint32_t order;
+};
+
+/* Lower score first, then later in scan order: the front of the heap is the first box to drop */
+static bool candidate_better(const region_candidate &a, const region_candidate &b)
+{
+    return a.box.score > b.box.score || (a.box.score == b.box.score && a.order < b.order);
+}
+
+struct region_context
+{
+    const region_layer_t *layer;
+    const void *input;
+    size_t max_boxes;
+    /* Each part keeps its own best max_boxes, so the result does not depend on the split or timing */
+    std::vector<region_candidate> parts[2];
+};
+
+static float lut_lookup(const float *lut, float x, float min, float max)
+{
+    float pos = (x - min) * (REGION_LAYER_LUT_SIZE - 1) / (max - min);
+    if (pos <= 0)
+        return lut[0];
+    if (pos >= REGION_LAYER_LUT_SIZE - 1)
+        return lut[REGION_LAYER_LUT_SIZE - 1];
+    int index = (int)pos;
+    float frac = pos - index;
+    return lut[index] + (lut[index + 1] - lut[index]) * frac;
+}
+
+/* Tensor access for a uint8 tensor: values stay quantized until a box passes the threshold */
+struct u8_tensor
+{
+    typedef uint8_t value_type;
+
+    static bool passes(const region_layer_t &layer, uint8_t value)
+    {
+        return value >= layer.objectness_threshold_q;
+    }
+
+    static float sigmoid(const region_layer_t &layer, uint8_t value)
+    {
+        return layer.sigmoid_lut[value];
+    }
+
+    static float exp_distance(const region_layer_t &layer, uint8_t max, uint8_t value)
+    {
+        return layer.exp_lut[max - value];
+    }
+
+    static float exp(const region_layer_t &layer, uint8_t value)
+    {
+        return expf(value * layer.config.quant_scale + layer.config.quant_bias);
+    }
+};
+
+struct float_tensor
+{
+    typedef float value_type;
+
+    static bool passes(const region_layer_t &layer, float value)
+    {
+        return value >= layer.objectness_threshold;
+    }
+
+    static float sigmoid(const region_layer_t &layer, float value)
+    {
+        return lut_lookup(layer.sigmoid_lut, value, -SIGMOID_LUT_RANGE, SIGMOID_LUT_RANGE);
+    }
+
+    static float exp_distance(const region_layer_t &layer, float max, float value)
+    {
+        return lut_lookup(layer.exp_lut, max - value, 0, EXP_LUT_RANGE);
+    }
+
+    static float exp(const region_layer_t &layer, float value)
+    {
+        return expf(value);
+    }
+};
+
+template <class T>
+static void region_decode_rows(void *userdata, size_t part, size_t begin, size_t end)
+{
+    auto &ctx = *reinterpret_cast<region_context *>(userdata);
+    auto &layer = *ctx.layer;
+    auto &config = layer.config;
+    auto input = reinterpret_cast<const typename T::value_type *>(ctx.input);
+    size_t plane_size = (size_t)config.width * config.height;
+
+    for (size_t row = begin; row < end; row++)
+    {
+        uint32_t anchor = row / config.height, y = row % config.height;
+        auto channels = input + (size_t)anchor * (5 + config.classes) * plane_size + (size_t)y * config.width;
+        auto objectness = channels + 4 * plane_size;
+
+        for (uint32_t x = 0; x < config.width; x++)
+        {
+            /* Threshold first: no class probability can lift a weak objectness over the threshold */
+            if (!T::passes(layer, objectness[x]))
+                continue;
+
+            float score = T::sigmoid(layer, objectness[x]);
+            uint32_t class_id = 0;
+            if (config.classes > 1)
+            {
+                auto classes = channels + 5 * plane_size + x;
+                auto max = classes[0];
+                for (uint32_t c = 1; c < config.classes; c++)
+                {
+                    if (classes[c * plane_size] > max)
+                    {
+                        max = classes[c * plane_size];
+                        class_id = c;
+                    }
+                }
+
+                float sum = 0;
+                for (uint32_t c = 0; c < config.classes; c++)
+                    sum += T::exp_distance(layer, max, classes[c * plane_size]);
+                score /= sum;
+            }
+
+            if (score < config.threshold)
+                continue;
+
+            region_candidate candidate;
+            candidate.box.score = score;
+            candidate.order = row * config.width + x;
+            auto &heap = ctx.parts[part];
+            if (heap.size() == ctx.max_boxes)
+            {
+                if (!candidate_better(candidate, heap.front()))
+                    continue;
+                std::pop_heap(heap.begin(), heap.end(), candidate_better);
+                heap.pop_back();
+            }
+
+            float cx = (x + T::sigmoid(layer, channels[x])) / config.width;
+            float cy = (y + T::sigmoid(layer, channels[plane_size + x])) / config.height;
+            float w = T::exp(layer, channels[2 * plane_size + x]) * config.anchors[anchor * 2] / config.width;
+            float h = T::exp(layer, channels[3 * plane_size + x]) * config.anchors[anchor * 2 + 1] / config.height;
+
+            region_box_t &box = candidate.box;
+            box.x1 = cx - w / 2;
+            box.y1 = cy - h / 2;
+            box.x2 = cx + w / 2;
+            box.y2 = cy + h / 2;
+            box.class_id = class_id;
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end(), candidate_better);
+        }
+    }
+}
+
+template <class T>
+static int region_layer_run(const region_layer_t *layer, const typename T::value_type *input, region_box_t *boxes, size_t max_boxes)
+{
+    auto &config = layer->config;
+    if (!max_boxes)
+        return 0;
+
+    try
+    {
+        region_context ctx;
+        ctx.layer = layer;
+        ctx.input = input;
+        ctx.max_boxes = max_boxes;
+        /* Reserved here so the decoding does not allocate */
+        for (auto &heap : ctx.parts)
+            heap.reserve(max_boxes);
+        parallel_for(region_decode_rows<T>, &ctx, (size_t)config.anchor_count * config.height, REGION_PARALLEL_MIN_ROWS, 1);
+
+        /* Merge the parts: the best max_boxes overall are among the best max_boxes of each part */
+        auto &merged = ctx.parts[0];
+        merged.insert(merged.end(), ctx.parts[1].begin(), ctx.parts[1].end());
+        size_t count = std::min(merged.size(), max_boxes);
+        std::partial_sort(merged.begin(), merged.begin() + count, merged.end(), candidate_better);
+        for (size_t i = 0; i < count; i++)
+            boxes[i] = merged[i].box;
+        return region_layer_nms(boxes, count, config.nms_threshold);
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+static float box_area(const region_box_t &box)
+{
+    return std::max(box.x2 - box.x1, 0.f) * std::max(box.y2 - box.y1, 0.f);
+}
+
+static float box_iou(const region_box_t &a, const region_box_t &b)
+{
+    float w = std::min(a.x2, b.x2) - std::max(a.x1, b.x1);
+    float h = std::min(a.y2, b.y2) - std::max(a.y1, b.y1);
+    if (w <= 0 || h <= 0)
+        return 0;
+    float inter = w * h;
+    return inter / (box_area(a) + box_area(b) - inter);
+}
+
+static int box_bin(float pos)
+{
+    return std::min(std::max((int)(pos * NMS_BINS), 0), NMS_BINS - 1);
+}
+
+int region_layer_init(region_layer_t *layer, const region_layer_config_t *config)
+{
+    if (!layer || !config || !config->anchors || !config->width || !config->height || !config->anchor_count
+        || !config->classes || config->quant_scale < 0)
+        return -1;
+
+    layer->config = *config;
+    float threshold = std::min(std::max(config->threshold, 0.f), 1.f);
+    if (config->quant_scale == 0)
+    {
+        for (int i = 0; i < REGION_LAYER_LUT_SIZE; i++)
+        {
+            float x = -SIGMOID_LUT_RANGE + i * 2 * SIGMOID_LUT_RANGE / (REGION_LAYER_LUT_SIZE - 1);
+            layer->sigmoid_lut[i] = 1.f / (1.f + expf(-x));
+            layer->exp_lut[i] = expf(-i * EXP_LUT_RANGE / (REGION_LAYER_LUT_SIZE - 1));
+        }
+
+        /* The logit of the threshold */
+        if (threshold <= 0)
+            layer->objectness_threshold = -INFINITY;
+        else if (threshold >= 1)
+            layer->objectness_threshold = INFINITY;
+        else
+            layer->objectness_threshold = logf(threshold / (1 - threshold));
+        layer->objectness_threshold_q = 0;
+    }
+    else
+    {
+        layer->objectness_threshold_q = REGION_LAYER_LUT_SIZE;
+        for (int i = REGION_LAYER_LUT_SIZE - 1; i >= 0; i--)
+        {
+            layer->sigmoid_lut[i] = 1.f / (1.f + expf(-(i * config->quant_scale + config->quant_bias)));
+            layer->exp_lut[i] = expf(-i * config->quant_scale);
+            if (layer->sigmoid_lut[i] >= threshold)
+                layer->objectness_threshold_q = i;
+        }
+        layer->objectness_threshold = 0;
+    }
+
+    return 0;
+}
+
+int region_layer_run_u8(const region_layer_t *layer, const uint8_t *input, region_box_t *boxes, size_t max_boxes)
+{
+    if (!layer || !input || !boxes || layer->config.quant_scale == 0)
+        return -1;
+    return region_layer_run<u8_tensor>(layer, input, boxes, max_boxes);
+}
+
+int region_layer_run_float(const region_layer_t *layer, const float *input, region_box_t *boxes, size_t max_boxes)
+{
+    if (!layer || !input || !boxes || layer->config.quant_scale != 0)
+        return -1;
+    return region_layer_run<float_tensor>(layer, input, boxes, max_boxes);
+}
+
+int region_layer_nms(region_box_t *boxes, size_t count, float nms_threshold)
+{
+    if (!boxes && count)
+        return -1;
+
+    try
+    {
+        /* Stable so equal scores keep the order they were given in */
+        std::stable_sort(boxes, boxes + count, [](const region_box_t &a, const region_box_t &b) { return a.score > b.score; });
+
+        /* Each kept box is linked into every bin it covers, two overlapping boxes always share a bin */
+        struct bin_node
+        {
+            uint32_t box;
+            int32_t next;
+        };
+
+        std::vector<bin_node> nodes;
+        std::vector<uint32_t> checked;
+        int32_t bins[NMS_BINS * NMS_BINS];
+        std::fill(std::begin(bins), std::end(bins), -1);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const region_box_t box = boxes[i];
+            int bx1 = box_bin(box.x1), bx2 = box_bin(box.x2);
+            int by1 = box_bin(box.y1), by2 = box_bin(box.y2);
+
+            bool suppressed = false;
+            for (int by = by1; by <= by2 && !suppressed; by++)
+            {
+                for (int bx = bx1; bx <= bx2 && !suppressed; bx++)
+                {
+                    for (int32_t n = bins[by * NMS_BINS + bx]; n != -1; n = nodes[n].next)
+                    {
+                        uint32_t other = nodes[n].box;
+                        if (checked[other] == i + 1)
+                            continue;
+                        checked[other] = i + 1;
+                        if (boxes[other].class_id == box.class_id && box_iou(boxes[other], box) > nms_threshold)
+                        {
+                            suppressed = true;
+                            break;
+                        }
+                    }
+                }
+            }
+
+            if (suppressed)
+                continue;
+
+            boxes[kept] = box;
+            checked.push_back(0);
+            for (int by = by1; by <= by2; by++)
+            {
+                for (int bx = bx1; bx <= bx2; bx++)
+                {
+                    nodes.push_back({ (uint32_t)kept, bins[by * NMS_BINS + bx] });
+                    bins[by * NMS_BINS + bx] = nodes.size() - 1;
+                }
+            }
+            kept++;
+        }
+
+        return kept;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
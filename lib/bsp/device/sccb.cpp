@@ -13,6 +13,7 @@
  * limitations under the License.
  */
 #include <FreeRTOS.h>
+#include <clint.h>
 #include <dvp.h>
 #include <fpioa.h>
 #include <hal.h>
@@ -22,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sysctl.h>
+#include <task.h>
 #include <utility.h>
 
 using namespace sys;
@@ -62,9 +64,17 @@ public:
 
     uint8_t read_byte(k_sccb_device_driver &device, uint16_t reg_address);
     void write_byte(k_sccb_device_driver &device, uint16_t reg_address, uint8_t value);
+    uint64_t write_table(k_sccb_device_driver &device, gsl::span<const sccb_reg_entry_t> entries);
 
 private:
     void setup_device(k_sccb_device_driver &device);
+    uint8_t read_reg(k_sccb_device_driver &device, uint16_t reg_address);
+    void write_reg(k_sccb_device_driver &device, uint16_t reg_address, uint8_t value);
+
+    static uint64_t get_time_us()
+    {
+        return clint->mtime * CLINT_CLOCK_DIV / (sysctl_clock_get_freq(SYSCTL_CLOCK_CPU) / 1000000UL);
+    }
 
     void dvp_sccb_start_transfer()
     {
@@ -107,6 +117,11 @@ public:
         sccb_->write_byte(*this, reg_address, value);
     }
 
+    virtual uint64_t write_table(gsl::span<const sccb_reg_entry_t> entries) override
+    {
+        return sccb_->write_table(*this, entries);
+    }
+
 private:
     friend class k_sccb_driver;
 
@@ -130,7 +145,49 @@ uint8_t k_sccb_driver::read_byte(k_sccb_device_driver &device, uint16_t reg_addr
 {
     COMMON_ENTRY;
     setup_device(device);
+    return read_reg(device, reg_address);
+}
+
+void k_sccb_driver::write_byte(k_sccb_device_driver &device, uint16_t reg_address, uint8_t value)
+{
+    COMMON_ENTRY;
+    setup_device(device);
+    write_reg(device, reg_address, value);
+}
 
+uint64_t k_sccb_driver::write_table(k_sccb_device_driver &device, gsl::span<const sccb_reg_entry_t> entries)
+{
+    COMMON_ENTRY;
+    uint64_t start = get_time_us();
+    setup_device(device);
+
+    for (auto &entry : entries)
+    {
+        switch (entry.op)
+        {
+        case SCCB_REG_WRITE:
+            write_reg(device, entry.reg_address, entry.value);
+            break;
+        case SCCB_REG_UPDATE:
+        {
+            uint8_t value = read_reg(device, entry.reg_address);
+            write_reg(device, entry.reg_address, (value & ~entry.mask) | (entry.value & entry.mask));
+            break;
+        }
+        case SCCB_REG_DELAY:
+            vTaskDelay(pdMS_TO_TICKS(entry.delay_ms));
+            break;
+        default:
+            configASSERT(!"Invalid SCCB table entry.");
+            break;
+        }
+    }
+
+    return get_time_us() - start;
+}
+
+uint8_t k_sccb_driver::read_reg(k_sccb_device_driver &device, uint16_t reg_address)
+{
     if (device.reg_address_width_ == 8)
     {
         set_bit_mask(&sccb_.sccb_cfg, DVP_SCCB_BYTE_NUM_MASK, DVP_SCCB_BYTE_NUM_2);
@@ -150,11 +207,8 @@ uint8_t k_sccb_driver::read_byte(k_sccb_device_driver &device, uint16_t reg_addr
     return ret;
 }
 
-void k_sccb_driver::write_byte(k_sccb_device_driver &device, uint16_t reg_address, uint8_t value)
+void k_sccb_driver::write_reg(k_sccb_device_driver &device, uint16_t reg_address, uint8_t value)
 {
-    COMMON_ENTRY;
-    setup_device(device);
-
     if (device.reg_address_width_ == 8)
     {
         set_bit_mask(&sccb_.sccb_cfg, DVP_SCCB_BYTE_NUM_MASK, DVP_SCCB_BYTE_NUM_3);
@@ -0,0 +1,366 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_KPU_EMULATOR_H
+#define _BSP_KPU_EMULATOR_H
+
+/* Functional emulation of the K210 layers of kmodel v3, for the host interpreter.
+ * A conv layer computes, per output channel and pixel of the input size:
+ *
+ *   conv = sum(x * w) + (arg_x * sum(x) >> shr_x) + (arg_w * sum(w) >> shr_w) + arg_add * group_inputs
+ *   bn   = (conv * norm_mul >> norm_shift) + norm_add
+ *   act  = clamp(round_half_even((bn - x_start) * y_mul, shift_number) + bias, 0, 255)
+ *
+ * with the last activation segment whose x_start is below the value, then pools the result.
+ * Weights are [out][in][k][k] ([channel][k][k] for depthwise), 8 or 16 bits by the model mode.
+ * first_stride and bypass_conv are not emulated.
+ */
+
+#include "kpu_layers.hpp"
+#include <gsl/span>
+#include <stdexcept>
+#include <vector>
+
+namespace sys
+{
+class kpu_k210_emulator
+{
+public:
+    static constexpr size_t ram_size = 2 * 1024 * 1024;
+
+    kpu_k210_emulator()
+        : ram_(ram_size)
+    {
+    }
+
+    gsl::span<const uint8_t> ram() const noexcept { return { ram_.data(), ptrdiff_t(ram_.size()) }; }
+
+    /* Output of the last conv layer, dense [channel][height][width] */
+    gsl::span<const uint8_t> conv_output() const noexcept { return { output_.data(), ptrdiff_t(output_.size()) }; }
+
+    /* Write the model input where the first conv layer reads it, like kpu run does */
+    void upload_input(const kpu_layer_argument_t &layer, const uint8_t *src)
+    {
+        upload_core(layer.image_size.data.i_row_wid + 1, layer.image_size.data.i_col_high + 1, layer.image_channel_num.data.i_ch_num + 1, src, layer.image_addr.data.image_src_addr);
+    }
+
+    /* Run a K210 layer, returns false if the type is not one */
+    bool run_layer(uint32_t type, const uint8_t *body, gsl::span<const uint8_t> model, gsl::span<uint8_t> main_buffer)
+    {
+        switch (type)
+        {
+            case KL_K210_CONV:
+                conv((const kpu_model_conv_layer_argument_t *)body, model, main_buffer);
+                break;
+            case KL_K210_ADD_PADDING:
+                add_padding((const kpu_model_add_padding_layer_argument_t *)body, main_buffer);
+                break;
+            case KL_K210_UPLOAD:
+            {
+                auto arg = (const kpu_model_upload_layer_argument_t *)body;
+                check_main(main_buffer, arg->main_mem_in_address, (uint64_t)arg->width * arg->height * arg->channels);
+                upload_core(arg->width, arg->height, arg->channels, main_buffer.data() + arg->main_mem_in_address, arg->kpu_mem_out_address);
+                break;
+            }
+            default:
+                return false;
+        }
+
+        return true;
+    }
+
+private:
+    struct tensor_layout
+    {
+        uint32_t address;
+        uint32_t channel_switch;
+        uint32_t row_switch;
+        uint32_t group;
+    };
+
+    static int64_t sign_extend(uint64_t value, uint32_t bits)
+    {
+        return (int64_t)(value << (64 - bits)) >> (64 - bits);
+    }
+
+    static int64_t shift_round_half_even(int64_t value, uint32_t shift)
+    {
+        if (shift == 0)
+            return value;
+
+        int64_t integral = value >> shift;
+        int64_t fract = value & ((INT64_C(1) << shift) - 1);
+        int64_t half = INT64_C(1) << (shift - 1);
+        if (fract > half || (fract == half && (integral & 1)))
+            integral++;
+        return integral;
+    }
+
+    static void pool_params(uint32_t pool_type, uint32_t &filter, uint32_t &stride)
+    {
+        static const uint8_t filters[] = { 1, 2, 2, 4, 4, 2, 2, 4, 2, 2 };
+        static const uint8_t strides[] = { 1, 2, 2, 4, 4, 2, 2, 4, 1, 1 };
+        if (pool_type >= sizeof(filters))
+            throw std::runtime_error("Invalid K210 pool type.");
+        filter = filters[pool_type];
+        stride = strides[pool_type];
+    }
+
+    static void check_main(gsl::span<uint8_t> main_buffer, uint64_t address, uint64_t size)
+    {
+        if (address + size > (uint64_t)main_buffer.size())
+            throw std::runtime_error("K210 layer is out of the main buffer.");
+    }
+
+    static const uint8_t *model_at(gsl::span<const uint8_t> model, uint64_t offset, uint64_t size)
+    {
+        if (offset + size > (uint64_t)model.size())
+            throw std::runtime_error("K210 layer is out of the model.");
+        return model.data() + offset;
+    }
+
+    size_t ram_offset(const tensor_layout &layout, uint32_t channel, uint32_t y) const
+    {
+        return ((size_t)(channel / layout.group) * layout.channel_switch + (size_t)y * layout.row_switch + layout.address) * 64 + channel % layout.group * (64 / layout.group);
+    }
+
+    void check_ram(const tensor_layout &layout, uint32_t width, uint32_t height, uint32_t channels) const
+    {
+        if (layout.group == 0 || 64 % layout.group != 0 || (layout.group > 1 && width > 64 / layout.group))
+            throw std::runtime_error("Invalid K210 tensor layout.");
+        if (ram_offset(layout, channels - 1, height - 1) + width > ram_.size())
+            throw std::runtime_error("K210 tensor is out of the KPU memory.");
+    }
+
+    void upload_core(size_t width, size_t height, size_t channels, const uint8_t *src, uint32_t kpu_addr)
+    {
+        uint32_t row_padding, row_group, row_length;
+        kpu_row_layout(width, row_padding, row_group, row_length);
+        if (((channels + row_group - 1) / row_group * row_length * height + kpu_addr) * 64 > ram_.size())
+            throw std::runtime_error("K210 upload is out of the KPU memory.");
+
+        uint8_t *dest = ram_.data() + (size_t)kpu_addr * 64;
+        for (size_t oc = 0; oc < channels; oc++)
+        {
+            uint8_t *channel_origin = dest + oc / row_group * row_length * height * 64 + oc % row_group * row_padding;
+            for (size_t y = 0; y < height; y++)
+            {
+                memcpy(channel_origin + y * row_length * 64, src, width);
+                src += width;
+            }
+        }
+    }
+
+    void add_padding(const kpu_model_add_padding_layer_argument_t *arg, gsl::span<uint8_t> main_buffer)
+    {
+        /* A 1x1 tensor becomes the top left pixel of 4x4 rows of 16 bytes */
+        const tensor_layout layout = { arg->kpu_mem_out_address, 4, 1, 4 };
+        check_main(main_buffer, arg->main_mem_in_address, arg->channels);
+        if (arg->channels)
+            check_ram(layout, 1, 4, arg->channels);
+
+        const uint8_t *src = main_buffer.data() + arg->main_mem_in_address;
+        for (uint32_t oc = 0; oc < arg->channels; oc++)
+            ram_[ram_offset(layout, oc, 0)] = *src++;
+    }
+
+    void conv(const kpu_model_conv_layer_argument_t *arg, gsl::span<const uint8_t> model, gsl::span<uint8_t> main_buffer)
+    {
+        kpu_layer_argument_t layer;
+        memcpy(&layer, model_at(model, arg->layer_offset, sizeof(layer)), sizeof(layer));
+        if (layer.kernel_pool_type_cfg.data.first_stride || layer.kernel_pool_type_cfg.data.bypass_conv)
+            throw std::runtime_error("K210 conv mode is not emulated.");
+        if (layer.kernel_pool_type_cfg.data.kernel_type > 1)
+            throw std::runtime_error("Invalid K210 kernel type.");
+
+        uint32_t in_width = layer.image_size.data.i_row_wid + 1, in_height = layer.image_size.data.i_col_high + 1;
+        uint32_t in_channels = layer.image_channel_num.data.i_ch_num + 1, out_channels = layer.image_channel_num.data.o_ch_num + 1;
+        uint32_t out_width = layer.image_size.data.o_row_wid + 1, out_height = layer.image_size.data.o_col_high + 1;
+        uint32_t kernel = layer.kernel_pool_type_cfg.data.kernel_type == 1 ? 3 : 1;
+        bool depthwise = layer.interrupt_enabe.data.depth_wise_layer;
+        uint32_t group_inputs = depthwise ? 1 : in_channels;
+        if (depthwise && in_channels != out_channels)
+            throw std::runtime_error("Invalid K210 depthwise layer.");
+
+        uint32_t filter, stride;
+        pool_params(layer.kernel_pool_type_cfg.data.pool_type, filter, stride);
+        if (out_width != in_width / stride || out_height != in_height / stride)
+            throw std::runtime_error("Invalid K210 pool output size.");
+
+        const tensor_layout in_layout = { (uint32_t)layer.image_addr.data.image_src_addr, (uint32_t)layer.kernel_calc_type_cfg.data.channel_switch_addr,
+            (uint32_t)layer.kernel_calc_type_cfg.data.row_switch_addr, (uint32_t)layer.kernel_calc_type_cfg.data.coef_group };
+        check_ram(in_layout, in_width, in_height, in_channels);
+
+        size_t weight_size = eight_bit_mode(model) ? 1 : 2;
+        size_t weights_count = (size_t)out_channels * group_inputs * kernel * kernel;
+        const uint8_t *weights = model_at(model, arg->weights_offset, weights_count * weight_size);
+        const uint8_t *bn = model_at(model, arg->bn_offset, sizeof(kpu_batchnorm_argument_t) * out_channels);
+        kpu_activate_table_t act;
+        memcpy(&act, model_at(model, arg->act_offset, sizeof(act)), sizeof(act));
+
+        input_.resize((size_t)in_channels * in_height * in_width);
+        for (uint32_t ic = 0; ic < in_channels; ic++)
+            for (uint32_t y = 0; y < in_height; y++)
+                memcpy(input_.data() + ((size_t)ic * in_height + y) * in_width, ram_.data() + ram_offset(in_layout, ic, y), in_width);
+
+        int64_t arg_x = sign_extend(layer.conv_value.data.arg_x, 24), arg_w = sign_extend(layer.conv_value.data.arg_w, 24);
+        int64_t arg_add = sign_extend(layer.conv_value2.data.arg_add, 40);
+        uint32_t shr_x = layer.conv_value.data.shr_x, shr_w = layer.conv_value.data.shr_w;
+        int32_t pad = kernel == 3 ? 1 : 0;
+        int64_t pad_value = layer.kernel_pool_type_cfg.data.pad_value;
+
+        conv_.resize((size_t)in_height * in_width);
+        output_.resize((size_t)out_channels * out_height * out_width);
+        for (uint32_t oc = 0; oc < out_channels; oc++)
+        {
+            kpu_batchnorm_argument_t oc_bn;
+            memcpy(&oc_bn, bn + oc * sizeof(oc_bn), sizeof(oc_bn));
+            int64_t norm_mul = sign_extend(oc_bn.batchnorm.data.norm_mul, 24), norm_add = sign_extend(oc_bn.batchnorm.data.norm_add, 32);
+            uint32_t norm_shift = oc_bn.batchnorm.data.norm_shift;
+
+            uint8_t *conv_dest = conv_.data();
+            for (int32_t oy = 0; oy < (int32_t)in_height; oy++)
+            {
+                for (int32_t ox = 0; ox < (int32_t)in_width; ox++)
+                {
+                    int64_t value = 0, sum_x = 0, sum_w = 0;
+                    for (uint32_t i = 0; i < group_inputs; i++)
+                    {
+                        uint32_t ic = depthwise ? oc : i;
+                        const uint8_t *in_channel = input_.data() + (size_t)ic * in_height * in_width;
+                        size_t w_index = ((size_t)oc * group_inputs + i) * kernel * kernel;
+                        for (int32_t ky = 0; ky < (int32_t)kernel; ky++)
+                        {
+                            for (int32_t kx = 0; kx < (int32_t)kernel; kx++)
+                            {
+                                int32_t in_y = oy + ky - pad, in_x = ox + kx - pad;
+                                int64_t x = (in_y < 0 || in_y >= (int32_t)in_height || in_x < 0 || in_x >= (int32_t)in_width) ? pad_value : in_channel[in_y * in_width + in_x];
+                                int64_t w = weight_size == 1 ? weights[w_index] : (weights[w_index * 2] | weights[w_index * 2 + 1] << 8);
+                                w_index++;
+                                value += x * w;
+                                sum_x += x;
+                                sum_w += w;
+                            }
+                        }
+                    }
+
+                    value += (arg_x * sum_x >> shr_x) + (arg_w * sum_w >> shr_w) + arg_add * group_inputs;
+                    value = (value * norm_mul >> norm_shift) + norm_add;
+                    *conv_dest++ = activate(act, value);
+                }
+            }
+
+            pool(conv_.data(), output_.data() + (size_t)oc * out_height * out_width, in_width, in_height, layer.kernel_pool_type_cfg.data.pool_type);
+        }
+
+        if (arg->flags & KLF_MAIN_MEM_OUT)
+        {
+            check_main(main_buffer, arg->main_mem_out_address, output_.size());
+            memcpy(main_buffer.data() + arg->main_mem_out_address, output_.data(), output_.size());
+        }
+        else
+        {
+            const tensor_layout out_layout = { (uint32_t)layer.image_addr.data.image_dst_addr, (uint32_t)layer.write_back_cfg.data.wb_channel_switch_addr,
+                (uint32_t)layer.write_back_cfg.data.wb_row_switch_addr, (uint32_t)layer.write_back_cfg.data.wb_group };
+            check_ram(out_layout, out_width, out_height, out_channels);
+            const uint8_t *src = output_.data();
+            for (uint32_t oc = 0; oc < out_channels; oc++)
+            {
+                for (uint32_t y = 0; y < out_height; y++)
+                {
+                    memcpy(ram_.data() + ram_offset(out_layout, oc, y), src, out_width);
+                    src += out_width;
+                }
+            }
+        }
+    }
+
+    static bool eight_bit_mode(gsl::span<const uint8_t> model)
+    {
+        kpu_model_header_t header;
+        memcpy(&header, model_at(model, 0, sizeof(header)), sizeof(header));
+        return header.flags & 1;
+    }
+
+    static uint8_t activate(const kpu_activate_table_t &act, int64_t value)
+    {
+        uint32_t segment = 0;
+        for (uint32_t i = 16; i-- > 0;)
+        {
+            if (value > sign_extend(act.activate_para[i].data.x_start, 36))
+            {
+                segment = i;
+                break;
+            }
+        }
+
+        const auto &para = act.activate_para[segment].data;
+        uint8_t bias = segment < 8 ? act.activate_para_bias0.data.result_bias[segment] : act.activate_para_bias1.data.result_bias[segment - 8];
+        int64_t result = shift_round_half_even((value - sign_extend(para.x_start, 36)) * (int16_t)para.y_mul, para.shift_number) + bias;
+        return (uint8_t)std::min<int64_t>(255, std::max<int64_t>(0, result));
+    }
+
+    static void pool(const uint8_t *src, uint8_t *dest, uint32_t width, uint32_t height, uint32_t pool_type)
+    {
+        uint32_t filter, stride;
+        pool_params(pool_type, filter, stride);
+        uint32_t out_width = width / stride, out_height = height / stride;
+
+        for (uint32_t oy = 0; oy < out_height; oy++)
+        {
+            for (uint32_t ox = 0; ox < out_width; ox++)
+            {
+                uint32_t in_y = oy * stride, in_x = ox * stride;
+                uint32_t value = 0;
+                switch (pool_type)
+                {
+                    case 0:
+                    case 5:
+                    case 7:
+                        value = src[in_y * width + in_x];
+                        break;
+                    case 6:
+                        value = src[in_y * width + in_x + 1];
+                        break;
+                    case 1:
+                    case 3:
+                    case 9:
+                        /* Pixels past the edge count as 0 */
+                        for (uint32_t ky = 0; ky < filter; ky++)
+                            for (uint32_t kx = 0; kx < filter; kx++)
+                                if (in_y + ky < height && in_x + kx < width)
+                                    value = std::max<uint32_t>(value, src[(in_y + ky) * width + in_x + kx]);
+                        break;
+                    default:
+                        /* Mean repeats the edge pixels */
+                        for (uint32_t ky = 0; ky < filter; ky++)
+                            for (uint32_t kx = 0; kx < filter; kx++)
+                                value += src[std::min(in_y + ky, height - 1) * width + std::min(in_x + kx, width - 1)];
+                        value /= filter * filter;
+                        break;
+                }
+
+                *dest++ = (uint8_t)value;
+            }
+        }
+    }
+
+    std::vector<uint8_t> ram_;
+    std::vector<uint8_t> input_;
+    std::vector<uint8_t> conv_;
+    std::vector<uint8_t> output_;
+};
+}
+
+#endif /* _BSP_KPU_EMULATOR_H */
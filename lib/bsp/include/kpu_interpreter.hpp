@@ -0,0 +1,293 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_KPU_INTERPRETER_H
+#define _BSP_KPU_INTERPRETER_H
+
+/* Reference interpreter for kmodel v3.
+ * Executes the CPU layers with the same kernels as the KPU driver and the K210 layers with the
+ * functional emulator, or hands them to a caller supplied handler, so it can be built on the host
+ * to check outputs and time layers (see tests/host and tools/kmodel_run.cpp):
+ *
+ *   g++ -std=c++17 -Ilib/arch/include -Ilib/hal/include -Ilib/bsp/include -Ithird_party ...
+ */
+
+#include "kpu_emulator.hpp"
+#include "kpu_layers.hpp"
+#include <chrono>
+#include <functional>
+#include <gsl/span>
+#include <stdexcept>
+#include <vector>
+
+namespace sys
+{
+class kpu_model_interpreter
+{
+public:
+    struct layer_result
+    {
+        uint32_t index;
+        uint32_t type;
+        std::chrono::nanoseconds elapsed;
+    };
+
+    using k210_layer_handler_t = std::function<void(uint32_t type, const uint8_t *body, const uint8_t *model_buffer, uint8_t *main_buffer)>;
+    using layer_observer_t = std::function<void(const layer_result &result, const uint8_t *main_buffer)>;
+
+    kpu_model_interpreter(const uint8_t *buffer, size_t size)
+        : model_((size + 7) / 8)
+    {
+        if (size < sizeof(kpu_model_header_t))
+            throw std::runtime_error("Invalid kmodel.");
+        memcpy(model_.data(), buffer, size);
+
+        auto base = (const uint8_t *)model_.data();
+        auto header = (const kpu_model_header_t *)base;
+        if (header->version != 3 || header->arch != 0)
+            throw std::runtime_error("Cannot load kmodel.");
+
+        size_t offset = sizeof(kpu_model_header_t);
+        outputs_ = (const kpu_model_output_t *)(base + offset);
+        offset += sizeof(kpu_model_output_t) * header->output_count;
+        layer_headers_ = (const kpu_model_layer_header_t *)(base + offset);
+        offset += sizeof(kpu_model_layer_header_t) * header->layers_length;
+        if (offset > size)
+            throw std::runtime_error("Invalid kmodel.");
+
+        output_count_ = header->output_count;
+        layers_length_ = header->layers_length;
+        for (uint32_t i = 0; i < output_count_; i++)
+        {
+            if ((uint64_t)outputs_[i].address + outputs_[i].size > header->main_mem_usage)
+                throw std::runtime_error("Invalid kmodel output.");
+        }
+
+        layer_bodies_.resize(layers_length_);
+        for (uint32_t i = 0; i < layers_length_; i++)
+        {
+            uint32_t body_size = layer_headers_[i].body_size;
+            if (offset + body_size > size)
+                throw std::runtime_error("Invalid kmodel layer.");
+
+            /* Keep every body 8 bytes aligned like the driver does for in place weights */
+            const uint8_t *body = base + offset;
+            if ((uintptr_t)body % sizeof(uint64_t) != 0)
+            {
+                staged_bodies_.emplace_back((body_size + 7) / 8);
+                memcpy(staged_bodies_.back().data(), body, body_size);
+                body = (const uint8_t *)staged_bodies_.back().data();
+            }
+
+            layer_bodies_[i] = body;
+            offset += body_size;
+        }
+
+        main_buffer_.resize(header->main_mem_usage);
+        model_size_ = size;
+    }
+
+    uint32_t layers_length() const noexcept { return layers_length_; }
+    uint32_t output_count() const noexcept { return output_count_; }
+    const kpu_model_layer_header_t &layer_header(uint32_t index) const { return layer_headers_[index]; }
+    gsl::span<uint8_t> main_buffer() noexcept { return { main_buffer_.data(), ptrdiff_t(main_buffer_.size()) }; }
+
+    gsl::span<const uint8_t> output(uint32_t index) const
+    {
+        if (index >= output_count_)
+            throw std::out_of_range("Invalid output index.");
+        return { main_buffer_.data() + outputs_[index].address, ptrdiff_t(outputs_[index].size) };
+    }
+
+    /* Input of the model, the first conv layer input in [channel][height][width] */
+    kpu_model_shape_t input_shape() const
+    {
+        kpu_layer_argument_t layer = first_layer();
+        return { (uint32_t)layer.image_size.data.i_row_wid + 1, (uint32_t)layer.image_size.data.i_col_high + 1, (uint32_t)layer.image_channel_num.data.i_ch_num + 1 };
+    }
+
+    /* Bytes written by a layer, to be read from the observer of the layer before later layers
+       overwrite them. Empty for the layers that only fill the KPU memory. */
+    gsl::span<const uint8_t> layer_output(uint32_t index) const
+    {
+        if (index >= layers_length_)
+            throw std::out_of_range("Invalid layer index.");
+
+        const uint8_t *body = layer_bodies_[index];
+        uint64_t address = 0, size = 0;
+        switch (layer_headers_[index].type)
+        {
+            case KL_K210_CONV:
+                if (!(((const kpu_model_conv_layer_argument_t *)body)->flags & KLF_MAIN_MEM_OUT))
+                    return emulator_.conv_output();
+                address = ((const kpu_model_conv_layer_argument_t *)body)->main_mem_out_address;
+                size = emulator_.conv_output().size();
+                break;
+            case KL_K210_ADD_PADDING:
+            case KL_K210_UPLOAD:
+                return {};
+            case KL_CONCAT:
+            case KL_QUANTIZED_CONCAT:
+            {
+                auto arg = (const kpu_model_concat_layer_argument_t *)body;
+                address = arg->main_mem_out_address;
+                for (uint32_t i = 0; i < arg->input_count; i++)
+                    size += arg->inputs_mem[i].size;
+                break;
+            }
+            case KL_QUANTIZE:
+            {
+                auto arg = (const kpu_model_quantize_layer_argument_t *)body;
+                address = arg->mem_out_address;
+                size = arg->count;
+                break;
+            }
+            default:
+                /* The remaining layers start with flags, the input and the output address */
+                address = ((const kpu_model_dequantize_layer_argument_t *)body)->main_mem_out_address;
+                size = cpu_output_size(layer_headers_[index].type, body);
+                break;
+        }
+
+        if (address + size > main_buffer_.size())
+            throw std::runtime_error("Invalid layer output.");
+        return { main_buffer_.data() + address, ptrdiff_t(size) };
+    }
+
+    /* Run with the K210 layers on the functional emulator, input is [channel][height][width] */
+    std::vector<layer_result> run(gsl::span<const uint8_t> input, const layer_observer_t &observer = nullptr)
+    {
+        kpu_model_shape_t shape = input_shape();
+        if ((uint64_t)input.size() != (uint64_t)shape.width * shape.height * shape.channels)
+            throw std::runtime_error("Invalid kmodel input size.");
+        emulator_.upload_input(first_layer(), input.data());
+
+        gsl::span<const uint8_t> model { (const uint8_t *)model_.data(), ptrdiff_t(model_size_) };
+        return run([&](uint32_t type, const uint8_t *body, const uint8_t *, uint8_t *) {
+            emulator_.run_layer(type, body, model, main_buffer());
+        },
+            observer);
+    }
+
+    std::vector<layer_result> run(const k210_layer_handler_t &k210_handler, const layer_observer_t &observer = nullptr)
+    {
+        std::vector<layer_result> results;
+        results.reserve(layers_length_);
+
+        for (uint32_t i = 0; i < layers_length_; i++)
+        {
+            uint32_t type = layer_headers_[i].type;
+            auto start = std::chrono::steady_clock::now();
+            if (!kpu_run_cpu_layer(main_buffer_.data(), type, layer_bodies_[i]))
+            {
+                if (type < KL_K210_CONV || !k210_handler)
+                    throw std::runtime_error(std::string("Layer is not supported: ") + kpu_layer_type_name(type));
+                k210_handler(type, layer_bodies_[i], (const uint8_t *)model_.data(), main_buffer_.data());
+            }
+
+            layer_result result { i, type, std::chrono::steady_clock::now() - start };
+            if (observer)
+                observer(result, main_buffer_.data());
+            results.emplace_back(result);
+        }
+
+        return results;
+    }
+
+private:
+    kpu_layer_argument_t first_layer() const
+    {
+        if (layers_length_ == 0 || layer_headers_[0].type != KL_K210_CONV)
+            throw std::runtime_error("The first layer of the kmodel is not a K210 conv.");
+        auto arg = (const kpu_model_conv_layer_argument_t *)layer_bodies_[0];
+        if ((uint64_t)arg->layer_offset + sizeof(kpu_layer_argument_t) > model_size_)
+            throw std::runtime_error("Invalid kmodel layer.");
+
+        kpu_layer_argument_t layer;
+        memcpy(&layer, (const uint8_t *)model_.data() + arg->layer_offset, sizeof(layer));
+        return layer;
+    }
+
+    static uint64_t cpu_output_size(uint32_t type, const uint8_t *body)
+    {
+        switch (type)
+        {
+            case KL_ADD:
+                return ((const kpu_model_add_layer_argument_t *)body)->count * sizeof(float);
+            case KL_QUANTIZED_ADD:
+                return ((const kpu_model_quant_add_layer_argument_t *)body)->count;
+            case KL_GLOBAL_AVERAGE_POOL2D:
+                return ((const kpu_model_gap2d_layer_argument_t *)body)->channels * sizeof(float);
+            case KL_QUANTIZED_GLOBAL_MAX_POOL2D:
+                return ((const kpu_model_quant_gmp2d_layer_argument_t *)body)->channels;
+            case KL_QUANTIZED_GLOBAL_AVERAGE_POOL2D:
+                return ((const kpu_model_quant_gap2d_layer_argument_t *)body)->channels;
+            case KL_QUANTIZED_MAX_POOL2D:
+                return shape_size(((const kpu_model_quant_max_pool2d_layer_argument_t *)body)->out_shape);
+            case KL_AVERAGE_POOL2D:
+                return shape_size(((const kpu_model_ave_pool2d_layer_argument_t *)body)->out_shape) * sizeof(float);
+            case KL_QUANTIZED_AVERAGE_POOL2D:
+                return shape_size(((const kpu_model_quant_ave_pool2d_layer_argument_t *)body)->out_shape);
+            case KL_DEQUANTIZE:
+                return (uint64_t)((const kpu_model_dequantize_layer_argument_t *)body)->count * sizeof(float);
+            case KL_REQUANTIZE:
+                return ((const kpu_model_requantize_layer_argument_t *)body)->count;
+            case KL_L2_NORMALIZATION:
+                return (uint64_t)((const kpu_model_l2_norm_layer_argument_t *)body)->channels * sizeof(float);
+            case KL_SOFTMAX:
+                return (uint64_t)((const kpu_model_softmax_layer_argument_t *)body)->channels * sizeof(float);
+            case KL_FULLY_CONNECTED:
+                return (uint64_t)((const kpu_model_fully_connected_layer_argument_t *)body)->out_channels * sizeof(float);
+            case KL_QUANTIZED_FULLY_CONNECTED:
+                return ((const kpu_model_quant_fully_connected_layer_argument_t *)body)->out_channels;
+            case KL_TENSORFLOW_FLATTEN:
+                return shape_size(((const kpu_model_tf_flatten_layer_argument_t *)body)->shape) * sizeof(float);
+            case KL_QUANTIZED_TENSORFLOW_FLATTEN:
+                return shape_size(((const kpu_model_quant_tf_flatten_layer_argument_t *)body)->shape);
+            case KL_RESIZE_NEAREST_NEIGHBOR:
+            {
+                auto arg = (const kpu_model_resize_nearest_neighbor_layer_argument_t *)body;
+                return (uint64_t)arg->out_width * arg->out_height * arg->in_shape.channels * sizeof(float);
+            }
+            case KL_QUANTIZED_RESIZE_NEAREST_NEIGHBOR:
+            {
+                auto arg = (const kpu_model_quant_resize_nearest_neighbor_layer_argument_t *)body;
+                return (uint64_t)arg->out_width * arg->out_height * arg->in_shape.channels;
+            }
+            case KL_K210_REMOVE_PADDING:
+                return ((const kpu_model_remove_padding_layer_argument_t *)body)->channels;
+            default:
+                return 0;
+        }
+    }
+
+    static uint64_t shape_size(const kpu_model_shape_t &shape)
+    {
+        return (uint64_t)shape.width * shape.height * shape.channels;
+    }
+
+    std::vector<uint64_t> model_;
+    std::vector<std::vector<uint64_t>> staged_bodies_;
+    std::vector<const uint8_t *> layer_bodies_;
+    std::vector<uint8_t> main_buffer_;
+    kpu_k210_emulator emulator_;
+    size_t model_size_;
+    const kpu_model_output_t *outputs_;
+    const kpu_model_layer_header_t *layer_headers_;
+    uint32_t output_count_;
+    uint32_t layers_length_;
+};
+}
+
+#endif /* _BSP_KPU_INTERPRETER_H */
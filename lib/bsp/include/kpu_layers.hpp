@@ -0,0 +1,966 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_KPU_LAYERS_H
+#define _BSP_KPU_LAYERS_H
+
+/* CPU implementations of the kmodel v3 layers.
+ * Only depends on kpu.h and the C/C++ runtime, so it can be built for the host as well. */
+
+#include <algorithm>
+#include <float.h>
+#include <kpu.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace sys
+{
+constexpr size_t kpu_align_up(size_t value, size_t align)
+{
+    return (value + align - 1) & ~(align - 1);
+}
+
+inline void kpu_add(uint8_t *main_buffer, const kpu_model_add_layer_argument_t *arg)
+{
+    const float *src_a = (const float *)(main_buffer + arg->main_mem_in_a_address);
+    const float *src_b = (const float *)(main_buffer + arg->main_mem_in_b_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    size_t i, count = arg->count;
+
+    for (i = 0; i < count; i++)
+        dest[i] = src_a[i] + src_b[i];
+}
+
+inline void kpu_quantized_add(uint8_t *main_buffer, const kpu_model_quant_add_layer_argument_t *arg)
+{
+    const uint8_t *src_a = (const uint8_t *)(main_buffer + arg->main_mem_in_a_address);
+    const uint8_t *src_b = (const uint8_t *)(main_buffer + arg->main_mem_in_b_address);
+    size_t count = kpu_align_up(arg->count, 8) / 8;
+    int64_t off_a = arg->in_a_offset, mul_a = arg->in_a_mul, sh_a = arg->in_a_shift;
+    int64_t off_b = arg->in_b_offset, mul_b = arg->in_b_mul, sh_b = arg->in_b_shift;
+    int64_t off_o = arg->out_offset, mul_o = arg->out_mul, sh_o = arg->out_shift;
+
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    size_t i;
+
+    if (sh_a == sh_b)
+    {
+#define QADD_UNROLL_1(x)     \
+        int64_t a##x = *src_a++; \
+        int64_t b##x = *src_b++;
+
+#define QADD_UNROLL_2(x) \
+        a##x += off_a; \
+        b##x += off_b;
+
+#define QADD_UNROLL_3(x) \
+        a##x *= mul_a; \
+        b##x *= mul_b;
+
+#define QADD_UNROLL_4(x) \
+        int64_t v##x = a##x + b##x;
+
+#define QADD_UNROLL_5(x) \
+        v##x >>= sh_a;
+
+#define QADD_UNROLL_6(x) \
+        v##x *= mul_o;
+
+#define QADD_UNROLL_7(x) \
+        v##x >>= sh_o;
+
+#define QADD_UNROLL_8(x) \
+        v##x += off_o;
+
+#define QADD_UNROLL_9(x) \
+        v##x = std::min<int64_t>(0xFF, std::max<int64_t>(0, v##x));
+
+#define QADD_UNROLL_10(x) \
+        *dest++ = v##x;
+
+#define QADD_UNROLL_S(x) \
+        QADD_UNROLL_##x(0) \
+        QADD_UNROLL_##x(1) \
+        QADD_UNROLL_##x(2) \
+        QADD_UNROLL_##x(3) \
+        QADD_UNROLL_##x(4) \
+        QADD_UNROLL_##x(5) \
+        QADD_UNROLL_##x(6) \
+        QADD_UNROLL_##x(7)
+
+        for (i = 0; i < count; i++)
+        {
+            QADD_UNROLL_S(1);
+            QADD_UNROLL_S(2);
+            QADD_UNROLL_S(3);
+            QADD_UNROLL_S(4);
+            QADD_UNROLL_S(5);
+            QADD_UNROLL_S(6);
+            QADD_UNROLL_S(7);
+            QADD_UNROLL_S(8);
+            QADD_UNROLL_S(9);
+            QADD_UNROLL_S(10);
+        }
+    }
+    else
+    {
+#undef QADD_UNROLL_1
+#define QADD_UNROLL_1(x)     \
+        int64_t a##x = *src_a++; \
+        int64_t b##x = *src_b++;
+
+#undef QADD_UNROLL_2
+#define QADD_UNROLL_2(x) \
+        a##x += off_a; \
+        b##x += off_b;
+
+#undef QADD_UNROLL_3
+#define QADD_UNROLL_3(x) \
+        a##x *= mul_a; \
+        b##x *= mul_b;
+
+#undef QADD_UNROLL_4
+#define QADD_UNROLL_4(x) \
+        a##x >>= sh_a; \
+        b##x >>= sh_b;
+
+#undef QADD_UNROLL_5
+#define QADD_UNROLL_5(x) \
+        int64_t v##x = a##x + b##x;
+
+#undef QADD_UNROLL_6
+#define QADD_UNROLL_6(x) \
+        v##x *= mul_o;
+
+#undef QADD_UNROLL_7
+#define QADD_UNROLL_7(x) \
+        v##x >>= sh_o;
+
+#undef QADD_UNROLL_8
+#define QADD_UNROLL_8(x) \
+        v##x += off_o;
+
+#undef QADD_UNROLL_9
+#define QADD_UNROLL_9(x) \
+        v##x = std::min<int64_t>(0xFF, std::max<int64_t>(0, v##x));
+
+#undef QADD_UNROLL_10
+#define QADD_UNROLL_10(x) \
+        *dest++ = v##x;
+
+#undef QADD_UNROLL_S
+#define QADD_UNROLL_S(x) \
+        QADD_UNROLL_##x(0) \
+        QADD_UNROLL_##x(1) \
+        QADD_UNROLL_##x(2) \
+        QADD_UNROLL_##x(3) \
+        QADD_UNROLL_##x(4) \
+        QADD_UNROLL_##x(5) \
+        QADD_UNROLL_##x(6) \
+        QADD_UNROLL_##x(7)
+
+        for (i = 0; i < count; i++)
+        {
+            QADD_UNROLL_S(1);
+            QADD_UNROLL_S(2);
+            QADD_UNROLL_S(3);
+            QADD_UNROLL_S(4);
+            QADD_UNROLL_S(5);
+            QADD_UNROLL_S(6);
+            QADD_UNROLL_S(7);
+            QADD_UNROLL_S(8);
+            QADD_UNROLL_S(9);
+            QADD_UNROLL_S(10);
+        }
+    }
+}
+
+inline void kpu_global_average_pool2d(uint8_t *main_buffer, const kpu_model_gap2d_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, channels = arg->channels, kernel_size = arg->kernel_size;
+
+    for (oc = 0; oc < channels; oc++)
+    {
+        float sum = 0.f;
+        size_t i;
+        for (i = 0; i < kernel_size; i++)
+            sum += *src++;
+
+        dest[oc] = sum / kernel_size;
+    }
+}
+
+inline void kpu_quantized_global_max_pool2d(uint8_t *main_buffer, const kpu_model_quant_gmp2d_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, channels = arg->channels, kernel_size = arg->kernel_size;
+
+    for (oc = 0; oc < channels; oc++)
+    {
+        uint8_t value = 0;
+        size_t i;
+        for (i = 0; i < kernel_size; i++)
+            value = std::max(value, src[i]);
+
+        dest[oc] = value;
+        src += kernel_size;
+    }
+}
+
+inline void kpu_quantized_global_average_pool2d(uint8_t *main_buffer, const kpu_model_quant_gap2d_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, channels = arg->channels, kernel_size = arg->kernel_size;
+
+    /* Input and output share the same quantization, so the mean is taken directly in the
+       quantized domain and rounded half up. */
+    for (oc = 0; oc < channels; oc++)
+    {
+        uint32_t sum = 0;
+        size_t i;
+        for (i = 0; i < kernel_size; i++)
+            sum += *src++;
+
+        dest[oc] = (uint8_t)((sum + kernel_size / 2) / kernel_size);
+    }
+}
+
+inline void kpu_quantized_max_pool2d(uint8_t *main_buffer, const kpu_model_quant_max_pool2d_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->in_shape, out_shape = arg->out_shape;
+    uint32_t kernel_width = arg->kernel_width, kernel_height = arg->kernel_height;
+    uint32_t stride_width = arg->stride_width, stride_height = arg->stride_height;
+    uint32_t padding_width = arg->padding_width, padding_height = arg->padding_height;
+
+    uint32_t out_y, out_x, oc;
+
+    for (oc = 0; oc < out_shape.channels; oc++)
+    {
+        const uint8_t *channel_src = src + in_shape.width * in_shape.height * oc;
+        for (out_y = 0; out_y < out_shape.height; out_y++)
+        {
+            for (out_x = 0; out_x < out_shape.width; out_x++)
+            {
+                int32_t in_x_origin = (int32_t)(out_x * stride_width) - padding_width;
+                int32_t in_y_origin = (int32_t)(out_y * stride_height) - padding_height;
+                int32_t kernel_x_start = std::max(0, -in_x_origin);
+                int32_t kernel_x_end = std::min<int32_t>(kernel_width, (int32_t)in_shape.width - in_x_origin);
+                int32_t kernel_y_start = std::max(0, -in_y_origin);
+                int32_t kernel_y_end = std::min<int32_t>(kernel_height, (int32_t)in_shape.height - in_y_origin);
+                uint8_t value = 0;
+
+                int32_t kernel_y, kernel_x;
+                for (kernel_y = kernel_y_start; kernel_y < kernel_y_end; kernel_y++)
+                {
+                    for (kernel_x = kernel_x_start; kernel_x < kernel_x_end; kernel_x++)
+                    {
+                        int32_t in_x = in_x_origin + kernel_x;
+                        int32_t in_y = in_y_origin + kernel_y;
+                        value = std::max(value, channel_src[in_y * in_shape.width + in_x]);
+                    }
+                }
+
+                *dest++ = value;
+            }
+        }
+    }
+}
+
+inline void kpu_average_pool2d(uint8_t *main_buffer, const kpu_model_ave_pool2d_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->in_shape, out_shape = arg->out_shape;
+    uint32_t kernel_width = arg->kernel_width, kernel_height = arg->kernel_height;
+    uint32_t stride_width = arg->stride_width, stride_height = arg->stride_height;
+    uint32_t padding_width = arg->padding_width, padding_height = arg->padding_height;
+
+    uint32_t out_y, out_x, oc;
+
+    for (oc = 0; oc < out_shape.channels; oc++)
+    {
+        const float *channel_src = src + in_shape.width * in_shape.height * oc;
+        for (out_y = 0; out_y < out_shape.height; out_y++)
+        {
+            for (out_x = 0; out_x < out_shape.width; out_x++)
+            {
+                int32_t in_x_origin = (int32_t)(out_x * stride_width) - padding_width;
+                int32_t in_y_origin = (int32_t)(out_y * stride_height) - padding_height;
+                int32_t kernel_x_start = std::max(0, -in_x_origin);
+                int32_t kernel_x_end = std::min<int32_t>(kernel_width, (int32_t)in_shape.width - in_x_origin);
+                int32_t kernel_y_start = std::max(0, -in_y_origin);
+                int32_t kernel_y_end = std::min<int32_t>(kernel_height, (int32_t)in_shape.height - in_y_origin);
+                float value = 0;
+                float kernel_count = 0;
+
+                int32_t kernel_y, kernel_x;
+                for (kernel_y = kernel_y_start; kernel_y < kernel_y_end; kernel_y++)
+                {
+                    for (kernel_x = kernel_x_start; kernel_x < kernel_x_end; kernel_x++)
+                    {
+                        int32_t in_x = in_x_origin + kernel_x;
+                        int32_t in_y = in_y_origin + kernel_y;
+                        value += channel_src[in_y * in_shape.width + in_x];
+                        kernel_count++;
+                    }
+                }
+
+                *dest++ = value / kernel_count;
+            }
+        }
+    }
+}
+
+inline void kpu_quantized_average_pool2d(uint8_t *main_buffer, const kpu_model_quant_ave_pool2d_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->in_shape, out_shape = arg->out_shape;
+    uint32_t kernel_width = arg->kernel_width, kernel_height = arg->kernel_height;
+    uint32_t stride_width = arg->stride_width, stride_height = arg->stride_height;
+    uint32_t padding_width = arg->padding_width, padding_height = arg->padding_height;
+
+    uint32_t out_y, out_x, oc;
+
+    for (oc = 0; oc < out_shape.channels; oc++)
+    {
+        const uint8_t *channel_src = src + in_shape.width * in_shape.height * oc;
+        for (out_y = 0; out_y < out_shape.height; out_y++)
+        {
+            for (out_x = 0; out_x < out_shape.width; out_x++)
+            {
+                int32_t in_x_origin = (int32_t)(out_x * stride_width) - padding_width;
+                int32_t in_y_origin = (int32_t)(out_y * stride_height) - padding_height;
+                int32_t kernel_x_start = std::max(0, -in_x_origin);
+                int32_t kernel_x_end = std::min<int32_t>(kernel_width, (int32_t)in_shape.width - in_x_origin);
+                int32_t kernel_y_start = std::max(0, -in_y_origin);
+                int32_t kernel_y_end = std::min<int32_t>(kernel_height, (int32_t)in_shape.height - in_y_origin);
+                uint32_t value = 0;
+                uint32_t kernel_count = 0;
+
+                int32_t kernel_y, kernel_x;
+                for (kernel_y = kernel_y_start; kernel_y < kernel_y_end; kernel_y++)
+                {
+                    const uint8_t *row_src = channel_src + (in_y_origin + kernel_y) * in_shape.width + in_x_origin;
+                    for (kernel_x = kernel_x_start; kernel_x < kernel_x_end; kernel_x++)
+                        value += row_src[kernel_x];
+                    kernel_count += kernel_x_end - kernel_x_start;
+                }
+
+                *dest++ = kernel_count ? (uint8_t)((value + kernel_count / 2) / kernel_count) : 0;
+            }
+        }
+    }
+}
+
+inline void kpu_quantize(uint8_t *main_buffer, const kpu_model_quantize_layer_argument_t *arg)
+{
+    size_t count = arg->count;
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    kpu_model_quant_param_t q = arg->quant_param;
+
+    float scale = 1.f / q.scale;
+
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->mem_out_address);
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        int value = (*src++ - q.bias) * scale;
+        if (value < 0) value = 0;
+        if (value > 0xFF) value = 0xFF;
+        *dest++ = (uint8_t)value;
+    }
+}
+
+inline void kpu_dequantize(uint8_t *main_buffer, const kpu_model_dequantize_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, count = arg->count;
+    kpu_model_quant_param_t q = arg->quant_param;
+
+    for (oc = 0; oc < count; oc++)
+        dest[oc] = *src++ * q.scale + q.bias;
+}
+
+inline void kpu_requantize(uint8_t *main_buffer, const kpu_model_requantize_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, count = kpu_align_up(arg->count, 8) / 8;
+    const uint8_t *table = arg->table;
+
+		for (oc = 0; oc < count;)
+	    {
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+			dest[oc++] = table[*src++];
+	    }
+	}
+
+inline void kpu_l2_normalization(uint8_t *main_buffer, const kpu_model_l2_norm_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, channels = arg->channels;
+
+    float sum = 0.f;
+    const float epsilon = 1e-10f;
+    for (oc = 0; oc < channels; oc++)
+        sum += src[oc] * src[oc];
+    if (sum < epsilon)
+        sum = epsilon;
+    sum = 1.f / sqrtf(sum);
+    for (oc = 0; oc < channels; oc++)
+        dest[oc] = src[oc] * sum;
+}
+
+inline void kpu_softmax(uint8_t *main_buffer, const kpu_model_softmax_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    size_t oc, channels = arg->channels;
+
+    float max = FLT_MIN;
+    for (oc = 0; oc < channels; oc++)
+        max = fmaxf(max, src[oc]);
+
+    float sum = 0.f;
+    for (oc = 0; oc < channels; oc++)
+    {
+        float value = expf(src[oc] - max);
+        sum += value;
+        dest[oc] = value;
+    }
+
+    for (oc = 0; oc < channels; oc++)
+        dest[oc] /= sum;
+}
+
+inline void kpu_concat(uint8_t *main_buffer, const kpu_model_concat_layer_argument_t *arg)
+{
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    uint32_t count = arg->input_count, i;
+
+    for (i = 0; i < count; i++)
+    {
+        kpu_model_memory_range_t input = arg->inputs_mem[i];
+        const uint8_t *src = (const uint8_t *)(main_buffer + input.start);
+        memcpy(dest, src, input.size);
+        dest += input.size;
+    }
+}
+
+inline void kpu_fully_connected(uint8_t *main_buffer, const kpu_model_fully_connected_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    uint32_t in_channels = arg->in_channels, out_channels = arg->out_channels, ic, oc;
+    const float *weights = arg->weights;
+    const float *bias = arg->weights + in_channels * out_channels;
+    uint32_t unroll_channels = in_channels / 8 * 8;
+
+    for (oc = 0; oc < out_channels; oc++)
+    {
+        const float *c_weights = weights + oc * in_channels;
+
+        float sum = 0.0f;
+        for (ic = 0; ic < unroll_channels; ic += 8)
+        {
+            sum += src[ic] * c_weights[ic];
+            sum += src[ic + 1] * c_weights[ic + 1];
+            sum += src[ic + 2] * c_weights[ic + 2];
+            sum += src[ic + 3] * c_weights[ic + 3];
+            sum += src[ic + 4] * c_weights[ic + 4];
+            sum += src[ic + 5] * c_weights[ic + 5];
+            sum += src[ic + 6] * c_weights[ic + 6];
+            sum += src[ic + 7] * c_weights[ic + 7];
+        }
+        for (; ic < in_channels; ic++)
+            sum += src[ic] * c_weights[ic];
+        dest[oc] = sum + bias[oc];
+    }
+}
+
+inline void kpu_quantized_fully_connected(uint8_t *main_buffer, const kpu_model_quant_fully_connected_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    uint32_t in_channels = arg->in_channels, out_channels = arg->out_channels, ic, oc;
+    const int32_t *bias = arg->bias;
+    const uint8_t *weights = (const uint8_t *)(arg->bias + out_channels);
+    int32_t in_offset = arg->in_offset, w_offset = arg->w_offset;
+    int64_t off_o = arg->out_offset, mul_o = arg->out_mul, sh_o = arg->out_shift;
+    uint32_t unroll_channels = in_channels / 4 * 4;
+
+    for (oc = 0; oc < out_channels; oc++)
+    {
+        const uint8_t *c_weights = weights + oc * in_channels;
+
+        int32_t sum = 0;
+        for (ic = 0; ic < unroll_channels; ic += 4)
+        {
+            sum += (src[ic] + in_offset) * (c_weights[ic] + w_offset);
+            sum += (src[ic + 1] + in_offset) * (c_weights[ic + 1] + w_offset);
+            sum += (src[ic + 2] + in_offset) * (c_weights[ic + 2] + w_offset);
+            sum += (src[ic + 3] + in_offset) * (c_weights[ic + 3] + w_offset);
+        }
+        for (; ic < in_channels; ic++)
+            sum += (src[ic] + in_offset) * (c_weights[ic] + w_offset);
+
+        int64_t value = (int64_t)(sum + bias[oc]) * mul_o;
+        value >>= sh_o;
+        value += off_o;
+        dest[oc] = (uint8_t)std::min<int64_t>(0xFF, std::max<int64_t>(0, value));
+    }
+}
+
+inline void kpu_tf_flatten(uint8_t *main_buffer, const kpu_model_tf_flatten_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->shape;
+    uint32_t oc, oy, ox;
+
+    for (oy = 0; oy < in_shape.height; oy++)
+        for (ox = 0; ox < in_shape.width; ox++)
+            for (oc = 0; oc < in_shape.channels; oc++)
+                *dest++ = src[(oc * in_shape.height + oy) * in_shape.width + ox];
+}
+
+inline void kpu_quantized_tf_flatten(uint8_t *main_buffer, const kpu_model_quant_tf_flatten_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->shape;
+    uint32_t oc, oy, ox;
+
+    for (oy = 0; oy < in_shape.height; oy++)
+        for (ox = 0; ox < in_shape.width; ox++)
+            for (oc = 0; oc < in_shape.channels; oc++)
+                *dest++ = src[(oc * in_shape.height + oy) * in_shape.width + ox];
+}
+
+inline void kpu_resize_nearest_neighbor(uint8_t *main_buffer, const kpu_model_resize_nearest_neighbor_layer_argument_t *arg)
+{
+    const float *src = (const float *)(main_buffer + arg->main_mem_in_address);
+    float *dest = (float *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->in_shape;
+    uint32_t out_width = arg->out_width, out_height = arg->out_height;
+    uint32_t oc, oy, ox;
+
+    float height_scale = (float)in_shape.height / out_height;
+    float width_scale = (float)in_shape.width / out_width;
+
+    for (oc = 0; oc < in_shape.channels; oc++)
+    {
+        const float *channel_src = src + in_shape.width * in_shape.height * oc;
+        for (oy = 0; oy <out_height; oy++)
+        {
+            uint32_t in_y = (uint32_t)std::min<float>(floorf(oy * height_scale), in_shape.height - 1);
+            const float *y_origin = channel_src + in_y * in_shape.width;
+            for (ox = 0; ox < out_width; ox++)
+            {
+                uint32_t in_x = (uint32_t)std::min<float>(floorf(ox * width_scale), in_shape.width - 1);
+                *dest++ = y_origin[in_x];
+            }
+        }
+    }
+}
+
+inline void kpu_quantized_resize_nearest_neighbor(uint8_t *main_buffer, const kpu_model_quant_resize_nearest_neighbor_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    kpu_model_shape_t in_shape = arg->in_shape;
+    uint32_t out_width = arg->out_width, out_height = arg->out_height;
+    uint32_t oc, oy, ox;
+
+    /* Source indices are exact floor(o * in / out) in integers instead of per pixel in float.
+       The column steps by in / out with the remainder carried, so a row needs no division. */
+    uint32_t x_step = in_shape.width / out_width, x_step_rem = in_shape.width % out_width;
+
+    for (oc = 0; oc < in_shape.channels; oc++)
+    {
+        const uint8_t *channel_src = src + in_shape.width * in_shape.height * oc;
+        for (oy = 0; oy < out_height; oy++)
+        {
+            uint32_t in_y = (uint32_t)((uint64_t)oy * in_shape.height / out_height);
+            const uint8_t *y_origin = channel_src + in_y * in_shape.width;
+            uint32_t in_x = 0, rem = 0;
+            for (ox = 0; ox < out_width; ox++)
+            {
+                *dest++ = y_origin[in_x];
+                in_x += x_step;
+                rem += x_step_rem;
+                if (rem >= out_width)
+                {
+                    rem -= out_width;
+                    in_x++;
+                }
+            }
+        }
+    }
+}
+
+inline void kpu_remove_padding(uint8_t *main_buffer, const kpu_model_remove_padding_layer_argument_t *arg)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + arg->main_mem_in_address);
+    uint8_t *dest = (uint8_t *)(main_buffer + arg->main_mem_out_address);
+    uint32_t oc, channels = arg->channels;
+
+    for (oc = 0; oc < channels; oc++)
+        *dest++ = src[oc * 16];
+}
+
+/* Rows of a KPU memory tensor: narrow rows of up to 4 channels share a 64 bytes line,
+   wider rows take whole lines. The channels of a group follow each other in a line. */
+inline void kpu_row_layout(size_t width, uint32_t &row_padding, uint32_t &row_group, uint32_t &row_length)
+{
+    if (width <= 16)
+    {
+        row_padding = 16;
+        row_group = 4;
+        row_length = 1;
+    }
+    else if (width <= 32)
+    {
+        row_padding = 32;
+        row_group = 2;
+        row_length = 1;
+    }
+    else
+    {
+        row_padding = 64;
+        row_group = 1;
+        row_length = (width + 63) / 64;
+    }
+}
+
+/* Fused pairs, each computes the output of the second layer without materializing the first one */
+
+inline void kpu_dequantize_softmax(uint8_t *main_buffer, const kpu_model_dequantize_layer_argument_t *dequantize, const kpu_model_softmax_layer_argument_t *softmax)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + dequantize->main_mem_in_address);
+    float *dest = (float *)(main_buffer + softmax->main_mem_out_address);
+    size_t oc, channels = softmax->channels;
+    kpu_model_quant_param_t q = dequantize->quant_param;
+
+    uint8_t q_min = 0xFF, q_max = 0;
+    for (oc = 0; oc < channels; oc++)
+    {
+        q_min = std::min(q_min, src[oc]);
+        q_max = std::max(q_max, src[oc]);
+    }
+
+    float max = fmaxf(FLT_MIN, fmaxf(q_min * q.scale + q.bias, q_max * q.scale + q.bias));
+    float sum = 0.f;
+    if (channels > 256)
+    {
+        /* Cheaper to exponentiate each quantized value once */
+        float table[256];
+        for (oc = 0; oc < 256; oc++)
+            table[oc] = expf((oc * q.scale + q.bias) - max);
+
+        for (oc = 0; oc < channels; oc++)
+        {
+            float value = table[src[oc]];
+            sum += value;
+            dest[oc] = value;
+        }
+    }
+    else
+    {
+        for (oc = 0; oc < channels; oc++)
+        {
+            float value = expf((src[oc] * q.scale + q.bias) - max);
+            sum += value;
+            dest[oc] = value;
+        }
+    }
+
+    for (oc = 0; oc < channels; oc++)
+        dest[oc] /= sum;
+}
+
+inline void kpu_tf_flatten_fully_connected(uint8_t *main_buffer, const kpu_model_tf_flatten_layer_argument_t *flatten, const kpu_model_fully_connected_layer_argument_t *fc)
+{
+    const float *src = (const float *)(main_buffer + flatten->main_mem_in_address);
+    float *dest = (float *)(main_buffer + fc->main_mem_out_address);
+    kpu_model_shape_t in_shape = flatten->shape;
+    size_t plane_size = in_shape.width * in_shape.height, pos;
+    uint32_t in_channels = fc->in_channels, out_channels = fc->out_channels, ic, oc;
+    const float *bias = fc->weights + in_channels * out_channels;
+
+    /* Weights are consumed in the flattened HWC order, gathering the CHW input in the same order */
+    for (oc = 0; oc < out_channels; oc++)
+    {
+        const float *c_weights = fc->weights + oc * in_channels;
+
+        float sum = 0.0f;
+        for (pos = 0; pos < plane_size; pos++)
+        {
+            const float *pixel = src + pos;
+            for (ic = 0; ic < in_shape.channels; ic++)
+                sum += pixel[ic * plane_size] * *c_weights++;
+        }
+        dest[oc] = sum + bias[oc];
+    }
+}
+
+inline void kpu_remove_padding_dequantize(uint8_t *main_buffer, const kpu_model_remove_padding_layer_argument_t *remove_padding, const kpu_model_dequantize_layer_argument_t *dequantize)
+{
+    const uint8_t *src = (const uint8_t *)(main_buffer + remove_padding->main_mem_in_address);
+    float *dest = (float *)(main_buffer + dequantize->main_mem_out_address);
+    uint32_t oc, channels = remove_padding->channels;
+    kpu_model_quant_param_t q = dequantize->quant_param;
+
+    for (oc = 0; oc < channels; oc++)
+        dest[oc] = src[oc * 16] * q.scale + q.bias;
+}
+
+enum kpu_tensor_access
+{
+    KTA_UNKNOWN,
+    KTA_NONE,
+    KTA_READ,
+    KTA_WRITE
+};
+
+/* How a layer uses a main memory tensor, by the start of its inputs and output in [start, end) */
+inline kpu_tensor_access kpu_layer_tensor_access(uint32_t type, const uint8_t *body, uint32_t start, uint32_t end)
+{
+    auto in_range = [=](uint32_t address) { return address >= start && address < end; };
+    uint32_t inputs[2] = { UINT32_MAX, UINT32_MAX }, output = UINT32_MAX, i;
+
+    switch (type)
+    {
+        case KL_ADD:
+        case KL_QUANTIZED_ADD:
+        {
+            const kpu_model_add_layer_argument_t *arg = (const kpu_model_add_layer_argument_t *)body;
+            inputs[0] = arg->main_mem_in_a_address;
+            inputs[1] = arg->main_mem_in_b_address;
+            output = arg->main_mem_out_address;
+            break;
+        }
+        case KL_CONCAT:
+        case KL_QUANTIZED_CONCAT:
+        {
+            const kpu_model_concat_layer_argument_t *arg = (const kpu_model_concat_layer_argument_t *)body;
+            for (i = 0; i < arg->input_count; i++)
+            {
+                if (in_range(arg->inputs_mem[i].start))
+                    return KTA_READ;
+            }
+            output = arg->main_mem_out_address;
+            break;
+        }
+        case KL_K210_CONV:
+        {
+            const kpu_model_conv_layer_argument_t *arg = (const kpu_model_conv_layer_argument_t *)body;
+            if (arg->flags & KLF_MAIN_MEM_OUT)
+                output = arg->main_mem_out_address;
+            break;
+        }
+        case KL_K210_ADD_PADDING:
+        case KL_K210_UPLOAD:
+            inputs[0] = ((const kpu_model_upload_layer_argument_t *)body)->main_mem_in_address;
+            break;
+        case KL_GLOBAL_AVERAGE_POOL2D:
+        case KL_QUANTIZED_GLOBAL_MAX_POOL2D:
+        case KL_QUANTIZED_GLOBAL_AVERAGE_POOL2D:
+        case KL_QUANTIZED_MAX_POOL2D:
+        case KL_AVERAGE_POOL2D:
+        case KL_QUANTIZED_AVERAGE_POOL2D:
+        case KL_QUANTIZE:
+        case KL_DEQUANTIZE:
+        case KL_REQUANTIZE:
+        case KL_L2_NORMALIZATION:
+        case KL_SOFTMAX:
+        case KL_FULLY_CONNECTED:
+        case KL_QUANTIZED_FULLY_CONNECTED:
+        case KL_TENSORFLOW_FLATTEN:
+        case KL_QUANTIZED_TENSORFLOW_FLATTEN:
+        case KL_RESIZE_NEAREST_NEIGHBOR:
+        case KL_QUANTIZED_RESIZE_NEAREST_NEIGHBOR:
+        case KL_K210_REMOVE_PADDING:
+        {
+            /* All of them start with flags, main_mem_in_address and the output address */
+            const kpu_model_dequantize_layer_argument_t *arg = (const kpu_model_dequantize_layer_argument_t *)body;
+            inputs[0] = arg->main_mem_in_address;
+            output = arg->main_mem_out_address;
+            break;
+        }
+        default:
+            return KTA_UNKNOWN;
+    }
+
+    if (in_range(inputs[0]) || in_range(inputs[1]))
+        return KTA_READ;
+    /* Only a write at the same start is assumed to replace the whole tensor */
+    if (output == start)
+        return KTA_WRITE;
+    return in_range(output) ? KTA_UNKNOWN : KTA_NONE;
+}
+
+inline const char *kpu_layer_type_name(uint32_t type)
+{
+    switch (type)
+    {
+        case KL_ADD:
+            return "Add";
+        case KL_QUANTIZED_ADD:
+            return "QuantAdd";
+        case KL_GLOBAL_AVERAGE_POOL2D:
+            return "GAP";
+        case KL_QUANTIZED_GLOBAL_MAX_POOL2D:
+            return "QuantGMP";
+        case KL_QUANTIZED_GLOBAL_AVERAGE_POOL2D:
+            return "QuantGAP";
+        case KL_QUANTIZED_MAX_POOL2D:
+            return "QuantMaxPool2d";
+        case KL_AVERAGE_POOL2D:
+            return "AveragePool2d";
+        case KL_QUANTIZED_AVERAGE_POOL2D:
+            return "QuantAveragePool2d";
+        case KL_QUANTIZE:
+            return "Quantize";
+        case KL_DEQUANTIZE:
+            return "Dequantize";
+        case KL_REQUANTIZE:
+            return "Requantize";
+        case KL_L2_NORMALIZATION:
+            return "L2Norm";
+        case KL_SOFTMAX:
+            return "Softmax";
+        case KL_CONCAT:
+            return "Concat";
+        case KL_QUANTIZED_CONCAT:
+            return "QuantConcat";
+        case KL_FULLY_CONNECTED:
+            return "FullyConnected";
+        case KL_QUANTIZED_FULLY_CONNECTED:
+            return "QuantFullyConnected";
+        case KL_TENSORFLOW_FLATTEN:
+            return "TFFlatten";
+        case KL_QUANTIZED_TENSORFLOW_FLATTEN:
+            return "QuantTFFlatten";
+        case KL_RESIZE_NEAREST_NEIGHBOR:
+            return "ResizeNearestNeighbor";
+        case KL_QUANTIZED_RESIZE_NEAREST_NEIGHBOR:
+            return "QuantResizeNearestNeighbor";
+        case KL_K210_CONV:
+            return "K210Conv";
+        case KL_K210_ADD_PADDING:
+            return "K210AddPad";
+        case KL_K210_REMOVE_PADDING:
+            return "K210RemovePad";
+        case KL_K210_UPLOAD:
+            return "K210Upload";
+        default:
+            return "Unknown";
+    }
+}
+
+/* Run a CPU layer on the main buffer, returns false if the layer must be executed by the KPU */
+inline bool kpu_run_cpu_layer(uint8_t *main_buffer, uint32_t type, const uint8_t *body)
+{
+    switch (type)
+    {
+        case KL_ADD:
+            kpu_add(main_buffer, (const kpu_model_add_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_ADD:
+            kpu_quantized_add(main_buffer, (const kpu_model_quant_add_layer_argument_t *)body);
+            break;
+        case KL_GLOBAL_AVERAGE_POOL2D:
+            kpu_global_average_pool2d(main_buffer, (const kpu_model_gap2d_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_GLOBAL_MAX_POOL2D:
+            kpu_quantized_global_max_pool2d(main_buffer, (const kpu_model_quant_gmp2d_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_GLOBAL_AVERAGE_POOL2D:
+            kpu_quantized_global_average_pool2d(main_buffer, (const kpu_model_quant_gap2d_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_MAX_POOL2D:
+            kpu_quantized_max_pool2d(main_buffer, (const kpu_model_quant_max_pool2d_layer_argument_t *)body);
+            break;
+        case KL_AVERAGE_POOL2D:
+            kpu_average_pool2d(main_buffer, (const kpu_model_ave_pool2d_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_AVERAGE_POOL2D:
+            kpu_quantized_average_pool2d(main_buffer, (const kpu_model_quant_ave_pool2d_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZE:
+            kpu_quantize(main_buffer, (const kpu_model_quantize_layer_argument_t *)body);
+            break;
+        case KL_DEQUANTIZE:
+            kpu_dequantize(main_buffer, (const kpu_model_dequantize_layer_argument_t *)body);
+            break;
+        case KL_REQUANTIZE:
+            kpu_requantize(main_buffer, (const kpu_model_requantize_layer_argument_t *)body);
+            break;
+        case KL_L2_NORMALIZATION:
+            kpu_l2_normalization(main_buffer, (const kpu_model_l2_norm_layer_argument_t *)body);
+            break;
+        case KL_SOFTMAX:
+            kpu_softmax(main_buffer, (const kpu_model_softmax_layer_argument_t *)body);
+            break;
+        case KL_CONCAT:
+        case KL_QUANTIZED_CONCAT:
+            kpu_concat(main_buffer, (const kpu_model_concat_layer_argument_t *)body);
+            break;
+        case KL_FULLY_CONNECTED:
+            kpu_fully_connected(main_buffer, (const kpu_model_fully_connected_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_FULLY_CONNECTED:
+            kpu_quantized_fully_connected(main_buffer, (const kpu_model_quant_fully_connected_layer_argument_t *)body);
+            break;
+        case KL_TENSORFLOW_FLATTEN:
+            kpu_tf_flatten(main_buffer, (const kpu_model_tf_flatten_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_TENSORFLOW_FLATTEN:
+            kpu_quantized_tf_flatten(main_buffer, (const kpu_model_quant_tf_flatten_layer_argument_t *)body);
+            break;
+        case KL_RESIZE_NEAREST_NEIGHBOR:
+            kpu_resize_nearest_neighbor(main_buffer, (const kpu_model_resize_nearest_neighbor_layer_argument_t *)body);
+            break;
+        case KL_QUANTIZED_RESIZE_NEAREST_NEIGHBOR:
+            kpu_quantized_resize_nearest_neighbor(main_buffer, (const kpu_model_quant_resize_nearest_neighbor_layer_argument_t *)body);
+            break;
+        case KL_K210_REMOVE_PADDING:
+            kpu_remove_padding(main_buffer, (const kpu_model_remove_padding_layer_argument_t *)body);
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+}
+
+#endif /* _BSP_KPU_LAYERS_H */
@@ -0,0 +1,38 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_LZ4_BLOCK_H
+#define _BSP_LZ4_BLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Largest compressed size of a LZ4 block of size bytes */
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+/* Decode a raw LZ4 block (no frame header), with no dictionary.
+ * Returns the decoded size, or -1 if the block is malformed or does not fit in dest_capacity.
+ */
+int lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dest, size_t dest_capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BSP_LZ4_BLOCK_H */
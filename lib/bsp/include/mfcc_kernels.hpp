@@ -0,0 +1,325 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_MFCC_KERNELS_H
+#define _BSP_MFCC_KERNELS_H
+
+/* Fixed point MFCC front end shared by the mfcc module and tests/host/mfcc_test.cpp.
+ * Every stage but the FFT is integer only, so the host reproduces the device features bit for bit
+ * when it is given the same FFT output. mfcc_software_fft stands in for the accelerator.
+ */
+
+#include "mfcc.h"
+#include <algorithm>
+#include <math.h>
+#include <stdexcept>
+#include <string.h>
+#include <vector>
+
+/* Window, filterbank and DCT tables are Q15 */
+#define MFCC_TABLE_BITS 15
+/* Log energies are Q16 */
+#define MFCC_LOG_BITS 16
+/* Frames are scaled to this many magnitude bits before the FFT */
+#define MFCC_FFT_INPUT_BITS 14
+#define MFCC_LN2_Q16 45426
+
+namespace sys
+{
+/* Complex FFT on points packed by two in 64 bits words as the accelerator expects: imaginary and
+ * real parts of the even point in the low half, then the odd point. Stage s halves its output if
+ * bit s of shift is set.
+ */
+typedef void (*mfcc_fft_t)(uint16_t shift, const uint64_t *input, size_t points, uint64_t *output);
+
+inline uint64_t mfcc_pack_points(int16_t re0, int16_t im0, int16_t re1, int16_t im1)
+{
+    return (uint64_t)(uint16_t)im0 | (uint64_t)(uint16_t)re0 << 16 | (uint64_t)(uint16_t)im1 << 32 | (uint64_t)(uint16_t)re1 << 48;
+}
+
+inline int16_t mfcc_point_re(const uint64_t *data, size_t point)
+{
+    return (int16_t)(data[point / 2] >> (point % 2 ? 48 : 16));
+}
+
+inline int16_t mfcc_point_im(const uint64_t *data, size_t point)
+{
+    return (int16_t)(data[point / 2] >> (point % 2 ? 32 : 0));
+}
+
+inline int16_t mfcc_saturate_int16(int64_t value)
+{
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+/* Radix-2 decimation in time with Q15 twiddles, for hosts and as a model of the accelerator */
+inline void mfcc_software_fft(uint16_t shift, const uint64_t *input, size_t points, uint64_t *output)
+{
+    std::vector<int32_t> re(points), im(points);
+    size_t bits = 0, i, j;
+    while (((size_t)1 << bits) < points)
+        bits++;
+
+    for (i = 0; i < points; i++)
+    {
+        size_t reversed = 0;
+        for (j = 0; j < bits; j++)
+            reversed |= ((i >> j) & 1) << (bits - 1 - j);
+        re[reversed] = mfcc_point_re(input, i);
+        im[reversed] = mfcc_point_im(input, i);
+    }
+
+    size_t stage = 0, length;
+    for (length = 2; length <= points; length <<= 1, stage++)
+    {
+        bool halve = shift & (1 << stage);
+        for (size_t start = 0; start < points; start += length)
+        {
+            for (size_t k = 0; k < length / 2; k++)
+            {
+                double angle = -2 * M_PI * k / length;
+                int32_t wr = (int32_t)lrint(cos(angle) * 32767), wi = (int32_t)lrint(sin(angle) * 32767);
+                size_t a = start + k, b = a + length / 2;
+                int32_t tr = (int32_t)(((int64_t)re[b] * wr - (int64_t)im[b] * wi + (1 << 14)) >> 15);
+                int32_t ti = (int32_t)(((int64_t)re[b] * wi + (int64_t)im[b] * wr + (1 << 14)) >> 15);
+                int32_t values[4] = { re[a] + tr, im[a] + ti, re[a] - tr, im[a] - ti };
+                for (auto &value : values)
+                    value = mfcc_saturate_int16(halve ? (value + 1) >> 1 : value);
+                re[a] = values[0];
+                im[a] = values[1];
+                re[b] = values[2];
+                im[b] = values[3];
+            }
+        }
+    }
+
+    for (i = 0; i < points; i += 2)
+        output[i / 2] = mfcc_pack_points(re[i], im[i], re[i + 1], im[i + 1]);
+}
+
+inline void mfcc_quantize(const int16_t *features, size_t count, int16_t min, int16_t max, uint8_t *dest)
+{
+    int32_t range = max > min ? max - min : 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        int32_t value = ((features[i] - min) * 255 + range / 2) / range;
+        dest[i] = value < 0 ? 0 : value > 255 ? 255 : value;
+    }
+}
+
+class mfcc_frontend
+{
+public:
+    mfcc_frontend(const mfcc_config_t &config, mfcc_fft_t fft)
+        : config_(config), fft_(fft)
+    {
+        uint32_t high_frequency = config.high_frequency ? config.high_frequency : config.sample_rate / 2;
+        uint32_t points = config.fft_points;
+        if (!fft || (points != 64 && points != 128 && points != 256 && points != 512)
+            || !config.frame_length || config.frame_length > points || !config.frame_shift || config.frame_shift > config.frame_length
+            || !config.mel_bands || !config.coefficients || config.coefficients > config.mel_bands
+            || config.low_frequency >= high_frequency || high_frequency > config.sample_rate / 2 || !config.sample_stride)
+            throw std::invalid_argument("Invalid MFCC configuration.");
+
+        while (((uint32_t)1 << stages_) < points)
+            stages_++;
+
+        frame_.resize(config.frame_length);
+        windowed_.resize(config.frame_length);
+        fft_input_.resize(points / 2);
+        fft_output_.resize(points / 2);
+        power_.resize(points / 2 + 1);
+        log_energies_.resize(config.mel_bands);
+
+        /* Hamming window */
+        window_.resize(config.frame_length);
+        for (uint32_t i = 0; i < config.frame_length; i++)
+        {
+            double value = config.frame_length == 1 ? 1 : 0.54 - 0.46 * cos(2 * M_PI * i / (config.frame_length - 1));
+            window_[i] = (int32_t)lrint(value * (1 << MFCC_TABLE_BITS));
+        }
+
+        /* Triangular filters evenly spaced on the mel scale, stored as runs of non zero weights */
+        auto to_mel = [](double hz) { return 2595 * log10(1 + hz / 700); };
+        auto to_hz = [](double mel) { return 700 * (pow(10, mel / 2595) - 1); };
+        double mel_low = to_mel(config.low_frequency), mel_high = to_mel(high_frequency);
+        std::vector<double> edges(config.mel_bands + 2);
+        for (uint32_t i = 0; i < edges.size(); i++)
+            edges[i] = to_hz(mel_low + (mel_high - mel_low) * i / (config.mel_bands + 1));
+
+        band_start_.resize(config.mel_bands);
+        band_length_.resize(config.mel_bands);
+        for (uint32_t band = 0; band < config.mel_bands; band++)
+        {
+            band_start_[band] = weights_.size();
+            band_length_[band] = 0;
+            uint32_t first_bin = 0;
+            for (uint32_t bin = 0; bin <= points / 2; bin++)
+            {
+                double hz = (double)bin * config.sample_rate / points;
+                double rise = (hz - edges[band]) / (edges[band + 1] - edges[band]);
+                double fall = (edges[band + 2] - hz) / (edges[band + 2] - edges[band + 1]);
+                int32_t weight = (int32_t)lrint(fmax(0, fmin(rise, fall)) * (1 << MFCC_TABLE_BITS));
+                if (!weight)
+                    continue;
+                if (!band_length_[band])
+                    first_bin = bin;
+                /* Zero weights inside a run are kept, the filters are convex */
+                weights_.resize(band_start_[band] + bin - first_bin + 1);
+                weights_[band_start_[band] + bin - first_bin] = weight;
+                band_length_[band] = bin - first_bin + 1;
+            }
+            band_bin_.push_back(first_bin);
+        }
+
+        /* log2(1 + i / 256) */
+        for (uint32_t i = 0; i <= 256; i++)
+            log2_table_[i] = (int32_t)lrint(log2(1 + i / 256.0) * (1 << MFCC_LOG_BITS));
+
+        /* Orthonormal DCT-II */
+        dct_.resize(config.coefficients * config.mel_bands);
+        for (uint32_t k = 0; k < config.coefficients; k++)
+        {
+            double scale = sqrt((k ? 2.0 : 1.0) / config.mel_bands);
+            for (uint32_t m = 0; m < config.mel_bands; m++)
+                dct_[k * config.mel_bands + m] = (int32_t)lrint(scale * cos(M_PI * k * (m + 0.5) / config.mel_bands) * (1 << MFCC_TABLE_BITS));
+        }
+    }
+
+    void reset() noexcept
+    {
+        filled_ = 0;
+    }
+
+    size_t process(const int16_t *samples, size_t count, int16_t *features, size_t max_frames, size_t &consumed)
+    {
+        size_t frames = 0, i = 0;
+        for (;;)
+        {
+            if (filled_ == config_.frame_length)
+            {
+                if (frames == max_frames)
+                    break;
+                compute_frame(frame_.data(), features + frames * config_.coefficients);
+                frames++;
+                filled_ = config_.frame_length - config_.frame_shift;
+                memmove(frame_.data(), frame_.data() + config_.frame_shift, filled_ * sizeof(int16_t));
+            }
+
+            if (i == count)
+                break;
+            size_t length = std::min<size_t>(count - i, config_.frame_length - filled_);
+            const int16_t *src = samples + i * config_.sample_stride;
+            for (size_t j = 0; j < length; j++)
+                frame_[filled_ + j] = src[j * config_.sample_stride];
+            filled_ += length;
+            i += length;
+        }
+
+        consumed = i;
+        return frames;
+    }
+
+    /* One frame of frame_length samples to coefficients values */
+    void compute_frame(const int16_t *frame, int16_t *features)
+    {
+        uint32_t length = config_.frame_length, points = config_.fft_points, i;
+
+        /* Scale the frame to use the FFT range, the scale is removed again in the log domain */
+        int32_t peak = 0;
+        for (i = 0; i < length; i++)
+        {
+            windowed_[i] = (frame[i] * window_[i] + (1 << (MFCC_TABLE_BITS - 1))) >> MFCC_TABLE_BITS;
+            peak = std::max(peak, windowed_[i] < 0 ? -windowed_[i] : windowed_[i]);
+        }
+
+        int32_t peak_bits = 0;
+        while (peak >> peak_bits)
+            peak_bits++;
+        int32_t norm = peak ? MFCC_FFT_INPUT_BITS - peak_bits : 0;
+
+        for (i = 0; i < points; i += 2)
+        {
+            int16_t values[2] = { 0, 0 };
+            for (uint32_t j = 0; j < 2 && i + j < length; j++)
+                values[j] = norm >= 0 ? windowed_[i + j] * (1 << norm) : windowed_[i + j] >> -norm;
+            fft_input_[i / 2] = mfcc_pack_points(values[0], 0, values[1], 0);
+        }
+
+        /* All stages halved, the output is the transform divided by the point count */
+        fft_((1 << stages_) - 1, fft_input_.data(), points, fft_output_.data());
+
+        for (i = 0; i <= points / 2; i++)
+        {
+            int32_t re = mfcc_point_re(fft_output_.data(), i), im = mfcc_point_im(fft_output_.data(), i);
+            power_[i] = (uint32_t)(re * re) + (uint32_t)(im * im);
+        }
+
+        /* Back to the power of the windowed frame: undo the Q15 weights, the scale and the FFT halving */
+        int32_t log_offset = (2 * (int32_t)stages_ - 2 * norm - MFCC_TABLE_BITS) * (1 << MFCC_LOG_BITS);
+        for (uint32_t band = 0; band < config_.mel_bands; band++)
+        {
+            const int32_t *weights = weights_.data() + band_start_[band];
+            const uint32_t *power = power_.data() + band_bin_[band];
+            uint64_t energy = 0;
+            for (i = 0; i < band_length_[band]; i++)
+                energy += (uint64_t)power[i] * weights[i];
+
+            int64_t log2_energy = log2_q16(energy ? energy : 1) + log_offset;
+            log_energies_[band] = (int32_t)((log2_energy * MFCC_LN2_Q16) >> MFCC_LOG_BITS);
+        }
+
+        for (uint32_t k = 0; k < config_.coefficients; k++)
+        {
+            const int32_t *dct = dct_.data() + k * config_.mel_bands;
+            int64_t sum = 0;
+            for (uint32_t m = 0; m < config_.mel_bands; m++)
+                sum += (int64_t)log_energies_[m] * dct[m];
+
+            const int shift = MFCC_TABLE_BITS + MFCC_LOG_BITS - MFCC_FRACTION_BITS;
+            features[k] = mfcc_saturate_int16((sum + ((int64_t)1 << (shift - 1))) >> shift);
+        }
+    }
+
+private:
+    int32_t log2_q16(uint64_t value) const noexcept
+    {
+        int32_t msb = 63 - __builtin_clzll(value);
+        uint32_t mantissa = (uint32_t)(msb >= 16 ? value >> (msb - 16) : value << (16 - msb));
+        uint32_t index = (mantissa >> 8) & 0xFF, frac = mantissa & 0xFF;
+        int32_t low = log2_table_[index], high = log2_table_[index + 1];
+        return (msb << MFCC_LOG_BITS) + low + (((high - low) * (int32_t)frac) >> 8);
+    }
+
+    mfcc_config_t config_;
+    mfcc_fft_t fft_;
+    uint32_t stages_ = 0;
+    uint32_t filled_ = 0;
+    std::vector<int16_t> frame_;
+    std::vector<int32_t> windowed_;
+    std::vector<int32_t> window_;
+    std::vector<uint64_t> fft_input_;
+    std::vector<uint64_t> fft_output_;
+    std::vector<uint32_t> power_;
+    std::vector<uint32_t> band_start_;
+    std::vector<uint32_t> band_length_;
+    std::vector<uint32_t> band_bin_;
+    std::vector<int32_t> weights_;
+    std::vector<int32_t> log_energies_;
+    std::vector<int32_t> dct_;
+    int32_t log2_table_[257];
+};
+}
+
+#endif /* _BSP_MFCC_KERNELS_H */
@@ -0,0 +1,37 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _BSP_PARALLEL_H
+#define _BSP_PARALLEL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* part is 0 on the calling core and 1 on the other core, for per part scratch memory */
+typedef void (*parallel_job_t)(void *userdata, size_t part, size_t begin, size_t end);
+
+/* Run job over [0, count), the upper part on a worker of the other core when it is free.
+ * Nothing is split when each part would be smaller than min_count, the split point is a multiple of align.
+ */
+void parallel_for(parallel_job_t job, void *userdata, size_t count, size_t min_count, size_t align);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BSP_PARALLEL_H */
@@ -0,0 +1,87 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <lz4_block.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t value;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        value = *(*ip)++;
+        *length += value;
+    } while (value == 0xFF);
+    return 0;
+}
+
+int lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dest, size_t dest_capacity)
+{
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dest, *oend = dest + dest_capacity;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t length = token >> 4;
+        if (length == 15 && read_length(&ip, iend, &length))
+            return -1;
+        if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        /* The last sequence has only literals */
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dest))
+            return -1;
+
+        length = token & 0xF;
+        if (length == 15 && read_length(&ip, iend, &length))
+            return -1;
+        length += LZ4_MIN_MATCH;
+        if (length > (size_t)(oend - op))
+            return -1;
+
+        const uint8_t *match = op - offset;
+        uint8_t *copy_end = op + length;
+        if (offset >= sizeof(uint64_t))
+        {
+            /* Chunks never overlap, the last one may write past copy_end but not past oend */
+            while (op < copy_end && oend - op >= (ptrdiff_t)sizeof(uint64_t))
+            {
+                memcpy(op, match, sizeof(uint64_t));
+                op += sizeof(uint64_t);
+                match += sizeof(uint64_t);
+            }
+        }
+
+        while (op < copy_end)
+            *op++ = *match++;
+        op = copy_end;
+    }
+
+    return op - dest;
+}
@@ -0,0 +1,101 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <atomic.h>
+#include <parallel.h>
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#define PARALLEL_WORKER_STACK_SIZE 2048
+#define PARALLEL_WORKER_PRIORITY 3
+
+enum
+{
+    WORKER_NONE,
+    WORKER_CREATING,
+    WORKER_READY,
+    WORKER_FAILED
+};
+
+typedef struct _parallel_worker
+{
+    int state;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t start;
+    SemaphoreHandle_t done;
+    parallel_job_t job;
+    void *userdata;
+    size_t begin;
+    size_t end;
+} parallel_worker_t;
+
+static parallel_worker_t workers[portNUM_PROCESSORS];
+
+static void parallel_worker_thread(void *arg)
+{
+    parallel_worker_t *worker = (parallel_worker_t *)arg;
+    while (1)
+    {
+        xSemaphoreTake(worker->start, portMAX_DELAY);
+        worker->job(worker->userdata, 1, worker->begin, worker->end);
+        xSemaphoreGive(worker->done);
+    }
+}
+
+static parallel_worker_t *get_worker(UBaseType_t core)
+{
+    parallel_worker_t *worker = &workers[core];
+    int state = atomic_cas(&worker->state, WORKER_NONE, WORKER_CREATING);
+    if (state == WORKER_NONE)
+    {
+        worker->lock = xSemaphoreCreateMutex();
+        worker->start = xSemaphoreCreateBinary();
+        worker->done = xSemaphoreCreateBinary();
+        if (worker->lock && worker->start && worker->done
+            && xTaskCreateAtProcessor(core, parallel_worker_thread, "parallel", PARALLEL_WORKER_STACK_SIZE, worker, PARALLEL_WORKER_PRIORITY, NULL) == pdPASS)
+            state = WORKER_READY;
+        else
+            state = WORKER_FAILED;
+        mb();
+        atomic_set(&worker->state, state);
+    }
+
+    /* While another task creates the worker just run on this core */
+    return state == WORKER_READY ? worker : NULL;
+}
+
+void parallel_for(parallel_job_t job, void *userdata, size_t count, size_t min_count, size_t align)
+{
+    size_t split = count / 2 / align * align;
+    parallel_worker_t *worker = NULL;
+    if (split >= min_count)
+        worker = get_worker(portNUM_PROCESSORS - 1 - uxPortGetProcessorId());
+
+    if (worker && xSemaphoreTake(worker->lock, 0) == pdTRUE)
+    {
+        worker->job = job;
+        worker->userdata = userdata;
+        worker->begin = split;
+        worker->end = count;
+        xSemaphoreGive(worker->start);
+        job(userdata, 0, 0, split);
+        xSemaphoreTake(worker->done, portMAX_DELAY);
+        xSemaphoreGive(worker->lock);
+    }
+    else
+    {
+        job(userdata, 0, 0, count);
+    }
+}
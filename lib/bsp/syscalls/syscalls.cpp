@@ -24,6 +24,9 @@
 
 using namespace sys;
 
+/* Buffer of files opened through open(), so small reads and writes do not reach FatFS one by one */
+#define SYS_FILE_BUFFER_SIZE 4096
+
 int sys_open(const char *name, int flags, int mode)
 {
     handle_t handle = NULL_HANDLE;
@@ -47,6 +50,9 @@ int sys_open(const char *name, int flags, int mode)
         if (flags & O_TRUNC)
             file_mode |= FILE_MODE_TRUNCATE;
         handle = filesystem_file_open(name, file_access, file_mode);
+        /* Unbuffered if there is no memory for the buffer */
+        if (handle)
+            filesystem_file_set_buffer(handle, SYS_FILE_BUFFER_SIZE);
     }
 
     if (handle)
@@ -76,7 +82,7 @@ off_t sys_lseek(int fd, off_t offset, int whence)
             else if (whence == SEEK_END)
             {
                 auto pos = f->get_size();
-                f->set_position(pos - offset);
+                f->set_position(pos + offset);
             }
 
             return f->get_position();
@@ -112,3 +118,17 @@ int sys_fstat(int fd, struct kernel_stat *buf)
         return -1;
     }
 }
+
+extern "C" ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+    if (offset < 0)
+        return -1;
+    return filesystem_file_pread(fd, reinterpret_cast<uint8_t *>(buf), len, offset);
+}
+
+extern "C" ssize_t pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    if (offset < 0)
+        return -1;
+    return filesystem_file_pwrite(fd, reinterpret_cast<const uint8_t *>(buf), len, offset);
+}
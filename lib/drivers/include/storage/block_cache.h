@@ -0,0 +1,93 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _DRIVERS_BLOCK_CACHE_H
+#define _DRIVERS_BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <osdefs.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _block_cache_config
+{
+    /* Count of cached blocks */
+    uint32_t blocks;
+    /* Blocks fetched past a sequential read miss, also the longest coalesced write */
+    uint32_t read_ahead_blocks;
+    /* Keep written blocks dirty until they are evicted or flushed, otherwise write through */
+    bool write_back;
+} block_cache_config_t;
+
+typedef struct _block_cache_stats
+{
+    /* Blocks requested by reads and the ones served from the cache */
+    uint64_t read_blocks;
+    uint64_t read_hits;
+    /* Blocks requested by writes and the ones that were already cached */
+    uint64_t write_blocks;
+    uint64_t write_hits;
+    /* Blocks fetched ahead of a sequential read */
+    uint64_t read_ahead_blocks;
+    /* Transfers issued to the storage */
+    uint64_t device_reads;
+    uint64_t device_writes;
+    /* Dirty blocks written to the storage */
+    uint64_t written_back_blocks;
+    uint64_t evictions;
+} block_cache_stats_t;
+
+/**
+ * @brief       Install a block cache on top of a block storage driver
+ *
+ * @param[in]   storage_handle      The storage device handle
+ * @param[in]   config              The cache configuration
+ *
+ * @return      result
+ *     - 0      Fail
+ *     - other  The driver handle, a block storage device
+ */
+handle_t block_cache_driver_install(handle_t storage_handle, const block_cache_config_t *config);
+
+/**
+ * @brief       Write the dirty blocks of a cache to its storage
+ *
+ * @param[in]   cache_handle        The block cache handle
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int block_cache_flush(handle_t cache_handle);
+
+/**
+ * @brief       Get the statistics of a block cache
+ *
+ * @param[in]   cache_handle        The block cache handle
+ * @param[out]  stats               The statistics
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int block_cache_get_stats(handle_t cache_handle, block_cache_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DRIVERS_BLOCK_CACHE_H */
@@ -0,0 +1,43 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _DRIVERS_RAMDISK_H
+#define _DRIVERS_RAMDISK_H
+
+#include <stdint.h>
+#include <osdefs.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @brief       Install a RAM disk driver
+ *
+ * @param[in]   buffer          The disk content, block_size * blocks_count bytes, or NULL to allocate a zeroed disk
+ * @param[in]   block_size      The block size
+ * @param[in]   blocks_count    The count of blocks
+ *
+ * @return      result
+ *     - 0      Fail
+ *     - other  The driver handle
+ */
+handle_t ramdisk_driver_install(uint8_t *buffer, uint32_t block_size, uint32_t blocks_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DRIVERS_RAMDISK_H */
@@ -0,0 +1,444 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "storage/block_cache.h"
+#include <FreeRTOS.h>
+#include <algorithm>
+#include <kernel/driver_impl.hpp>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace sys;
+
+#define COMMON_ENTRY \
+    semaphore_lock locker(free_mutex_);
+
+#define NO_LINE UINT32_MAX
+
+/* Every cached block is a line of a LRU list. A miss of a sequential read fetches the
+ * following blocks in the same transfer, and dirty neighbours are written back together
+ * so the storage sees multi-block transfers. Both go through a staging buffer of
+ * read_ahead_blocks + 1 blocks, lines are always allocated before it is filled.
+ */
+
+struct cache_line
+{
+    uint32_t block;
+    bool valid;
+    bool dirty;
+    uint32_t prev;
+    uint32_t next;
+};
+
+class k_block_cache_driver : public block_storage_driver, public heap_object, public free_object_access
+{
+public:
+    k_block_cache_driver(handle_t storage_handle, const block_cache_config_t &config)
+        : storage_driver_(system_handle_to_object(storage_handle).get_object().as<block_storage_driver>()), config_(config)
+    {
+        if (!storage_driver_)
+            throw std::invalid_argument("Not a block storage device.");
+        if (config_.blocks < 2)
+            throw std::invalid_argument("A block cache needs at least 2 blocks.");
+        /* A fetch must never evict its own lines */
+        config_.read_ahead_blocks = std::min(config_.read_ahead_blocks, config_.blocks / 2 - 1);
+    }
+
+    virtual void install() override
+    {
+        free_mutex_ = xSemaphoreCreateMutex();
+    }
+
+    virtual void on_first_open() override
+    {
+        storage_ = make_accessor(storage_driver_);
+        block_size_ = storage_->get_rw_block_size();
+        blocks_count_ = storage_->get_blocks_count();
+        staging_blocks_ = config_.read_ahead_blocks + 1;
+
+        lines_.resize(config_.blocks);
+        data_.resize((size_t)config_.blocks * block_size_);
+        staging_.resize((size_t)staging_blocks_ * block_size_);
+        fill_lines_.resize(staging_blocks_);
+        index_.reserve(config_.blocks);
+        for (uint32_t i = 0; i < config_.blocks; i++)
+            lines_[i] = { 0, false, false, i ? i - 1 : NO_LINE, i + 1 < config_.blocks ? i + 1 : NO_LINE };
+        mru_ = 0;
+        lru_ = config_.blocks - 1;
+        next_block_ = NO_LINE;
+    }
+
+    virtual void on_last_close() override
+    {
+        COMMON_ENTRY;
+        flush_dirty();
+        lines_ = {};
+        data_ = {};
+        staging_ = {};
+        fill_lines_ = {};
+        index_.clear();
+        storage_.reset();
+    }
+
+    virtual uint32_t get_rw_block_size() override
+    {
+        return block_size_;
+    }
+
+    virtual uint32_t get_blocks_count() override
+    {
+        return blocks_count_;
+    }
+
+    virtual void read_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<uint8_t> buffer) override
+    {
+        COMMON_ENTRY;
+        bool sequential = start_block == next_block_;
+        stats_.read_blocks += blocks_count;
+
+        uint32_t i = 0;
+        while (i < blocks_count)
+        {
+            uint32_t block = start_block + i;
+            uint8_t *dest = buffer.data() + (size_t)i * block_size_;
+            uint32_t line = find(block);
+            if (line != NO_LINE)
+            {
+                memcpy(dest, line_data(line), block_size_);
+                touch(line);
+                stats_.read_hits++;
+                i++;
+                continue;
+            }
+
+            uint32_t run = 1;
+            while (i + run < blocks_count && find(block + run) == NO_LINE)
+                run++;
+
+            if (run > staging_blocks_)
+            {
+                /* Too long to be worth caching, it would only evict the working set */
+                storage_->read_blocks(block, run, { dest, ptrdiff_t(run * block_size_) });
+                stats_.device_reads++;
+            }
+            else
+            {
+                uint32_t fetch = run;
+                if (sequential && i + run == blocks_count)
+                {
+                    while (fetch < staging_blocks_ && block + fetch < blocks_count_ && find(block + fetch) == NO_LINE)
+                        fetch++;
+                }
+
+                fill(block, fetch);
+                memcpy(dest, staging_.data(), (size_t)run * block_size_);
+                stats_.read_ahead_blocks += fetch - run;
+            }
+
+            i += run;
+        }
+
+        next_block_ = start_block + blocks_count;
+    }
+
+    virtual void write_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<const uint8_t> buffer) override
+    {
+        COMMON_ENTRY;
+        stats_.write_blocks += blocks_count;
+
+        if (!config_.write_back || blocks_count > staging_blocks_)
+        {
+            /* Cached copies stay valid and become clean */
+            storage_->write_blocks(start_block, blocks_count, buffer);
+            stats_.device_writes++;
+            for (uint32_t i = 0; i < blocks_count; i++)
+            {
+                uint32_t line = find(start_block + i);
+                if (line != NO_LINE)
+                {
+                    memcpy(line_data(line), buffer.data() + (size_t)i * block_size_, block_size_);
+                    lines_[line].dirty = false;
+                    stats_.write_hits++;
+                }
+            }
+            return;
+        }
+
+        for (uint32_t i = 0; i < blocks_count; i++)
+        {
+            uint32_t block = start_block + i;
+            uint32_t line = find(block);
+            if (line != NO_LINE)
+            {
+                touch(line);
+                stats_.write_hits++;
+            }
+            else
+            {
+                line = allocate(block);
+            }
+
+            memcpy(line_data(line), buffer.data() + (size_t)i * block_size_, block_size_);
+            lines_[line].dirty = true;
+        }
+    }
+
+    virtual void erase_blocks(uint32_t start_block, uint32_t blocks_count) override
+    {
+        COMMON_ENTRY;
+
+        /* Cached copies, dirty or not, hold data no longer needed */
+        if (blocks_count < config_.blocks)
+        {
+            for (uint32_t i = 0; i < blocks_count; i++)
+            {
+                uint32_t line = find(start_block + i);
+                if (line != NO_LINE)
+                    drop(line);
+            }
+        }
+        else
+        {
+            for (uint32_t line = 0; line < config_.blocks; line++)
+            {
+                if (lines_[line].valid && lines_[line].block - start_block < blocks_count)
+                    drop(line);
+            }
+        }
+
+        storage_->erase_blocks(start_block, blocks_count);
+    }
+
+    virtual void flush() override
+    {
+        COMMON_ENTRY;
+        flush_dirty();
+        storage_->flush();
+    }
+
+    block_cache_stats_t get_stats()
+    {
+        COMMON_ENTRY;
+        return stats_;
+    }
+
+private:
+    uint8_t *line_data(uint32_t line) noexcept
+    {
+        return data_.data() + (size_t)line * block_size_;
+    }
+
+    uint32_t find(uint32_t block) const
+    {
+        auto it = index_.find(block);
+        return it == index_.end() ? NO_LINE : it->second;
+    }
+
+    void unlink(uint32_t line) noexcept
+    {
+        auto &l = lines_[line];
+        if (l.prev != NO_LINE)
+            lines_[l.prev].next = l.next;
+        else
+            mru_ = l.next;
+        if (l.next != NO_LINE)
+            lines_[l.next].prev = l.prev;
+        else
+            lru_ = l.prev;
+    }
+
+    void touch(uint32_t line) noexcept
+    {
+        if (line == mru_)
+            return;
+        unlink(line);
+        lines_[line].prev = NO_LINE;
+        lines_[line].next = mru_;
+        lines_[mru_].prev = line;
+        mru_ = line;
+    }
+
+    void drop(uint32_t line) noexcept
+    {
+        index_.erase(lines_[line].block);
+        lines_[line].valid = false;
+        lines_[line].dirty = false;
+        if (line == lru_)
+            return;
+        unlink(line);
+        lines_[line].prev = lru_;
+        lines_[line].next = NO_LINE;
+        lines_[lru_].next = line;
+        lru_ = line;
+    }
+
+    /* Reuse the least recently used line for a block, writing it back first if it is dirty */
+    uint32_t allocate(uint32_t block)
+    {
+        uint32_t line = lru_;
+        auto &l = lines_[line];
+        if (l.valid)
+        {
+            if (l.dirty)
+                write_back(line);
+            index_.erase(l.block);
+            stats_.evictions++;
+        }
+
+        l.block = block;
+        l.valid = true;
+        l.dirty = false;
+        index_[block] = line;
+        touch(line);
+        return line;
+    }
+
+    /* Read blocks that are not cached into new lines and the staging buffer */
+    void fill(uint32_t block, uint32_t count)
+    {
+        auto &lines = fill_lines_;
+        for (uint32_t i = 0; i < count; i++)
+            lines[i] = allocate(block + i);
+
+        try
+        {
+            storage_->read_blocks(block, count, { staging_.data(), ptrdiff_t(count * block_size_) });
+            stats_.device_reads++;
+        }
+        catch (...)
+        {
+            for (uint32_t i = 0; i < count; i++)
+                drop(lines[i]);
+            throw;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+            memcpy(line_data(lines[i]), staging_.data() + (size_t)i * block_size_, block_size_);
+    }
+
+    bool is_dirty(uint32_t block) const
+    {
+        uint32_t line = find(block);
+        return line != NO_LINE && lines_[line].dirty;
+    }
+
+    /* Write a dirty line together with the dirty lines of the adjacent blocks */
+    void write_back(uint32_t line)
+    {
+        uint32_t first = lines_[line].block, count = 1;
+        while (count < staging_blocks_ && first > 0 && is_dirty(first - 1))
+        {
+            first--;
+            count++;
+        }
+        while (count < staging_blocks_ && is_dirty(first + count))
+            count++;
+
+        for (uint32_t i = 0; i < count; i++)
+            memcpy(staging_.data() + (size_t)i * block_size_, line_data(find(first + i)), block_size_);
+        storage_->write_blocks(first, count, { staging_.data(), ptrdiff_t(count * block_size_) });
+        for (uint32_t i = 0; i < count; i++)
+            lines_[find(first + i)].dirty = false;
+
+        stats_.device_writes++;
+        stats_.written_back_blocks += count;
+    }
+
+    void flush_dirty()
+    {
+        std::vector<uint32_t> dirty;
+        for (auto &line : lines_)
+        {
+            if (line.dirty)
+                dirty.push_back(line.block);
+        }
+
+        /* In block order each write back extends forward only */
+        std::sort(dirty.begin(), dirty.end());
+        for (auto block : dirty)
+        {
+            uint32_t line = find(block);
+            if (lines_[line].dirty)
+                write_back(line);
+        }
+    }
+
+private:
+    object_ptr<block_storage_driver> storage_driver_;
+    block_cache_config_t config_;
+    SemaphoreHandle_t free_mutex_;
+
+    object_accessor<block_storage_driver> storage_;
+    uint32_t block_size_;
+    uint32_t blocks_count_;
+    uint32_t staging_blocks_;
+    std::vector<cache_line> lines_;
+    std::vector<uint8_t> data_;
+    std::vector<uint8_t> staging_;
+    std::vector<uint32_t> fill_lines_;
+    std::unordered_map<uint32_t, uint32_t> index_;
+    uint32_t mru_;
+    uint32_t lru_;
+    uint32_t next_block_;
+    block_cache_stats_t stats_ = {};
+};
+
+#define CACHE_ENTRY                                                  \
+    auto &obj = system_handle_to_object(cache_handle);               \
+    configASSERT(obj.is<k_block_cache_driver>());                    \
+    auto cache = obj.as<k_block_cache_driver>();
+
+handle_t block_cache_driver_install(handle_t storage_handle, const block_cache_config_t *config)
+{
+    try
+    {
+        configASSERT(config);
+        auto driver = make_object<k_block_cache_driver>(storage_handle, *config);
+        driver->install();
+        return system_alloc_handle(make_accessor(driver));
+    }
+    catch (...)
+    {
+        return NULL_HANDLE;
+    }
+}
+
+int block_cache_flush(handle_t cache_handle)
+{
+    try
+    {
+        CACHE_ENTRY;
+        cache->flush();
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int block_cache_get_stats(handle_t cache_handle, block_cache_stats_t *stats)
+{
+    try
+    {
+        CACHE_ENTRY;
+        *stats = cache->get_stats();
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
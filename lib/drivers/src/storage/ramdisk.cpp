@@ -0,0 +1,99 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "storage/ramdisk.h"
+#include <FreeRTOS.h>
+#include <kernel/driver_impl.hpp>
+#include <string.h>
+#include <vector>
+
+using namespace sys;
+
+class k_ramdisk_driver : public block_storage_driver, public heap_object, public free_object_access
+{
+public:
+    k_ramdisk_driver(uint8_t *buffer, uint32_t block_size, uint32_t blocks_count)
+        : block_size_(block_size), blocks_count_(blocks_count)
+    {
+        if (!block_size || !blocks_count)
+            throw std::invalid_argument("Invalid RAM disk size.");
+
+        if (buffer)
+        {
+            data_ = buffer;
+        }
+        else
+        {
+            storage_.resize((size_t)block_size * blocks_count);
+            data_ = storage_.data();
+        }
+    }
+
+    virtual void install() override
+    {
+    }
+
+    virtual uint32_t get_rw_block_size() override
+    {
+        return block_size_;
+    }
+
+    virtual uint32_t get_blocks_count() override
+    {
+        return blocks_count_;
+    }
+
+    virtual void read_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<uint8_t> buffer) override
+    {
+        memcpy(buffer.data(), data_ + check_range(start_block, blocks_count), (size_t)blocks_count * block_size_);
+    }
+
+    virtual void write_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<const uint8_t> buffer) override
+    {
+        memcpy(data_ + check_range(start_block, blocks_count), buffer.data(), (size_t)blocks_count * block_size_);
+    }
+
+    virtual void erase_blocks(uint32_t start_block, uint32_t blocks_count) override
+    {
+        memset(data_ + check_range(start_block, blocks_count), 0, (size_t)blocks_count * block_size_);
+    }
+
+private:
+    size_t check_range(uint32_t start_block, uint32_t blocks_count)
+    {
+        if (start_block >= blocks_count_ || blocks_count > blocks_count_ - start_block)
+            throw std::out_of_range("Blocks out of the RAM disk.");
+        return (size_t)start_block * block_size_;
+    }
+
+private:
+    uint32_t block_size_;
+    uint32_t blocks_count_;
+    uint8_t *data_;
+    std::vector<uint8_t> storage_;
+};
+
+handle_t ramdisk_driver_install(uint8_t *buffer, uint32_t block_size, uint32_t blocks_count)
+{
+    try
+    {
+        auto driver = make_object<k_ramdisk_driver>(buffer, block_size, blocks_count);
+        driver->install();
+        return system_alloc_handle(make_accessor(driver));
+    }
+    catch (...)
+    {
+        return NULL_HANDLE;
+    }
+}
@@ -13,10 +13,15 @@
  * limitations under the License.
  */
 #include "storage/sdcard.h"
+#include <FreeRTOS.h>
+#include <algorithm>
 #include <hal.h>
 #include <kernel/driver_impl.hpp>
+#include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
+#include <task.h>
+#include <vector>
 
 using namespace sys;
 
@@ -29,6 +34,7 @@ using namespace sys;
 #define SD_START_DATA_MULTIPLE_BLOCK_READ 0xFE /*!< Data token start byte, Start Multiple Block Read */
 #define SD_START_DATA_SINGLE_BLOCK_WRITE 0xFE /*!< Data token start byte, Start Single Block Write */
 #define SD_START_DATA_MULTIPLE_BLOCK_WRITE 0xFC /*!< Data token start byte, Start Multiple Block Write */
+#define SD_STOP_DATA_MULTIPLE_BLOCK_WRITE 0xFD /*!< Data token stop byte, Stop Multiple Block Write */
 
 /*
  * @brief  Commands: CMDxx = CMD-number | 0x40
@@ -44,15 +50,40 @@ using namespace sys;
 #define SD_ACMD23 23 /*!< CMD23 = 0x57 */
 #define SD_CMD24 24 /*!< CMD24 = 0x58 */
 #define SD_CMD25 25 /*!< CMD25 = 0x59 */
+#define SD_CMD32 32 /*!< CMD32 = 0x60 */
+#define SD_CMD33 33 /*!< CMD33 = 0x61 */
+#define SD_CMD38 38 /*!< CMD38 = 0x66 */
 #define SD_ACMD41 41 /*!< ACMD41 = 0x41 */
 #define SD_CMD55 55 /*!< CMD55 = 0x55 */
 #define SD_CMD58 58 /*!< CMD58 = 0x58 */
 #define SD_CMD59 59 /*!< CMD59 = 0x59 */
 
 #define SD_SPI_LOW_CLOCK_RATE 200000U
-#define SD_SPI_HIGH_CLOCK_RATE 20000000U
+/* Highest clock of a card in SPI mode, lowered to TRAN_SPEED of the CSD */
+#define SD_SPI_HIGH_CLOCK_RATE 25000000U
 #define SPI_SLAVE_SELECT 3
 
+#define SD_BLOCK_SIZE 512
+#define SD_CRC_SIZE 2
+/* Start token, block and CRC of a block read */
+#define SD_READ_FRAME_SIZE (1 + SD_BLOCK_SIZE + SD_CRC_SIZE)
+/* Bytes read past the last expected frame of a burst, for the gaps between blocks */
+#define SD_READ_LOOKAHEAD 14
+/* A burst is one SPI receive, at most 65536 frames */
+#define SD_READ_BURST_MAX 0x10000
+/* Bytes read at once while waiting for a token or for the end of busy */
+#define SD_POLL_CHUNK 16
+/* Bytes read at once while waiting for a response, a response comes within 8 bytes (Ncr) */
+#define SD_RESPONSE_CHUNK 8
+#define SD_RESPONSE_TIMEOUT_BYTES 0x1000
+#define SD_READ_TIMEOUT_MS 100
+#define SD_WRITE_TIMEOUT_MS 500
+/* Erase command class in the CCC of the CSD */
+#define SD_CCC_ERASE (1 << 5)
+/* Blocks erased by one CMD38, a few allocation units so each erase ends within the timeout */
+#define SD_ERASE_MAX_BLOCKS 8192
+#define SD_ERASE_TIMEOUT_MS 1000
+
 /** 
   * @brief  Card Specific Data: CSD Register   
   */
@@ -170,14 +201,30 @@ public:
 
     virtual void read_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<uint8_t> buffer) override
     {
-        spi8_dev_->set_clock_rate(SD_SPI_HIGH_CLOCK_RATE);
-        sd_read_sector_dma(buffer.data(), start_block, blocks_count);
+        if (sd_read_sector_dma(buffer.data(), start_block, blocks_count))
+            throw std::runtime_error("SD card read failed.");
     }
 
     virtual void write_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<const uint8_t> buffer) override
     {
-        spi8_dev_->set_clock_rate(SD_SPI_HIGH_CLOCK_RATE);
-        sd_write_sector_dma(buffer.data(), start_block, blocks_count);
+        if (sd_write_sector_dma(buffer.data(), start_block, blocks_count))
+            throw std::runtime_error("SD card write failed.");
+    }
+
+    virtual void erase_blocks(uint32_t start_block, uint32_t blocks_count) override
+    {
+        /* The erase is a hint for the wear leveling of the card, cards without the erase class skip it */
+        if (!(card_info_.SD_csd.CardComdClasses & SD_CCC_ERASE))
+            return;
+
+        while (blocks_count)
+        {
+            uint32_t count = std::min<uint32_t>(blocks_count, SD_ERASE_MAX_BLOCKS);
+            if (sd_erase_sector(start_block, count))
+                throw std::runtime_error("SD card erase failed.");
+            start_block += count;
+            blocks_count -= count;
+        }
     }
 
 private:
@@ -193,22 +240,20 @@ private:
 
     void sd_write_data(const uint8_t *data_buff, size_t length)
     {
+        /*!< Bytes read ahead were received before this write */
+        rx_pending_len_ = 0;
         spi8_dev_->write({ data_buff, std::ptrdiff_t(length) });
     }
 
     void sd_read_data(uint8_t *data_buff, size_t length)
     {
-        spi8_dev_->read({ data_buff, std::ptrdiff_t(length) });
-    }
-
-    void sd_write_data_dma(const uint8_t *data_buff)
-    {
-        spi8_dev_->write({ data_buff, 512L });
-    }
-
-    void sd_read_data_dma(uint8_t *data_buff)
-    {
-        spi8_dev_->read({ data_buff, 512L });
+        /*!< Bytes read ahead by sd_get_response come first */
+        size_t pending = std::min(length, rx_pending_len_);
+        memcpy(data_buff, rx_pending_ + rx_pending_pos_, pending);
+        rx_pending_pos_ += pending;
+        rx_pending_len_ -= pending;
+        if (length > pending)
+            spi8_dev_->read({ data_buff + pending, std::ptrdiff_t(length - pending) });
     }
 
     /*
@@ -256,7 +301,8 @@ private:
     }
 
     /*
-     * @brief  Returns the SD response.
+     * @brief  Returns the SD response, reading SD_RESPONSE_CHUNK bytes at a time.
+     *         The bytes read after the response are kept for the next read.
      * @param  None
      * @retval The SD Response:
      *         - 0xFF: Sequence failed
@@ -264,22 +310,50 @@ private:
      */
     uint8_t sd_get_response()
     {
-        uint8_t result;
-        uint16_t timeout = 0x0FFF;
+        uint8_t chunk[SD_RESPONSE_CHUNK];
         /*!< Check if response is got or a timeout is happen */
-        while (timeout--)
+        for (size_t polled = 0; polled < SD_RESPONSE_TIMEOUT_BYTES; polled += sizeof(chunk))
         {
-            sd_read_data(&result, 1);
-            /*!< Right response got */
-            if (result != 0xFF)
-                return result;
+            sd_read_data(chunk, sizeof(chunk));
+            for (size_t i = 0; i < sizeof(chunk); i++)
+            {
+                /*!< Right response got */
+                if (chunk[i] != 0xFF)
+                {
+                    rx_pending_pos_ = 0;
+                    rx_pending_len_ = sizeof(chunk) - i - 1;
+                    memcpy(rx_pending_, chunk + i + 1, rx_pending_len_);
+                    return chunk[i];
+                }
+            }
         }
         /*!< After time out */
         return 0xFF;
     }
 
     /*
-     * @brief  Get SD card data response.
+     * @brief  Wait until the card releases busy, reading SD_POLL_CHUNK bytes at a time.
+     * @param  timeout_ms: the longest time the card may stay busy.
+     * @retval The SD Response:
+     *         - 0xFF: Timeout
+     *         - 0: Ready
+     */
+    uint8_t sd_wait_ready(uint32_t timeout_ms = SD_WRITE_TIMEOUT_MS)
+    {
+        uint8_t chunk[SD_POLL_CHUNK];
+        TickType_t start = xTaskGetTickCount();
+        do
+        {
+            sd_read_data(chunk, sizeof(chunk));
+            /*!< Busy is held low, the last byte is enough */
+            if (chunk[sizeof(chunk) - 1] != 0x00)
+                return 0;
+        } while (xTaskGetTickCount() - start < pdMS_TO_TICKS(timeout_ms));
+        return 0xFF;
+    }
+
+    /*
+     * @brief  Get SD card data response and wait for the end of programming.
      * @param  None
      * @retval The SD status: Read data response xxx0<status>1
      *         - status 010: Data accecpted
@@ -289,19 +363,17 @@ private:
      */
     uint8_t sd_get_dataresponse()
     {
-        uint8_t response;
-        /*!< Read resonse */
-        sd_read_data(&response, 1);
-        /*!< Mask unused bits */
-        response &= 0x1F;
-        if (response != 0x05)
+        uint8_t chunk[SD_POLL_CHUNK];
+        size_t i;
+        /*!< The response follows the CRC, busy follows the response in the same chunk */
+        sd_read_data(chunk, sizeof(chunk));
+        for (i = 0; i < sizeof(chunk) && chunk[i] == 0xFF; i++)
+            ;
+        if (i == sizeof(chunk) || (chunk[i] & 0x1F) != 0x05)
             return 0xFF;
-        /*!< Wait null data */
-        sd_read_data(&response, 1);
-        while (response == 0)
-            sd_read_data(&response, 1);
-        /*!< Return response */
-        return 0;
+        if (i + 1 < sizeof(chunk) && chunk[sizeof(chunk) - 1] != 0x00)
+            return 0;
+        return sd_wait_ready();
     }
 
     /*
@@ -552,55 +624,116 @@ private:
         if ((frame[0] & 0x40) == 0)
             return 0xFF;
 
-        spi8_dev_->set_clock_rate(SD_SPI_HIGH_CLOCK_RATE);
-        return sd_get_cardinfo(&card_info_);
+        if (sd_get_cardinfo(&card_info_))
+            return 0xFF;
+        spi8_dev_->set_clock_rate(sd_get_max_clock_rate(card_info_.SD_csd));
+        return 0;
+    }
+
+    /*
+     * @brief  Get the highest clock of the card from TRAN_SPEED of the CSD.
+     * @param  SD_csd: the CSD register
+     * @retval The clock rate in Hz
+     */
+    static uint32_t sd_get_max_clock_rate(const SD_CSD &SD_csd)
+    {
+        /*!< Time values in tenths, units from 100kbit/s */
+        static const uint8_t time_values[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+        uint32_t unit = SD_csd.MaxBusClkFrec & 0x07, rate = 10000;
+        if (unit > 3)
+            return SD_SPI_HIGH_CLOCK_RATE;
+        while (unit--)
+            rate *= 10;
+        rate *= time_values[(SD_csd.MaxBusClkFrec >> 3) & 0x0F];
+        return rate && rate < SD_SPI_HIGH_CLOCK_RATE ? rate : SD_SPI_HIGH_CLOCK_RATE;
     }
 
     /*
-     * @brief  Reads a block of data from the SD.
+     * @brief  Reads blocks of data from the SD.
+     *         The blocks of a burst come in as one stream, read in a single transfer
+     *         of up to SD_READ_BURST_MAX bytes, and the start tokens, CRCs and gaps
+     *         are parsed out of it.
      * @param  data_buff: pointer to the buffer that receives the data read from the
      *                  SD.
      * @param  sector: SD's internal address to read from.
+     * @param  count: count of blocks.
      * @retval The SD Response:
      *         - 0xFF: Sequence failed
      *         - 0: Sequence succeed
      */
-    uint8_t sd_read_sector(uint8_t *data_buff, uint32_t sector, uint32_t count)
+    uint8_t sd_read_sector_dma(uint8_t *data_buff, uint32_t sector, uint32_t count)
     {
-        uint8_t frame[2], flag;
-        /*!< Send CMD17 (SD_CMD17) to read one block */
-        if (count == 1)
-        {
-            flag = 0;
-            sd_send_cmd(SD_CMD17, sector, 0);
-        }
-        else
-        {
-            flag = 1;
-            sd_send_cmd(SD_CMD18, sector, 0);
-        }
+        bool multiple = count > 1, failed = false;
+        /*!< Bytes of the current frame received, 0 while waiting for its start token */
+        size_t received = 0;
+
+        /*!< Send CMD17 (SD_CMD17) to read one block, CMD18 to read several */
+        sd_send_cmd(multiple ? SD_CMD18 : SD_CMD17, sector, 0);
         /*!< Check if the SD acknowledged the read block command: R1 response (0x00: no errors) */
         if (sd_get_response() != 0x00)
         {
             sd_end_cmd();
             return 0xFF;
         }
-        while (count)
+
+        TickType_t start = xTaskGetTickCount();
+        while (count && !failed)
         {
-            if (sd_get_response() != SD_START_DATA_SINGLE_BLOCK_READ)
-                break;
-            /*!< Read the SD block data : read NumByteToRead data */
-            sd_read_data(data_buff, 512);
-            /*!< Get CRC bytes (not really needed by us, but required by SD) */
-            sd_read_data(frame, 2);
-            data_buff += 512;
-            count--;
+            size_t length = std::min<size_t>(SD_READ_BURST_MAX, (size_t)count * SD_READ_FRAME_SIZE - received + SD_READ_LOOKAHEAD);
+            if (read_stream_.size() < length)
+                read_stream_.resize(length);
+            sd_read_data(read_stream_.data(), length);
+
+            const uint8_t *it = read_stream_.data(), *end = it + length;
+            while (it != end && count)
+            {
+                if (received == 0)
+                {
+                    /*!< Gap before the start token, anything else is an error token */
+                    if (*it == 0xFF)
+                    {
+                        it++;
+                        continue;
+                    }
+                    if (*it++ != SD_START_DATA_MULTIPLE_BLOCK_READ)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    received = 1;
+                }
+                else if (received < 1 + SD_BLOCK_SIZE)
+                {
+                    size_t copy = std::min<size_t>(end - it, 1 + SD_BLOCK_SIZE - received);
+                    memcpy(data_buff + received - 1, it, copy);
+                    it += copy;
+                    received += copy;
+                }
+                else
+                {
+                    /*!< CRC bytes (not really needed by us, but required by SD) */
+                    size_t skip = std::min<size_t>(end - it, SD_READ_FRAME_SIZE - received);
+                    it += skip;
+                    received += skip;
+                    if (received == SD_READ_FRAME_SIZE)
+                    {
+                        data_buff += SD_BLOCK_SIZE;
+                        count--;
+                        received = 0;
+                        start = xTaskGetTickCount();
+                    }
+                }
+            }
+
+            if (count && received == 0 && xTaskGetTickCount() - start >= pdMS_TO_TICKS(SD_READ_TIMEOUT_MS))
+                failed = true;
         }
         sd_end_cmd();
-        if (flag)
+        if (multiple)
         {
             sd_send_cmd(SD_CMD12, 0, 0);
             sd_get_response();
+            sd_wait_ready();
             sd_end_cmd();
             sd_end_cmd();
         }
@@ -609,26 +742,38 @@ private:
     }
 
     /*
-     * @brief  Writes a block on the SD
+     * @brief  Writes blocks on the SD
+     *         The start token, the block and its CRC go out in one transfer, the data
+     *         response and busy are polled in chunks. In SPI mode the card must leave
+     *         busy before the next block is sent, so the blocks are not streamed.
      * @param  data_buff: pointer to the buffer containing the data to be written on
      *                  the SD.
      * @param  sector: address to write on.
+     * @param  count: count of blocks.
      * @retval The SD Response:
      *         - 0xFF: Sequence failed
      *         - 0: Sequence succeed
      */
-    uint8_t sd_write_sector(uint8_t *data_buff, uint32_t sector, uint32_t count)
+    uint8_t sd_write_sector_dma(const uint8_t *data_buff, uint32_t sector, uint32_t count)
     {
-        uint8_t frame[2] = { 0xFF };
+        uint8_t frame[2] = { SD_STOP_DATA_MULTIPLE_BLOCK_WRITE, 0xFF };
+        bool multiple = count > 1;
 
-        if (count == 1)
+        write_frame_[0] = 0xFF;
+        write_frame_[sizeof(write_frame_) - 2] = 0xFF;
+        write_frame_[sizeof(write_frame_) - 1] = 0xFF;
+        if (!multiple)
         {
-            frame[1] = SD_START_DATA_SINGLE_BLOCK_WRITE;
+            write_frame_[1] = SD_START_DATA_SINGLE_BLOCK_WRITE;
             sd_send_cmd(SD_CMD24, sector, 0);
         }
         else
         {
-            frame[1] = SD_START_DATA_MULTIPLE_BLOCK_WRITE;
+            write_frame_[1] = SD_START_DATA_MULTIPLE_BLOCK_WRITE;
+            /*!< Pre-erase hint, ACMD23 */
+            sd_send_cmd(SD_CMD55, 0, 0);
+            sd_get_response();
+            sd_end_cmd();
             sd_send_cmd(SD_ACMD23, count, 0);
             sd_get_response();
             sd_end_cmd();
@@ -642,13 +787,10 @@ private:
         }
         while (count--)
         {
-            /*!< Send the data token to signify the start of the data */
-            sd_write_data(frame, 2);
-            /*!< Write the block data to SD : write count data by block */
-            sd_write_data(data_buff, 512);
-            /*!< Put CRC bytes (not really needed by us, but required by SD) */
-            sd_write_data(frame, 2);
-            data_buff += 512;
+            /*!< Gap byte, data token, the block and the CRC (not really needed by us, but required by SD) */
+            memcpy(write_frame_ + 2, data_buff, SD_BLOCK_SIZE);
+            sd_write_data(write_frame_, sizeof(write_frame_));
+            data_buff += SD_BLOCK_SIZE;
             /*!< Read data response */
             if (sd_get_dataresponse() != 0x00)
             {
@@ -656,90 +798,11 @@ private:
                 return 0xFF;
             }
         }
-        sd_end_cmd();
-        sd_end_cmd();
-        /*!< Returns the reponse */
-        return 0;
-    }
-
-    uint8_t sd_read_sector_dma(uint8_t *data_buff, uint32_t sector, uint32_t count)
-    {
-        uint8_t frame[2], flag;
-
-        /*!< Send CMD17 (SD_CMD17) to read one block */
-        if (count == 1)
-        {
-            flag = 0;
-            sd_send_cmd(SD_CMD17, sector, 0);
-        }
-        else
-        {
-            flag = 1;
-            sd_send_cmd(SD_CMD18, sector, 0);
-        }
-        /*!< Check if the SD acknowledged the read block command: R1 response (0x00: no errors) */
-        if (sd_get_response() != 0x00)
-        {
-            sd_end_cmd();
-            return 0xFF;
-        }
-        while (count)
-        {
-            if (sd_get_response() != SD_START_DATA_SINGLE_BLOCK_READ)
-                break;
-            /*!< Read the SD block data : read NumByteToRead data */
-            sd_read_data_dma(data_buff);
-            /*!< Get CRC bytes (not really needed by us, but required by SD) */
-            sd_read_data(frame, 2);
-            data_buff += 512;
-            count--;
-        }
-        sd_end_cmd();
-        if (flag)
+        if (multiple)
         {
-            sd_send_cmd(SD_CMD12, 0, 0);
-            sd_get_response();
-            sd_end_cmd();
-            sd_end_cmd();
-        }
-        /*!< Returns the reponse */
-        return count > 0 ? 0xFF : 0;
-    }
-
-    uint8_t sd_write_sector_dma(const uint8_t *data_buff, uint32_t sector, uint32_t count)
-    {
-        uint8_t frame[2] = { 0xFF };
-
-        if (count == 1)
-        {
-            frame[1] = SD_START_DATA_SINGLE_BLOCK_WRITE;
-            sd_send_cmd(SD_CMD24, sector, 0);
-        }
-        else
-        {
-            frame[1] = SD_START_DATA_MULTIPLE_BLOCK_WRITE;
-            sd_send_cmd(SD_ACMD23, count, 0);
-            sd_get_response();
-            sd_end_cmd();
-            sd_send_cmd(SD_CMD25, sector, 0);
-        }
-        /*!< Check if the SD acknowledged the write block command: R1 response (0x00: no errors) */
-        if (sd_get_response() != 0x00)
-        {
-            sd_end_cmd();
-            return 0xFF;
-        }
-        while (count--)
-        {
-            /*!< Send the data token to signify the start of the data */
+            /*!< Stop transmission token, the card is busy until the data is programmed */
             sd_write_data(frame, 2);
-            /*!< Write the block data to SD : write count data by block */
-            sd_write_data_dma(data_buff);
-            /*!< Put CRC bytes (not really needed by us, but required by SD) */
-            sd_write_data(frame, 2);
-            data_buff += 512;
-            /*!< Read data response */
-            if (sd_get_dataresponse() != 0x00)
+            if (sd_wait_ready() != 0x00)
             {
                 sd_end_cmd();
                 return 0xFF;
@@ -751,6 +814,36 @@ private:
         return 0;
     }
 
+    /*
+     * @brief  Erases blocks of the SD, they read as all 0 or all 1 bits afterwards.
+     * @param  sector: the first block to erase.
+     * @param  count: count of blocks.
+     * @retval The SD Response:
+     *         - 0xFF: Sequence failed
+     *         - 0: Sequence succeed
+     */
+    uint8_t sd_erase_sector(uint32_t sector, uint32_t count)
+    {
+        /*!< CMD32 and CMD33 set the first and the last block to erase */
+        sd_send_cmd(SD_CMD32, sector, 0);
+        uint8_t result = sd_get_response();
+        sd_end_cmd();
+        if (result != 0x00)
+            return 0xFF;
+        sd_send_cmd(SD_CMD33, sector + count - 1, 0);
+        result = sd_get_response();
+        sd_end_cmd();
+        if (result != 0x00)
+            return 0xFF;
+        /*!< CMD38 answers R1b, the card is busy until the blocks are erased */
+        sd_send_cmd(SD_CMD38, 0, 0);
+        result = sd_get_response();
+        if (result == 0x00)
+            result = sd_wait_ready(SD_ERASE_TIMEOUT_MS);
+        sd_end_cmd();
+        return result ? 0xFF : 0;
+    }
+
 private:
     object_ptr<spi_driver> spi_driver_;
     object_ptr<gpio_driver> cs_gpio_driver_;
@@ -759,6 +852,11 @@ private:
     object_accessor<gpio_driver> cs_gpio_;
     object_accessor<spi_device_driver> spi8_dev_;
     SD_CardInfo card_info_;
+    uint8_t write_frame_[2 + SD_BLOCK_SIZE + SD_CRC_SIZE];
+    std::vector<uint8_t> read_stream_;
+    uint8_t rx_pending_[SD_RESPONSE_CHUNK];
+    size_t rx_pending_pos_ = 0;
+    size_t rx_pending_len_ = 0;
 };
 
 handle_t spi_sdcard_driver_install(handle_t spi_handle, handle_t cs_gpio_handle, uint32_t cs_gpio_pin)
@@ -413,6 +413,19 @@ void dvp_set_output_enable(handle_t file, uint32_t index, bool enable);
  */
 void dvp_set_output_attributes(handle_t file, uint32_t index, video_format_t format, void *output_buffer);
 
+/**
+ * @brief       Set the planes of the RGB24 planar output of a DVP device
+ *
+ * Unlike dvp_set_output_attributes the planes need not to be contiguous,
+ * use it with kpu_get_input_planes to capture straight into the KPU input.
+ *
+ * @param[in]   file            The DVP device handle
+ * @param[out]  r_plane         The R plane
+ * @param[out]  g_plane         The G plane
+ * @param[out]  b_plane         The B plane
+ */
+void dvp_set_output_planes(handle_t file, void *r_plane, void *g_plane, void *b_plane);
+
 /**
  * @brief       Enable or disable a frame event of a DVP device
  *
@@ -441,6 +454,46 @@ void dvp_set_on_frame_event(handle_t file, dvp_on_frame_event_t handler, void *u
  */
 double dvp_xclk_set_clock_rate(handle_t file, double clock_rate);
 
+/**
+ * @brief       Capture into a queue of frame buffers owned by a DVP device
+ *
+ * The buffers are allocated in uncached memory for every enabled output,
+ * call it after dvp_config and dvp_set_output_enable.
+ * Frames are rotated on VIDEO_FE_END and capture never waits for the consumer.
+ * Replacing or leaving the queue waits for the frame in flight, then gives back
+ * the output buffers and frame interrupts set before the queue.
+ *
+ * @param[in]   file                The DVP device handle
+ * @param[in]   buffers_count       The count of buffers, at least 2, 0 leaves the queue mode
+ * @param[in]   policy              What to drop when all buffers are in use
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail, a frame is still acquired
+ */
+int dvp_set_frame_queue(handle_t file, uint32_t buffers_count, dvp_frame_drop_policy_t policy);
+
+/**
+ * @brief       Acquire the oldest captured frame of a DVP device
+ *
+ * @param[in]   file            The DVP device handle
+ * @param[out]  frame           The frame
+ * @param[in]   millisecond     The timeout, portMAX_DELAY waits forever
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Timeout
+ */
+int dvp_acquire_frame(handle_t file, dvp_frame_t *frame, size_t millisecond);
+
+/**
+ * @brief       Give an acquired frame back to a DVP device
+ *
+ * @param[in]   file            The DVP device handle
+ * @param[in]   frame           The frame
+ */
+void dvp_release_frame(handle_t file, const dvp_frame_t *frame);
+
 /**
  * @brief       Register and open a SCCB device
  *
@@ -472,6 +525,19 @@ uint8_t sccb_dev_read_byte(handle_t file, uint16_t reg_address);
  */
 void sccb_dev_write_byte(handle_t file, uint16_t reg_address, uint8_t value);
 
+/**
+ * @brief       Program a table of registers of a SCCB device
+ *
+ * The whole table runs as one sequence, other users of the controller wait until it ends.
+ *
+ * @param[in]   file            The SCCB device handle
+ * @param[in]   entries         The register writes, read-modify-writes and delays
+ * @param[in]   count           The count of entries
+ *
+ * @return      The time the table took in microseconds
+ */
+uint64_t sccb_dev_write_table(handle_t file, const sccb_reg_entry_t *entries, size_t count);
+
 /**
  * @brief       Do 16bit quantized complex FFT
  *
@@ -853,6 +919,9 @@ void rtc_set_datetime(handle_t file, const struct tm *datetime);
 /**
  * @brief       Load model from buffer
  *
+ * The buffer may also hold a model packed by tools/kmodel_compress.py,
+ * it is then decompressed into memory owned by the context.
+ *
  * @param[in]   buffer      model data
  *
  * @return      result
@@ -861,6 +930,21 @@ void rtc_set_datetime(handle_t file, const struct tm *datetime);
  */
 handle_t kpu_model_load_from_buffer(uint8_t *buffer);
 
+/**
+ * @brief       Load model from a file
+ *
+ * The model is read in chunks straight into its final location,
+ * no copy of the whole file is needed. Models packed by tools/kmodel_compress.py
+ * are decompressed a batch of blocks at a time on both cores.
+ *
+ * @param[in]   file        The file handle, positioned at the start of the model
+ *
+ * @return      result
+ *     - 0      Fail
+ *     - other  The kpu context handle
+ */
+handle_t kpu_model_load_from_file(handle_t file);
+
 /**
  * @brief       KPU run.
  *
@@ -887,6 +971,90 @@ int kpu_run(handle_t context, const uint8_t *src);
  */
 int kpu_get_output(handle_t context, uint32_t index, uint8_t **data, size_t *size);
 
+/**
+ * @brief       Get the input planes of a model in KPU memory.
+ *
+ * Only available when the input rows fill whole KPU memory lines (width is a multiple of 64),
+ * a DVP can then write a frame there with dvp_set_output_planes.
+ *
+ * @param[in]   context         The kpu context handle
+ * @param[out]  planes          The address of each input channel
+ * @param[in]   count           The length of the planes array
+ *
+ * @return      result
+ *     - -1     The input layout is not writable in place
+ *     - other  The count of input channels
+ */
+int kpu_get_input_planes(handle_t context, uint8_t **planes, size_t count);
+
+/**
+ * @brief       KPU run on an input already written to the planes from kpu_get_input_planes.
+ *
+ * The capture of the next frame must not begin before this returns.
+ *
+ * @param[in]   context         The kpu context handle
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int kpu_run_from_dvp_frame(handle_t context);
+
+/**
+ * @brief       Enable or disable per-layer profiling of a model.
+ *
+ * @param[in]   context         The kpu context handle
+ * @param[in]   enable          Record the profile of each layer on the following runs
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int kpu_set_profile_enabled(handle_t context, bool enable);
+
+/**
+ * @brief       Get the per-layer profile of the last run.
+ *
+ * @param[in]   context         The kpu context handle
+ * @param[out]  profile         The profile array, one entry per layer
+ * @param[in]   count           The length of the profile array
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The number of layers of the model
+ */
+int kpu_get_profile(handle_t context, kpu_layer_profile_t *profile, size_t count);
+
+/**
+ * @brief       Choose whether the fused pairs of a model run as one kernel or as two layers.
+ *
+ * The pairs are found when the model is loaded, a new model runs them fused. Running the same
+ * model both ways and comparing the pair_cycles of kpu_get_fusion_info gives the gain of the fusion.
+ *
+ * @param[in]   context         The kpu context handle
+ * @param[in]   enable          Run the fused pairs as one kernel on the following runs
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int kpu_set_fusion_enabled(handle_t context, bool enable);
+
+/**
+ * @brief       Get the layers fused when the model was loaded and the time of the last run.
+ *
+ * Dequantize + softmax, flatten + fully connected, remove padding + dequantize and
+ * quantize + upload are fused when the intermediate tensor is not used by any other layer.
+ *
+ * @param[in]   context         The kpu context handle
+ * @param[out]  info            The fusion info
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int kpu_get_fusion_info(handle_t context, kpu_fusion_info_t *info);
+
 #ifdef __cplusplus
 }
 #endif
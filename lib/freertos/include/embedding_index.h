@@ -0,0 +1,119 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FREERTOS_EMBEDDING_INDEX_H
+#define _FREERTOS_EMBEDDING_INDEX_H
+
+#include "osdefs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Gallery of int8 quantized embeddings searched by dot product.
+ * Embeddings are expected to be L2 normalized, so the score is their cosine similarity.
+ */
+
+typedef struct _embedding_index embedding_index_t;
+
+typedef struct _embedding_match
+{
+    uint32_t id;
+    uint32_t label;
+    float score;
+} embedding_match_t;
+
+/**
+ * @brief       Create an empty embedding index
+ *
+ * @param[in]   dimension       The length of each embedding
+ *
+ * @return      result
+ *     - NULL   Fail
+ *     - other  The embedding index
+ */
+embedding_index_t *embedding_index_create(uint32_t dimension);
+
+/**
+ * @brief       Destroy an embedding index
+ *
+ * @param[in]   index       The embedding index
+ */
+void embedding_index_destroy(embedding_index_t *index);
+
+/**
+ * @brief       Add an embedding to an index
+ *
+ * @param[in]   index           The embedding index
+ * @param[in]   embedding       The embedding
+ * @param[in]   label           The label returned by searches
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The id of the entry
+ */
+int embedding_index_add(embedding_index_t *index, const float *embedding, uint32_t label);
+
+/**
+ * @brief       Get the count of entries of an index
+ *
+ * @param[in]   index       The embedding index
+ *
+ * @return      The count of entries
+ */
+size_t embedding_index_get_count(const embedding_index_t *index);
+
+/**
+ * @brief       Find the entries closest to an embedding
+ *
+ * @param[in]   index       The embedding index
+ * @param[in]   query       The embedding to search
+ * @param[out]  matches     The best matches, by descending score
+ * @param[in]   k           The length of the matches array
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The count of matches
+ */
+int embedding_index_search(const embedding_index_t *index, const float *query, embedding_match_t *matches, size_t k);
+
+/**
+ * @brief       Save an index to a file
+ *
+ * @param[in]   index       The embedding index
+ * @param[in]   file        The file handle
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int embedding_index_save(const embedding_index_t *index, handle_t file);
+
+/**
+ * @brief       Load an index saved by embedding_index_save
+ *
+ * @param[in]   file        The file handle
+ *
+ * @return      result
+ *     - NULL   Fail
+ *     - other  The embedding index
+ */
+embedding_index_t *embedding_index_load(handle_t file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FREERTOS_EMBEDDING_INDEX_H */
@@ -26,8 +26,12 @@ extern "C"
 /**
  * @brief       Mount a filesystem
  *
- * @param[in]   name                The filesystem path
- * @param[in]   storage_handle      The storage device handle
+ * The storage handle is not consumed: the volume opens its own access to the device and
+ * keeps it while mounted. The caller still owns the handle, can go on using it, e.g. to
+ * flush or query a block cache, and closes it with io_close when done with it.
+ *
+ * @param[in]   name                The mount path "/fs/<name>", the files of the volume are under it
+ * @param[in]   storage_handle      The storage device handle, it stays open and owned by the caller
  *
  * @return      result
  *     - 0      Success
@@ -35,6 +39,78 @@ extern "C"
  */
 int filesystem_mount(const char *name, handle_t storage_handle);
 
+/**
+ * @brief       Create a FAT volume on a storage device and mount it
+ *
+ * The storage handle is not consumed, as for filesystem_mount.
+ *
+ * @param[in]   name                The mount path "/fs/<name>", the files of the volume are under it
+ * @param[in]   storage_handle      The storage device handle, it stays open and owned by the caller
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int filesystem_format(const char *name, handle_t storage_handle);
+
+/**
+ * @brief       Create a FAT volume of a given type and cluster size on a storage device and mount it
+ *
+ * The storage handle is not consumed, as for filesystem_mount. The format fails if the volume
+ * has too few or too many clusters of that size for the type.
+ *
+ * @param[in]   name                The mount path "/fs/<name>", the files of the volume are under it
+ * @param[in]   storage_handle      The storage device handle
+ * @param[in]   options             The type and the cluster size of the volume
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int filesystem_format_with_options(const char *name, handle_t storage_handle, const filesystem_format_options_t *options);
+
+/**
+ * @brief       Get the type, the cluster size and the space of a mounted volume
+ *
+ * The first call after the mount of a FAT12 or FAT16 volume counts the free clusters.
+ *
+ * @param[in]   name            The mount path "/fs/<name>"
+ * @param[out]  info            The volume information
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int filesystem_get_volume_info(const char *name, filesystem_volume_info_t *info);
+
+/**
+ * @brief       Erase the free space of a volume on its storage device
+ *
+ * Clusters freed by removing or truncating files are queued and erased by the next
+ * filesystem_file_flush, or by a sync of the volume once 16 ranges wait; formatting erases
+ * nothing. This erases all the free space, e.g. after a format or a card written elsewhere,
+ * and is meant to be scheduled at idle times. The volume is locked one FAT sector at a time,
+ * file I/O goes on between sectors.
+ *
+ * @param[in]   name            The mount path "/fs/<name>"
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int filesystem_discard_free_space(const char *name);
+
+/**
+ * @brief       Delete a file or an empty directory
+ *
+ * @param[in]   path            The path
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int filesystem_remove(const char *path);
+
 /**
  * @brief       Open a file
  *
@@ -48,6 +124,41 @@ int filesystem_mount(const char *name, handle_t storage_handle);
  */
 handle_t filesystem_file_open(const char *filename, file_access_t file_access, file_mode_t file_mode);
 
+/**
+ * @brief       Open an existing file read only, its handle can be used by several tasks at once
+ *
+ * @param[in]   filename        The file path
+ *
+ * @return      result
+ *     - 0      Fail
+ *     - other  The file handle
+ *
+ * Positional reads run concurrently, each with a file position of its own.
+ * Reads without a position share the position of the handle.
+ */
+handle_t filesystem_file_open_shared(const char *filename);
+
+/**
+ * @brief       Create a log file, preallocated as one contiguous extent and written straight to the storage
+ *
+ * @param[in]   filename            The file path
+ * @param[in]   capacity            The maximum size of the log
+ * @param[in]   commit_interval     Bytes written between two updates of the file size, 0 to only update it on flush and close
+ *
+ * @return      result
+ *     - 0      Fail
+ *     - other  The file handle, it is write only and cannot seek
+ *
+ * Data written since the last update of the size is lost if power fails, flush writes it and updates the size.
+ * Closing the file releases the unused end of the extent.
+ *
+ * If power fails while the log is open, the file keeps the last committed size, 0 before the first update,
+ * and its data up to that size. The directory entry still owns the whole extent, so its unused end stays
+ * allocated: removing the file, or opening it again as a log, which recreates it, frees the extent.
+ * Disk checkers report the file as shorter than its cluster chain and trim the chain to the size.
+ */
+handle_t filesystem_log_open(const char *filename, uint64_t capacity, uint32_t commit_interval);
+
 /**
  * @brief       Close a file handle
  *
@@ -83,6 +194,34 @@ int filesystem_file_read(handle_t file, uint8_t *buffer, size_t buffer_len);
  */
 int filesystem_file_write(handle_t file, const uint8_t *buffer, size_t buffer_len);
 
+/**
+ * @brief       Read from a file at a position, without moving the position of the file
+ *
+ * @param[in]   file            The file handle
+ * @param[out]  buffer          The destination buffer
+ * @param[in]   buffer_len      The length of the buffer
+ * @param[in]   offset          The position to read from
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The length read
+ */
+int filesystem_file_pread(handle_t file, uint8_t *buffer, size_t buffer_len, fpos_t offset);
+
+/**
+ * @brief       Write to a file at a position, without moving the position of the file
+ *
+ * @param[in]   file            The file handle
+ * @param[in]   buffer          The source buffer
+ * @param[in]   buffer_len      The length of the buffer
+ * @param[in]   offset          The position to write to
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The length written
+ */
+int filesystem_file_pwrite(handle_t file, const uint8_t *buffer, size_t buffer_len, fpos_t offset);
+
 /**
  * @brief       Get the position of a file
  *
@@ -116,6 +255,8 @@ uint64_t filesystem_file_get_size(handle_t file);
 /**
  * @brief       Flush the buffer of a file
  *
+ * The clusters freed on the volume since the last flush are erased too.
+ *
  * @param[in]   file            The file handle
  *
  * @return      result
@@ -124,6 +265,33 @@ uint64_t filesystem_file_get_size(handle_t file);
  */
 int filesystem_file_flush(handle_t file);
 
+/**
+ * @brief       Set the size of the user space buffer of a file
+ *
+ * @param[in]   file            The file handle
+ * @param[in]   buffer_size     The buffer size, a multiple of the sector size, 0 to remove the buffer
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ *
+ * Small reads and writes are then gathered in the buffer, writes reach the file when the buffer is full, on flush, seek and close.
+ */
+int filesystem_file_set_buffer(handle_t file, size_t buffer_size);
+
+/**
+ * @brief       Map the clusters of a file so seeks no longer walk the FAT chain
+ *
+ * @param[in]   file            The file handle
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ *
+ * The map covers the current size of the file, writing or seeking past it turns fast seek off.
+ */
+int filesystem_file_enable_fast_seek(handle_t file);
+
 /**
  * @brief       Find files in a directory
  *
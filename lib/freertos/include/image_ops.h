@@ -0,0 +1,153 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FREERTOS_IMAGE_OPS_H
+#define _FREERTOS_IMAGE_OPS_H
+
+#include "osdefs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Image operations between the DVP output and the KPU input.
+ * Planar images (VIDEO_FMT_RGB24_PLANAR) store each channel as a width * height plane,
+ * RGB565 images (VIDEO_FMT_RGB565) store one uint16_t per pixel.
+ * Large images are split by rows between the calling core and a worker on the other core.
+ */
+
+typedef enum _image_interp
+{
+    IMAGE_INTERP_NEAREST,
+    IMAGE_INTERP_BILINEAR
+} image_interp_t;
+
+/**
+ * @brief       Convert an RGB565 image to planar RGB888
+ *
+ * @param[in]   src         The RGB565 image
+ * @param[out]  dest        The R, G and B planes, one after another
+ * @param[in]   width       The image width
+ * @param[in]   height      The image height
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_rgb565_to_planar(const uint16_t *src, uint8_t *dest, uint32_t width, uint32_t height);
+
+/**
+ * @brief       Crop an image
+ *
+ * @param[in]   format          The image format
+ * @param[in]   src             The source image
+ * @param[in]   src_width       The source width
+ * @param[in]   src_height      The source height
+ * @param[out]  dest            The destination image
+ * @param[in]   x               The left of the crop
+ * @param[in]   y               The top of the crop
+ * @param[in]   width           The crop width
+ * @param[in]   height          The crop height
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_crop(video_format_t format, const void *src, uint32_t src_width, uint32_t src_height, void *dest,
+    uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+/**
+ * @brief       Resize a planar image
+ *
+ * @param[in]   src             The source planes
+ * @param[in]   channels        The count of planes
+ * @param[in]   src_width       The source width
+ * @param[in]   src_height      The source height
+ * @param[out]  dest            The destination planes
+ * @param[in]   width           The destination width
+ * @param[in]   height          The destination height
+ * @param[in]   interp          The interpolation
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_resize(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, image_interp_t interp);
+
+/**
+ * @brief       Resize a planar image keeping its aspect ratio and pad the rest
+ *
+ * @param[in]   src             The source planes
+ * @param[in]   channels        The count of planes
+ * @param[in]   src_width       The source width
+ * @param[in]   src_height      The source height
+ * @param[out]  dest            The destination planes
+ * @param[in]   width           The destination width
+ * @param[in]   height          The destination height
+ * @param[in]   interp          The interpolation
+ * @param[in]   pad_value       The value of the padding
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_letterbox(const uint8_t *src, uint32_t channels, uint32_t src_width, uint32_t src_height, uint8_t *dest,
+    uint32_t width, uint32_t height, image_interp_t interp, uint8_t pad_value);
+
+/**
+ * @brief       Normalize a planar image into quantized uint8
+ *
+ * Computes (x - mean) * scale per channel then quantizes it as (value - out_bias) / out_scale,
+ * the inverse of the kmodel input dequantization.
+ *
+ * @param[in]   src             The source planes
+ * @param[out]  dest            The destination planes, can be the same as src
+ * @param[in]   channels        The count of planes
+ * @param[in]   plane_size      The size of each plane
+ * @param[in]   mean            The mean of each channel
+ * @param[in]   scale           The scale of each channel
+ * @param[in]   out_scale       The quantization scale
+ * @param[in]   out_bias        The quantization bias
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_normalize_u8(const uint8_t *src, uint8_t *dest, uint32_t channels, size_t plane_size,
+    const float *mean, const float *scale, float out_scale, float out_bias);
+
+/**
+ * @brief       Normalize a planar image into float
+ *
+ * @param[in]   src             The source planes
+ * @param[out]  dest            The destination planes
+ * @param[in]   channels        The count of planes
+ * @param[in]   plane_size      The size of each plane
+ * @param[in]   mean            The mean of each channel
+ * @param[in]   scale           The scale of each channel
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int image_normalize_float(const uint8_t *src, float *dest, uint32_t channels, size_t plane_size,
+    const float *mean, const float *scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FREERTOS_IMAGE_OPS_H */
@@ -18,6 +18,7 @@
 #include "object.hpp"
 #include <gsl/span>
 #include <memory>
+#include <stdexcept>
 
 #define MAKE_ENUM_CLASS_BITMASK_TYPE(enumName)                                                           \
     static_assert(std::is_enum<enumName>::value, "enumName is not a enum.");                             \
@@ -267,9 +268,13 @@ public:
     virtual void set_signal(dvp_signal_type_t type, bool value) = 0;
     virtual void set_output_enable(uint32_t index, bool enable) = 0;
     virtual void set_output_attributes(uint32_t index, video_format_t format, void *output_buffer) = 0;
+    virtual void set_output_planes(void *r_plane, void *g_plane, void *b_plane) = 0;
     virtual void set_frame_event_enable(dvp_frame_event_t event, bool enable) = 0;
     virtual void set_on_frame_event(dvp_on_frame_event_t callback, void *userdata) = 0;
     virtual double xclk_set_clock_rate(double clock_rate) = 0;
+    virtual bool set_frame_queue(uint32_t buffers_count, dvp_frame_drop_policy_t policy) = 0;
+    virtual bool acquire_frame(dvp_frame_t &frame, TickType_t timeout) = 0;
+    virtual void release_frame(uint32_t index) = 0;
 };
 
 class sccb_device_driver : public driver
@@ -277,6 +282,7 @@ class sccb_device_driver : public driver
 public:
     virtual uint8_t read_byte(uint16_t reg_address) = 0;
     virtual void write_byte(uint16_t reg_address, uint8_t value) = 0;
+    virtual uint64_t write_table(gsl::span<const sccb_reg_entry_t> entries) = 0;
 };
 
 class sccb_driver : public driver
@@ -358,8 +364,15 @@ class kpu_driver : public driver
 {
 public:
     virtual handle_t model_load_from_buffer(uint8_t *buffer) = 0;
+    virtual handle_t model_load_from_file(handle_t file) = 0;
     virtual int run(handle_t context, const uint8_t *src) = 0;
     virtual int get_output(handle_t context, uint32_t index, uint8_t **data, size_t *size) = 0;
+    virtual int get_input_planes(handle_t context, uint8_t **planes, size_t count) = 0;
+    virtual int run_from_dvp_frame(handle_t context) = 0;
+    virtual int set_profile_enabled(handle_t context, bool enable) = 0;
+    virtual int get_profile(handle_t context, kpu_layer_profile_t *profile, size_t count) = 0;
+    virtual int set_fusion_enabled(handle_t context, bool enable) = 0;
+    virtual int get_fusion_info(handle_t context, kpu_fusion_info_t *info) = 0;
 };
 
 class custom_driver : public driver
@@ -401,6 +414,16 @@ public:
     virtual uint32_t get_blocks_count() = 0;
     virtual void read_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<uint8_t> buffer) = 0;
     virtual void write_blocks(uint32_t start_block, uint32_t blocks_count, gsl::span<const uint8_t> buffer) = 0;
+
+    /* The erase is a hint that the blocks are no longer used, devices without it ignore it */
+    virtual void erase_blocks(uint32_t start_block, uint32_t blocks_count)
+    {
+    }
+
+    /* Devices that finish their writes before returning have nothing to flush */
+    virtual void flush()
+    {
+    }
 };
 
 class filesystem_file : public virtual object_access
@@ -412,6 +435,23 @@ public:
     virtual void set_position(fpos_t position) = 0;
     virtual uint64_t get_size() = 0;
     virtual void flush() = 0;
+
+    /* Positional I/O, for files that can serve it without moving their position */
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer)
+    {
+        throw std::runtime_error("Positional read is not supported.");
+    }
+
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer)
+    {
+        throw std::runtime_error("Positional write is not supported.");
+    }
+
+    /* Only files with a cluster chain to map implement it */
+    virtual void enable_fast_seek()
+    {
+        throw std::runtime_error("Fast seek is not supported.");
+    }
 };
 
 class network_adapter_handler
@@ -0,0 +1,117 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FREERTOS_MFCC_H
+#define _FREERTOS_MFCC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Streaming MFCC front end for keyword spotting.
+ * Frames are windowed, transformed by the FFT accelerator and reduced to cepstral
+ * coefficients in fixed point. The header has no OS dependency so the host reference
+ * in mfcc_kernels.hpp can share it.
+ */
+
+/* Coefficients are signed Q9.6 */
+#define MFCC_FRACTION_BITS 6
+
+typedef struct _mfcc_config
+{
+    uint32_t sample_rate;
+    /* Samples per frame, at most fft_points */
+    uint32_t frame_length;
+    /* Samples between the starts of two frames, at most frame_length */
+    uint32_t frame_shift;
+    /* 64, 128, 256 or 512 */
+    uint32_t fft_points;
+    uint32_t mel_bands;
+    /* Cepstral coefficients per frame, at most mel_bands */
+    uint32_t coefficients;
+    uint32_t low_frequency;
+    /* 0 for half the sample rate */
+    uint32_t high_frequency;
+    /* Distance between two samples of the input, 2 to take one channel of interleaved stereo */
+    uint32_t sample_stride;
+} mfcc_config_t;
+
+typedef struct _mfcc mfcc_t;
+
+/**
+ * @brief       Create a MFCC front end
+ *
+ * @param[in]   config      The configuration
+ *
+ * @return      result
+ *     - NULL   Fail
+ *     - other  The MFCC front end
+ */
+mfcc_t *mfcc_create(const mfcc_config_t *config);
+
+/**
+ * @brief       Destroy a MFCC front end
+ *
+ * @param[in]   mfcc        The MFCC front end
+ */
+void mfcc_destroy(mfcc_t *mfcc);
+
+/**
+ * @brief       Drop the samples of the pending frame
+ *
+ * @param[in]   mfcc        The MFCC front end
+ */
+void mfcc_reset(mfcc_t *mfcc);
+
+/**
+ * @brief       Feed samples and compute the frames they complete
+ *
+ * Samples are consumed until the input ends or max_frames frames are written,
+ * the samples of a partial frame are kept for the next call.
+ *
+ * @param[in]   mfcc            The MFCC front end
+ * @param[in]   samples         The 16 bits PCM samples
+ * @param[in]   count           The count of samples
+ * @param[out]  features        The frames, coefficients values each
+ * @param[in]   max_frames      The count of frames features can hold
+ * @param[out]  consumed        The count of samples consumed, may be NULL
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The count of frames written
+ */
+int mfcc_process(mfcc_t *mfcc, const int16_t *samples, size_t count, int16_t *features, size_t max_frames, size_t *consumed);
+
+/**
+ * @brief       Quantize coefficients to KPU input values
+ *
+ * [min, max] is mapped linearly to [0, 255], values outside are clamped.
+ *
+ * @param[in]   features    The coefficients
+ * @param[in]   count       The count of coefficients
+ * @param[in]   min         The coefficient mapped to 0
+ * @param[in]   max         The coefficient mapped to 255
+ * @param[out]  dest        The quantized values
+ */
+void mfcc_quantize_u8(const int16_t *features, size_t count, int16_t min, int16_t max, uint8_t *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FREERTOS_MFCC_H */
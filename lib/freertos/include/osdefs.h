@@ -168,6 +168,55 @@ typedef enum _dvp_signal_type
 
 typedef void(*dvp_on_frame_event_t)(dvp_frame_event_t event, void *userdata);
 
+typedef enum _dvp_frame_drop_policy
+{
+    /* Reuse the oldest ready frame when no buffer is free. */
+    DVP_DROP_OLDEST,
+    /* Discard the frame just captured when no buffer is free. */
+    DVP_DROP_NEWEST
+} dvp_frame_drop_policy_t;
+
+typedef struct _dvp_frame
+{
+    /* The buffer index, used to release the frame. */
+    uint32_t index;
+    /* The frame sequence number, gaps indicate dropped frames. */
+    uint32_t sequence;
+    /* The capture start time in microseconds. */
+    uint64_t timestamp;
+    /* The buffer of each output, NULL if the output is disabled. */
+    void *output_buffers[2];
+} dvp_frame_t;
+
+typedef enum _sccb_reg_op
+{
+    /* Write value to the register. */
+    SCCB_REG_WRITE,
+    /* Replace the bits of the register selected by mask with value. */
+    SCCB_REG_UPDATE,
+    /* Wait delay_ms milliseconds. */
+    SCCB_REG_DELAY
+} sccb_reg_op_t;
+
+typedef struct _sccb_reg_entry
+{
+    sccb_reg_op_t op;
+    union
+    {
+        /* The register of SCCB_REG_WRITE and SCCB_REG_UPDATE. */
+        uint16_t reg_address;
+        /* The wait of SCCB_REG_DELAY. */
+        uint16_t delay_ms;
+    };
+    uint8_t value;
+    uint8_t mask;
+} sccb_reg_entry_t;
+
+/* Table entries, e.g. { SCCB_WRITE(0x12, 0x80), SCCB_DELAY(10), SCCB_UPDATE(0x0c, 0x40, 0x40) } */
+#define SCCB_WRITE(reg, value) { SCCB_REG_WRITE, { (reg) }, (value), 0 }
+#define SCCB_UPDATE(reg, value, mask) { SCCB_REG_UPDATE, { (reg) }, (value), (mask) }
+#define SCCB_DELAY(ms) { SCCB_REG_DELAY, { (ms) }, 0, 0 }
+
 typedef struct tag_fft_data
 {
     int16_t I1;
@@ -238,6 +287,34 @@ typedef void(*pic_irq_handler_t)(void *userdata);
 
 typedef void(*dma_stage_completion_handler_t)(void *userdata);
 
+typedef struct _kpu_layer_profile
+{
+    /* The kmodel layer type. */
+    uint32_t type;
+    /* CPU cycles spent waiting for the KPU or its DMA. */
+    uint64_t kpu_cycles;
+    /* CPU cycles spent executing the layer on the CPU. */
+    uint64_t cpu_cycles;
+    /* Bytes moved by DMA. */
+    uint32_t dma_bytes;
+    /* Bytes copied by the CPU between main memory and KPU memory. */
+    uint32_t memcpy_bytes;
+} kpu_layer_profile_t;
+
+typedef struct _kpu_fusion_info
+{
+    /* Pairs of layers executed as one fused kernel. */
+    uint32_t fused_pairs;
+    /* Bytes of intermediate tensors no longer written and read back on each run. */
+    uint32_t saved_bytes;
+    /* CPU cycles taken by the last run. */
+    uint64_t last_run_cycles;
+    /* CPU cycles the layers of the fused pairs took in the last run, fused or not. */
+    uint64_t pair_cycles;
+    /* Whether the pairs run fused. */
+    bool enabled;
+} kpu_fusion_info_t;
+
 typedef enum _file_access
 {
     FILE_ACCESS_READ = 1,
@@ -265,6 +342,30 @@ typedef struct _find_file_data
     char filename[MAX_PATH];
 } find_find_data_t;
 
+typedef enum _filesystem_type
+{
+    /* Formats by the size of the volume */
+    FILESYSTEM_ANY,
+    FILESYSTEM_FAT12,
+    FILESYSTEM_FAT16,
+    FILESYSTEM_FAT32
+} filesystem_type_t;
+
+typedef struct _filesystem_format_options
+{
+    filesystem_type_t type;
+    /* Bytes per cluster, a power of 2 from 512 to 65536, 0 picks it by the size of the volume */
+    uint32_t cluster_size;
+} filesystem_format_options_t;
+
+typedef struct _filesystem_volume_info
+{
+    filesystem_type_t type;
+    uint32_t cluster_size;
+    uint64_t total_bytes;
+    uint64_t free_bytes;
+} filesystem_volume_info_t;
+
 typedef enum _address_family
 {
     AF_UNSPECIFIED,
@@ -0,0 +1,132 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FREERTOS_REGION_LAYER_H
+#define _FREERTOS_REGION_LAYER_H
+
+#include "osdefs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* YOLOv2 region layer decoding and non-max suppression on kpu_get_output tensors.
+ * The tensor is laid out as [anchor_count * (5 + classes), height, width], each anchor
+ * holding x, y, w, h, objectness and then the class scores.
+ */
+
+#define REGION_LAYER_LUT_SIZE 256
+
+typedef struct _region_layer_config
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t classes;
+    uint32_t anchor_count;
+    /* Width and height of each anchor in grid cells */
+    const float *anchors;
+    /* Minimum objectness * class probability of a box */
+    float threshold;
+    /* Maximum IoU between two boxes of the same class */
+    float nms_threshold;
+    /* Dequantization of a uint8 tensor: value = q * scale + bias, scale is 0 for a float tensor */
+    float quant_scale;
+    float quant_bias;
+} region_layer_config_t;
+
+typedef struct _region_layer
+{
+    region_layer_config_t config;
+    /* Indexed by q for a uint8 tensor, sampled over [-8, 8] for a float tensor */
+    float sigmoid_lut[REGION_LAYER_LUT_SIZE];
+    /* exp(-d) indexed by the distance d to the largest class score, in q or sampled over [0, 16] */
+    float exp_lut[REGION_LAYER_LUT_SIZE];
+    /* Objectness below this cannot reach the threshold */
+    uint32_t objectness_threshold_q;
+    float objectness_threshold;
+} region_layer_t;
+
+typedef struct _region_box
+{
+    /* Corners, relative to the image size */
+    float x1;
+    float y1;
+    float x2;
+    float y2;
+    float score;
+    uint32_t class_id;
+} region_box_t;
+
+/**
+ * @brief       Initialize a region layer
+ *
+ * @param[out]  layer       The region layer
+ * @param[in]   config      The configuration, the anchors must stay valid while the layer is used
+ *
+ * @return      result
+ *     - 0      Success
+ *     - other  Fail
+ */
+int region_layer_init(region_layer_t *layer, const region_layer_config_t *config);
+
+/**
+ * @brief       Decode boxes from a uint8 tensor and suppress the overlapping ones
+ *
+ * @param[in]   layer       The region layer
+ * @param[in]   input       The tensor
+ * @param[out]  boxes       The boxes sorted by score
+ * @param[in]   max_boxes   The length of the boxes array, when more boxes pass the threshold
+ *                          the best max_boxes by score go to the suppression, ties in scan order
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The count of boxes
+ */
+int region_layer_run_u8(const region_layer_t *layer, const uint8_t *input, region_box_t *boxes, size_t max_boxes);
+
+/**
+ * @brief       Decode boxes from a float tensor and suppress the overlapping ones
+ *
+ * @param[in]   layer       The region layer
+ * @param[in]   input       The tensor
+ * @param[out]  boxes       The boxes sorted by score
+ * @param[in]   max_boxes   The length of the boxes array, when more boxes pass the threshold
+ *                          the best max_boxes by score go to the suppression, ties in scan order
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The count of boxes
+ */
+int region_layer_run_float(const region_layer_t *layer, const float *input, region_box_t *boxes, size_t max_boxes);
+
+/**
+ * @brief       Sort boxes by score and remove the ones overlapping a better box of the same class,
+ *              boxes of equal score keep their order
+ *
+ * @param[inout]    boxes           The boxes, the kept ones are moved to the front
+ * @param[in]       count           The count of boxes
+ * @param[in]       nms_threshold   Maximum IoU between two kept boxes
+ *
+ * @return      result
+ *     - -1     Fail
+ *     - other  The count of kept boxes
+ */
+int region_layer_nms(region_box_t *boxes, size_t count, float nms_threshold);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FREERTOS_REGION_LAYER_H */
@@ -550,6 +550,12 @@ void dvp_set_output_attributes(handle_t file, uint32_t index, video_format_t for
     dvp->set_output_attributes(index, format, output_buffer);
 }
 
+void dvp_set_output_planes(handle_t file, void *r_plane, void *g_plane, void *b_plane)
+{
+    COMMON_ENTRY(dvp);
+    dvp->set_output_planes(r_plane, g_plane, b_plane);
+}
+
 void dvp_set_frame_event_enable(handle_t file, dvp_frame_event_t event, bool enable)
 {
     COMMON_ENTRY(dvp);
@@ -568,6 +574,25 @@ double dvp_xclk_set_clock_rate(handle_t file, double clock_rate)
     return dvp->xclk_set_clock_rate(clock_rate);
 }
 
+int dvp_set_frame_queue(handle_t file, uint32_t buffers_count, dvp_frame_drop_policy_t policy)
+{
+    COMMON_ENTRY(dvp);
+    return dvp->set_frame_queue(buffers_count, policy) ? 0 : -1;
+}
+
+int dvp_acquire_frame(handle_t file, dvp_frame_t *frame, size_t millisecond)
+{
+    COMMON_ENTRY(dvp);
+    TickType_t timeout = millisecond == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(millisecond);
+    return dvp->acquire_frame(*frame, timeout) ? 0 : -1;
+}
+
+void dvp_release_frame(handle_t file, const dvp_frame_t *frame)
+{
+    COMMON_ENTRY(dvp);
+    dvp->release_frame(frame->index);
+}
+
 /* SSCB */
 
 handle_t sccb_get_device(handle_t file, uint32_t slave_address, uint32_t reg_address_width)
@@ -589,6 +614,12 @@ void sccb_dev_write_byte(handle_t file, uint16_t reg_address, uint8_t value)
     sccb_device->write_byte(reg_address, value);
 }
 
+uint64_t sccb_dev_write_table(handle_t file, const sccb_reg_entry_t *entries, size_t count)
+{
+    COMMON_ENTRY(sccb_device);
+    return sccb_device->write_table({ entries, std::ptrdiff_t(count) });
+}
+
 /* FFT */
 
 void fft_complex_uint16(uint16_t shift, fft_direction_t direction, const uint64_t *input, size_t point_num, uint64_t *output)
@@ -813,6 +844,12 @@ handle_t kpu_model_load_from_buffer(uint8_t *buffer)
     return kpu->model_load_from_buffer(buffer);
 }
 
+handle_t kpu_model_load_from_file(handle_t file)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->model_load_from_file(file);
+}
+
 int kpu_run(handle_t context, const uint8_t *src)
 {
     COMMON_ENTRY_FILE(kpu_file_, kpu);
@@ -825,6 +862,42 @@ int kpu_get_output(handle_t context, uint32_t index, uint8_t **data, size_t *siz
     return kpu->get_output(context, index, data, size);
 }
 
+int kpu_get_input_planes(handle_t context, uint8_t **planes, size_t count)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->get_input_planes(context, planes, count);
+}
+
+int kpu_run_from_dvp_frame(handle_t context)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->run_from_dvp_frame(context);
+}
+
+int kpu_set_profile_enabled(handle_t context, bool enable)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->set_profile_enabled(context, enable);
+}
+
+int kpu_get_profile(handle_t context, kpu_layer_profile_t *profile, size_t count)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->get_profile(context, profile, count);
+}
+
+int kpu_set_fusion_enabled(handle_t context, bool enable)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->set_fusion_enabled(context, enable);
+}
+
+int kpu_get_fusion_info(handle_t context, kpu_fusion_info_t *info)
+{
+    COMMON_ENTRY_FILE(kpu_file_, kpu);
+    return kpu->get_fusion_info(context, info);
+}
+
 /* HAL */
 
 static uintptr_t pic_file_;
@@ -16,14 +16,29 @@
 #include "FreeRTOS.h"
 #include "devices.h"
 #include "kernel/driver_impl.hpp"
+#include <algorithm>
 #include <array>
 #include <cstring>
 #include <diskio.h>
 #include <ff.h>
+#include <memory>
+#include <sys/lock.h>
+#include <string>
+#include <vector>
 
 using namespace sys;
 
-#define MAX_FILE_SYSTEMS 16
+/* Enough for a file of 15 fragments */
+#define FAST_SEEK_INITIAL_LINK_MAP 32
+#define LOG_BUFFER_SIZE (32 * 1024)
+/* FILs of a shared file, the count of positional reads running at once */
+#define SHARED_FILE_MAX_READERS 4
+/* File status flag of ff.c, the directory entry of a file is only written back when it is set */
+#define FA_MODIFIED 0x40
+/* Sectors of the first FAT kept by each volume, so chain walks do not go to the device again */
+#define FAT_CACHE_SECTORS 16
+/* Ranges of freed sectors a volume collects before a sync erases them */
+#define ERASE_QUEUE_RANGES 16
 
 static void check_fatfs_error(FRESULT result)
 {
@@ -54,133 +69,1191 @@ static void check_fatfs_error(FRESULT result)
         throw std::runtime_error(err_str[result]);
 }
 
-static const char *normalize_path(const char *name)
+/* Holds the sync object of a volume, as FatFS does around its own volume functions */
+class volume_lock
+{
+public:
+    volume_lock(FATFS *fs)
+        : fs_(fs)
+    {
+        if (!ff_req_grant(fs_->sobj))
+            check_fatfs_error(FR_TIMEOUT);
+    }
+
+    ~volume_lock()
+    {
+        ff_rel_grant(fs_->sobj);
+    }
+
+private:
+    FATFS *fs_;
+};
+
+/* A mounted volume. Its index is the FatFS logical drive, each volume has a sync object of its own
+ * so I/O to different volumes runs in parallel.
+ */
+class k_filesystem : public virtual object, public heap_object
+{
+public:
+    FATFS FatFS;
+
+    k_filesystem(std::string mount_name, object_accessor<block_storage_driver> storage)
+        : FatFS(), mount_name_(std::move(mount_name)), storage_(std::move(storage))
+    {
+    }
+
+    block_storage_driver &get_storage() noexcept
+    {
+        return *storage_.operator->();
+    }
+
+    void read_sectors(DWORD sector, UINT count, BYTE *buffer)
+    {
+        if (count == 1 && is_fat_sector(sector))
+        {
+            auto &line = get_fat_line(sector);
+            std::copy(line.data.begin(), line.data.end(), buffer);
+        }
+        else
+        {
+            auto &storage = get_storage();
+            storage.read_blocks(sector, count, { buffer, ptrdiff_t(storage.get_rw_block_size() * count) });
+        }
+    }
+
+    void write_sectors(DWORD sector, UINT count, const BYTE *buffer)
+    {
+        drop_queued_erases(sector, count);
+        auto &storage = get_storage();
+        storage.write_blocks(sector, count, { buffer, ptrdiff_t(storage.get_rw_block_size() * count) });
+
+        /* Write through, the cached sectors stay the same as the device */
+        for (auto &line : fat_cache_)
+        {
+            if (line.valid && line.sector >= sector && line.sector < sector + count)
+            {
+                auto src = buffer + (line.sector - sector) * FF_MAX_SS;
+                std::copy(src, src + FF_MAX_SS, line.data.begin());
+            }
+        }
+    }
+
+    void erase_sectors(DWORD sector, DWORD count)
+    {
+        for (auto &line : fat_cache_)
+        {
+            if (line.valid && line.sector - sector < count)
+                line.valid = false;
+        }
+
+        get_storage().erase_blocks(sector, count);
+    }
+
+    /* FatFS trims the clusters of a chain as it removes them, before the FAT is written. The
+     * ranges wait for a sync, when the FAT no longer points to them, and sectors written
+     * meanwhile leave them.
+     */
+    void queue_erase(DWORD sector, DWORD count)
+    {
+        /* f_mkfs trims the whole volume before it is mounted, formatting does not erase */
+        if (!FatFS.fs_type)
+            return;
+
+        if (!erase_queue_.empty() && erase_queue_.back().sector + erase_queue_.back().count == sector)
+            erase_queue_.back().count += count;
+        else
+            erase_queue_.push_back({ sector, count });
+    }
+
+    /* Erase the queued ranges once there are min_ranges of them */
+    void flush_erase_queue_locked(size_t min_ranges)
+    {
+        if (erase_queue_.empty() || erase_queue_.size() < min_ranges)
+            return;
+
+        /* The erase is a hint, ranges that fail are not tried again */
+        auto ranges = std::move(erase_queue_);
+        erase_queue_.clear();
+        for (auto &range : ranges)
+            erase_sectors(range.sector, range.count);
+    }
+
+    void flush_erase_queue()
+    {
+        volume_lock locker(&FatFS);
+        flush_erase_queue_locked(0);
+    }
+
+    /* Erase the free clusters one FAT sector at a time, each run of free clusters of the sector
+     * at once. The volume is locked while a sector is scanned and its runs erased, so none of its
+     * clusters is allocated meanwhile, and released between sectors so file I/O goes on.
+     */
+    void discard_free_space()
+    {
+        WORD id = 0;
+        for (DWORD begin = 0;;)
+        {
+            volume_lock locker(&FatFS);
+            if (!FatFS.fs_type || (begin && FatFS.id != id))
+                check_fatfs_error(FR_NOT_ENABLED);
+            id = FatFS.id;
+            if (begin >= FatFS.n_fatent)
+                break;
+            /* The queued ranges are free clusters, the scan erases them */
+            if (!begin)
+                erase_queue_.clear();
+
+            DWORD end = std::min(begin + fat_entries_per_sector(), FatFS.n_fatent);
+            discard_clusters(begin, end);
+            begin = end;
+        }
+    }
+
+    /* Find a free cluster after the cluster. FAT sectors without a free cluster are skipped with
+     * a bitmap, a bit is cleared once its sector is seen full and set again when a cluster of the
+     * sector is freed. So the FAT is only read where it may have free clusters.
+     */
+    DWORD find_free_cluster(DWORD cluster)
+    {
+        if (FatFS.fs_type != FS_FAT16 && FatFS.fs_type != FS_FAT32)
+            return 1;
+
+        DWORD sectors = (FatFS.n_fatent + fat_entries_per_sector() - 1) / fat_entries_per_sector();
+        /* Built again when the volume is mounted again */
+        if (free_map_.empty() || free_map_id_ != FatFS.id)
+        {
+            free_map_.assign((sectors + 31) / 32, 0xFFFFFFFF);
+            free_map_id_ = FatFS.id;
+        }
+
+        cluster = cluster + 1 < FatFS.n_fatent ? std::max<DWORD>(cluster + 1, 2) : 2;
+        DWORD first = cluster / fat_entries_per_sector();
+        DWORD found = search_free_map(first, sectors, cluster);
+        /* Wrap around, the first sector is searched again from its start */
+        if (!found)
+            found = search_free_map(0, first + 1, 2);
+        return found;
+    }
+
+    void free_cluster(DWORD cluster)
+    {
+        if (!free_map_.empty() && free_map_id_ == FatFS.id)
+        {
+            DWORD sector = cluster / fat_entries_per_sector();
+            free_map_[sector / 32] |= 1U << (sector % 32);
+        }
+    }
+
+    static size_t install_filesystem(std::string mount_name, object_accessor<block_storage_driver> storage)
+    {
+        auto obj = make_object<k_filesystem>(std::move(mount_name), std::move(storage));
+
+        table_lock locker;
+        if (find_volume(obj->mount_name_) != -1)
+            throw std::runtime_error("Filesystem already mounted.");
+
+        for (size_t i = 0; i < filesystems_.size(); i++)
+        {
+            if (!filesystems_[i])
+            {
+                filesystems_[i] = obj;
+                return i;
+            }
+        }
+
+        throw std::runtime_error("Max custom drivers exceeded.");
+    }
+
+    static void uninstall_filesystem(size_t index)
+    {
+        table_lock locker;
+        filesystems_.at(index) = nullptr;
+    }
+
+    /* Only the mount and unmount of a volume change its entry, FatFS does not use it meanwhile */
+    static object_ptr<k_filesystem> get_filesystem(size_t index)
+    {
+        return filesystems_.at(index);
+    }
+
+    static int find_filesystem(const std::string &mount_name)
+    {
+        table_lock locker;
+        return find_volume(mount_name);
+    }
+
+private:
+    class table_lock
+    {
+    public:
+        table_lock()
+        {
+            _lock_acquire(&lock_);
+        }
+
+        ~table_lock()
+        {
+            _lock_release(&lock_);
+        }
+    };
+
+    struct erase_range
+    {
+        DWORD sector;
+        DWORD count;
+    };
+
+    struct fat_cache_line
+    {
+        bool valid;
+        DWORD sector;
+        uint32_t last_used;
+        std::array<uint8_t, FF_MAX_SS> data;
+    };
+
+    bool is_fat_sector(DWORD sector) const noexcept
+    {
+        return FatFS.fs_type && sector >= FatFS.fatbase && sector < FatFS.fatbase + FatFS.fsize;
+    }
+
+    fat_cache_line &get_fat_line(DWORD sector)
+    {
+        auto victim = &fat_cache_[0];
+        for (auto &line : fat_cache_)
+        {
+            if (line.valid && line.sector == sector)
+            {
+                line.last_used = ++fat_cache_clock_;
+                return line;
+            }
+
+            if (!line.valid || (victim->valid && line.last_used < victim->last_used))
+                victim = &line;
+        }
+
+        victim->valid = false;
+        auto &storage = get_storage();
+        storage.read_blocks(sector, 1, { victim->data.data(), ptrdiff_t(victim->data.size()) });
+        victim->valid = true;
+        victim->sector = sector;
+        victim->last_used = ++fat_cache_clock_;
+        return *victim;
+    }
+
+    /* The window of FatFS holds the latest content of its sector, it may not be written yet */
+    const BYTE *get_fat_sector(DWORD sector)
+    {
+        if (FatFS.winsect == sector)
+            return FatFS.win;
+        return get_fat_line(sector).data.data();
+    }
+
+    BYTE get_fat_byte(DWORD offset)
+    {
+        return get_fat_sector(FatFS.fatbase + offset / FF_MAX_SS)[offset % FF_MAX_SS];
+    }
+
+    DWORD get_fat_entry(DWORD cluster)
+    {
+        switch (FatFS.fs_type)
+        {
+        case FS_FAT12:
+        {
+            /* 12 bits entries may straddle two sectors */
+            DWORD offset = cluster + cluster / 2;
+            DWORD value = get_fat_byte(offset) | get_fat_byte(offset + 1) << 8;
+            return cluster & 1 ? value >> 4 : value & 0xFFF;
+        }
+        case FS_FAT16:
+            return get_fat_byte(cluster * 2) | get_fat_byte(cluster * 2 + 1) << 8;
+        case FS_FAT32:
+        {
+            auto entry = get_fat_sector(FatFS.fatbase + cluster / (FF_MAX_SS / 4)) + cluster % (FF_MAX_SS / 4) * 4;
+            return entry[0] | entry[1] << 8 | entry[2] << 16 | (entry[3] & 0x0F) << 24;
+        }
+        default:
+            throw std::runtime_error("Unsupported filesystem.");
+        }
+    }
+
+    DWORD fat_entries_per_sector() const noexcept
+    {
+        return FF_MAX_SS / (FatFS.fs_type == FS_FAT32 ? 4 : 2);
+    }
+
+    /* The entry of a FAT16 or FAT32 cluster in its FAT sector */
+    DWORD get_sector_entry(const BYTE *data, DWORD cluster) const noexcept
+    {
+        DWORD entries = fat_entries_per_sector();
+        auto entry = data + cluster % entries * (FF_MAX_SS / entries);
+        return FatFS.fs_type == FS_FAT32
+            ? (entry[0] | entry[1] << 8 | entry[2] << 16 | (entry[3] & 0x0F) << 24)
+            : (entry[0] | entry[1] << 8);
+    }
+
+    /* Erase the runs of free clusters in [begin, end), the clusters of one FAT sector. FAT12
+     * entries may straddle two sectors and are read one by one. */
+    void discard_clusters(DWORD begin, DWORD end)
+    {
+        auto data = FatFS.fs_type == FS_FAT12 ? nullptr : get_fat_sector(FatFS.fatbase + begin / fat_entries_per_sector());
+        DWORD run_begin = 0;
+        for (DWORD cluster = std::max<DWORD>(begin, 2); cluster <= end; cluster++)
+        {
+            bool is_free = cluster < end && !(data ? get_sector_entry(data, cluster) : get_fat_entry(cluster));
+            if (is_free && !run_begin)
+            {
+                run_begin = cluster;
+            }
+            else if (!is_free && run_begin)
+            {
+                erase_sectors(FatFS.database + (run_begin - 2) * FatFS.csize, (cluster - run_begin) * FatFS.csize);
+                run_begin = 0;
+            }
+        }
+    }
+
+    void drop_queued_erases(DWORD sector, DWORD count)
+    {
+        if (erase_queue_.empty())
+            return;
+
+        /* Keep the parts of each range before and after the written sectors */
+        for (size_t i = 0; i < erase_queue_.size(); i++)
+        {
+            auto range = erase_queue_[i];
+            DWORD begin = std::max(range.sector, sector), end = std::min(range.sector + range.count, sector + count);
+            if (begin >= end)
+                continue;
+
+            erase_queue_[i].count = begin - range.sector;
+            if (end < range.sector + range.count)
+                erase_queue_.push_back({ end, range.sector + range.count - end });
+        }
+
+        erase_queue_.erase(std::remove_if(erase_queue_.begin(), erase_queue_.end(), [](const erase_range &range) { return !range.count; }), erase_queue_.end());
+    }
+
+    DWORD search_free_map(DWORD sector, DWORD end_sector, DWORD cluster)
+    {
+        DWORD entries = fat_entries_per_sector();
+        while ((sector = next_free_map_sector(sector, end_sector)) < end_sector)
+        {
+            DWORD sector_begin = std::max<DWORD>(sector * entries, 2);
+            DWORD begin = std::max(sector_begin, cluster);
+            DWORD end = std::min((sector + 1) * entries, FatFS.n_fatent);
+            auto data = get_fat_sector(FatFS.fatbase + sector);
+            for (DWORD i = begin; i < end; i++)
+            {
+                if (!get_sector_entry(data, i))
+                    return i;
+            }
+
+            if (begin == sector_begin)
+                free_map_[sector / 32] &= ~(1U << (sector % 32));
+            sector++;
+        }
+
+        return 0;
+    }
+
+    DWORD next_free_map_sector(DWORD sector, DWORD end_sector) const noexcept
+    {
+        while (sector < end_sector)
+        {
+            uint32_t bits = free_map_[sector / 32] >> (sector % 32);
+            if (bits)
+                return std::min<DWORD>(sector + __builtin_ctz(bits), end_sector);
+            sector = (sector / 32 + 1) * 32;
+        }
+
+        return end_sector;
+    }
+
+    static int find_volume(const std::string &mount_name)
+    {
+        for (size_t i = 0; i < filesystems_.size(); i++)
+        {
+            if (filesystems_[i] && filesystems_[i]->mount_name_ == mount_name)
+                return i;
+        }
+
+        return -1;
+    }
+
+    static std::array<object_ptr<k_filesystem>, FF_VOLUMES> filesystems_;
+    static _lock_t lock_;
+
+    std::string mount_name_;
+    object_accessor<block_storage_driver> storage_;
+    std::array<fat_cache_line, FAT_CACHE_SECTORS> fat_cache_ = {};
+    uint32_t fat_cache_clock_ = 0;
+    std::vector<uint32_t> free_map_;
+    WORD free_map_id_ = 0;
+    std::vector<erase_range> erase_queue_;
+};
+
+std::array<object_ptr<k_filesystem>, FF_VOLUMES> k_filesystem::filesystems_;
+_lock_t k_filesystem::lock_;
+
+/* Split "/fs/<mount name>/<path>" into the mount name and the path in the volume */
+static const char *split_path(const char *name, std::string &mount_name)
 {
     auto str = std::strstr(name, "/fs/");
     if (!str)
         throw std::runtime_error("Invalid path.");
-    return str + 4;
+    str += 4;
+    auto end = std::strchr(str, '/');
+    if (!end)
+        end = str + std::strlen(str);
+    if (end == str)
+        throw std::runtime_error("Invalid path.");
+    mount_name.assign(str, end);
+    return *end ? end + 1 : end;
+}
+
+/* Translate a path to the FatFS path "<logical drive>/<path>" */
+static std::string normalize_path(const char *name)
+{
+    std::string mount_name;
+    auto path = split_path(name, mount_name);
+    auto volume = k_filesystem::find_filesystem(mount_name);
+    if (volume == -1)
+        throw std::runtime_error("Filesystem not mounted.");
+    return std::to_string(volume) + '/' + path;
+}
+
+static std::string volume_path(size_t volume)
+{
+    return std::to_string(volume) + '/';
+}
+
+/* Build the cluster link map of a file, the first item is the table length and FatFS returns
+ * the required one if it is too small
+ */
+static FRESULT create_link_map(FIL &file, std::vector<DWORD> &link_map)
+{
+    link_map.assign(FAST_SEEK_INITIAL_LINK_MAP, 0);
+    FRESULT err;
+    do
+    {
+        link_map[0] = link_map.size();
+        file.cltbl = link_map.data();
+        err = f_lseek(&file, CREATE_LINKMAP);
+        if (err == FR_NOT_ENOUGH_CORE)
+            link_map.resize(link_map[0]);
+    } while (err == FR_NOT_ENOUGH_CORE);
+
+    if (err != FR_OK)
+        file.cltbl = nullptr;
+    return err;
 }
 
-class k_filesystem : public virtual object, public heap_object
-{
-public:
-    FATFS FatFS;
+static size_t read_file(FIL &file, gsl::span<uint8_t> buffer)
+{
+    UINT read = buffer.size();
+    check_fatfs_error(f_read(&file, buffer.data(), read, &read));
+    return read;
+}
+
+class k_filesystem_file : public filesystem_file, public heap_object, public exclusive_object_access
+{
+public:
+    k_filesystem_file(const char *fileName, file_access_t file_access, file_mode_t file_mode)
+    {
+        BYTE mode = 0;
+        if (file_access & FILE_ACCESS_READ)
+            mode |= FA_READ;
+        if (file_access & FILE_ACCESS_WRITE)
+            mode |= FA_WRITE;
+        if (file_mode & FILE_MODE_OPEN_EXISTING)
+            mode |= FA_OPEN_EXISTING;
+        else if (file_mode & FILE_MODE_OPEN_ALWAYS)
+            mode |= FA_OPEN_ALWAYS;
+        else if (file_mode & FILE_MODE_CREATE_NEW)
+            mode |= FA_CREATE_NEW;
+        else if (file_mode & FILE_MODE_CREATE_ALWAYS)
+            mode |= FA_CREATE_ALWAYS;
+        else if (file_mode & FILE_MODE_APPEND)
+            mode |= FA_OPEN_APPEND;
+
+        check_fatfs_error(f_open(&file_, normalize_path(fileName).c_str(), mode));
+
+        if (file_mode & FILE_MODE_TRUNCATE)
+        {
+            auto err = f_truncate(&file_);
+            if (err != FR_OK)
+                f_close(&file_);
+            check_fatfs_error(err);
+        }
+
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    ~k_filesystem_file()
+    {
+        f_close(&file_);
+        vSemaphoreDelete(mutex_);
+    }
+
+    virtual size_t read(gsl::span<uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        return read_file(file_, buffer);
+    }
+
+    virtual size_t write(gsl::span<const uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        return write_locked(buffer);
+    }
+
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        auto position = f_tell(&file_);
+        try
+        {
+            seek(offset);
+            auto read = read_file(file_, buffer);
+            check_fatfs_error(f_lseek(&file_, position));
+            return read;
+        }
+        catch (...)
+        {
+            f_lseek(&file_, position);
+            throw;
+        }
+    }
+
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        auto position = f_tell(&file_);
+        try
+        {
+            seek(offset);
+            auto written = write_locked(buffer);
+            check_fatfs_error(f_lseek(&file_, position));
+            return written;
+        }
+        catch (...)
+        {
+            f_lseek(&file_, position);
+            throw;
+        }
+    }
+
+    virtual fpos_t get_position() override
+    {
+        semaphore_lock locker(mutex_);
+        return f_tell(&file_);
+    }
+
+    virtual void set_position(fpos_t position) override
+    {
+        semaphore_lock locker(mutex_);
+        seek(position);
+    }
+
+    virtual uint64_t get_size() override
+    {
+        semaphore_lock locker(mutex_);
+        return f_size(&file_);
+    }
+
+    virtual void flush() override
+    {
+        semaphore_lock locker(mutex_);
+        check_fatfs_error(f_sync(&file_));
+        k_filesystem::get_filesystem(file_.obj.fs->pdrv)->flush_erase_queue();
+    }
+
+    virtual void enable_fast_seek() override
+    {
+        semaphore_lock locker(mutex_);
+        auto err = create_link_map(file_, link_map_);
+        if (err != FR_OK)
+            disable_fast_seek();
+        check_fatfs_error(err);
+    }
+
+private:
+    size_t write_locked(gsl::span<const uint8_t> buffer)
+    {
+        if (file_.cltbl && f_tell(&file_) + buffer.size() > f_size(&file_))
+            disable_fast_seek();
+
+        UINT written = buffer.size();
+        check_fatfs_error(f_write(&file_, buffer.data(), written, &written));
+        if (written != buffer.size())
+            throw std::runtime_error("Disk full.");
+        return written;
+    }
+
+    void seek(fpos_t position)
+    {
+        /* The link map only covers the current size, fast seek would stop at the end of file */
+        if (file_.cltbl && (FSIZE_t)position > f_size(&file_))
+            disable_fast_seek();
+        check_fatfs_error(f_lseek(&file_, position));
+    }
+
+    void disable_fast_seek() noexcept
+    {
+        file_.cltbl = nullptr;
+        link_map_ = {};
+    }
+
+private:
+    FIL file_;
+    std::vector<DWORD> link_map_;
+    SemaphoreHandle_t mutex_;
+};
+
+/* A read only file whose handle can be used by several tasks. Positional reads each take a
+ * FIL of their own from a pool, so they only wait for the volume and not for each other's
+ * position. The FILs share the link map once fast seek is enabled.
+ */
+class k_filesystem_shared_file : public filesystem_file, public heap_object, public free_object_access
+{
+public:
+    k_filesystem_shared_file(const char *fileName)
+        : path_(normalize_path(fileName))
+    {
+        check_fatfs_error(f_open(&file_, path_.c_str(), FA_READ | FA_OPEN_EXISTING));
+        mutex_ = xSemaphoreCreateMutex();
+        readers_available_ = xSemaphoreCreateCounting(SHARED_FILE_MAX_READERS, SHARED_FILE_MAX_READERS);
+    }
+
+    ~k_filesystem_shared_file()
+    {
+        for (auto &reader : readers_)
+            f_close(reader.get());
+        f_close(&file_);
+        vSemaphoreDelete(readers_available_);
+        vSemaphoreDelete(mutex_);
+    }
+
+    virtual size_t read(gsl::span<uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        return read_file(file_, buffer);
+    }
+
+    virtual size_t write(gsl::span<const uint8_t> buffer) override
+    {
+        throw std::runtime_error("Shared files are read only.");
+    }
+
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer) override
+    {
+        auto reader = acquire_reader();
+        try
+        {
+            check_fatfs_error(f_lseek(reader, offset));
+            auto read = read_file(*reader, buffer);
+            release_reader(reader);
+            return read;
+        }
+        catch (...)
+        {
+            release_reader(reader);
+            throw;
+        }
+    }
+
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer) override
+    {
+        throw std::runtime_error("Shared files are read only.");
+    }
+
+    virtual fpos_t get_position() override
+    {
+        semaphore_lock locker(mutex_);
+        return f_tell(&file_);
+    }
+
+    virtual void set_position(fpos_t position) override
+    {
+        semaphore_lock locker(mutex_);
+        check_fatfs_error(f_lseek(&file_, position));
+    }
+
+    virtual uint64_t get_size() override
+    {
+        return f_size(&file_);
+    }
+
+    virtual void flush() override
+    {
+    }
+
+    virtual void enable_fast_seek() override
+    {
+        semaphore_lock locker(mutex_);
+        /* Readers may be using the map, it is built once and never changes */
+        if (!link_map_.empty())
+            return;
+
+        std::vector<DWORD> link_map;
+        check_fatfs_error(create_link_map(file_, link_map));
+        link_map_ = std::move(link_map);
+        for (auto reader : idle_readers_)
+            reader->cltbl = link_map_.data();
+    }
+
+private:
+    FIL *acquire_reader()
+    {
+        xSemaphoreTake(readers_available_, portMAX_DELAY);
+        try
+        {
+            semaphore_lock locker(mutex_);
+            if (!idle_readers_.empty())
+            {
+                auto reader = idle_readers_.back();
+                idle_readers_.pop_back();
+                return reader;
+            }
+
+            auto reader = std::make_unique<FIL>();
+            check_fatfs_error(f_open(reader.get(), path_.c_str(), FA_READ | FA_OPEN_EXISTING));
+            reader->cltbl = link_map_.empty() ? nullptr : link_map_.data();
+            readers_.emplace_back(std::move(reader));
+            idle_readers_.reserve(readers_.size());
+            return readers_.back().get();
+        }
+        catch (...)
+        {
+            xSemaphoreGive(readers_available_);
+            throw;
+        }
+    }
+
+    void release_reader(FIL *reader) noexcept
+    {
+        {
+            semaphore_lock locker(mutex_);
+            reader->cltbl = link_map_.empty() ? nullptr : link_map_.data();
+            idle_readers_.push_back(reader);
+        }
+        xSemaphoreGive(readers_available_);
+    }
+
+private:
+    std::string path_;
+    FIL file_;
+    std::vector<DWORD> link_map_;
+    SemaphoreHandle_t mutex_;
+    SemaphoreHandle_t readers_available_;
+    std::vector<std::unique_ptr<FIL>> readers_;
+    std::vector<FIL *> idle_readers_;
+};
+
+/* A log file is preallocated as one contiguous extent and written straight to the storage
+ * in whole sectors, FatFS only allocates the extent and commits the size to the directory
+ * entry. Until the next commit, the directory entry holds the last committed size.
+ * While the log is open the entry owns the whole extent, with a size of 0 before the first
+ * commit, and closing it truncates the extent to the committed size.
+ */
+class k_filesystem_log_file : public filesystem_file, public heap_object, public exclusive_object_access
+{
+public:
+    k_filesystem_log_file(const char *fileName, uint64_t capacity, uint32_t commit_interval)
+        : capacity_(capacity), commit_interval_(commit_interval), buffer_(LOG_BUFFER_SIZE)
+    {
+        if (!capacity || capacity > (FSIZE_t)-1)
+            throw std::invalid_argument("Invalid log capacity.");
+
+        check_fatfs_error(f_open(&file_, normalize_path(fileName).c_str(), FA_WRITE | FA_CREATE_ALWAYS));
+        auto err = f_expand(&file_, (FSIZE_t)capacity, 1);
+        if (err == FR_OK)
+        {
+            /* Commit the allocation, so the extent is freed with the file if power fails before close */
+            err = commit(0);
+        }
+
+        if (err != FR_OK)
+        {
+            f_close(&file_);
+            check_fatfs_error(err);
+        }
+
+        auto fs = file_.obj.fs;
+        filesystem_ = k_filesystem::get_filesystem(fs->pdrv);
+        first_sector_ = fs->database + (file_.obj.sclust - 2) * fs->csize;
+    }
+
+    ~k_filesystem_log_file()
+    {
+        try
+        {
+            write_buffer();
+            commit(size_);
+        }
+        catch (...)
+        {
+        }
+
+        /* Release the extent past the committed size even if the last writes failed, all of it
+         * if nothing was committed, so the entry no longer owns clusters beyond its size */
+        file_.obj.objsize = (FSIZE_t)capacity_;
+        if (f_lseek(&file_, (FSIZE_t)committed_) == FR_OK)
+            f_truncate(&file_);
+        f_close(&file_);
+    }
+
+    virtual size_t read(gsl::span<uint8_t> buffer) override
+    {
+        throw std::runtime_error("Log files are write only.");
+    }
+
+    virtual size_t write(gsl::span<const uint8_t> buffer) override
+    {
+        if ((uint64_t)buffer.size() > capacity_ - size_)
+            throw std::runtime_error("Disk full.");
+
+        auto src = buffer.data();
+        size_t left = buffer.size();
+        while (left)
+        {
+            size_t to_copy = std::min(left, buffer_.size() - fill_);
+            memcpy(buffer_.data() + fill_, src, to_copy);
+            fill_ += to_copy;
+            size_ += to_copy;
+            src += to_copy;
+            left -= to_copy;
+
+            if (fill_ == buffer_.size())
+            {
+                write_buffer();
+                if (commit_interval_ && size_ - committed_ >= commit_interval_)
+                    check_fatfs_error(commit(size_));
+            }
+        }
+
+        return buffer.size();
+    }
+
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer) override
+    {
+        throw std::runtime_error("Log files are write only.");
+    }
+
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer) override
+    {
+        throw std::runtime_error("Log files are append only.");
+    }
+
+    virtual fpos_t get_position() override
+    {
+        return size_;
+    }
+
+    virtual void set_position(fpos_t position) override
+    {
+        throw std::runtime_error("Log files are append only.");
+    }
+
+    virtual uint64_t get_size() override
+    {
+        return size_;
+    }
+
+    virtual void flush() override
+    {
+        write_buffer();
+        check_fatfs_error(commit(size_));
+    }
+
+    virtual void enable_fast_seek() override
+    {
+        /* Log files are contiguous and never seek */
+    }
+
+private:
+    /* Write the buffered sectors, the last one padded, and keep a partial sector for the next writes */
+    void write_buffer()
+    {
+        if (!fill_)
+            return;
+
+        size_t sectors = (fill_ + FF_MAX_SS - 1) / FF_MAX_SS;
+        std::fill(buffer_.begin() + fill_, buffer_.begin() + sectors * FF_MAX_SS, 0);
+
+        volume_lock locker(file_.obj.fs);
+        auto &storage = filesystem_->get_storage();
+        storage.write_blocks(first_sector_ + buffer_sector_, sectors, { buffer_.data(), ptrdiff_t(sectors * FF_MAX_SS) });
+
+        size_t full_sectors = fill_ / FF_MAX_SS;
+        fill_ %= FF_MAX_SS;
+        if (fill_)
+            memmove(buffer_.data(), buffer_.data() + full_sectors * FF_MAX_SS, fill_);
+        buffer_sector_ += full_sectors;
+    }
+
+    /* Write the size to the directory entry, the data up to it must be on the storage */
+    FRESULT commit(uint64_t size)
+    {
+        file_.obj.objsize = (FSIZE_t)size;
+        file_.flag |= FA_MODIFIED;
+        auto err = f_sync(&file_);
+        if (err == FR_OK)
+            committed_ = size;
+        return err;
+    }
+
+private:
+    FIL file_;
+    object_ptr<k_filesystem> filesystem_;
+    uint64_t capacity_;
+    uint32_t commit_interval_;
+    DWORD first_sector_;
+    std::vector<uint8_t> buffer_;
+    /* Sector of the log held at the start of the buffer */
+    DWORD buffer_sector_ = 0;
+    size_t fill_ = 0;
+    uint64_t size_ = 0;
+    uint64_t committed_ = 0;
+};
+
+/* A user space buffer in front of a file. Reads fetch up to the next multiple of the buffer
+ * size and writes are gathered up to it, so the file sees few, aligned transfers of whole
+ * sectors. Requests as large as the buffer go straight to the file.
+ */
+class k_buffered_file : public filesystem_file, public heap_object, public exclusive_object_access
+{
+    enum buffer_mode
+    {
+        BM_NONE,
+        BM_READ,
+        BM_WRITE
+    };
+
+public:
+    k_buffered_file(size_t buffer_size)
+        : buffer_(buffer_size)
+    {
+        mutex_ = xSemaphoreCreateMutex();
+    }
+
+    ~k_buffered_file()
+    {
+        try
+        {
+            write_buffer();
+        }
+        catch (...)
+        {
+        }
+
+        vSemaphoreDelete(mutex_);
+    }
 
-    k_filesystem(object_accessor<block_storage_driver> storage)
-        : storage_(std::move(storage))
+    void attach(object_accessor<filesystem_file> file) noexcept
     {
+        file_ = std::move(file);
     }
 
-    block_storage_driver &get_storage() noexcept
+    object_accessor<filesystem_file> detach()
     {
-        return *storage_.operator->();
+        semaphore_lock locker(mutex_);
+        drop_buffer();
+        return std::move(file_);
+    }
+
+    void set_buffer_size(size_t buffer_size)
+    {
+        semaphore_lock locker(mutex_);
+        drop_buffer();
+        buffer_.resize(buffer_size);
     }
 
-    static object_ptr<k_filesystem> install_filesystem(object_accessor<block_storage_driver> storage)
+    virtual size_t read(gsl::span<uint8_t> buffer) override
     {
-        auto obj = make_object<k_filesystem>(std::move(storage));
+        semaphore_lock locker(mutex_);
+        write_buffer();
 
-        for (size_t i = 0; i < filesystems_.size(); i++)
+        auto dest = buffer.data();
+        size_t left = buffer.size();
+        while (left)
         {
-            if (!filesystems_[i])
+            if (mode_ == BM_READ && cursor_ < length_)
             {
-                filesystems_[i] = obj;
-                return obj;
+                size_t to_copy = std::min(left, length_ - cursor_);
+                memcpy(dest, buffer_.data() + cursor_, to_copy);
+                cursor_ += to_copy;
+                dest += to_copy;
+                left -= to_copy;
+                continue;
+            }
+
+            /* The file is positioned at the end of the buffer */
+            mode_ = BM_NONE;
+            if (left >= buffer_.size())
+            {
+                left -= file_->read({ dest, ptrdiff_t(left) });
+                break;
             }
+
+            fpos_t position = file_->get_position();
+            size_t fetch = buffer_.size() - position % buffer_.size();
+            length_ = file_->read({ buffer_.data(), ptrdiff_t(fetch) });
+            if (!length_)
+                break;
+            mode_ = BM_READ;
+            buffer_position_ = position;
+            cursor_ = 0;
         }
 
-        throw std::runtime_error("Max custom drivers exceeded.");
+        return buffer.size() - left;
     }
 
-    static object_ptr<k_filesystem> get_filesystem(size_t index)
+    virtual size_t write(gsl::span<const uint8_t> buffer) override
     {
-        return filesystems_.at(index);
-    }
+        semaphore_lock locker(mutex_);
+        /* Pending write data ends at the position, the new data goes after it */
+        if (mode_ == BM_READ)
+            drop_buffer();
 
-private:
-    static std::array<object_ptr<k_filesystem>, MAX_FILE_SYSTEMS> filesystems_;
+        auto src = buffer.data();
+        size_t left = buffer.size();
+        while (left)
+        {
+            if (mode_ == BM_NONE)
+            {
+                if (left >= buffer_.size())
+                {
+                    file_->write({ src, ptrdiff_t(left) });
+                    break;
+                }
 
-    object_accessor<block_storage_driver> storage_;
-};
+                mode_ = BM_WRITE;
+                buffer_position_ = file_->get_position();
+                length_ = 0;
+            }
 
-std::array<object_ptr<k_filesystem>, MAX_FILE_SYSTEMS> k_filesystem::filesystems_;
+            size_t capacity = buffer_.size() - buffer_position_ % buffer_.size();
+            size_t to_copy = std::min(left, capacity - length_);
+            memcpy(buffer_.data() + length_, src, to_copy);
+            length_ += to_copy;
+            src += to_copy;
+            left -= to_copy;
+            if (length_ == capacity)
+                write_buffer();
+        }
 
-class k_filesystem_file : public filesystem_file, public heap_object, public exclusive_object_access
-{
-public:
-    k_filesystem_file(const char *fileName, file_access_t file_access, file_mode_t file_mode)
+        return buffer.size();
+    }
+
+    /* Positional I/O keeps the buffer, unless the range overlaps it */
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer) override
     {
-        BYTE mode = 0;
-        if (file_access & FILE_ACCESS_READ)
-            mode |= FA_READ;
-        if (file_access & FILE_ACCESS_WRITE)
-            mode |= FA_WRITE;
-        if (file_mode & FILE_MODE_OPEN_EXISTING)
-            mode |= FA_OPEN_EXISTING;
-        else if (file_mode & FILE_MODE_OPEN_ALWAYS)
-            mode |= FA_OPEN_ALWAYS;
-        else if (file_mode & FILE_MODE_CREATE_NEW)
-            mode |= FA_CREATE_NEW;
-        else if (file_mode & FILE_MODE_CREATE_ALWAYS)
-            mode |= FA_CREATE_ALWAYS;
-        else if (file_mode & FILE_MODE_APPEND)
-            mode |= FA_OPEN_APPEND;
+        semaphore_lock locker(mutex_);
+        if (mode_ == BM_WRITE && overlaps_buffer(offset, buffer.size()))
+            write_buffer();
+        return file_->read_at(offset, buffer);
+    }
 
-        check_fatfs_error(f_open(&file_, normalize_path(fileName), mode));
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer) override
+    {
+        semaphore_lock locker(mutex_);
+        if (overlaps_buffer(offset, buffer.size()))
+            drop_buffer();
+        return file_->write_at(offset, buffer);
+    }
 
-        if (file_mode & FILE_MODE_TRUNCATE)
-        {
-            auto err = f_truncate(&file_);
-            if (err != FR_OK)
-                f_close(&file_);
-            check_fatfs_error(err);
-        }
+    virtual fpos_t get_position() override
+    {
+        semaphore_lock locker(mutex_);
+        if (mode_ == BM_READ)
+            return buffer_position_ + cursor_;
+        else if (mode_ == BM_WRITE)
+            return buffer_position_ + length_;
+        return file_->get_position();
     }
 
-    ~k_filesystem_file()
+    virtual void set_position(fpos_t position) override
     {
-        f_close(&file_);
+        semaphore_lock locker(mutex_);
+        /* Seeks inside the read buffer keep it, as do seeks to the end of the write buffer */
+        if (mode_ == BM_READ && position >= buffer_position_ && position <= buffer_position_ + (fpos_t)length_)
+        {
+            cursor_ = position - buffer_position_;
+            return;
+        }
+        else if (mode_ == BM_WRITE && position == buffer_position_ + (fpos_t)length_)
+        {
+            return;
+        }
+
+        write_buffer();
+        mode_ = BM_NONE;
+        file_->set_position(position);
     }
 
-    virtual size_t read(gsl::span<uint8_t> buffer) override
+    virtual uint64_t get_size() override
     {
-        UINT read = buffer.size();
-        check_fatfs_error(f_read(&file_, buffer.data(), read, &read));
-        return read;
+        semaphore_lock locker(mutex_);
+        uint64_t size = file_->get_size();
+        if (mode_ == BM_WRITE)
+            size = std::max(size, (uint64_t)(buffer_position_ + length_));
+        return size;
     }
 
-    virtual size_t write(gsl::span<const uint8_t> buffer) override
+    virtual void flush() override
     {
-        UINT written = buffer.size();
-        check_fatfs_error(f_write(&file_, buffer.data(), written, &written));
-        if (written != buffer.size())
-            throw std::runtime_error("Disk full.");
-        return written;
+        semaphore_lock locker(mutex_);
+        write_buffer();
+        file_->flush();
     }
 
-    virtual fpos_t get_position() override
+    virtual void enable_fast_seek() override
     {
-        return f_tell(&file_);
+        semaphore_lock locker(mutex_);
+        write_buffer();
+        file_->enable_fast_seek();
     }
 
-    virtual void set_position(fpos_t position) override
+private:
+    void write_buffer()
     {
-        check_fatfs_error(f_lseek(&file_, position));
+        if (mode_ == BM_WRITE)
+        {
+            /* Drop the data even if the write fails, it would fail again on the next flush */
+            mode_ = BM_NONE;
+            file_->write({ buffer_.data(), ptrdiff_t(length_) });
+        }
     }
 
-    virtual uint64_t get_size() override
+    bool overlaps_buffer(fpos_t offset, size_t size) const noexcept
     {
-        return f_size(&file_);
+        return mode_ != BM_NONE && offset < buffer_position_ + (fpos_t)length_ && offset + (fpos_t)size > buffer_position_;
     }
 
-    virtual void flush() override
+    /* Leave the file at the logical position, without any buffered data */
+    void drop_buffer()
     {
-        check_fatfs_error(f_sync(&file_));
+        if (mode_ == BM_READ)
+        {
+            mode_ = BM_NONE;
+            file_->set_position(buffer_position_ + cursor_);
+        }
+        else
+        {
+            write_buffer();
+        }
     }
 
 private:
-    FIL file_;
+    object_accessor<filesystem_file> file_;
+    std::vector<uint8_t> buffer_;
+    buffer_mode mode_ = BM_NONE;
+    /* Position in the file of the first byte of the buffer */
+    fpos_t buffer_position_ = 0;
+    size_t length_ = 0;
+    size_t cursor_ = 0;
+    SemaphoreHandle_t mutex_;
 };
 
 class k_filesystem_find : public virtual object_access, public heap_object, public exclusive_object_access
@@ -188,7 +1261,7 @@ class k_filesystem_find : public virtual object_access, public heap_object, publ
 public:
     k_filesystem_find(const char *path, const char *pattern)
     {
-        check_fatfs_error(f_findfirst(&dir_, &info_, normalize_path(path), pattern));
+        check_fatfs_error(f_findfirst(&dir_, &info_, normalize_path(path).c_str(), pattern));
     }
 
     void fill_find_data(find_find_data_t &find_data)
@@ -206,12 +1279,136 @@ private:
     FILINFO info_;
 };
 
+static object_accessor<block_storage_driver> open_storage(handle_t storage_handle)
+{
+    /* The handle stays usable, a block cache is still flushed and queried through it */
+    auto storage = system_handle_to_object(storage_handle).get_object().as<block_storage_driver>();
+    if (!storage)
+        throw std::invalid_argument("Not a block storage device.");
+    return make_accessor(std::move(storage));
+}
+
+/* Volume control functions of FatFS are not reentrant for a volume, the volume entry
+ * is reserved first so concurrent mounts get different volumes.
+ */
+static void mount_filesystem(const char *name, handle_t storage_handle, const filesystem_format_options_t *format)
+{
+    std::string mount_name;
+    if (*split_path(name, mount_name))
+        throw std::runtime_error("Invalid mount path.");
+
+    auto volume = k_filesystem::install_filesystem(std::move(mount_name), open_storage(storage_handle));
+    try
+    {
+        auto path = volume_path(volume);
+        if (format)
+        {
+            static const BYTE options[] = { FM_ANY, FM_FAT, FM_FAT, FM_FAT32 };
+            if (format->type > FILESYSTEM_FAT32)
+                throw std::invalid_argument("Invalid filesystem type.");
+            std::unique_ptr<uint8_t[]> work(new uint8_t[FF_MAX_SS]);
+            check_fatfs_error(f_mkfs(path.c_str(), options[format->type], format->cluster_size, work.get(), FF_MAX_SS));
+        }
+
+        auto &fs = k_filesystem::get_filesystem(volume)->FatFS;
+        check_fatfs_error(f_mount(&fs, path.c_str(), 1));
+        /* FatFS picks FAT12 or FAT16 by the count of clusters */
+        if (format && format->type != FILESYSTEM_ANY && fs.fs_type != format->type)
+            throw std::runtime_error("The volume does not fit the filesystem type.");
+    }
+    catch (...)
+    {
+        f_mount(nullptr, volume_path(volume).c_str(), 0);
+        k_filesystem::uninstall_filesystem(volume);
+        throw;
+    }
+}
+
 int filesystem_mount(const char *name, handle_t storage_handle)
 {
     try
     {
-        auto fs = k_filesystem::install_filesystem(system_handle_to_object(storage_handle).move_as<block_storage_driver>());
-        check_fatfs_error(f_mount(&fs->FatFS, normalize_path(name), 1));
+        mount_filesystem(name, storage_handle, nullptr);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+static size_t find_mounted_volume(const char *name)
+{
+    std::string mount_name;
+    if (*split_path(name, mount_name))
+        throw std::runtime_error("Invalid mount path.");
+    auto volume = k_filesystem::find_filesystem(mount_name);
+    if (volume == -1)
+        throw std::runtime_error("Filesystem not mounted.");
+    return volume;
+}
+
+int filesystem_format(const char *name, handle_t storage_handle)
+{
+    filesystem_format_options_t options = { FILESYSTEM_ANY, 0 };
+    return filesystem_format_with_options(name, storage_handle, &options);
+}
+
+int filesystem_format_with_options(const char *name, handle_t storage_handle, const filesystem_format_options_t *options)
+{
+    try
+    {
+        if (!options)
+            throw std::invalid_argument("Options are null.");
+        mount_filesystem(name, storage_handle, options);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int filesystem_get_volume_info(const char *name, filesystem_volume_info_t *info)
+{
+    try
+    {
+        auto volume = find_mounted_volume(name);
+        DWORD free_clusters;
+        FATFS *fs;
+        check_fatfs_error(f_getfree(volume_path(volume).c_str(), &free_clusters, &fs));
+
+        uint32_t cluster_size = fs->csize * FF_MAX_SS;
+        info->type = (filesystem_type_t)fs->fs_type;
+        info->cluster_size = cluster_size;
+        info->total_bytes = (uint64_t)(fs->n_fatent - 2) * cluster_size;
+        info->free_bytes = (uint64_t)free_clusters * cluster_size;
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int filesystem_discard_free_space(const char *name)
+{
+    try
+    {
+        k_filesystem::get_filesystem(find_mounted_volume(name))->discard_free_space();
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+int filesystem_remove(const char *path)
+{
+    try
+    {
+        check_fatfs_error(f_unlink(normalize_path(path).c_str()));
         return 0;
     }
     catch (...)
@@ -241,6 +1438,32 @@ handle_t filesystem_file_open(const char *filename, file_access_t file_access, f
     }
 }
 
+handle_t filesystem_file_open_shared(const char *filename)
+{
+    try
+    {
+        auto file = make_object<k_filesystem_shared_file>(filename);
+        return system_alloc_handle(make_accessor<object_access>(file));
+    }
+    catch (...)
+    {
+        return NULL_HANDLE;
+    }
+}
+
+handle_t filesystem_log_open(const char *filename, uint64_t capacity, uint32_t commit_interval)
+{
+    try
+    {
+        auto file = make_object<k_filesystem_log_file>(filename, capacity, commit_interval);
+        return system_alloc_handle(make_accessor<object_access>(file));
+    }
+    catch (...)
+    {
+        return NULL_HANDLE;
+    }
+}
+
 int filesystem_file_close(handle_t file)
 {
     return io_close(file);
@@ -302,6 +1525,65 @@ uint64_t filesystem_file_get_size(handle_t file)
     CATCH_ALL;
 }
 
+int filesystem_file_pread(handle_t file, uint8_t *buffer, size_t buffer_len, fpos_t offset)
+{
+    try
+    {
+        FILE_ENTRY;
+
+        return f->read_at(offset, { buffer, std::ptrdiff_t(buffer_len) });
+    }
+    CATCH_ALL;
+}
+
+int filesystem_file_pwrite(handle_t file, const uint8_t *buffer, size_t buffer_len, fpos_t offset)
+{
+    try
+    {
+        FILE_ENTRY;
+
+        return f->write_at(offset, { buffer, std::ptrdiff_t(buffer_len) });
+    }
+    CATCH_ALL;
+}
+
+int filesystem_file_set_buffer(handle_t file, size_t buffer_size)
+{
+    try
+    {
+        auto &obj = system_handle_to_object(file);
+        configASSERT(obj.is<filesystem_file>());
+        if (auto buffered = obj.as<k_buffered_file>())
+        {
+            if (buffer_size)
+                buffered->set_buffer_size(buffer_size);
+            else
+                obj = buffered->detach();
+        }
+        else if (buffer_size)
+        {
+            auto buffered = make_object<k_buffered_file>(buffer_size);
+            buffered->attach(obj.move_as<filesystem_file>());
+            obj = make_accessor<object_access>(std::move(buffered));
+        }
+
+        return 0;
+    }
+    CATCH_ALL;
+}
+
+int filesystem_file_enable_fast_seek(handle_t file)
+{
+    try
+    {
+        FILE_ENTRY;
+
+        f->enable_fast_seek();
+        return 0;
+    }
+    CATCH_ALL;
+}
+
 int filesystem_file_flush(handle_t file)
 {
     try
@@ -377,9 +1659,7 @@ extern "C"
     )
     {
         auto fs = k_filesystem::get_filesystem(pdrv);
-        auto &st = fs->get_storage();
-
-        st.read_blocks(sector, count, { buff, ptrdiff_t(st.get_rw_block_size() * count) });
+        fs->read_sectors(sector, count, buff);
         return RES_OK;
     }
 
@@ -391,9 +1671,7 @@ extern "C"
     )
     {
         auto fs = k_filesystem::get_filesystem(pdrv);
-        auto &st = fs->get_storage();
-
-        st.write_blocks(sector, count, { buff, ptrdiff_t(st.get_rw_block_size() * count) });
+        fs->write_sectors(sector, count, buff);
         return RES_OK;
     }
 
@@ -409,6 +1687,15 @@ extern "C"
         switch (cmd)
         {
         case CTRL_SYNC:
+            st.flush();
+            try
+            {
+                /* The FAT is written, the clusters freed before can go */
+                fs->flush_erase_queue_locked(ERASE_QUEUE_RANGES);
+            }
+            catch (...)
+            {
+            }
             break;
         case GET_SECTOR_COUNT:
             *(DWORD *)buff = st.get_blocks_count();
@@ -419,6 +1706,19 @@ extern "C"
         case GET_BLOCK_SIZE:
             *(DWORD *)buff = st.get_rw_block_size();
             break;
+        case CTRL_TRIM:
+        {
+            /* The first and the last sector of the freed clusters */
+            auto range = (const DWORD *)buff;
+            try
+            {
+                fs->queue_erase(range[0], range[1] - range[0] + 1);
+            }
+            catch (...)
+            {
+            }
+            break;
+        }
         default:
             return RES_PARERR;
         }
@@ -426,6 +1726,23 @@ extern "C"
         return RES_OK;
     }
 
+    DWORD ff_find_free_cluster(FATFS *fs, DWORD clst)
+    {
+        try
+        {
+            return k_filesystem::get_filesystem(fs->pdrv)->find_free_cluster(clst);
+        }
+        catch (...)
+        {
+            return 0xFFFFFFFF;
+        }
+    }
+
+    void ff_free_cluster(FATFS *fs, DWORD clst)
+    {
+        k_filesystem::get_filesystem(fs->pdrv)->free_cluster(clst);
+    }
+
     DWORD get_fattime(void)
     {
         return 0;
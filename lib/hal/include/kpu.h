@@ -463,6 +463,24 @@ typedef struct
     uint32_t channels;
 } kpu_model_gap2d_layer_argument_t;
 
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    uint32_t kernel_size;
+    uint32_t channels;
+} kpu_model_quant_gmp2d_layer_argument_t;
+
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    uint32_t kernel_size;
+    uint32_t channels;
+} kpu_model_quant_gap2d_layer_argument_t;
+
 typedef struct
 {
     uint32_t flags;
@@ -494,6 +512,21 @@ typedef struct
     kpu_model_activation_t act;
 } kpu_model_ave_pool2d_layer_argument_t;
 
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    kpu_model_shape_t in_shape;
+    kpu_model_shape_t out_shape;
+    uint32_t kernel_width;
+    uint32_t kernel_height;
+    uint32_t stride_width;
+    uint32_t stride_height;
+    uint32_t padding_width;
+    uint32_t padding_height;
+} kpu_model_quant_ave_pool2d_layer_argument_t;
+
 typedef struct
 {
     uint32_t flags;
@@ -582,6 +615,22 @@ typedef struct
     float weights[0];
 } kpu_model_fully_connected_layer_argument_t;
 
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    uint32_t in_channels;
+    uint32_t out_channels;
+    int32_t in_offset;
+    int32_t w_offset;
+    int32_t out_offset;
+    int32_t out_mul;
+    int32_t out_shift;
+    /* int32_t bias[out_channels], followed by uint8_t weights[out_channels][in_channels] */
+    int32_t bias[0];
+} kpu_model_quant_fully_connected_layer_argument_t;
+
 typedef struct
 {
     uint32_t flags;
@@ -590,6 +639,14 @@ typedef struct
     kpu_model_shape_t shape;
 } kpu_model_tf_flatten_layer_argument_t;
 
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    kpu_model_shape_t shape;
+} kpu_model_quant_tf_flatten_layer_argument_t;
+
 typedef struct
 {
     uint32_t flags;
@@ -601,6 +658,17 @@ typedef struct
     uint32_t align_corners;
 } kpu_model_resize_nearest_neighbor_layer_argument_t;
 
+typedef struct
+{
+    uint32_t flags;
+    uint32_t main_mem_in_address;
+    uint32_t main_mem_out_address;
+    kpu_model_shape_t in_shape;
+    uint32_t out_width;
+    uint32_t out_height;
+    uint32_t align_corners;
+} kpu_model_quant_resize_nearest_neighbor_layer_argument_t;
+
 typedef struct
 {
     const uint8_t *model_buffer;
@@ -0,0 +1,455 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <devices.h>
+#include <encoding.h>
+#include <filesystem.h>
+#include <parallel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <storage/block_cache.h>
+#include <storage/ramdisk.h>
+#include <string.h>
+#include <sysctl.h>
+#ifdef SD_BENCHMARK
+#include <pin_cfg.h>
+#include <storage/sdcard.h>
+#endif
+
+/* Filesystem benchmark on a RAM disk, so the filesystem and cache layers can be measured
+ * without a card. Each test prints one JSON object per line.
+ * Built with SD_BENCHMARK, it also measures sequential I/O on the FAT volume of an SD card.
+ */
+
+#define BLOCK_SIZE 512
+/* FAT32 needs more than 65525 clusters, at least 32 MiB, far more than the RAM of the chip.
+ * So the disk is FAT16, which needs more than 4085 clusters: 4 MiB of 512 bytes clusters.
+ * Left to pick the type by the size, FatFS would make it FAT12.
+ */
+#define DISK_BLOCKS 8192
+#define DISK_TYPE FILESYSTEM_FAT16
+#define DISK_CLUSTER_SIZE 512
+/* 0 mounts the RAM disk directly */
+#define CACHE_BLOCKS 64
+#define CACHE_READ_AHEAD_BLOCKS 8
+
+#define SEQUENTIAL_FILE_SIZE (1024 * 1024)
+#define SEQUENTIAL_CHUNK_SIZE (32 * 1024)
+#define RANDOM_IO_SIZE 4096
+#define RANDOM_IO_COUNT 256
+#define SMALL_FILES 100
+#define SMALL_FILE_SIZE 512
+
+#define ROOT "/fs/0/"
+#define BIG_FILE ROOT "SEQ.BIN"
+#define LOG_FILE ROOT "LOG.BIN"
+#define LOG_FRAME_SIZE 480
+#define LOG_COMMIT_INTERVAL (256 * 1024)
+#define LINE_COUNT 10000
+#define LINE_BUFFER_SIZE 4096
+
+/* A second RAM disk, written at the same time as the first one from the other core */
+#define SECOND_DISK_BLOCKS 2048
+#define SECOND_ROOT "/fs/1/"
+#define VOLUME_FILE_SIZE (512 * 1024)
+
+#ifdef SD_BENCHMARK
+/* Card on SPI1 with chip select on GPIOHS7, as wired on the Maix boards */
+#define SD_SPI "/dev/spi1"
+#define SD_CS_GPIO "/dev/gpio0"
+#define SD_CS_PIN 7
+#define SD_ROOT "/fs/2/"
+#define SD_FILE SD_ROOT "SDBENCH.BIN"
+
+const fpioa_cfg_t g_fpioa_cfg = {
+    .version = PIN_CFG_VERSION,
+    .functions_count = 4,
+    .functions = {
+        { 27, FUNC_SPI1_SCLK },
+        { 28, FUNC_SPI1_D0 },
+        { 26, FUNC_SPI1_D1 },
+        { 29, FUNC_GPIOHS7 } }
+};
+#endif
+
+static uint8_t buffer[SEQUENTIAL_CHUNK_SIZE];
+static uint8_t volume_buffers[2][SEQUENTIAL_CHUNK_SIZE];
+static const char *volume_files[2] = { ROOT "VOL.BIN", SECOND_ROOT "VOL.BIN" };
+static int volume_results[2];
+static const char csv_line[] = "1234567,-12.5,3.75,ok\n";
+#define LINE_SIZE (sizeof(csv_line) - 1)
+
+static uint64_t now_us(void)
+{
+    return read_csr(mcycle) / (sysctl_clock_get_freq(SYSCTL_CLOCK_CPU) / 1000000);
+}
+
+static void report_volume(const char *test, const char *name)
+{
+    static const char *type_names[] = { "unknown", "FAT12", "FAT16", "FAT32" };
+    filesystem_volume_info_t info;
+    if (filesystem_get_volume_info(name, &info))
+    {
+        printf("{\"test\":\"%s\",\"ok\":false}\n", test);
+        return;
+    }
+
+    printf("{\"test\":\"%s\",\"ok\":true,\"type\":\"%s\",\"cluster_size\":%u,\"total_bytes\":%llu,\"free_bytes\":%llu}\n",
+        test, type_names[info.type <= FILESYSTEM_FAT32 ? info.type : 0], (unsigned)info.cluster_size,
+        (unsigned long long)info.total_bytes, (unsigned long long)info.free_bytes);
+}
+
+static void report(const char *test, uint64_t bytes, uint32_t ops, uint64_t start_us, int result)
+{
+    uint64_t us = now_us() - start_us;
+    if (!us)
+        us = 1;
+    printf("{\"test\":\"%s\",\"ok\":%s,\"bytes\":%llu,\"ops\":%u,\"us\":%llu,\"kib_per_s\":%llu,\"ops_per_s\":%llu}\n",
+        test, result ? "false" : "true", (unsigned long long)bytes, (unsigned)ops, (unsigned long long)us,
+        (unsigned long long)(bytes * 1000000 / 1024 / us), (unsigned long long)((uint64_t)ops * 1000000 / us));
+}
+
+static int sequential_write(const char *path)
+{
+    handle_t file = filesystem_file_open(path, FILE_ACCESS_WRITE, FILE_MODE_CREATE_ALWAYS);
+    if (!file)
+        return -1;
+    int result = 0;
+    for (size_t i = 0; i < SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE && !result; i++)
+    {
+        memset(buffer, (int)i, sizeof(buffer));
+        if (filesystem_file_write(file, buffer, sizeof(buffer)) != sizeof(buffer))
+            result = -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    return result;
+}
+
+static int sequential_read(const char *path)
+{
+    handle_t file = filesystem_file_open(path, FILE_ACCESS_READ, FILE_MODE_OPEN_EXISTING);
+    if (!file)
+        return -1;
+    int result = 0;
+    for (size_t i = 0; i < SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE && !result; i++)
+    {
+        if (filesystem_file_read(file, buffer, sizeof(buffer)) != sizeof(buffer) || buffer[0] != (uint8_t)i)
+            result = -1;
+    }
+    filesystem_file_close(file);
+    return result;
+}
+
+static int random_io(file_access_t access)
+{
+    handle_t file = filesystem_file_open(BIG_FILE, access, FILE_MODE_OPEN_EXISTING);
+    if (!file)
+        return -1;
+    int result = 0;
+    srand(RANDOM_IO_COUNT);
+    for (size_t i = 0; i < RANDOM_IO_COUNT && !result; i++)
+    {
+        fpos_t position = (fpos_t)(rand() % (SEQUENTIAL_FILE_SIZE / RANDOM_IO_SIZE)) * RANDOM_IO_SIZE;
+        if (filesystem_file_set_position(file, position))
+            result = -1;
+        else if (access == FILE_ACCESS_WRITE)
+            result = filesystem_file_write(file, buffer, RANDOM_IO_SIZE) == RANDOM_IO_SIZE ? 0 : -1;
+        else
+            result = filesystem_file_read(file, buffer, RANDOM_IO_SIZE) == RANDOM_IO_SIZE ? 0 : -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    return result;
+}
+
+/* Small frames appended to a preallocated log, as a data logger does */
+static int log_write(void)
+{
+    handle_t file = filesystem_log_open(LOG_FILE, SEQUENTIAL_FILE_SIZE, LOG_COMMIT_INTERVAL);
+    if (!file)
+        return -1;
+    int result = 0;
+    memset(buffer, 'l', LOG_FRAME_SIZE);
+    for (size_t i = 0; i < SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE && !result; i++)
+    {
+        if (filesystem_file_write(file, buffer, LOG_FRAME_SIZE) != LOG_FRAME_SIZE)
+            result = -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    return result;
+}
+
+static int frames_write(void)
+{
+    handle_t file = filesystem_file_open(LOG_FILE, FILE_ACCESS_WRITE, FILE_MODE_CREATE_ALWAYS);
+    if (!file)
+        return -1;
+    int result = 0;
+    memset(buffer, 'f', LOG_FRAME_SIZE);
+    for (size_t i = 0; i < SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE && !result; i++)
+    {
+        if (filesystem_file_write(file, buffer, LOG_FRAME_SIZE) != LOG_FRAME_SIZE)
+            result = -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    return result;
+}
+
+/* CSV like lines, written one by one */
+static int line_write(size_t buffer_size)
+{
+    handle_t file = filesystem_file_open(LOG_FILE, FILE_ACCESS_WRITE, FILE_MODE_CREATE_ALWAYS);
+    if (!file)
+        return -1;
+    int result = buffer_size ? filesystem_file_set_buffer(file, buffer_size) : 0;
+    for (size_t i = 0; i < LINE_COUNT && !result; i++)
+    {
+        if (filesystem_file_write(file, (const uint8_t *)csv_line, LINE_SIZE) != LINE_SIZE)
+            result = -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    filesystem_remove(LOG_FILE);
+    return result;
+}
+
+/* Seek and read latency, fast seek replaces the FAT chain walk of each seek by a map lookup */
+static void random_read_latency(const char *test, int fast_seek)
+{
+    uint64_t map_us = 0, total_us = 0, max_us = 0;
+    int result = 0;
+    handle_t file = filesystem_file_open(BIG_FILE, FILE_ACCESS_READ, FILE_MODE_OPEN_EXISTING);
+    if (!file)
+        result = -1;
+
+    if (!result && fast_seek)
+    {
+        uint64_t start = now_us();
+        result = filesystem_file_enable_fast_seek(file);
+        map_us = now_us() - start;
+    }
+
+    srand(RANDOM_IO_COUNT + 1);
+    for (size_t i = 0; i < RANDOM_IO_COUNT && !result; i++)
+    {
+        fpos_t position = (fpos_t)(rand() % (SEQUENTIAL_FILE_SIZE / RANDOM_IO_SIZE)) * RANDOM_IO_SIZE;
+        uint64_t start = now_us();
+        if (filesystem_file_set_position(file, position) || filesystem_file_read(file, buffer, RANDOM_IO_SIZE) != RANDOM_IO_SIZE)
+            result = -1;
+        uint64_t us = now_us() - start;
+        total_us += us;
+        if (us > max_us)
+            max_us = us;
+    }
+
+    if (file)
+        filesystem_file_close(file);
+    printf("{\"test\":\"%s\",\"ok\":%s,\"ops\":%u,\"map_us\":%llu,\"avg_us\":%llu,\"max_us\":%llu}\n",
+        test, result ? "false" : "true", RANDOM_IO_COUNT, (unsigned long long)map_us,
+        (unsigned long long)(total_us / RANDOM_IO_COUNT), (unsigned long long)max_us);
+}
+
+static void small_file_name(char *name, size_t index)
+{
+    sprintf(name, ROOT "F%03u.TXT", (unsigned)index);
+}
+
+static int small_files_create(void)
+{
+    char name[32];
+    memset(buffer, 'x', SMALL_FILE_SIZE);
+    for (size_t i = 0; i < SMALL_FILES; i++)
+    {
+        small_file_name(name, i);
+        handle_t file = filesystem_file_open(name, FILE_ACCESS_WRITE, FILE_MODE_CREATE_NEW);
+        if (!file)
+            return -1;
+        int written = filesystem_file_write(file, buffer, SMALL_FILE_SIZE);
+        filesystem_file_close(file);
+        if (written != SMALL_FILE_SIZE)
+            return -1;
+    }
+    return 0;
+}
+
+static int enumerate(uint32_t *entries)
+{
+    find_find_data_t data;
+    handle_t find = filesystem_find_first(ROOT, "*", &data);
+    if (!find)
+        return -1;
+    *entries = 1;
+    while (filesystem_find_next(find, &data))
+        (*entries)++;
+    filesystem_find_close(find);
+    return *entries >= SMALL_FILES ? 0 : -1;
+}
+
+static int small_files_delete(void)
+{
+    char name[32];
+    for (size_t i = 0; i < SMALL_FILES; i++)
+    {
+        small_file_name(name, i);
+        if (filesystem_remove(name))
+            return -1;
+    }
+    return 0;
+}
+
+static int volume_file_write(size_t volume)
+{
+    handle_t file = filesystem_file_open(volume_files[volume], FILE_ACCESS_WRITE, FILE_MODE_CREATE_ALWAYS);
+    if (!file)
+        return -1;
+    int result = 0;
+    memset(volume_buffers[volume], 'v', SEQUENTIAL_CHUNK_SIZE);
+    for (size_t i = 0; i < VOLUME_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE && !result; i++)
+    {
+        if (filesystem_file_write(file, volume_buffers[volume], SEQUENTIAL_CHUNK_SIZE) != SEQUENTIAL_CHUNK_SIZE)
+            result = -1;
+    }
+    if (filesystem_file_flush(file))
+        result = -1;
+    filesystem_file_close(file);
+    return result;
+}
+
+static void volume_write_job(void *userdata, size_t part, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i++)
+        volume_results[i] = volume_file_write(i);
+}
+
+/* The same writes to both volumes, one after another and then on both cores */
+static void two_volume_write(handle_t second_storage)
+{
+    uint64_t start = now_us();
+    if (!second_storage || filesystem_format(SECOND_ROOT, second_storage))
+    {
+        report("two_volume_write", 0, 0, start, -1);
+        return;
+    }
+
+    volume_write_job(NULL, 0, 0, 2);
+    report("two_volume_write", 2 * VOLUME_FILE_SIZE, 2 * VOLUME_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, volume_results[0] | volume_results[1]);
+    start = now_us();
+    parallel_for(volume_write_job, NULL, 2, 1, 1);
+    report("two_volume_write_parallel", 2 * VOLUME_FILE_SIZE, 2 * VOLUME_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, volume_results[0] | volume_results[1]);
+    filesystem_remove(volume_files[0]);
+    filesystem_remove(volume_files[1]);
+}
+
+#ifdef SD_BENCHMARK
+/* The card keeps its volume, only the test file is written and removed. The rates depend on
+ * the card and on the SPI clock it allows, so they are only meaningful on hardware. */
+static void sd_benchmark(void)
+{
+    handle_t spi = io_open(SD_SPI), gpio = io_open(SD_CS_GPIO);
+    handle_t card = spi && gpio ? spi_sdcard_driver_install(spi, gpio, SD_CS_PIN) : 0;
+    uint64_t start = now_us();
+    if (!card || filesystem_mount(SD_ROOT, card))
+    {
+        report("sd_setup", 0, 0, start, -1);
+        return;
+    }
+
+    report_volume("sd_volume", SD_ROOT);
+
+    start = now_us();
+    report("sd_seq_write", SEQUENTIAL_FILE_SIZE, SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, sequential_write(SD_FILE));
+    start = now_us();
+    report("sd_seq_read", SEQUENTIAL_FILE_SIZE, SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, sequential_read(SD_FILE));
+    filesystem_remove(SD_FILE);
+}
+#endif
+
+int main()
+{
+    handle_t storage = ramdisk_driver_install(NULL, BLOCK_SIZE, DISK_BLOCKS);
+    handle_t cache = 0;
+    if (CACHE_BLOCKS)
+    {
+        block_cache_config_t config = { CACHE_BLOCKS, CACHE_READ_AHEAD_BLOCKS, true };
+        cache = block_cache_driver_install(storage, &config);
+    }
+
+    filesystem_format_options_t format = { DISK_TYPE, DISK_CLUSTER_SIZE };
+    if (!storage || (CACHE_BLOCKS && !cache) || filesystem_format_with_options(ROOT, cache ? cache : storage, &format))
+    {
+        puts("{\"test\":\"setup\",\"ok\":false}");
+        while (1)
+            ;
+    }
+
+    report_volume("volume", ROOT);
+
+    uint64_t start = now_us();
+    report("seq_write", SEQUENTIAL_FILE_SIZE, SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, sequential_write(BIG_FILE));
+    start = now_us();
+    report("seq_read", SEQUENTIAL_FILE_SIZE, SEQUENTIAL_FILE_SIZE / SEQUENTIAL_CHUNK_SIZE, start, sequential_read(BIG_FILE));
+    start = now_us();
+    report("rand_write_4k", RANDOM_IO_COUNT * RANDOM_IO_SIZE, RANDOM_IO_COUNT, start, random_io(FILE_ACCESS_WRITE));
+    start = now_us();
+    report("rand_read_4k", RANDOM_IO_COUNT * RANDOM_IO_SIZE, RANDOM_IO_COUNT, start, random_io(FILE_ACCESS_READ));
+    random_read_latency("rand_read_latency", 0);
+    random_read_latency("rand_read_latency_fast_seek", 1);
+    start = now_us();
+    report("frames_write", SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE * LOG_FRAME_SIZE, SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE, start, frames_write());
+    filesystem_remove(LOG_FILE);
+    start = now_us();
+    report("log_write", SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE * LOG_FRAME_SIZE, SEQUENTIAL_FILE_SIZE / LOG_FRAME_SIZE, start, log_write());
+    filesystem_remove(LOG_FILE);
+    start = now_us();
+    report("line_write", LINE_COUNT * LINE_SIZE, LINE_COUNT, start, line_write(0));
+    start = now_us();
+    report("line_write_buffered", LINE_COUNT * LINE_SIZE, LINE_COUNT, start, line_write(LINE_BUFFER_SIZE));
+    start = now_us();
+    report("small_create", SMALL_FILES * SMALL_FILE_SIZE, SMALL_FILES, start, small_files_create());
+    uint32_t entries = 0;
+    start = now_us();
+    int result = enumerate(&entries);
+    report("enumerate", 0, entries, start, result);
+    start = now_us();
+    report("small_delete", 0, SMALL_FILES, start, small_files_delete());
+    two_volume_write(ramdisk_driver_install(NULL, BLOCK_SIZE, SECOND_DISK_BLOCKS));
+
+    if (cache)
+    {
+        block_cache_stats_t stats;
+        if (block_cache_get_stats(cache, &stats) == 0)
+        {
+            printf("{\"test\":\"cache\",\"read_blocks\":%llu,\"read_hits\":%llu,\"write_blocks\":%llu,\"write_hits\":%llu,\"read_ahead_blocks\":%llu,\"device_reads\":%llu,\"device_writes\":%llu,\"evictions\":%llu}\n",
+                (unsigned long long)stats.read_blocks, (unsigned long long)stats.read_hits, (unsigned long long)stats.write_blocks,
+                (unsigned long long)stats.write_hits, (unsigned long long)stats.read_ahead_blocks, (unsigned long long)stats.device_reads,
+                (unsigned long long)stats.device_writes, (unsigned long long)stats.evictions);
+        }
+    }
+
+#ifdef SD_BENCHMARK
+    sd_benchmark();
+#endif
+
+    puts("{\"test\":\"done\"}");
+    while (1)
+        ;
+}
@@ -0,0 +1,268 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <algorithm>
+#include <devices.h>
+#include <embedding_index.h>
+#include <math.h>
+#include <random>
+#include <string.h>
+#include <vector>
+
+/* The SWAR search against plain int8 dot products of the same quantization, which it must
+ * match exactly, and against the float cosine similarity over a 5k x 128 gallery. */
+
+static std::mt19937 rng(2018);
+
+/* Files are memory streams, the handle is the stream */
+struct memory_file
+{
+    std::vector<uint8_t> data;
+    size_t position = 0;
+    size_t max_read = SIZE_MAX;
+};
+
+int io_read(handle_t file, uint8_t *buffer, size_t len)
+{
+    auto &stream = *reinterpret_cast<memory_file *>(file);
+    len = std::min({ len, stream.data.size() - stream.position, stream.max_read });
+    memcpy(buffer, stream.data.data() + stream.position, len);
+    stream.position += len;
+    return len;
+}
+
+int io_write(handle_t file, const uint8_t *buffer, size_t len)
+{
+    auto &stream = *reinterpret_cast<memory_file *>(file);
+    stream.data.insert(stream.data.end(), buffer, buffer + len);
+    return len;
+}
+
+static std::vector<float> random_embedding(uint32_t dimension)
+{
+    std::normal_distribution<float> normal;
+    std::vector<float> embedding(dimension);
+    double norm = 0;
+    for (auto &value : embedding)
+    {
+        value = normal(rng);
+        norm += value * value;
+    }
+
+    for (auto &value : embedding)
+        value /= sqrt(norm);
+    return embedding;
+}
+
+/* A gallery entry moved by noise of the given size, normalized again */
+static std::vector<float> perturb(const std::vector<float> &embedding, float noise)
+{
+    auto result = random_embedding(embedding.size());
+    double norm = 0;
+    for (size_t i = 0; i < result.size(); i++)
+    {
+        result[i] = embedding[i] + result[i] * noise;
+        norm += result[i] * result[i];
+    }
+
+    for (auto &value : result)
+        value /= sqrt(norm);
+    return result;
+}
+
+/* The quantization of embedding_index.cpp without the offset */
+static float quantize(const std::vector<float> &embedding, std::vector<int32_t> &dest)
+{
+    float max = 0;
+    for (float value : embedding)
+        max = std::max(max, fabsf(value));
+
+    float inv_scale = max == 0 ? 0 : 127 / max;
+    dest.resize(embedding.size());
+    for (size_t i = 0; i < embedding.size(); i++)
+        dest[i] = lrintf(embedding[i] * inv_scale);
+    return max / 127;
+}
+
+struct reference_index
+{
+    std::vector<std::vector<float>> embeddings;
+    std::vector<std::vector<int32_t>> quantized;
+    std::vector<float> scales;
+};
+
+/* Best k by score, ties by id */
+static std::vector<embedding_match_t> reference_search(const reference_index &reference, const std::vector<float> &query, size_t k)
+{
+    std::vector<int32_t> query_q;
+    float query_scale = quantize(query, query_q);
+    std::vector<embedding_match_t> matches;
+    for (size_t id = 0; id < reference.quantized.size(); id++)
+    {
+        int64_t dot = 0;
+        for (size_t i = 0; i < query_q.size(); i++)
+            dot += reference.quantized[id][i] * query_q[i];
+        matches.push_back({ (uint32_t)id, (uint32_t)(id * 7 % 1000), dot * reference.scales[id] * query_scale });
+    }
+
+    std::stable_sort(matches.begin(), matches.end(), [](const embedding_match_t &a, const embedding_match_t &b) { return a.score > b.score; });
+    matches.resize(std::min(matches.size(), k));
+    return matches;
+}
+
+static double float_dot(const std::vector<float> &a, const std::vector<float> &b)
+{
+    double dot = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        dot += (double)a[i] * b[i];
+    return dot;
+}
+
+static void check_search(const embedding_index_t *index, const reference_index &reference, const std::vector<float> &query, size_t k)
+{
+    std::vector<embedding_match_t> matches(k);
+    int count = embedding_index_search(index, query.data(), matches.data(), k);
+    auto expected = reference_search(reference, query, k);
+    CHECK(count == (int)expected.size());
+    for (int i = 0; i < count; i++)
+    {
+        CHECK(matches[i].id == expected[i].id && matches[i].label == expected[i].label);
+        CHECK(matches[i].score == expected[i].score);
+        /* int8 on both sides of a 128 long dot product */
+        CHECK(fabs(matches[i].score - float_dot(reference.embeddings[matches[i].id], query)) < 0.02);
+    }
+}
+
+static void build(uint32_t dimension, size_t count, embedding_index_t *&index, reference_index &reference)
+{
+    index = embedding_index_create(dimension);
+    CHECK(index);
+    for (size_t id = 0; id < count; id++)
+    {
+        reference.embeddings.push_back(random_embedding(dimension));
+        reference.quantized.emplace_back();
+        reference.scales.push_back(quantize(reference.embeddings.back(), reference.quantized.back()));
+        CHECK(embedding_index_add(index, reference.embeddings.back().data(), id * 7 % 1000) == (int)id);
+    }
+
+    CHECK(embedding_index_get_count(index) == count);
+}
+
+static void test_search(uint32_t dimension, size_t count)
+{
+    embedding_index_t *index;
+    reference_index reference;
+    build(dimension, count, index, reference);
+
+    for (int i = 0; i < 20; i++)
+    {
+        size_t id = rng() % count;
+        auto query = perturb(reference.embeddings[id], 0.02f);
+        check_search(index, reference, query, 5);
+
+        /* A slightly moved entry is still the best match */
+        embedding_match_t match;
+        CHECK(embedding_index_search(index, query.data(), &match, 1) == 1 && match.id == id);
+    }
+
+    check_search(index, reference, random_embedding(dimension), 1);
+    check_search(index, reference, random_embedding(dimension), count + 3);
+    embedding_index_destroy(index);
+}
+
+static void test_ties()
+{
+    /* Equal entries on both sides of the split come back by id */
+    const uint32_t dimension = 40;
+    embedding_index_t *index;
+    reference_index reference;
+    build(dimension, 400, index, reference);
+    auto duplicate = reference.embeddings[3];
+    for (size_t id = 400; id < 1000; id++)
+    {
+        reference.embeddings.push_back(id % 50 ? random_embedding(dimension) : duplicate);
+        reference.quantized.emplace_back();
+        reference.scales.push_back(quantize(reference.embeddings.back(), reference.quantized.back()));
+        CHECK(embedding_index_add(index, reference.embeddings.back().data(), id * 7 % 1000) == (int)id);
+    }
+
+    check_search(index, reference, duplicate, 10);
+    embedding_index_destroy(index);
+}
+
+static void test_extremes()
+{
+    /* Components at +-127 give the largest lanes, where an accumulation too many overflows */
+    const uint32_t dimension = 128;
+    embedding_index_t *index = embedding_index_create(dimension);
+    CHECK(index);
+    reference_index reference;
+    for (size_t id = 0; id < 24; id++)
+    {
+        std::vector<float> embedding(dimension);
+        for (uint32_t i = 0; i < dimension; i++)
+            embedding[i] = ((id % 3 == 0) || (id % 3 == 2 && i % 2) ? 1 : -1) / sqrtf(dimension);
+        reference.embeddings.push_back(embedding);
+        reference.quantized.emplace_back();
+        reference.scales.push_back(quantize(embedding, reference.quantized.back()));
+        CHECK(embedding_index_add(index, embedding.data(), id * 7 % 1000) == (int)id);
+    }
+
+    for (size_t id = 0; id < 3; id++)
+        check_search(index, reference, reference.embeddings[id], 24);
+    embedding_index_destroy(index);
+}
+
+static void test_save_load()
+{
+    embedding_index_t *index;
+    reference_index reference;
+    build(100, 77, index, reference);
+
+    memory_file file;
+    CHECK(embedding_index_save(index, (handle_t)&file) == 0);
+    embedding_index_destroy(index);
+
+    /* Short reads are completed */
+    file.max_read = 33;
+    index = embedding_index_load((handle_t)&file);
+    CHECK(index && embedding_index_get_count(index) == 77);
+    check_search(index, reference, perturb(reference.embeddings[12], 0.05f), 8);
+    embedding_index_destroy(index);
+
+    file.position = 0;
+    file.data.resize(file.data.size() - 1);
+    CHECK(!embedding_index_load((handle_t)&file));
+    file.position = 0;
+    file.data[0] ^= 1;
+    CHECK(!embedding_index_load((handle_t)&file));
+}
+
+int main()
+{
+    test_search(128, 5000);
+    test_search(100, 13);
+    test_search(17, 1);
+    test_ties();
+    test_extremes();
+    test_save_load();
+
+    CHECK(!embedding_index_create(0));
+    embedding_match_t match;
+    CHECK(embedding_index_search(nullptr, nullptr, &match, 1) == -1);
+
+    printf("embedding_index_test passed\n");
+    return 0;
+}
@@ -0,0 +1,366 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <algorithm>
+#include <filesystem.h>
+#include <kernel/driver_impl.hpp>
+#include <random>
+#include <storage/ramdisk.h>
+#include <string.h>
+#include <vector>
+
+/* The buffered layer of filesystem_file_set_buffer over a memory file that counts the calls
+ * reaching it, and files of a FAT volume on a RAM disk, against a plain model of the file. */
+
+using namespace sys;
+
+#define BUFFER_SIZE 4096
+#define DISK_BLOCKS 8192
+
+static std::mt19937 rng(2018);
+
+class memory_file : public filesystem_file, public heap_object, public exclusive_object_access
+{
+public:
+    virtual size_t read(gsl::span<uint8_t> buffer) override
+    {
+        size_t read = read_at(position_, buffer);
+        position_ += read;
+        return read;
+    }
+
+    virtual size_t write(gsl::span<const uint8_t> buffer) override
+    {
+        writes++;
+        store(position_, buffer);
+        position_ += buffer.size();
+        return buffer.size();
+    }
+
+    virtual size_t read_at(fpos_t offset, gsl::span<uint8_t> buffer) override
+    {
+        size_t read = std::min<size_t>(buffer.size(), data.size() - std::min<size_t>(offset, data.size()));
+        std::copy_n(data.begin() + offset, read, buffer.begin());
+        return read;
+    }
+
+    virtual size_t write_at(fpos_t offset, gsl::span<const uint8_t> buffer) override
+    {
+        writes++;
+        store(offset, buffer);
+        return buffer.size();
+    }
+
+    virtual fpos_t get_position() override
+    {
+        return position_;
+    }
+
+    virtual void set_position(fpos_t position) override
+    {
+        position_ = position;
+    }
+
+    virtual uint64_t get_size() override
+    {
+        return data.size();
+    }
+
+    virtual void flush() override
+    {
+    }
+
+    std::vector<uint8_t> data;
+    size_t writes = 0;
+
+private:
+    void store(fpos_t offset, gsl::span<const uint8_t> buffer)
+    {
+        if ((size_t)offset + buffer.size() > data.size())
+            data.resize(offset + buffer.size());
+        std::copy(buffer.begin(), buffer.end(), data.begin() + offset);
+    }
+
+    fpos_t position_ = 0;
+};
+
+static handle_t open_memory_file(memory_file *&file)
+{
+    auto object = make_object<memory_file>();
+    file = object.get();
+    handle_t handle = system_alloc_handle(make_accessor<object_access>(std::move(object)));
+    CHECK(filesystem_file_set_buffer(handle, BUFFER_SIZE) == 0);
+    return handle;
+}
+
+/* As sys_lseek */
+static fpos_t seek(handle_t file, fpos_t offset, int whence)
+{
+    if (whence == SEEK_CUR)
+        offset += filesystem_file_get_position(file);
+    else if (whence == SEEK_END)
+        offset += filesystem_file_get_size(file);
+    CHECK(filesystem_file_set_position(file, offset) == 0);
+    return filesystem_file_get_position(file);
+}
+
+static std::vector<uint8_t> random_bytes(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (auto &value : data)
+        value = rng();
+    return data;
+}
+
+static void test_small_writes()
+{
+    /* CSV lines of 20 bytes reach the file a buffer at a time */
+    const size_t lines = 2000, line_size = 20;
+    memory_file *file;
+    handle_t handle = open_memory_file(file);
+    std::vector<uint8_t> expected;
+    for (size_t i = 0; i < lines; i++)
+    {
+        auto line = random_bytes(line_size);
+        CHECK(filesystem_file_write(handle, line.data(), line.size()) == (int)line.size());
+        expected.insert(expected.end(), line.begin(), line.end());
+    }
+
+    CHECK(file->writes == lines * line_size / BUFFER_SIZE);
+    CHECK(filesystem_file_flush(handle) == 0);
+    CHECK(file->writes == lines * line_size / BUFFER_SIZE + 1 && file->data == expected);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+static void test_seek_after_writes()
+{
+    memory_file *file;
+    handle_t handle = open_memory_file(file);
+    auto data = random_bytes(1000);
+    CHECK(filesystem_file_write(handle, data.data(), 600) == 600);
+    CHECK(file->writes == 0);
+
+    /* The buffered bytes count in the position and the size, telling the position keeps them */
+    CHECK(filesystem_file_get_size(handle) == 600);
+    CHECK(seek(handle, 0, SEEK_CUR) == 600 && file->writes == 0);
+    CHECK(filesystem_file_write(handle, data.data() + 600, 400) == 400);
+    CHECK(seek(handle, 0, SEEK_END) == 1000 && file->writes == 0);
+
+    CHECK(seek(handle, -10, SEEK_END) == 990 && file->writes == 1);
+    CHECK(filesystem_file_write(handle, data.data(), 20) == 20);
+    data.resize(1010);
+    std::copy_n(data.begin(), 20, data.begin() + 990);
+    CHECK(filesystem_file_get_size(handle) == 1010 && seek(handle, -30, SEEK_CUR) == 980);
+
+    uint8_t buffer[50];
+    CHECK(filesystem_file_read(handle, buffer, sizeof(buffer)) == 30);
+    CHECK(std::equal(buffer, buffer + 30, data.begin() + 980) && file->data == data);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+static void test_positional()
+{
+    memory_file *file;
+    handle_t handle = open_memory_file(file);
+    auto data = random_bytes(5000);
+    CHECK(filesystem_file_write(handle, data.data(), 4500) == 4500);
+    CHECK(filesystem_file_write(handle, data.data() + 4500, 100) == 100);
+    size_t writes = file->writes;
+
+    /* Away from the pending bytes the buffer stays */
+    CHECK(filesystem_file_pwrite(handle, data.data(), 50, 100) == 50 && file->writes == writes + 1);
+    uint8_t buffer[200];
+    CHECK(filesystem_file_pread(handle, buffer, 50, 200) == 50 && file->writes == writes + 1);
+
+    /* Over them the buffer goes first, so the positional data wins */
+    CHECK(filesystem_file_pread(handle, buffer, 200, 4450) == 150 && std::equal(buffer, buffer + 150, data.begin() + 4450));
+    CHECK(filesystem_file_write(handle, data.data() + 4600, 100) == 100);
+    CHECK(filesystem_file_pwrite(handle, data.data(), 200, 4650) == 200);
+    std::copy_n(data.begin(), 200, data.begin() + 4650);
+    std::copy_n(data.begin(), 50, data.begin() + 100);
+    data.resize(4850);
+    CHECK(filesystem_file_get_position(handle) == 4700 && filesystem_file_get_size(handle) == 4850);
+    CHECK(filesystem_file_flush(handle) == 0 && file->data == data);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+/* Random reads, writes, seeks and positional I/O of every size, within the file */
+static void test_random(handle_t handle, std::vector<uint8_t> &model)
+{
+    fpos_t position = 0;
+    for (int i = 0; i < 3000; i++)
+    {
+        size_t size = rng() % 4 ? rng() % 64 : rng() % (3 * BUFFER_SIZE);
+        fpos_t offset = rng() % (model.size() + 1);
+        std::vector<uint8_t> buffer(size);
+        switch (rng() % 6)
+        {
+        case 0:
+        case 1:
+        {
+            buffer = random_bytes(size);
+            CHECK(filesystem_file_write(handle, buffer.data(), size) == (int)size);
+            if (position + size > model.size())
+                model.resize(position + size);
+            std::copy(buffer.begin(), buffer.end(), model.begin() + position);
+            position += size;
+            break;
+        }
+        case 2:
+        {
+            size_t expected = std::min<size_t>(size, model.size() - position);
+            CHECK(filesystem_file_read(handle, buffer.data(), size) == (int)expected);
+            CHECK(std::equal(buffer.begin(), buffer.begin() + expected, model.begin() + position));
+            position += expected;
+            break;
+        }
+        case 3:
+            CHECK(seek(handle, offset, SEEK_SET) == offset);
+            position = offset;
+            break;
+        case 4:
+        {
+            size_t expected = std::min<size_t>(size, model.size() - offset);
+            CHECK(filesystem_file_pread(handle, buffer.data(), size, offset) == (int)expected);
+            CHECK(std::equal(buffer.begin(), buffer.begin() + expected, model.begin() + offset));
+            break;
+        }
+        case 5:
+        {
+            buffer = random_bytes(size);
+            CHECK(filesystem_file_pwrite(handle, buffer.data(), size, offset) == (int)size);
+            if (offset + size > model.size())
+                model.resize(offset + size);
+            std::copy(buffer.begin(), buffer.end(), model.begin() + offset);
+            break;
+        }
+        }
+
+        CHECK(filesystem_file_get_position(handle) == position && filesystem_file_get_size(handle) == model.size());
+    }
+}
+
+static void test_random_memory()
+{
+    memory_file *file;
+    handle_t handle = open_memory_file(file);
+    std::vector<uint8_t> model;
+    test_random(handle, model);
+    CHECK(filesystem_file_flush(handle) == 0 && file->data == model);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+static void test_volume()
+{
+    std::vector<uint8_t> disk(512 * DISK_BLOCKS);
+    handle_t storage = ramdisk_driver_install(disk.data(), 512, DISK_BLOCKS);
+    CHECK(storage && filesystem_format("/fs/0", storage) == 0);
+
+    handle_t handle = filesystem_file_open("/fs/0/A.BIN", FILE_ACCESS_READ_WRITE, FILE_MODE_CREATE_NEW);
+    CHECK(handle && filesystem_file_set_buffer(handle, BUFFER_SIZE) == 0);
+    std::vector<uint8_t> model;
+    test_random(handle, model);
+    CHECK(filesystem_file_close(handle) == 0);
+
+    /* Closing writes the pending bytes */
+    handle = filesystem_file_open("/fs/0/A.BIN", FILE_ACCESS_READ, FILE_MODE_OPEN_EXISTING);
+    std::vector<uint8_t> data(model.size() + 1);
+    CHECK(handle && filesystem_file_read(handle, data.data(), data.size()) == (int)model.size());
+    data.pop_back();
+    CHECK(data == model);
+
+    /* A failed positional write leaves the position */
+    CHECK(filesystem_file_set_position(handle, 100) == 0);
+    CHECK(filesystem_file_pwrite(handle, data.data(), 10, 500) == -1);
+    CHECK(filesystem_file_get_position(handle) == 100);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+static size_t count_bytes(const std::vector<uint8_t> &data, uint8_t value)
+{
+    return std::count(data.begin(), data.end(), value);
+}
+
+static void write_file(const char *path, size_t size, uint8_t value)
+{
+    std::vector<uint8_t> data(size, value);
+    handle_t handle = filesystem_file_open(path, FILE_ACCESS_WRITE, FILE_MODE_CREATE_ALWAYS);
+    CHECK(handle && filesystem_file_write(handle, data.data(), size) == (int)size);
+    CHECK(filesystem_file_close(handle) == 0);
+}
+
+/* The RAM disk zeroes erased blocks */
+static void test_trim()
+{
+    std::vector<uint8_t> disk(512 * DISK_BLOCKS, 0xAA);
+    handle_t storage = ramdisk_driver_install(disk.data(), 512, DISK_BLOCKS);
+    CHECK(storage && filesystem_format("/fs/1", storage) == 0);
+    /* Formatting does not erase the volume */
+    CHECK(count_bytes(disk, 0xAA) > disk.size() / 2);
+
+    /* Removed clusters wait for the next flush. Filling the volume takes them again, and they
+     * keep their new data. */
+    write_file("/fs/1/A.BIN", 100000, 0x55);
+    write_file("/fs/1/B.BIN", 100000, 0x55);
+    CHECK(filesystem_remove("/fs/1/A.BIN") == 0);
+    CHECK(count_bytes(disk, 0x55) >= 200000);
+    filesystem_volume_info_t info;
+    CHECK(filesystem_get_volume_info("/fs/1", &info) == 0);
+    write_file("/fs/1/C.BIN", info.free_bytes, 0x66);
+    CHECK(filesystem_remove("/fs/1/B.BIN") == 0);
+    handle_t handle = filesystem_file_open("/fs/1/C.BIN", FILE_ACCESS_READ_WRITE, FILE_MODE_OPEN_EXISTING);
+    CHECK(handle && filesystem_file_flush(handle) == 0);
+    CHECK(count_bytes(disk, 0x55) < 100 && count_bytes(disk, 0x66) >= info.free_bytes);
+    CHECK(filesystem_file_close(handle) == 0);
+
+    /* Truncated clusters too */
+    handle = filesystem_file_open("/fs/1/C.BIN", FILE_ACCESS_WRITE, FILE_MODE_TRUNCATE);
+    CHECK(handle && filesystem_file_flush(handle) == 0);
+    CHECK(count_bytes(disk, 0x66) < 100);
+    CHECK(filesystem_file_close(handle) == 0);
+
+    /* Without flushes the ranges go once enough of them wait, every other file makes a range */
+    char path[32];
+    for (int i = 0; i < 40; i++)
+    {
+        snprintf(path, sizeof(path), "/fs/1/F%d.BIN", i);
+        write_file(path, 3000, 0x77);
+    }
+    write_file("/fs/1/G.BIN", 3000, 0x88);
+    for (int i = 0; i < 40; i += 2)
+    {
+        snprintf(path, sizeof(path), "/fs/1/F%d.BIN", i);
+        CHECK(filesystem_remove(path) == 0);
+    }
+    CHECK(count_bytes(disk, 0x77) < 3000 * 25 && count_bytes(disk, 0x88) >= 3000);
+
+    /* The discard erases everything free, whoever freed it */
+    CHECK(filesystem_discard_free_space("/fs/1") == 0);
+    CHECK(count_bytes(disk, 0x77) < 3000 * 20 + 100 && count_bytes(disk, 0xAA) < 200 * 512);
+    CHECK(count_bytes(disk, 0x66) < 100 && count_bytes(disk, 0x88) >= 3000);
+}
+
+int main()
+{
+    test_small_writes();
+    test_seek_after_writes();
+    test_positional();
+    test_random_memory();
+    test_volume();
+    test_trim();
+
+    printf("filesystem_test passed\n");
+    return 0;
+}
@@ -0,0 +1,254 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <algorithm>
+#include <image_ops.h>
+#include <math.h>
+#include <random>
+#include <vector>
+
+/* The SWAR kernels against plain references: exact for the conversions, nearest and crop.
+ * Bilinear rounds to 8 bits after each direction with 8 bits weights, so it stays below 2
+ * of the exact value. The golden checksums pin the outputs
+ * of a fixed image so a change of rounding or of the row split shows up. */
+
+static std::mt19937 rng(2018);
+
+static std::vector<uint8_t> make_image(uint32_t channels, uint32_t width, uint32_t height)
+{
+    /* Gradients with noise, smooth enough for bilinear to matter */
+    std::vector<uint8_t> image((size_t)channels * width * height);
+    for (uint32_t c = 0; c < channels; c++)
+        for (uint32_t y = 0; y < height; y++)
+            for (uint32_t x = 0; x < width; x++)
+                image[((size_t)c * height + y) * width + x] = (uint8_t)((x * 255 / width + y * 97 / height + c * 40 + rng() % 24) & 0xFF);
+    return image;
+}
+
+static uint32_t checksum(const std::vector<uint8_t> &data)
+{
+    uint32_t hash = 2166136261u;
+    for (uint8_t value : data)
+        hash = (hash ^ value) * 16777619u;
+    return hash;
+}
+
+static void test_rgb565_to_planar(uint32_t width, uint32_t height)
+{
+    std::vector<uint16_t> src((size_t)width * height);
+    for (auto &pixel : src)
+        pixel = rng();
+    std::vector<uint8_t> dest(src.size() * 3);
+    CHECK(image_rgb565_to_planar(src.data(), dest.data(), width, height) == 0);
+
+    for (size_t i = 0; i < src.size(); i++)
+    {
+        /* High bits replicated into the low ones, within 1 of the exact scale */
+        uint32_t r5 = src[i] >> 11, g6 = (src[i] >> 5) & 0x3F, b5 = src[i] & 0x1F;
+        CHECK(dest[i] == ((r5 << 3) | (r5 >> 2)) && fabs(dest[i] - r5 * 255.0 / 31) < 1.0);
+        CHECK(dest[src.size() + i] == ((g6 << 2) | (g6 >> 4)) && fabs(dest[src.size() + i] - g6 * 255.0 / 63) < 1.0);
+        CHECK(dest[src.size() * 2 + i] == ((b5 << 3) | (b5 >> 2)) && fabs(dest[src.size() * 2 + i] - b5 * 255.0 / 31) < 1.0);
+    }
+}
+
+static void test_crop()
+{
+    auto src = make_image(3, 37, 21);
+    std::vector<uint8_t> dest(3 * 11 * 7);
+    CHECK(image_crop(VIDEO_FMT_RGB24_PLANAR, src.data(), 37, 21, dest.data(), 25, 13, 11, 7) == 0);
+    for (uint32_t c = 0; c < 3; c++)
+        for (uint32_t y = 0; y < 7; y++)
+            for (uint32_t x = 0; x < 11; x++)
+                CHECK(dest[(c * 7 + y) * 11 + x] == src[(c * 21 + y + 13) * 37 + x + 25]);
+
+    CHECK(image_crop(VIDEO_FMT_RGB24_PLANAR, src.data(), 37, 21, dest.data(), 27, 13, 11, 7) != 0);
+}
+
+static void test_resize_nearest(uint32_t channels, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height)
+{
+    auto src = make_image(channels, src_width, src_height);
+    std::vector<uint8_t> dest((size_t)channels * width * height);
+    CHECK(image_resize(src.data(), channels, src_width, src_height, dest.data(), width, height, IMAGE_INTERP_NEAREST) == 0);
+
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        for (uint32_t y = 0; y < height; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                uint32_t sy = (uint64_t)y * src_height / height, sx = (uint64_t)x * src_width / width;
+                CHECK(dest[((size_t)c * height + y) * width + x] == src[((size_t)c * src_height + sy) * src_width + sx]);
+            }
+        }
+    }
+}
+
+/* Half pixel centers and edge clamping, as OpenCV INTER_LINEAR */
+static double bilinear_reference(const uint8_t *plane, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height, uint32_t x, uint32_t y)
+{
+    double fx = std::max((x + 0.5) * src_width / width - 0.5, 0.0), fy = std::max((y + 0.5) * src_height / height - 0.5, 0.0);
+    uint32_t x0 = std::min((uint32_t)fx, src_width - 1), y0 = std::min((uint32_t)fy, src_height - 1);
+    uint32_t x1 = std::min(x0 + 1, src_width - 1), y1 = std::min(y0 + 1, src_height - 1);
+    double wx = fx - x0, wy = fy - y0;
+    double top = plane[y0 * src_width + x0] * (1 - wx) + plane[y0 * src_width + x1] * wx;
+    double bottom = plane[y1 * src_width + x0] * (1 - wx) + plane[y1 * src_width + x1] * wx;
+    return top * (1 - wy) + bottom * wy;
+}
+
+static void test_resize_bilinear(uint32_t channels, uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height)
+{
+    auto src = make_image(channels, src_width, src_height);
+    std::vector<uint8_t> dest((size_t)channels * width * height);
+    CHECK(image_resize(src.data(), channels, src_width, src_height, dest.data(), width, height, IMAGE_INTERP_BILINEAR) == 0);
+
+    double error_sum = 0;
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        const uint8_t *plane = src.data() + (size_t)c * src_width * src_height;
+        for (uint32_t y = 0; y < height; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                double error = dest[((size_t)c * height + y) * width + x] - bilinear_reference(plane, src_width, src_height, width, height, x, y);
+                CHECK(fabs(error) < 2.0);
+                error_sum += error;
+            }
+        }
+    }
+
+    /* Ties round up, truncating instead would be off by about -1 */
+    CHECK(fabs(error_sum / dest.size()) < 0.5);
+}
+
+static void test_letterbox(uint32_t src_width, uint32_t src_height, uint32_t width, uint32_t height, image_interp_t interp)
+{
+    const uint8_t pad_value = 114;
+    auto src = make_image(3, src_width, src_height);
+    std::vector<uint8_t> dest((size_t)3 * width * height);
+    CHECK(image_letterbox(src.data(), 3, src_width, src_height, dest.data(), width, height, interp, pad_value) == 0);
+
+    /* The image keeps its aspect ratio, centered, and matches a plain resize to the scaled size */
+    uint32_t scaled_width = std::max<uint64_t>(std::min<uint64_t>(width, (uint64_t)src_width * height / src_height), 1);
+    uint32_t scaled_height = std::max<uint64_t>(std::min<uint64_t>(height, (uint64_t)src_height * width / src_width), 1);
+    uint32_t left = (width - scaled_width) / 2, top = (height - scaled_height) / 2;
+    std::vector<uint8_t> scaled((size_t)3 * scaled_width * scaled_height);
+    CHECK(image_resize(src.data(), 3, src_width, src_height, scaled.data(), scaled_width, scaled_height, interp) == 0);
+
+    for (uint32_t c = 0; c < 3; c++)
+    {
+        for (uint32_t y = 0; y < height; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                uint8_t value = dest[((size_t)c * height + y) * width + x];
+                if (x < left || x >= left + scaled_width || y < top || y >= top + scaled_height)
+                    CHECK(value == pad_value);
+                else
+                    CHECK(value == scaled[((size_t)c * scaled_height + y - top) * scaled_width + x - left]);
+            }
+        }
+    }
+}
+
+static void test_normalize()
+{
+    const uint32_t channels = 3;
+    const size_t plane_size = 5000;
+    const float mean[] = { 123.7f, 116.3f, 103.5f }, scale[] = { 1 / 58.4f, 1 / 57.1f, 1 / 57.4f };
+    const float out_scale = 0.0185f, out_bias = -2.2f;
+    auto src = make_image(channels, 100, 50);
+
+    std::vector<float> dest_float(src.size());
+    std::vector<uint8_t> dest_u8(src.size());
+    CHECK(image_normalize_float(src.data(), dest_float.data(), channels, plane_size, mean, scale) == 0);
+    CHECK(image_normalize_u8(src.data(), dest_u8.data(), channels, plane_size, mean, scale, out_scale, out_bias) == 0);
+
+    for (size_t i = 0; i < src.size(); i++)
+    {
+        uint32_t c = i / plane_size;
+        double value = (src[i] - (double)mean[c]) * scale[c];
+        CHECK(fabs(dest_float[i] - value) <= 1e-5);
+        double q = std::min(std::max(floor((value - out_bias) / out_scale + 0.5), 0.0), 255.0);
+        CHECK(fabs(dest_u8[i] - q) <= 1.0);
+    }
+
+    /* In place */
+    CHECK(image_normalize_u8(src.data(), src.data(), channels, plane_size, mean, scale, out_scale, out_bias) == 0);
+    CHECK(src == dest_u8);
+}
+
+static void test_golden()
+{
+    struct golden
+    {
+        uint32_t width;
+        uint32_t height;
+        image_interp_t interp;
+        bool letterbox;
+        uint32_t checksum;
+    };
+
+    /* 320x240 camera frame to common model inputs */
+    static const golden goldens[] = {
+        { 224, 224, IMAGE_INTERP_NEAREST, false, 0x70192304 },
+        { 224, 224, IMAGE_INTERP_BILINEAR, false, 0x43c6e6a7 },
+        { 320, 256, IMAGE_INTERP_BILINEAR, true, 0x33135a26 },
+        { 416, 416, IMAGE_INTERP_BILINEAR, true, 0x9e25d071 },
+        { 128, 160, IMAGE_INTERP_NEAREST, true, 0xe4c56b90 },
+    };
+
+    for (auto &item : goldens)
+    {
+        rng.seed(2018);
+        auto src = make_image(3, 320, 240);
+        std::vector<uint8_t> dest((size_t)3 * item.width * item.height);
+        if (item.letterbox)
+            CHECK(image_letterbox(src.data(), 3, 320, 240, dest.data(), item.width, item.height, item.interp, 0) == 0);
+        else
+            CHECK(image_resize(src.data(), 3, 320, 240, dest.data(), item.width, item.height, item.interp) == 0);
+        CHECK(checksum(dest) == item.checksum);
+    }
+}
+
+int main()
+{
+    test_rgb565_to_planar(8, 1);
+    test_rgb565_to_planar(13, 7);
+    test_rgb565_to_planar(320, 40);
+
+    test_crop();
+
+    test_resize_nearest(1, 16, 16, 16, 16);
+    test_resize_nearest(3, 320, 240, 224, 224);
+    test_resize_nearest(3, 13, 9, 40, 31);
+    test_resize_nearest(2, 100, 60, 7, 5);
+
+    test_resize_bilinear(1, 16, 16, 16, 16);
+    test_resize_bilinear(3, 320, 240, 224, 224);
+    test_resize_bilinear(3, 13, 9, 40, 31);
+    test_resize_bilinear(2, 100, 60, 7, 5);
+    test_resize_bilinear(1, 1, 1, 9, 3);
+
+    test_letterbox(320, 240, 224, 224, IMAGE_INTERP_BILINEAR);
+    test_letterbox(240, 320, 224, 224, IMAGE_INTERP_NEAREST);
+    test_letterbox(320, 240, 320, 240, IMAGE_INTERP_BILINEAR);
+    test_letterbox(1000, 10, 64, 64, IMAGE_INTERP_BILINEAR);
+
+    test_normalize();
+    test_golden();
+
+    printf("image_ops_test passed\n");
+    return 0;
+}
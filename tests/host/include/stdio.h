@@ -0,0 +1,24 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HOST_STDIO_H
+#define _HOST_STDIO_H
+
+/* The host header with the file position of newlib, an integer the filesystem computes with */
+#define fpos_t host_fpos_t
+#include_next <stdio.h>
+#undef fpos_t
+typedef long long fpos_t;
+
+#endif /* _HOST_STDIO_H */
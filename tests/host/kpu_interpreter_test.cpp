@@ -0,0 +1,328 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <kpu_interpreter.hpp>
+#include <math.h>
+#include <random>
+
+/* A small kmodel built here runs through the interpreter and the K210 emulator:
+ *   3x3 conv 2 -> 3 channels, depthwise 3x3 with a mean 2 stride 1 pool,
+ *   1x1 conv 3 -> 4 channels with a max 2 stride 2 pool to main memory, dequantize.
+ * The reference below computes the same network directly on dense tensors. */
+
+using namespace sys;
+
+#define WIDTH 8
+#define HEIGHT 8
+#define NORM_ADD -40
+#define PAD_VALUE 7
+#define OUT_ADDRESS 0
+#define FLOAT_ADDRESS 64
+
+static std::mt19937 rng(2018);
+
+struct conv_desc
+{
+    uint32_t in_channels;
+    uint32_t out_channels;
+    uint32_t kernel;
+    bool depthwise;
+    uint32_t pool_type;
+    uint32_t in_address;
+    uint32_t out_address;
+    bool main_out;
+    int32_t arg_x;
+    uint32_t shr_x;
+    uint32_t act_shift;
+    std::vector<uint8_t> weights;
+};
+
+class model_builder
+{
+public:
+    void add_conv(const conv_desc &desc)
+    {
+        layers_.push_back({ KL_K210_CONV, conv_body(desc) });
+    }
+
+    void add_dequantize(uint32_t in_address, uint32_t out_address, uint32_t count, float scale, float bias)
+    {
+        kpu_model_dequantize_layer_argument_t arg = { 0, in_address, out_address, count, { scale, bias } };
+        layers_.push_back({ KL_DEQUANTIZE, std::vector<uint8_t>((uint8_t *)&arg, (uint8_t *)(&arg + 1)) });
+    }
+
+    std::vector<uint8_t> build(uint32_t main_mem_usage, kpu_model_output_t output)
+    {
+        kpu_model_header_t header = { 3, 1, 0, (uint32_t)layers_.size(), 0, main_mem_usage, 1 };
+        std::vector<uint8_t> model;
+        append(model, &header, sizeof(header));
+        append(model, &output, sizeof(output));
+        for (auto &layer : layers_)
+        {
+            kpu_model_layer_header_t layer_header = { layer.type, (uint32_t)layer.body.size() };
+            append(model, &layer_header, sizeof(layer_header));
+        }
+
+        /* Conv bodies hold their tables, the offsets are from the start of the model */
+        for (auto &layer : layers_)
+        {
+            if (layer.type == KL_K210_CONV)
+            {
+                auto arg = (kpu_model_conv_layer_argument_t *)layer.body.data();
+                uint32_t base = (uint32_t)model.size();
+                arg->layer_offset += base;
+                arg->weights_offset += base;
+                arg->bn_offset += base;
+                arg->act_offset += base;
+            }
+
+            append(model, layer.body.data(), layer.body.size());
+        }
+
+        return model;
+    }
+
+private:
+    struct layer
+    {
+        uint32_t type;
+        std::vector<uint8_t> body;
+    };
+
+    static void append(std::vector<uint8_t> &dest, const void *src, size_t size)
+    {
+        dest.insert(dest.end(), (const uint8_t *)src, (const uint8_t *)src + size);
+    }
+
+    static void align(std::vector<uint8_t> &dest)
+    {
+        dest.resize(kpu_align_up(dest.size(), 8));
+    }
+
+    static std::vector<uint8_t> conv_body(const conv_desc &desc)
+    {
+        kpu_layer_argument_t layer;
+        memset(&layer, 0, sizeof(layer));
+        uint32_t out_size = desc.pool_type == 1 ? WIDTH / 2 : WIDTH;
+        layer.interrupt_enabe.data.depth_wise_layer = desc.depthwise;
+        layer.image_addr.data.image_src_addr = desc.in_address;
+        layer.image_addr.data.image_dst_addr = desc.out_address;
+        layer.image_channel_num.data.i_ch_num = desc.in_channels - 1;
+        layer.image_channel_num.data.o_ch_num = desc.out_channels - 1;
+        layer.image_size.data.i_row_wid = WIDTH - 1;
+        layer.image_size.data.i_col_high = HEIGHT - 1;
+        layer.image_size.data.o_row_wid = out_size - 1;
+        layer.image_size.data.o_col_high = out_size - 1;
+        layer.kernel_pool_type_cfg.data.kernel_type = desc.kernel == 3 ? 1 : 0;
+        layer.kernel_pool_type_cfg.data.pool_type = desc.pool_type;
+        layer.kernel_pool_type_cfg.data.pad_value = PAD_VALUE;
+        /* 8 pixels rows, 4 channels per 64 bytes line */
+        layer.kernel_calc_type_cfg.data.channel_switch_addr = HEIGHT;
+        layer.kernel_calc_type_cfg.data.row_switch_addr = 1;
+        layer.kernel_calc_type_cfg.data.coef_group = 4;
+        layer.write_back_cfg.data.wb_channel_switch_addr = HEIGHT;
+        layer.write_back_cfg.data.wb_row_switch_addr = 1;
+        layer.write_back_cfg.data.wb_group = 4;
+        layer.conv_value.data.arg_x = desc.arg_x & 0xFFFFFF;
+        layer.conv_value.data.shr_x = desc.shr_x;
+        layer.dma_parameter.data.dma_total_byte = desc.out_channels * out_size * out_size - 1;
+
+        std::vector<kpu_batchnorm_argument_t> bn(desc.out_channels);
+        for (auto &item : bn)
+        {
+            item.batchnorm.reg = 0;
+            item.batchnorm.data.norm_mul = 3;
+            item.batchnorm.data.norm_shift = 1;
+            item.batchnorm.data.norm_add = (uint32_t)NORM_ADD;
+        }
+
+        /* ReLU then a rounding shift: segment 15 takes the positive values, the others give 0 */
+        kpu_activate_table_t act;
+        memset(&act, 0, sizeof(act));
+        for (uint32_t i = 0; i < 15; i++)
+            act.activate_para[i].data.x_start = (UINT64_C(1) << 35);
+        act.activate_para[15].data.y_mul = 1;
+        act.activate_para[15].data.shift_number = desc.act_shift;
+
+        kpu_model_conv_layer_argument_t arg = { desc.main_out ? (uint32_t)KLF_MAIN_MEM_OUT : 0, OUT_ADDRESS, 0, 0, 0, 0 };
+        std::vector<uint8_t> body;
+        append(body, &arg, sizeof(arg));
+        align(body);
+        ((kpu_model_conv_layer_argument_t *)body.data())->layer_offset = (uint32_t)body.size();
+        append(body, &layer, sizeof(layer));
+        ((kpu_model_conv_layer_argument_t *)body.data())->weights_offset = (uint32_t)body.size();
+        append(body, desc.weights.data(), desc.weights.size());
+        align(body);
+        ((kpu_model_conv_layer_argument_t *)body.data())->bn_offset = (uint32_t)body.size();
+        append(body, bn.data(), bn.size() * sizeof(kpu_batchnorm_argument_t));
+        ((kpu_model_conv_layer_argument_t *)body.data())->act_offset = (uint32_t)body.size();
+        append(body, &act, sizeof(act));
+        return body;
+    }
+
+    std::vector<layer> layers_;
+};
+
+static std::vector<uint8_t> random_bytes(size_t size, uint32_t limit)
+{
+    std::vector<uint8_t> result(size);
+    for (auto &value : result)
+        value = rng() % limit;
+    return result;
+}
+
+static std::vector<uint8_t> reference_conv(const std::vector<uint8_t> &input, const conv_desc &desc)
+{
+    std::vector<uint8_t> conv(desc.out_channels * HEIGHT * WIDTH);
+    int pad = desc.kernel / 2;
+    for (uint32_t oc = 0; oc < desc.out_channels; oc++)
+    {
+        for (int oy = 0; oy < HEIGHT; oy++)
+        {
+            for (int ox = 0; ox < WIDTH; ox++)
+            {
+                double sum = 0, sum_x = 0;
+                uint32_t inputs = desc.depthwise ? 1 : desc.in_channels;
+                for (uint32_t i = 0; i < inputs; i++)
+                {
+                    uint32_t ic = desc.depthwise ? oc : i;
+                    for (uint32_t ky = 0; ky < desc.kernel; ky++)
+                    {
+                        for (uint32_t kx = 0; kx < desc.kernel; kx++)
+                        {
+                            int y = oy + ky - pad, x = ox + kx - pad;
+                            double value = (y < 0 || y >= HEIGHT || x < 0 || x >= WIDTH) ? PAD_VALUE : input[(ic * HEIGHT + y) * WIDTH + x];
+                            sum += value * desc.weights[((oc * inputs + i) * desc.kernel + ky) * desc.kernel + kx];
+                            sum_x += value;
+                        }
+                    }
+                }
+
+                sum += floor(desc.arg_x * sum_x / (1 << desc.shr_x));
+                double bn = floor(sum * 3 / 2) + NORM_ADD;
+                double act = bn > 0 ? nearbyint(bn / (1 << desc.act_shift)) : 0;
+                conv[(oc * HEIGHT + oy) * WIDTH + ox] = (uint8_t)std::min(act, 255.0);
+            }
+        }
+    }
+
+    std::vector<uint8_t> output;
+    for (uint32_t oc = 0; oc < desc.out_channels; oc++)
+    {
+        const uint8_t *channel = conv.data() + oc * HEIGHT * WIDTH;
+        if (desc.pool_type == 0)
+        {
+            output.insert(output.end(), channel, channel + HEIGHT * WIDTH);
+        }
+        else if (desc.pool_type == 1)
+        {
+            for (int oy = 0; oy < HEIGHT / 2; oy++)
+                for (int ox = 0; ox < WIDTH / 2; ox++)
+                    output.push_back(std::max({ channel[oy * 2 * WIDTH + ox * 2], channel[oy * 2 * WIDTH + ox * 2 + 1], channel[(oy * 2 + 1) * WIDTH + ox * 2], channel[(oy * 2 + 1) * WIDTH + ox * 2 + 1] }));
+        }
+        else
+        {
+            /* Mean of 2x2 at stride 1, the last row and column repeat */
+            for (int oy = 0; oy < HEIGHT; oy++)
+            {
+                for (int ox = 0; ox < WIDTH; ox++)
+                {
+                    int y1 = std::min(oy + 1, HEIGHT - 1), x1 = std::min(ox + 1, WIDTH - 1);
+                    output.push_back((channel[oy * WIDTH + ox] + channel[oy * WIDTH + x1] + channel[y1 * WIDTH + ox] + channel[y1 * WIDTH + x1]) / 4);
+                }
+            }
+        }
+    }
+
+    return output;
+}
+
+static void test_conv_network()
+{
+    conv_desc conv0 = { 2, 3, 3, false, 0, 0, 32, false, -3, 1, 8, random_bytes(3 * 2 * 9, 16) };
+    conv_desc conv1 = { 3, 3, 3, true, 8, 32, 64, false, 0, 0, 7, random_bytes(3 * 9, 16) };
+    conv_desc conv2 = { 3, 4, 1, false, 1, 64, 0, true, 5, 3, 4, random_bytes(4 * 3, 16) };
+
+    model_builder builder;
+    builder.add_conv(conv0);
+    builder.add_conv(conv1);
+    builder.add_conv(conv2);
+    builder.add_dequantize(OUT_ADDRESS, FLOAT_ADDRESS, 64, 0.5f, -1.f);
+    auto model = builder.build(FLOAT_ADDRESS + 64 * sizeof(float), { FLOAT_ADDRESS, 64 * sizeof(float) });
+
+    kpu_model_interpreter interpreter(model.data(), model.size());
+    kpu_model_shape_t shape = interpreter.input_shape();
+    CHECK(shape.width == WIDTH && shape.height == HEIGHT && shape.channels == 2);
+
+    auto input = random_bytes(2 * HEIGHT * WIDTH, 256);
+    auto expected0 = reference_conv(input, conv0);
+    auto expected1 = reference_conv(expected0, conv1);
+    auto expected2 = reference_conv(expected1, conv2);
+    const std::vector<uint8_t> *expected[] = { &expected0, &expected1, &expected2 };
+
+    uint32_t observed = 0;
+    auto results = interpreter.run(input, [&](const kpu_model_interpreter::layer_result &result, const uint8_t *) {
+        auto output = interpreter.layer_output(result.index);
+        if (result.index < 3)
+        {
+            CHECK((size_t)output.size() == expected[result.index]->size());
+            CHECK(std::equal(output.begin(), output.end(), expected[result.index]->begin()));
+        }
+        else
+        {
+            CHECK(output.size() == 64 * sizeof(float));
+        }
+        observed++;
+    });
+    CHECK(results.size() == 4 && observed == 4);
+
+    auto output = interpreter.output(0);
+    const float *values = (const float *)output.data();
+    for (size_t i = 0; i < 64; i++)
+        CHECK(values[i] == expected2[i] * 0.5f - 1.f);
+
+    /* The input must match the first layer */
+    input.pop_back();
+    bool thrown = false;
+    try
+    {
+        interpreter.run(input);
+    }
+    catch (std::runtime_error &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    /* A truncated model is rejected */
+    thrown = false;
+    try
+    {
+        kpu_model_interpreter truncated(model.data(), model.size() - 8);
+    }
+    catch (std::runtime_error &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+int main()
+{
+    test_conv_network();
+
+    printf("kpu_interpreter_test passed\n");
+    return 0;
+}
@@ -0,0 +1,181 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <kpu_layers.hpp>
+#include <algorithm>
+#include <math.h>
+#include <random>
+#include <vector>
+
+/* The quantized layers must give the same bytes as dequantizing, computing in double and
+ * quantizing again with round half up. The quantization is exact in binary so ties are real ties. */
+
+using namespace sys;
+
+#define IN_ADDRESS 0
+#define OUT_ADDRESS 65536
+#define Q_SCALE 0.5
+#define Q_BIAS -3.0
+
+static std::mt19937 rng(2018);
+
+static std::vector<uint8_t> make_buffer(size_t in_size)
+{
+    std::vector<uint8_t> buffer(OUT_ADDRESS * 2);
+    for (size_t i = 0; i < in_size; i++)
+        buffer[IN_ADDRESS + i] = rng();
+    return buffer;
+}
+
+static double dequantize(uint8_t value)
+{
+    return value * Q_SCALE + Q_BIAS;
+}
+
+static uint8_t quantize(double value)
+{
+    return (uint8_t)std::min(std::max(floor((value - Q_BIAS) / Q_SCALE + 0.5), 0.0), 255.0);
+}
+
+static void test_global_pools(uint32_t channels, uint32_t kernel_size)
+{
+    auto buffer = make_buffer(channels * kernel_size);
+    const uint8_t *src = buffer.data() + IN_ADDRESS, *dest = buffer.data() + OUT_ADDRESS;
+
+    kpu_model_quant_gmp2d_layer_argument_t gmp = { 0, IN_ADDRESS, OUT_ADDRESS, kernel_size, channels };
+    kpu_quantized_global_max_pool2d(buffer.data(), &gmp);
+    for (uint32_t oc = 0; oc < channels; oc++)
+        CHECK(dest[oc] == *std::max_element(src + oc * kernel_size, src + (oc + 1) * kernel_size));
+
+    kpu_model_quant_gap2d_layer_argument_t gap = { 0, IN_ADDRESS, OUT_ADDRESS, kernel_size, channels };
+    kpu_quantized_global_average_pool2d(buffer.data(), &gap);
+    for (uint32_t oc = 0; oc < channels; oc++)
+    {
+        double sum = 0;
+        for (uint32_t i = 0; i < kernel_size; i++)
+            sum += dequantize(src[oc * kernel_size + i]);
+        CHECK(dest[oc] == quantize(sum / kernel_size));
+    }
+}
+
+static void test_average_pool(kpu_model_shape_t in_shape, uint32_t kernel, uint32_t stride, uint32_t padding)
+{
+    kpu_model_shape_t out_shape = { (in_shape.width + 2 * padding - kernel) / stride + 1, (in_shape.height + 2 * padding - kernel) / stride + 1, in_shape.channels };
+    auto buffer = make_buffer(in_shape.width * in_shape.height * in_shape.channels);
+    const uint8_t *src = buffer.data() + IN_ADDRESS, *dest = buffer.data() + OUT_ADDRESS;
+
+    kpu_model_quant_ave_pool2d_layer_argument_t arg = { 0, IN_ADDRESS, OUT_ADDRESS, in_shape, out_shape, kernel, kernel, stride, stride, padding, padding };
+    kpu_quantized_average_pool2d(buffer.data(), &arg);
+
+    for (uint32_t oc = 0; oc < out_shape.channels; oc++)
+    {
+        for (uint32_t oy = 0; oy < out_shape.height; oy++)
+        {
+            for (uint32_t ox = 0; ox < out_shape.width; ox++)
+            {
+                /* Padding is not counted, like the float layer */
+                double sum = 0;
+                int count = 0;
+                for (uint32_t ky = 0; ky < kernel; ky++)
+                {
+                    for (uint32_t kx = 0; kx < kernel; kx++)
+                    {
+                        int y = (int)(oy * stride + ky) - (int)padding, x = (int)(ox * stride + kx) - (int)padding;
+                        if (y >= 0 && y < (int)in_shape.height && x >= 0 && x < (int)in_shape.width)
+                        {
+                            sum += dequantize(src[(oc * in_shape.height + y) * in_shape.width + x]);
+                            count++;
+                        }
+                    }
+                }
+
+                CHECK(*dest++ == quantize(sum / count));
+            }
+        }
+    }
+}
+
+static void test_tf_flatten(kpu_model_shape_t shape)
+{
+    auto buffer = make_buffer(shape.width * shape.height * shape.channels);
+    const uint8_t *src = buffer.data() + IN_ADDRESS, *dest = buffer.data() + OUT_ADDRESS;
+
+    kpu_model_quant_tf_flatten_layer_argument_t arg = { 0, IN_ADDRESS, OUT_ADDRESS, shape };
+    kpu_quantized_tf_flatten(buffer.data(), &arg);
+    for (uint32_t y = 0; y < shape.height; y++)
+        for (uint32_t x = 0; x < shape.width; x++)
+            for (uint32_t c = 0; c < shape.channels; c++)
+                CHECK(*dest++ == src[(c * shape.height + y) * shape.width + x]);
+}
+
+static void test_resize_nearest_neighbor(kpu_model_shape_t in_shape, uint32_t out_width, uint32_t out_height)
+{
+    auto buffer = make_buffer(in_shape.width * in_shape.height * in_shape.channels);
+    const uint8_t *src = buffer.data() + IN_ADDRESS, *dest = buffer.data() + OUT_ADDRESS;
+
+    kpu_model_quant_resize_nearest_neighbor_layer_argument_t arg = { 0, IN_ADDRESS, OUT_ADDRESS, in_shape, out_width, out_height, 0 };
+    kpu_quantized_resize_nearest_neighbor(buffer.data(), &arg);
+    for (uint32_t c = 0; c < in_shape.channels; c++)
+    {
+        for (uint32_t oy = 0; oy < out_height; oy++)
+        {
+            for (uint32_t ox = 0; ox < out_width; ox++)
+            {
+                uint32_t y = (uint32_t)floor((double)oy * in_shape.height / out_height);
+                uint32_t x = (uint32_t)floor((double)ox * in_shape.width / out_width);
+                CHECK(*dest++ == src[(c * in_shape.height + y) * in_shape.width + x]);
+            }
+        }
+    }
+
+    /* Where the float layer computes exact indices both agree */
+    if (out_width % in_shape.width == 0 && out_height % in_shape.height == 0)
+    {
+        size_t count = in_shape.width * in_shape.height * in_shape.channels, out_count = out_width * out_height * in_shape.channels;
+        std::vector<uint8_t> float_buffer(OUT_ADDRESS * 2 + out_count * sizeof(float));
+        float *float_src = (float *)(float_buffer.data() + IN_ADDRESS);
+        for (size_t i = 0; i < count; i++)
+            float_src[i] = (float)dequantize(src[i]);
+
+        kpu_model_resize_nearest_neighbor_layer_argument_t float_arg = { 0, IN_ADDRESS, OUT_ADDRESS * 2, in_shape, out_width, out_height, 0 };
+        kpu_resize_nearest_neighbor(float_buffer.data(), &float_arg);
+        const float *float_dest = (const float *)(float_buffer.data() + OUT_ADDRESS * 2);
+        for (size_t i = 0; i < out_count; i++)
+            CHECK(buffer[OUT_ADDRESS + i] == quantize(float_dest[i]));
+    }
+}
+
+int main()
+{
+    test_global_pools(1, 1);
+    test_global_pools(7, 49);
+    test_global_pools(64, 13 * 13);
+
+    test_average_pool({ 8, 8, 3 }, 2, 2, 0);
+    test_average_pool({ 7, 5, 4 }, 3, 1, 1);
+    test_average_pool({ 13, 13, 2 }, 3, 2, 1);
+
+    test_tf_flatten({ 1, 1, 10 });
+    test_tf_flatten({ 7, 3, 5 });
+
+    test_resize_nearest_neighbor({ 13, 13, 3 }, 26, 26);
+    test_resize_nearest_neighbor({ 7, 5, 2 }, 13, 11);
+    test_resize_nearest_neighbor({ 3, 3, 1 }, 9, 7);
+    test_resize_nearest_neighbor({ 16, 12, 2 }, 5, 3);
+    test_resize_nearest_neighbor({ 1, 1, 4 }, 5, 5);
+
+    printf("kpu_layers_test passed\n");
+    return 0;
+}
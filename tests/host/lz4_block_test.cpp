@@ -0,0 +1,303 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <fstream>
+#include <iterator>
+#include <lz4_block.h>
+#include <random>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+/* Round trips through the greedy compressor of tools/kmodel_compress.py, malformed blocks,
+ * and, given a container and the original file, the output of the script itself:
+ *
+ *   lz4_block_test [container raw]
+ */
+
+#define MIN_MATCH 4
+#define MATCH_START_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_OFFSET 0xFFFF
+#define GUARD_SIZE 16
+#define GUARD_VALUE 0xA5
+
+static std::mt19937 rng(2018);
+
+static void write_length(std::vector<uint8_t> &out, size_t length)
+{
+    for (; length >= 0xFF; length -= 0xFF)
+        out.push_back(0xFF);
+    out.push_back(length);
+}
+
+static void write_sequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t literals_length, size_t offset = 0, size_t match_length = 0)
+{
+    size_t token_match = match_length ? std::min<size_t>(match_length - MIN_MATCH, 15) : 0;
+    out.push_back(std::min<size_t>(literals_length, 15) << 4 | token_match);
+    if (literals_length >= 15)
+        write_length(out, literals_length - 15);
+    out.insert(out.end(), literals, literals + literals_length);
+    if (match_length)
+    {
+        out.push_back(offset & 0xFF);
+        out.push_back(offset >> 8);
+        if (match_length - MIN_MATCH >= 15)
+            write_length(out, match_length - MIN_MATCH - 15);
+    }
+}
+
+/* The built-in compressor of kmodel_compress.py */
+static std::vector<uint8_t> compress(const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> out;
+    std::unordered_map<uint32_t, size_t> table;
+    size_t size = data.size(), anchor = 0, pos = 0;
+    while (pos + MATCH_START_LIMIT <= size)
+    {
+        uint32_t key;
+        memcpy(&key, data.data() + pos, sizeof(key));
+        auto it = table.find(key);
+        bool found = it != table.end() && pos - it->second <= MAX_OFFSET;
+        size_t candidate = found ? it->second : 0;
+        table[key] = pos;
+        if (!found)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t length = MIN_MATCH, limit = size - LAST_LITERALS;
+        while (pos + length < limit && data[candidate + length] == data[pos + length])
+            length++;
+        write_sequence(out, data.data() + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    write_sequence(out, data.data() + anchor, size - anchor);
+    return out;
+}
+
+/* Decodes into a buffer of exactly capacity bytes followed by a guard that must stay untouched */
+static int decompress(const std::vector<uint8_t> &block, size_t capacity, std::vector<uint8_t> &dest)
+{
+    dest.assign(capacity + GUARD_SIZE, GUARD_VALUE);
+    int result = lz4_decompress_block(block.data(), block.size(), dest.data(), capacity);
+    for (size_t i = capacity; i < dest.size(); i++)
+        CHECK(dest[i] == GUARD_VALUE);
+    dest.resize(capacity);
+    return result;
+}
+
+static void check_round_trip(const std::vector<uint8_t> &data)
+{
+    auto block = compress(data);
+    CHECK(block.size() <= LZ4_COMPRESS_BOUND(data.size()));
+
+    std::vector<uint8_t> dest;
+    CHECK(decompress(block, data.size(), dest) == (int)data.size());
+    CHECK(dest == data);
+
+    /* A larger buffer gets the same bytes, a smaller one is refused without writing past it */
+    CHECK(decompress(block, data.size() + 100, dest) == (int)data.size());
+    CHECK(std::equal(data.begin(), data.end(), dest.begin()));
+    if (!data.empty())
+        CHECK(decompress(block, data.size() - 1, dest) == -1);
+}
+
+static std::vector<uint8_t> random_bytes(size_t size, uint32_t alphabet)
+{
+    std::vector<uint8_t> data(size);
+    for (auto &value : data)
+        value = rng() % alphabet;
+    return data;
+}
+
+/* Runs repeating with every short period, so matches overlap their own output */
+static std::vector<uint8_t> periodic_bytes(size_t size)
+{
+    std::vector<uint8_t> data;
+    while (data.size() < size)
+    {
+        size_t period = 1 + rng() % 20, length = 1 + rng() % 600;
+        auto pattern = random_bytes(period, 256);
+        for (size_t i = 0; i < length && data.size() < size; i++)
+            data.push_back(pattern[i % period]);
+    }
+    return data;
+}
+
+/* Quantized weights: few distinct values, rows repeated at a distance */
+static std::vector<uint8_t> weight_bytes(size_t size)
+{
+    std::vector<uint8_t> data;
+    auto row = random_bytes(288, 16);
+    while (data.size() < size)
+    {
+        if (rng() % 4 == 0)
+            row = random_bytes(288, 16);
+        data.insert(data.end(), row.begin(), row.end());
+        data.back() ^= rng() % 3;
+    }
+    data.resize(size);
+    return data;
+}
+
+static void test_round_trips()
+{
+    for (size_t size : { 0, 1, 5, 11, 12, 13, 17, 64, 300, 1000, 16384, 70000 })
+    {
+        check_round_trip(std::vector<uint8_t>(size, 0));
+        check_round_trip(random_bytes(size, 256));
+        check_round_trip(random_bytes(size, 3));
+        check_round_trip(periodic_bytes(size));
+        check_round_trip(weight_bytes(size));
+    }
+
+    /* Long literal runs and long matches need extra length bytes */
+    auto data = random_bytes(1000, 256);
+    auto zeros = std::vector<uint8_t>(5000, 7);
+    data.insert(data.end(), zeros.begin(), zeros.end());
+    auto tail = random_bytes(270, 256);
+    data.insert(data.end(), tail.begin(), tail.end());
+    check_round_trip(data);
+}
+
+static void test_copies()
+{
+    /* Every offset and length around the 8 bytes chunks, ending right at the capacity */
+    for (size_t offset = 1; offset <= 24; offset++)
+    {
+        for (size_t length = MIN_MATCH; length <= 40; length++)
+        {
+            auto literals = random_bytes(offset, 256);
+            std::vector<uint8_t> block;
+            write_sequence(block, literals.data(), literals.size(), offset, length);
+            write_sequence(block, nullptr, 0);
+
+            std::vector<uint8_t> expected = literals;
+            for (size_t i = 0; i < length; i++)
+                expected.push_back(expected[expected.size() - offset]);
+
+            std::vector<uint8_t> dest;
+            CHECK(decompress(block, expected.size(), dest) == (int)expected.size());
+            CHECK(dest == expected);
+        }
+    }
+}
+
+static void test_malformed()
+{
+    auto data = weight_bytes(4000);
+    auto block = compress(data);
+    std::vector<uint8_t> dest;
+
+    /* Cut anywhere, a block either fails or decodes a prefix of the data */
+    for (size_t len = 0; len < block.size(); len++)
+    {
+        std::vector<uint8_t> cut(block.begin(), block.begin() + len);
+        int result = decompress(cut, data.size(), dest);
+        CHECK(result == -1 || (result <= (int)data.size() && std::equal(dest.begin(), dest.begin() + result, data.begin())));
+    }
+
+    uint8_t literals[] = { 1, 2, 3 };
+    std::vector<uint8_t> bad;
+    write_sequence(bad, literals, 3, 0, 4);
+    write_sequence(bad, nullptr, 0);
+    CHECK(decompress(bad, 100, dest) == -1);
+
+    bad.clear();
+    write_sequence(bad, literals, 3, 4, 4);
+    write_sequence(bad, nullptr, 0);
+    CHECK(decompress(bad, 100, dest) == -1);
+
+    /* Lengths that run past the input */
+    bad = { 0xF0, 0xFF, 0xFF };
+    CHECK(decompress(bad, 1000, dest) == -1);
+    bad = { 0x30, 1, 2 };
+    CHECK(decompress(bad, 1000, dest) == -1);
+
+    /* Random garbage must not write out of bounds */
+    for (int i = 0; i < 2000; i++)
+    {
+        auto garbage = random_bytes(1 + rng() % 64, 256);
+        decompress(garbage, rng() % 300, dest);
+    }
+}
+
+static std::vector<uint8_t> read_file(const char *path)
+{
+    std::ifstream file(path, std::ios::binary);
+    CHECK(file);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+static uint32_t read_u32(const std::vector<uint8_t> &data, size_t offset)
+{
+    CHECK(offset + 4 <= data.size());
+    return data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | (uint32_t)data[offset + 3] << 24;
+}
+
+/* Decode a kmodel_compress.py container block by block, as kpu.cpp does */
+static void test_container(const char *container_path, const char *raw_path)
+{
+    auto container = read_file(container_path), raw = read_file(raw_path);
+    CHECK(read_u32(container, 0) == 0x345A4C4B && read_u32(container, 4) == 1);
+    uint32_t block_size = read_u32(container, 8), block_count = read_u32(container, 12);
+    CHECK(read_u32(container, 16) == raw.size());
+
+    size_t pos = 20 + 4 * (size_t)block_count, compressed = 0;
+    std::vector<uint8_t> out;
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        uint32_t size = read_u32(container, 20 + 4 * i), length = size & ~0x80000000u;
+        size_t expected = std::min<size_t>(block_size, raw.size() - (size_t)i * block_size);
+        CHECK(pos + length <= container.size());
+        std::vector<uint8_t> block(container.begin() + pos, container.begin() + pos + length);
+        if (size & 0x80000000u)
+        {
+            CHECK(length == expected);
+            out.insert(out.end(), block.begin(), block.end());
+        }
+        else
+        {
+            std::vector<uint8_t> dest;
+            CHECK(decompress(block, expected, dest) == (int)expected);
+            out.insert(out.end(), dest.begin(), dest.end());
+            compressed++;
+        }
+        pos += length;
+    }
+
+    CHECK(pos == container.size() && out == raw && compressed > 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3)
+    {
+        test_container(argv[1], argv[2]);
+        printf("lz4 container round trip passed\n");
+        return 0;
+    }
+
+    test_round_trips();
+    test_copies();
+    test_malformed();
+
+    printf("lz4_block_test passed\n");
+    return 0;
+}
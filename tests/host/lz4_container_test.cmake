@@ -0,0 +1,12 @@
+# Packs a file with tools/kmodel_compress.py and checks lz4_block_test decodes it back.
+# Variables: PYTHON, COMPRESS, TEST, INPUT, OUTPUT
+
+execute_process(COMMAND ${PYTHON} ${COMPRESS} ${INPUT} ${OUTPUT} --block-size 4096 RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "kmodel_compress.py failed")
+endif()
+
+execute_process(COMMAND ${TEST} ${OUTPUT} ${INPUT} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "lz4_block_test could not decode the container")
+endif()
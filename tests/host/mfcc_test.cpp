@@ -0,0 +1,194 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <math.h>
+#include <mfcc_kernels.hpp>
+#include <random>
+
+using namespace sys;
+
+/* The fixed point front end with the software FFT against a double reference: Hamming window,
+ * DFT power, the same mel filters without quantization, natural log and orthonormal DCT. */
+
+static std::mt19937 rng(2018);
+
+static std::vector<double> reference_frame(const mfcc_config_t &config, const int16_t *frame)
+{
+    uint32_t length = config.frame_length, points = config.fft_points;
+    uint32_t high_frequency = config.high_frequency ? config.high_frequency : config.sample_rate / 2;
+
+    std::vector<double> power(points / 2 + 1);
+    for (uint32_t bin = 0; bin <= points / 2; bin++)
+    {
+        double re = 0, im = 0;
+        for (uint32_t i = 0; i < length; i++)
+        {
+            double window = length == 1 ? 1 : 0.54 - 0.46 * cos(2 * M_PI * i / (length - 1));
+            double angle = -2 * M_PI * bin * i / points;
+            re += frame[i] * window * cos(angle);
+            im += frame[i] * window * sin(angle);
+        }
+        power[bin] = re * re + im * im;
+    }
+
+    auto to_mel = [](double hz) { return 2595 * log10(1 + hz / 700); };
+    auto to_hz = [](double mel) { return 700 * (pow(10, mel / 2595) - 1); };
+    double mel_low = to_mel(config.low_frequency), mel_high = to_mel(high_frequency);
+    std::vector<double> log_energies(config.mel_bands);
+    for (uint32_t band = 0; band < config.mel_bands; band++)
+    {
+        double left = to_hz(mel_low + (mel_high - mel_low) * band / (config.mel_bands + 1));
+        double center = to_hz(mel_low + (mel_high - mel_low) * (band + 1) / (config.mel_bands + 1));
+        double right = to_hz(mel_low + (mel_high - mel_low) * (band + 2) / (config.mel_bands + 1));
+        double energy = 0;
+        for (uint32_t bin = 0; bin <= points / 2; bin++)
+        {
+            double hz = (double)bin * config.sample_rate / points;
+            energy += power[bin] * fmax(0, fmin((hz - left) / (center - left), (right - hz) / (right - center)));
+        }
+        log_energies[band] = log(fmax(energy, 1));
+    }
+
+    std::vector<double> features(config.coefficients);
+    for (uint32_t k = 0; k < config.coefficients; k++)
+    {
+        double scale = sqrt((k ? 2.0 : 1.0) / config.mel_bands);
+        for (uint32_t m = 0; m < config.mel_bands; m++)
+            features[k] += scale * cos(M_PI * k * (m + 0.5) / config.mel_bands) * log_energies[m];
+    }
+    return features;
+}
+
+static std::vector<int16_t> make_signal(const mfcc_config_t &config, size_t count, double amplitude, double noise)
+{
+    /* Two tones, a chirp and noise */
+    std::normal_distribution<double> normal(0, noise);
+    std::vector<int16_t> samples(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        double t = (double)i / config.sample_rate;
+        double value = amplitude * (0.5 * sin(2 * M_PI * 440 * t) + 0.3 * sin(2 * M_PI * 1750 * t)
+                                       + 0.2 * sin(2 * M_PI * (200 + 1500 * t) * t))
+            + normal(rng);
+        samples[i] = mfcc_saturate_int16(lrint(value));
+    }
+    return samples;
+}
+
+/* The 16 bits FFT halving every stage leaves noise of about 0.1 on the coefficients, unbiased:
+ * a wrong scale would move c0 by several units */
+static void test_reference(const mfcc_config_t &config, double amplitude, double noise)
+{
+    auto samples = make_signal(config, config.sample_rate / 2, amplitude, noise);
+    mfcc_frontend frontend(config, mfcc_software_fft);
+    size_t max_frames = samples.size() / config.frame_shift, consumed;
+    std::vector<int16_t> features(max_frames * config.coefficients);
+    size_t frames = frontend.process(samples.data(), samples.size(), features.data(), max_frames, consumed);
+    CHECK(frames == (samples.size() - config.frame_length) / config.frame_shift + 1 && consumed == samples.size());
+
+    double error_sum = 0;
+    std::vector<double> bias(config.coefficients);
+    for (size_t f = 0; f < frames; f++)
+    {
+        auto expected = reference_frame(config, samples.data() + f * config.frame_shift);
+        for (uint32_t k = 0; k < config.coefficients; k++)
+        {
+            double error = features[f * config.coefficients + k] / (double)(1 << MFCC_FRACTION_BITS) - expected[k];
+            CHECK(fabs(error) < 0.5);
+            error_sum += fabs(error);
+            bias[k] += error / frames;
+        }
+    }
+
+    CHECK(error_sum / (frames * config.coefficients) < 0.1);
+    for (double value : bias)
+        CHECK(fabs(value) < 0.1);
+}
+
+static void test_streaming(const mfcc_config_t &config)
+{
+    /* Chunks of any size give the frames of a single call */
+    auto samples = make_signal(config, 5000 * config.sample_stride, 3000, 100);
+    size_t count = samples.size() / config.sample_stride, consumed;
+    size_t max_frames = count / config.frame_shift;
+    std::vector<int16_t> expected(max_frames * config.coefficients), features(max_frames * config.coefficients);
+
+    mfcc_frontend frontend(config, mfcc_software_fft);
+    size_t frames = frontend.process(samples.data(), count, expected.data(), max_frames, consumed);
+    CHECK(frames > 0 && consumed == count);
+
+    frontend.reset();
+    size_t position = 0, written = 0;
+    while (position < count)
+    {
+        size_t chunk = std::min<size_t>(1 + rng() % 700, count - position);
+        written += frontend.process(samples.data() + position * config.sample_stride, chunk, features.data() + written * config.coefficients, 1 + rng() % 3, consumed);
+        position += consumed;
+    }
+
+    CHECK(written == frames);
+    CHECK(features == expected);
+}
+
+static void test_quantize()
+{
+    const int16_t features[] = { -1000, -640, 0, 320, 640, 1000 };
+    uint8_t dest[6];
+    mfcc_quantize(features, 6, -640, 640, dest);
+    CHECK(dest[0] == 0 && dest[1] == 0 && dest[2] == 128 && dest[3] == 191 && dest[4] == 255 && dest[5] == 255);
+    mfcc_quantize(features, 6, 5, 5, dest);
+    CHECK(dest[0] == 0 && dest[5] == 255);
+}
+
+static void test_invalid()
+{
+    mfcc_config_t config = { 16000, 400, 160, 512, 40, 13, 20, 0, 1 };
+    mfcc_frontend frontend(config, mfcc_software_fft);
+
+    bool thrown = false;
+    config.fft_points = 384;
+    try
+    {
+        mfcc_frontend invalid(config, mfcc_software_fft);
+    }
+    catch (std::invalid_argument &)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+int main()
+{
+    /* 25 ms frames every 10 ms at 16 kHz */
+    mfcc_config_t speech = { 16000, 400, 160, 512, 40, 13, 20, 0, 1 };
+    test_reference(speech, 8000, 200);
+    /* Quiet input is scaled up before the FFT */
+    test_reference(speech, 60, 4);
+
+    mfcc_config_t small = { 8000, 256, 128, 256, 23, 12, 100, 3800, 1 };
+    test_reference(small, 12000, 300);
+
+    mfcc_config_t stereo = speech;
+    stereo.sample_stride = 2;
+    test_streaming(speech);
+    test_streaming(stereo);
+
+    test_quantize();
+    test_invalid();
+
+    printf("mfcc_test passed\n");
+    return 0;
+}
@@ -0,0 +1,252 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "test.h"
+#include <algorithm>
+#include <math.h>
+#include <random>
+#include <region_layer.h>
+#include <vector>
+
+/* The region layer against a double reference: exp and sigmoid computed exactly, plain O(n^2)
+ * suppression. The float tensor goes through the lookup tables, so boxes match within 2e-3.
+ * Boxes are planted in a background of weak objectness, away from the threshold so the
+ * table error cannot decide whether a box passes. */
+
+static const uint32_t width = 13, height = 13, classes = 20, anchor_count = 5;
+static const float anchors[] = { 1.08f, 1.19f, 3.42f, 4.41f, 6.63f, 11.38f, 9.42f, 5.11f, 16.62f, 10.52f };
+static const float threshold = 0.3f, nms_threshold = 0.45f;
+static const size_t plane_size = width * height;
+
+static std::mt19937 rng(2018);
+
+struct reference_box
+{
+    region_box_t box;
+    uint32_t order;
+};
+
+static double sigmoid(double x)
+{
+    return 1 / (1 + exp(-x));
+}
+
+static float *channel(std::vector<float> &tensor, uint32_t anchor, uint32_t c)
+{
+    return tensor.data() + ((size_t)anchor * (5 + classes) + c) * plane_size;
+}
+
+static double cell_score(std::vector<float> &tensor, uint32_t anchor, size_t pos, uint32_t *class_id)
+{
+    double max = channel(tensor, anchor, 5)[pos], sum = 0;
+    *class_id = 0;
+    for (uint32_t c = 1; c < classes; c++)
+    {
+        if (channel(tensor, anchor, 5 + c)[pos] > max)
+        {
+            max = channel(tensor, anchor, 5 + c)[pos];
+            *class_id = c;
+        }
+    }
+
+    for (uint32_t c = 0; c < classes; c++)
+        sum += exp(channel(tensor, anchor, 5 + c)[pos] - max);
+    return sigmoid(channel(tensor, anchor, 4)[pos]) / sum;
+}
+
+/* Weak objectness everywhere and `count` boxes planted at random cells, the first `tied` with the same values */
+static std::vector<float> make_tensor(size_t count, size_t tied)
+{
+    std::uniform_real_distribution<float> offset(-2, 2), size(-1, 1), objectness(0.5f, 4), class_score(-3, 3);
+    std::vector<float> tensor((size_t)anchor_count * (5 + classes) * plane_size);
+    for (auto &value : tensor)
+        value = class_score(rng);
+    for (uint32_t anchor = 0; anchor < anchor_count; anchor++)
+        std::fill_n(channel(tensor, anchor, 4), plane_size, -8.f);
+
+    std::vector<float> tied_values(5 + classes);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t anchor = rng() % anchor_count;
+        size_t pos = rng() % plane_size;
+        for (uint32_t c = 0; c < 5 + classes; c++)
+            channel(tensor, anchor, c)[pos] = class_score(rng);
+        channel(tensor, anchor, 0)[pos] = offset(rng);
+        channel(tensor, anchor, 1)[pos] = offset(rng);
+        channel(tensor, anchor, 2)[pos] = size(rng);
+        channel(tensor, anchor, 3)[pos] = size(rng);
+        channel(tensor, anchor, 4)[pos] = objectness(rng);
+        channel(tensor, anchor, 5 + rng() % classes)[pos] = 6;
+
+        if (i < tied)
+        {
+            /* Stronger than the others, so they compete for the last places */
+            if (i == 0)
+            {
+                channel(tensor, anchor, 4)[pos] = 5;
+                for (uint32_t c = 0; c < 5 + classes; c++)
+                    tied_values[c] = channel(tensor, anchor, c)[pos];
+            }
+
+            for (uint32_t c = 0; c < 5 + classes; c++)
+                channel(tensor, anchor, c)[pos] = tied_values[c];
+        }
+
+        uint32_t class_id;
+        if (fabs(cell_score(tensor, anchor, pos, &class_id) - threshold) < 0.01)
+            channel(tensor, anchor, 4)[pos] = -8;
+    }
+
+    return tensor;
+}
+
+static float box_iou(const region_box_t &a, const region_box_t &b)
+{
+    double w = std::min(a.x2, b.x2) - std::max(a.x1, b.x1);
+    double h = std::min(a.y2, b.y2) - std::max(a.y1, b.y1);
+    if (w <= 0 || h <= 0)
+        return 0;
+    double inter = w * h;
+    return inter / ((a.x2 - a.x1) * (a.y2 - a.y1) + (b.x2 - b.x1) * (b.y2 - b.y1) - inter);
+}
+
+/* The best max_boxes by score, ties in scan order, then greedy suppression */
+static std::vector<region_box_t> reference_run(std::vector<float> &tensor, size_t max_boxes)
+{
+    std::vector<reference_box> boxes;
+    for (uint32_t anchor = 0; anchor < anchor_count; anchor++)
+    {
+        for (size_t pos = 0; pos < plane_size; pos++)
+        {
+            uint32_t class_id;
+            double score = cell_score(tensor, anchor, pos, &class_id);
+            if (score < threshold)
+                continue;
+
+            uint32_t x = pos % width, y = pos / width;
+            double cx = (x + sigmoid(channel(tensor, anchor, 0)[pos])) / width;
+            double cy = (y + sigmoid(channel(tensor, anchor, 1)[pos])) / height;
+            double w = exp(channel(tensor, anchor, 2)[pos]) * anchors[anchor * 2] / width;
+            double h = exp(channel(tensor, anchor, 3)[pos]) * anchors[anchor * 2 + 1] / height;
+            region_box_t box = { (float)(cx - w / 2), (float)(cy - h / 2), (float)(cx + w / 2), (float)(cy + h / 2), (float)score, class_id };
+            boxes.push_back({ box, (uint32_t)(anchor * plane_size + pos) });
+        }
+    }
+
+    std::sort(boxes.begin(), boxes.end(), [](const reference_box &a, const reference_box &b) {
+        return a.box.score > b.box.score || (a.box.score == b.box.score && a.order < b.order);
+    });
+    boxes.resize(std::min(boxes.size(), max_boxes));
+
+    std::vector<region_box_t> kept;
+    for (auto &candidate : boxes)
+    {
+        bool suppressed = false;
+        for (auto &box : kept)
+            suppressed |= box.class_id == candidate.box.class_id && box_iou(box, candidate.box) > nms_threshold;
+        if (!suppressed)
+            kept.push_back(candidate.box);
+    }
+
+    return kept;
+}
+
+static void check_boxes(const std::vector<region_box_t> &expected, const region_box_t *boxes, int count, float tolerance)
+{
+    CHECK(count == (int)expected.size());
+    for (int i = 0; i < count; i++)
+    {
+        CHECK(boxes[i].class_id == expected[i].class_id);
+        CHECK(fabs(boxes[i].score - expected[i].score) <= tolerance);
+        CHECK(fabs(boxes[i].x1 - expected[i].x1) <= tolerance && fabs(boxes[i].y1 - expected[i].y1) <= tolerance);
+        CHECK(fabs(boxes[i].x2 - expected[i].x2) <= tolerance && fabs(boxes[i].y2 - expected[i].y2) <= tolerance);
+    }
+}
+
+static region_layer_config_t make_config(float quant_scale, float quant_bias)
+{
+    return { width, height, classes, anchor_count, anchors, threshold, nms_threshold, quant_scale, quant_bias };
+}
+
+static void test_float(size_t count, size_t tied, size_t max_boxes)
+{
+    auto tensor = make_tensor(count, tied);
+    region_layer_t layer;
+    region_layer_config_t config = make_config(0, 0);
+    CHECK(region_layer_init(&layer, &config) == 0);
+
+    std::vector<region_box_t> boxes(max_boxes);
+    int result = region_layer_run_float(&layer, tensor.data(), boxes.data(), max_boxes);
+    check_boxes(reference_run(tensor, max_boxes), boxes.data(), result, 2e-3f);
+}
+
+static void test_u8(size_t count, size_t max_boxes)
+{
+    /* The reference runs on the dequantized values, the tables are exact for them */
+    const float scale = 0.05f, bias = -8.f;
+    auto tensor = make_tensor(count, 0);
+    std::vector<uint8_t> quantized(tensor.size());
+    for (size_t i = 0; i < tensor.size(); i++)
+    {
+        quantized[i] = (uint8_t)std::min(std::max(lrintf((tensor[i] - bias) / scale), 0L), 255L);
+        tensor[i] = quantized[i] * scale + bias;
+    }
+
+    region_layer_t layer;
+    region_layer_config_t config = make_config(scale, bias);
+    CHECK(region_layer_init(&layer, &config) == 0);
+
+    std::vector<region_box_t> boxes(max_boxes);
+    int result = region_layer_run_u8(&layer, quantized.data(), boxes.data(), max_boxes);
+    check_boxes(reference_run(tensor, max_boxes), boxes.data(), result, 1e-4f);
+}
+
+static void test_nms()
+{
+    region_box_t boxes[] = {
+        { 0.1f, 0.1f, 0.5f, 0.5f, 0.6f, 1 },
+        { 0.12f, 0.1f, 0.52f, 0.5f, 0.9f, 1 },
+        { 0.12f, 0.1f, 0.52f, 0.5f, 0.7f, 2 },
+        { 0.6f, 0.6f, 0.9f, 0.9f, 0.7f, 1 },
+    };
+
+    /* The weaker overlapping box of class 1 goes, equal scores keep their order */
+    CHECK(region_layer_nms(boxes, 4, 0.5f) == 3);
+    CHECK(boxes[0].score == 0.9f && boxes[1].class_id == 2 && boxes[2].class_id == 1 && boxes[2].x1 == 0.6f);
+    CHECK(region_layer_nms(nullptr, 0, 0.5f) == 0);
+    CHECK(region_layer_nms(nullptr, 1, 0.5f) == -1);
+}
+
+int main()
+{
+    test_nms();
+
+    test_float(40, 0, 100);
+    test_float(0, 0, 10);
+    /* More boxes than room: the best ones are kept whatever part of the split found them */
+    test_float(200, 0, 12);
+    test_float(60, 30, 8);
+    test_float(60, 30, 1);
+
+    test_u8(40, 100);
+    test_u8(200, 12);
+
+    region_layer_t layer;
+    region_layer_config_t config = make_config(0, 0);
+    config.anchors = nullptr;
+    CHECK(region_layer_init(&layer, &config) != 0);
+
+    printf("region_layer_test passed\n");
+    return 0;
+}
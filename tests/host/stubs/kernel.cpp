@@ -0,0 +1,127 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <kernel/driver_impl.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/lock.h>
+#include <vector>
+
+/* Handles as lib/freertos/kernel/devices.cpp hands them out, and the FreeRTOS calls of the
+ * filesystem. The host tests run on one thread, so semaphores and locks are always free.
+ */
+
+using namespace sys;
+
+#define HANDLE_OFFSET 256
+
+static std::vector<object_accessor<object_access> *> handles;
+
+handle_t sys::system_alloc_handle(object_accessor<object_access> object)
+{
+    handles.push_back(new object_accessor<object_access>(std::move(object)));
+    return handles.size() - 1 + HANDLE_OFFSET;
+}
+
+object_accessor<object_access> &sys::system_handle_to_object(handle_t file)
+{
+    if (file < HANDLE_OFFSET || !handles.at(file - HANDLE_OFFSET))
+        throw std::invalid_argument("Invalid handle.");
+    return *handles[file - HANDLE_OFFSET];
+}
+
+extern "C"
+{
+    int io_close(handle_t file)
+    {
+        if (file)
+        {
+            delete handles.at(file - HANDLE_OFFSET);
+            handles[file - HANDLE_OFFSET] = nullptr;
+        }
+
+        return 0;
+    }
+
+    void vPortFatal(const char *file, int line, const char *message)
+    {
+        fprintf(stderr, "%s:%d: %s\n", file, line, message);
+        abort();
+    }
+
+    void *pvPortMalloc(size_t size)
+    {
+        return malloc(size);
+    }
+
+    void vPortFree(void *ptr)
+    {
+        free(ptr);
+    }
+
+    UBaseType_t uxPortIsInISR()
+    {
+        return 0;
+    }
+
+    QueueHandle_t xQueueCreateMutex(const uint8_t)
+    {
+        return (QueueHandle_t)1;
+    }
+
+    QueueHandle_t xQueueCreateCountingSemaphore(const UBaseType_t, const UBaseType_t)
+    {
+        return (QueueHandle_t)1;
+    }
+
+    void vQueueDelete(QueueHandle_t)
+    {
+    }
+
+    BaseType_t xQueueSemaphoreTake(QueueHandle_t, TickType_t)
+    {
+        return pdTRUE;
+    }
+
+    BaseType_t xQueueGenericSend(QueueHandle_t, const void *const, TickType_t, const BaseType_t)
+    {
+        return pdTRUE;
+    }
+
+    BaseType_t xQueueGiveFromISR(QueueHandle_t, BaseType_t *const)
+    {
+        return pdTRUE;
+    }
+
+    BaseType_t xQueueReceiveFromISR(QueueHandle_t, void *const, BaseType_t *const)
+    {
+        return pdTRUE;
+    }
+
+    void vPortYieldFromISR()
+    {
+    }
+
+    void vPortDebugBreak()
+    {
+    }
+
+    void _lock_acquire(_lock_t *)
+    {
+    }
+
+    void _lock_release(_lock_t *)
+    {
+    }
+}
@@ -0,0 +1,32 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <parallel.h>
+
+/* Splits like lib/bsp/parallel.c but runs both parts one after the other,
+ * so the per part scratch memory and the split seams are still exercised.
+ */
+void parallel_for(parallel_job_t job, void *userdata, size_t count, size_t min_count, size_t align)
+{
+    size_t split = count / 2 / align * align;
+    if (split >= min_count)
+    {
+        job(userdata, 0, 0, split);
+        job(userdata, 1, split, count);
+    }
+    else
+    {
+        job(userdata, 0, 0, count);
+    }
+}
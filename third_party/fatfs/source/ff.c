@@ -435,6 +435,13 @@ static BYTE CurrVol;				/* Current drive */
 
 #if FF_FS_LOCK != 0
 static FILESEM Files[FF_FS_LOCK];	/* Open object lock semaphores */
+#if FF_FS_REENTRANT && FF_VOLUMES > 1	/* The volume sync objects do not cover the table shared by all volumes */
+#define LOCK_FILES()	ff_lock_files()
+#define UNLOCK_FILES()	ff_unlock_files()
+#else
+#define LOCK_FILES()
+#define UNLOCK_FILES()
+#endif
 #endif
 
 #if FF_STR_VOLUME_ID
@@ -927,9 +934,11 @@ static FRESULT chk_lock (	/* Check if the file can be accessed */
 )
 {
 	UINT i, be;
+	FRESULT res;
 
 	/* Search open object table for the object */
 	be = 0;
+	LOCK_FILES();
 	for (i = 0; i < FF_FS_LOCK; i++) {
 		if (Files[i].fs) {	/* Existing entry */
 			if (Files[i].fs == dp->obj.fs &&	 	/* Check if the object matches with an open object */
@@ -940,11 +949,13 @@ static FRESULT chk_lock (	/* Check if the file can be accessed */
 		}
 	}
 	if (i == FF_FS_LOCK) {	/* The object has not been opened */
-		return (!be && acc != 2) ? FR_TOO_MANY_OPEN_FILES : FR_OK;	/* Is there a blank entry for new object? */
+		res = (!be && acc != 2) ? FR_TOO_MANY_OPEN_FILES : FR_OK;	/* Is there a blank entry for new object? */
+	} else {
+		/* The object was opened. Reject any open against writing file and all write mode open */
+		res = (acc != 0 || Files[i].ctr == 0x100) ? FR_LOCKED : FR_OK;
 	}
-
-	/* The object was opened. Reject any open against writing file and all write mode open */
-	return (acc != 0 || Files[i].ctr == 0x100) ? FR_LOCKED : FR_OK;
+	UNLOCK_FILES();
+	return res;
 }
 
 
@@ -952,7 +963,9 @@ static int enq_lock (void)	/* Check if an entry is available for a new object */
 {
 	UINT i;
 
+	LOCK_FILES();
 	for (i = 0; i < FF_FS_LOCK && Files[i].fs; i++) ;
+	UNLOCK_FILES();
 	return (i == FF_FS_LOCK) ? 0 : 1;
 }
 
@@ -962,9 +975,10 @@ static UINT inc_lock (	/* Increment object open counter and returns its index (0
 	int acc		/* Desired access (0:Read, 1:Write, 2:Delete/Rename) */
 )
 {
-	UINT i;
+	UINT i, id = 0;
 
 
+	LOCK_FILES();
 	for (i = 0; i < FF_FS_LOCK; i++) {	/* Find the object */
 		if (Files[i].fs == dp->obj.fs &&
 			Files[i].clu == dp->obj.sclust &&
@@ -973,18 +987,21 @@ static UINT inc_lock (	/* Increment object open counter and returns its index (0
 
 	if (i == FF_FS_LOCK) {				/* Not opened. Register it as new. */
 		for (i = 0; i < FF_FS_LOCK && Files[i].fs; i++) ;
-		if (i == FF_FS_LOCK) return 0;	/* No free entry to register (int err) */
-		Files[i].fs = dp->obj.fs;
-		Files[i].clu = dp->obj.sclust;
-		Files[i].ofs = dp->dptr;
-		Files[i].ctr = 0;
+		if (i < FF_FS_LOCK) {			/* A free entry to register, else int err */
+			Files[i].fs = dp->obj.fs;
+			Files[i].clu = dp->obj.sclust;
+			Files[i].ofs = dp->dptr;
+			Files[i].ctr = 0;
+		}
 	}
 
-	if (acc >= 1 && Files[i].ctr) return 0;	/* Access violation (int err) */
-
-	Files[i].ctr = acc ? 0x100 : Files[i].ctr + 1;	/* Set semaphore value */
+	if (i < FF_FS_LOCK && !(acc >= 1 && Files[i].ctr)) {	/* Not an access violation, else int err */
+		Files[i].ctr = acc ? 0x100 : Files[i].ctr + 1;	/* Set semaphore value */
+		id = i + 1;	/* Index number origin from 1 */
+	}
+	UNLOCK_FILES();
 
-	return i + 1;	/* Index number origin from 1 */
+	return id;
 }
 
 
@@ -997,11 +1014,13 @@ static FRESULT dec_lock (	/* Decrement object open counter */
 
 
 	if (--i < FF_FS_LOCK) {	/* Index number origin from 0 */
+		LOCK_FILES();
 		n = Files[i].ctr;
 		if (n == 0x100) n = 0;		/* If write mode open, delete the entry */
 		if (n > 0) n--;				/* Decrement read mode open count */
 		Files[i].ctr = n;
 		if (n == 0) Files[i].fs = 0;	/* Delete the entry if open count gets zero */
+		UNLOCK_FILES();
 		res = FR_OK;
 	} else {
 		res = FR_INT_ERR;			/* Invalid index nunber */
@@ -1016,9 +1035,11 @@ static void clear_lock (	/* Clear lock entries of the volume */
 {
 	UINT i;
 
+	LOCK_FILES();
 	for (i = 0; i < FF_FS_LOCK; i++) {
 		if (Files[i].fs == fs) Files[i].fs = 0;
 	}
+	UNLOCK_FILES();
 }
 
 #endif	/* FF_FS_LOCK != 0 */
@@ -1261,6 +1282,9 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 			break;
 		}
 	}
+#if FF_USE_FREE_MAP
+	if (res == FR_OK && val == 0) ff_free_cluster(fs, clst);	/* Tell the free cluster search */
+#endif
 	return res;
 }
 
@@ -1560,6 +1584,13 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 				ncl = 0;
 			}
 		}
+#if FF_USE_FREE_MAP
+		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
+			ncl = ff_find_free_cluster(fs, scl);	/* Find a free cluster with the user defined search */
+			if (ncl == 0 || ncl == 0xFFFFFFFF) return ncl;	/* No free cluster or hard error? */
+			if (ncl == 1) ncl = 0;					/* Not supported, search the FAT */
+		}
+#endif
 		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
 			ncl = scl;	/* Start cluster */
 			for (;;) {
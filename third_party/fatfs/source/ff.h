@@ -321,12 +321,22 @@ void* ff_memalloc (UINT msize);			/* Allocate memory block */
 void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 
+/* Free cluster search functions */
+#if FF_USE_FREE_MAP && !FF_FS_READONLY
+DWORD ff_find_free_cluster (FATFS* fs, DWORD clst);	/* Find a free cluster after clst (0:No free cluster, 1:Use the FAT search, 0xFFFFFFFF:Disk error) */
+void ff_free_cluster (FATFS* fs, DWORD clst);		/* Tell a cluster is freed */
+#endif
+
 /* Sync functions */
 #if FF_FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, FF_SYNC_t* sobj);	/* Create a sync object */
 int ff_req_grant (FF_SYNC_t sobj);		/* Lock sync object */
 void ff_rel_grant (FF_SYNC_t sobj);		/* Unlock sync object */
 int ff_del_syncobj (FF_SYNC_t sobj);	/* Delete a sync object */
+#if FF_FS_LOCK && FF_VOLUMES > 1
+void ff_lock_files (void);		/* Lock the open object table */
+void ff_unlock_files (void);	/* Unlock the open object table */
+#endif
 #endif
 
 
@@ -9,6 +9,7 @@
 #include <task.h>
 #include <semphr.h>
 #include <stdlib.h>
+#include <sys/lock.h>
 
 
 #if FF_USE_LFN == 3	/* Dynamic memory allocation */
@@ -137,5 +138,26 @@ void ff_rel_grant (
     }
 }
 
+
+#if FF_FS_LOCK && FF_VOLUMES > 1
+/*------------------------------------------------------------------------*/
+/* Lock the Open Object Table                                             */
+/*------------------------------------------------------------------------*/
+/* The table is shared by all the volumes, this is called with the grant
+/  of a volume held and keeps files of other volumes from changing it.
+*/
+static _lock_t files_lock;
+
+void ff_lock_files (void)
+{
+	_lock_acquire(&files_lock);
+}
+
+void ff_unlock_files (void)
+{
+	_lock_release(&files_lock);
+}
+#endif
+
 #endif
 
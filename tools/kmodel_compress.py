@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+# Copyright 2018 Canaan Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Pack a kmodel into the block compressed container read by kpu_model_load_from_file
+and kpu_model_load_from_buffer.
+
+Layout, little endian:
+    uint32 magic ('KLZ4'), version, block_size, block_count, raw_size
+    uint32 compressed size of each block, bit 31 set if the block is stored uncompressed
+    the blocks, each a raw LZ4 block with no dictionary
+
+The python lz4 package is used when it is installed, otherwise a slower built-in compressor.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x345A4C4B
+VERSION = 1
+STORED = 0x80000000
+MIN_MATCH = 4
+# A match must start 12 bytes before the end of a block and the last 5 bytes are literals
+MATCH_START_LIMIT = 12
+LAST_LITERALS = 5
+MAX_OFFSET = 0xFFFF
+
+try:
+    import lz4.block as lz4_block
+except ImportError:
+    lz4_block = None
+
+
+def write_length(out, length):
+    while length >= 0xFF:
+        out.append(0xFF)
+        length -= 0xFF
+    out.append(length)
+
+
+def write_sequence(out, literals, offset=0, match_length=0):
+    token_literals = min(len(literals), 15)
+    token_match = min(match_length - MIN_MATCH, 15) if match_length else 0
+    out.append(token_literals << 4 | token_match)
+    if len(literals) >= 15:
+        write_length(out, len(literals) - 15)
+    out += literals
+    if match_length:
+        out += struct.pack('<H', offset)
+        if match_length - MIN_MATCH >= 15:
+            write_length(out, match_length - MIN_MATCH - 15)
+
+
+def compress_block(data):
+    if lz4_block:
+        return lz4_block.compress(data, store_size=False)
+
+    out = bytearray()
+    table = {}
+    size = len(data)
+    anchor = pos = 0
+    while pos + MATCH_START_LIMIT <= size:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+        if candidate is None or pos - candidate > MAX_OFFSET:
+            pos += 1
+            continue
+
+        length = MIN_MATCH
+        limit = size - LAST_LITERALS
+        while pos + length < limit and data[candidate + length] == data[pos + length]:
+            length += 1
+        write_sequence(out, data[anchor:pos], pos - candidate, length)
+        pos += length
+        anchor = pos
+
+    write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress_block(data, raw_size):
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        token = data[pos]
+        pos += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                value = data[pos]
+                pos += 1
+                length += value
+                if value != 0xFF:
+                    break
+        out += data[pos:pos + length]
+        pos += length
+        if pos == len(data):
+            break
+
+        offset = data[pos] | data[pos + 1] << 8
+        pos += 2
+        length = token & 0xF
+        if length == 15:
+            while True:
+                value = data[pos]
+                pos += 1
+                length += value
+                if value != 0xFF:
+                    break
+        length += MIN_MATCH
+        if offset == 0 or offset > len(out):
+            raise ValueError('invalid match offset')
+        for _ in range(length):
+            out.append(out[-offset])
+
+    if len(out) != raw_size:
+        raise ValueError('invalid block size')
+    return bytes(out)
+
+
+def pack(raw, block_size):
+    blocks = []
+    sizes = []
+    for offset in range(0, len(raw), block_size):
+        block = raw[offset:offset + block_size]
+        compressed = compress_block(block)
+        if len(compressed) >= len(block):
+            blocks.append(block)
+            sizes.append(len(block) | STORED)
+        else:
+            blocks.append(compressed)
+            sizes.append(len(compressed))
+
+    header = struct.pack('<5I', MAGIC, VERSION, block_size, len(blocks), len(raw))
+    return header + struct.pack('<%dI' % len(sizes), *sizes) + b''.join(blocks)
+
+
+def unpack(container):
+    magic, version, block_size, block_count, raw_size = struct.unpack_from('<5I', container)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError('not a compressed kmodel')
+    sizes = struct.unpack_from('<%dI' % block_count, container, 20)
+    pos = 20 + 4 * block_count
+    raw = bytearray()
+    for i, size in enumerate(sizes):
+        length = size & ~STORED
+        block = container[pos:pos + length]
+        expected = min(block_size, raw_size - i * block_size)
+        raw += block if size & STORED else decompress_block(block, expected)
+        pos += length
+    return bytes(raw)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('input', help='kmodel to compress')
+    parser.add_argument('output', help='compressed container')
+    parser.add_argument('--block-size', type=int, default=16384,
+                        help='uncompressed bytes per block, two blocks are decoded at once on the device')
+    parser.add_argument('--verify', action='store_true', help='decompress the output and compare it with the input')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        raw = f.read()
+    if len(raw) < 4 or struct.unpack_from('<I', raw)[0] != 3:
+        print('warning: %s is not a version 3 kmodel' % args.input, file=sys.stderr)
+    if args.block_size <= 0:
+        parser.error('block size must be positive')
+
+    container = pack(raw, args.block_size)
+    with open(args.output, 'wb') as f:
+        f.write(container)
+    print('%s: %d -> %d bytes (%.1f%%)' % (args.output, len(raw), len(container), 100.0 * len(container) / max(len(raw), 1)))
+
+    if args.verify and unpack(container) != raw:
+        print('error: round trip mismatch', file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,146 @@
+/* Copyright 2018 Canaan Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Run a kmodel v3 on the host with the reference interpreter and the K210 emulator.
+ * Prints the time, output size and checksum of every layer, and can dump the layer outputs
+ * to compare them with the board or another build:
+ *
+ *   kmodel_run [-i input.bin] [-n runs] [-d dump_dir] model.kmodel
+ *
+ * The input is the raw [channel][height][width] bytes of the first layer, zeros if not given.
+ * Built by the tests/host CMake project.
+ */
+
+#include <kpu_interpreter.hpp>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+
+using namespace sys;
+
+static std::vector<uint8_t> read_file(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Cannot open " + path);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+static void write_file(const std::string &path, gsl::span<const uint8_t> data)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file.write((const char *)data.data(), data.size()))
+        throw std::runtime_error("Cannot write " + path);
+}
+
+/* FNV-1a, to compare outputs without dumping them */
+static uint32_t checksum(gsl::span<const uint8_t> data)
+{
+    uint32_t hash = 2166136261u;
+    for (uint8_t value : data)
+        hash = (hash ^ value) * 16777619u;
+    return hash;
+}
+
+static int usage()
+{
+    fprintf(stderr, "usage: kmodel_run [-i input.bin] [-n runs] [-d dump_dir] model.kmodel\n");
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string input_path, dump_dir;
+    int runs = 1, opt;
+    while ((opt = getopt(argc, argv, "i:n:d:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                input_path = optarg;
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'd':
+                dump_dir = optarg;
+                break;
+            default:
+                return usage();
+        }
+    }
+
+    if (optind != argc - 1 || runs < 1)
+        return usage();
+
+    try
+    {
+        auto model = read_file(argv[optind]);
+        kpu_model_interpreter interpreter(model.data(), model.size());
+
+        kpu_model_shape_t shape = interpreter.input_shape();
+        std::vector<uint8_t> input((size_t)shape.width * shape.height * shape.channels);
+        if (!input_path.empty())
+            input = read_file(input_path);
+
+        std::vector<double> total_us(interpreter.layers_length());
+        std::vector<size_t> output_sizes(interpreter.layers_length());
+        std::vector<uint32_t> checksums(interpreter.layers_length());
+        for (int run = 0; run < runs; run++)
+        {
+            bool last = run == runs - 1;
+            interpreter.run(input, [&](const kpu_model_interpreter::layer_result &result, const uint8_t *) {
+                total_us[result.index] += std::chrono::duration<double, std::micro>(result.elapsed).count();
+                if (!last)
+                    return;
+
+                auto output = interpreter.layer_output(result.index);
+                output_sizes[result.index] = output.size();
+                checksums[result.index] = checksum(output);
+                if (!dump_dir.empty() && !output.empty())
+                    write_file(dump_dir + "/layer_" + std::to_string(result.index) + ".bin", output);
+            });
+        }
+
+        printf("input %ux%ux%u, %d run(s)\n", shape.width, shape.height, shape.channels, runs);
+        printf("%5s  %-28s %12s %10s %10s\n", "layer", "type", "avg us", "bytes", "checksum");
+        double model_us = 0;
+        for (uint32_t i = 0; i < interpreter.layers_length(); i++)
+        {
+            double us = total_us[i] / runs;
+            model_us += us;
+            printf("%5u  %-28s %12.1f %10zu   %08x\n", i, kpu_layer_type_name(interpreter.layer_header(i).type), us, output_sizes[i], checksums[i]);
+        }
+        printf("total %.1f us\n", model_us);
+
+        for (uint32_t i = 0; i < interpreter.output_count(); i++)
+        {
+            auto output = interpreter.output(i);
+            printf("output %u: %zu bytes, checksum %08x\n", i, (size_t)output.size(), checksum(output));
+            if (!dump_dir.empty())
+                write_file(dump_dir + "/output_" + std::to_string(i) + ".bin", output);
+        }
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "kmodel_run: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}